@@ -0,0 +1,310 @@
+#include "access_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <new>
+
+__thread access_log::ring * access_log::t_ring = NULL;
+
+static const int MAX_IOV = 1024;
+
+access_log::access_log(const char * path)
+    : m_path(path), m_fd(-1), m_wakefd(-1), m_started(false), m_stop(false), m_reopen(false),
+      m_rings(NULL), m_dropped(0), m_bytes_written(0), m_write_errors(0) {
+    m_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_fd == -1 || m_wakefd == -1) {
+        if (m_fd != -1) close(m_fd);
+        if (m_wakefd != -1) close(m_wakefd);
+        throw std::exception();
+    }
+}
+
+access_log::~access_log() {
+    stop();
+    ring * r = m_rings.load();
+    while (r) {
+        ring * next = r->next;
+        r->~ring();
+        free(r);
+        r = next;
+    }
+    close(m_fd);
+    close(m_wakefd);
+}
+
+void access_log::stop() {
+    if (m_started) {
+        m_stop = true;
+        uint64_t one = 1;
+        write(m_wakefd, &one, sizeof(one));
+        pthread_join(m_thread, NULL);
+        m_started = false;
+    }
+    // 后台线程已经结束，这里写出剩下的数据
+    flush();
+}
+
+bool access_log::start() {
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void access_log::reopen() {
+    m_reopen = true;
+    uint64_t one = 1;
+    write(m_wakefd, &one, sizeof(one));
+}
+
+void * access_log::worker(void * arg) {
+    access_log * log = (access_log *) arg;
+    struct pollfd pfd;
+    pfd.fd = log->m_wakefd;
+    pfd.events = POLLIN;
+    while (!log->m_stop) {
+        int ret = poll(&pfd, 1, FLUSH_INTERVAL_MS);
+        if (ret < 0 && errno != EINTR) break;
+        if (ret > 0) {
+            uint64_t cnt;
+            read(log->m_wakefd, &cnt, sizeof(cnt));
+        }
+        log->flush();
+        if (log->m_reopen.exchange(false)) {
+            log->do_reopen();
+        }
+    }
+    return log;
+}
+
+void access_log::do_reopen() {
+    int fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        // 继续写原来的文件
+        printf("reopen access log failure\n");
+        return;
+    }
+    dup2(fd, m_fd);
+    close(fd);
+}
+
+access_log::ring * access_log::local() {
+    ring * r = t_ring;
+    if (r) {
+        return r;
+    }
+    void * mem = NULL;
+    if (posix_memalign(&mem, 64, sizeof(ring)) != 0) {
+        return NULL;
+    }
+    r = new (mem) ring;
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->entries.store(0, std::memory_order_relaxed);
+    // 放到链表头部
+    ring * head = m_rings.load(std::memory_order_relaxed);
+    do {
+        r->next = head;
+    } while (!m_rings.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+    t_ring = r;
+    return r;
+}
+
+static char * put_str(char * p, char * end, const char * s) {
+    while (*s && p < end) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static char * put_uint(char * p, char * end, unsigned long long v) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n > 0 && p < end) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+// URL中的引号、反斜杠和控制字符写成\xHH，日志行可以被可靠地解析
+static char * put_escaped(char * p, char * end, const char * s) {
+    static const char hex[] = "0123456789abcdef";
+    for (; *s && p < end; s++) {
+        unsigned char c = *s;
+        if (c < 0x20 || c == 0x7f || c == '"' || c == '\\') {
+            if (end - p < 4) break;
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+        } else {
+            *p++ = c;
+        }
+    }
+    return p;
+}
+
+static char * put_addr(char * p, char * end, const sockaddr_in * addr) {
+    if (!addr) {
+        return put_str(p, end, "-");
+    }
+    const unsigned char * b = (const unsigned char *) &addr->sin_addr.s_addr;
+    for (int i = 0; i < 4; i++) {
+        if (i > 0 && p < end) *p++ = '.';
+        p = put_uint(p, end, b[i]);
+    }
+    return p;
+}
+
+// 时间格式和Common Log Format一样（UTC），每个线程每秒格式化一次
+static char * put_time(char * p, char * end) {
+    static __thread time_t t_last = 0;
+    static __thread char t_buf[32];
+    static __thread int t_len = 0;
+    time_t now = time(NULL);
+    if (now != t_last) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        t_len = strftime(t_buf, sizeof(t_buf), "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+        t_last = now;
+    }
+    if (end - p < t_len) {
+        return p;
+    }
+    memcpy(p, t_buf, t_len);
+    return p + t_len;
+}
+
+// 127.0.0.1 [18/Oct/2026:08:00:00 +0000] "GET /index.html" 200 350 queue_us=3 parse_us=1 build_us=2
+int access_log::format(char * line, const access_entry & e) {
+    char * p = line;
+    char * end = line + MAX_LINE - 1; // 留出换行符的位置
+    p = put_addr(p, end, e.addr);
+    p = put_str(p, end, " ");
+    p = put_time(p, end);
+    p = put_str(p, end, " \"");
+    if (e.method) {
+        p = put_str(p, end, e.method);
+        p = put_str(p, end, " ");
+        // 给后面的字段留出位置，URL太长时截断
+        char * url_end = end - 128;
+        p = put_escaped(p, url_end > p ? url_end : p, e.url ? e.url : "-");
+    } else {
+        p = put_str(p, end, "-");
+    }
+    p = put_str(p, end, "\" ");
+    p = put_uint(p, end, e.status);
+    p = put_str(p, end, " ");
+    p = put_uint(p, end, e.bytes);
+    p = put_str(p, end, " queue_us=");
+    p = put_uint(p, end, e.queue_ns / 1000);
+    p = put_str(p, end, " parse_us=");
+    p = put_uint(p, end, e.parse_ns / 1000);
+    p = put_str(p, end, " build_us=");
+    p = put_uint(p, end, e.build_ns / 1000);
+    *p++ = '\n';
+    return p - line;
+}
+
+void access_log::log(const access_entry & e) {
+    ring * r = local();
+    if (!r) {
+        m_dropped++;
+        return;
+    }
+    char line[MAX_LINE];
+    size_t len = format(line, e);
+
+    size_t head = r->head.load(std::memory_order_relaxed);
+    size_t tail = r->tail.load(std::memory_order_acquire);
+    if (RING_SIZE - (head - tail) < len) {
+        // 后台线程来不及写，丢弃
+        m_dropped++;
+        return;
+    }
+    size_t off = head & (RING_SIZE - 1);
+    size_t first = RING_SIZE - off < len ? RING_SIZE - off : len;
+    memcpy(r->data + off, line, first);
+    memcpy(r->data, line + first, len - first);
+    r->head.store(head + len, std::memory_order_release);
+    if (head - tail < RING_SIZE / 2 && head + len - tail >= RING_SIZE / 2) {
+        // 刚超过一半，不等定时写出，马上唤醒后台线程
+        uint64_t one = 1;
+        write(m_wakefd, &one, sizeof(one));
+    }
+    r->entries.store(r->entries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// 把所有环形缓冲区中的数据用一次writev写出，没写完的部分下一轮再写
+void access_log::flush() {
+    struct iovec iov[MAX_IOV];
+    ring * rings[MAX_IOV / 2];
+    size_t lens[MAX_IOV / 2];
+    int nring = 0;
+    int niov = 0;
+    size_t total = 0;
+
+    for (ring * r = m_rings.load(std::memory_order_acquire); r && nring < MAX_IOV / 2; r = r->next) {
+        size_t head = r->head.load(std::memory_order_acquire);
+        size_t tail = r->tail.load(std::memory_order_relaxed);
+        size_t len = head - tail;
+        if (len == 0 || total + len > (size_t)SSIZE_MAX) {
+            continue;
+        }
+        size_t off = tail & (RING_SIZE - 1);
+        size_t first = RING_SIZE - off < len ? RING_SIZE - off : len;
+        iov[niov].iov_base = r->data + off;
+        iov[niov].iov_len = first;
+        niov++;
+        if (len > first) {
+            iov[niov].iov_base = r->data;
+            iov[niov].iov_len = len - first;
+            niov++;
+        }
+        rings[nring] = r;
+        lens[nring] = len;
+        nring++;
+        total += len;
+    }
+    if (total == 0) {
+        return;
+    }
+
+    ssize_t ret = writev(m_fd, iov, niov);
+    if (ret < 0) {
+        m_write_errors++;
+        return;
+    }
+    m_bytes_written += ret;
+    // 按顺序归还写出的部分
+    size_t written = ret;
+    for (int i = 0; i < nring && written > 0; i++) {
+        size_t n = lens[i] < written ? lens[i] : written;
+        rings[i]->tail.store(rings[i]->tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+        written -= n;
+    }
+}
+
+void access_log::get_stats(access_log_stats & stats) {
+    stats.entries = 0;
+    for (ring * r = m_rings.load(std::memory_order_acquire); r; r = r->next) {
+        stats.entries += r->entries.load(std::memory_order_relaxed);
+    }
+    stats.dropped = m_dropped;
+    stats.bytes_written = m_bytes_written;
+    stats.write_errors = m_write_errors;
+}
@@ -0,0 +1,85 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <netinet/in.h>
+
+// 一条访问日志
+struct access_entry {
+    const sockaddr_in * addr; // 客户端地址
+    const char * method; // 请求行没有解析出来时为NULL
+    const char * url;
+    int status;
+    long long bytes; // 响应的字节数，包括响应头
+    uint64_t queue_ns; // 在线程池队列中等待的时间，流水线中后面的请求为0
+    uint64_t parse_ns; // 解析请求的时间
+    uint64_t build_ns; // 生成响应的时间
+};
+
+// 访问日志的统计数据
+struct access_log_stats {
+    uint64_t entries; // 写入环形缓冲区的日志条数
+    uint64_t dropped; // 环形缓冲区满而丢弃的日志条数
+    uint64_t bytes_written; // 写入文件的字节数
+    uint64_t write_errors; // 写文件失败的次数
+};
+
+/*
+    异步访问日志，整个进程一个。
+    每个线程第一次记日志时分配自己的环形缓冲区，挂到无锁链表上，之后把格式化好的日志行拷进去（单生产者单消费者，没有锁）；
+    后台线程定期（或者某个环形缓冲区超过一半时被唤醒）把所有环形缓冲区中的数据用一次writev追加到日志文件，
+    不同线程的日志之间不保证按时间排序。环形缓冲区满时丢弃日志并计数，不阻塞处理请求的线程。
+    日志轮转：把文件移走之后调用reopen()（收到SIGUSR1时），后台线程写完已有的数据后重新打开日志文件。
+*/
+class access_log {
+public:
+    static const size_t RING_SIZE = 1024 * 1024; // 每个线程的环形缓冲区大小，必须是2的幂
+    static const int FLUSH_INTERVAL_MS = 100; // 后台线程写文件的间隔
+    static const int MAX_LINE = 2048; // 一条日志的最大长度，URL太长时截断
+
+    explicit access_log(const char * path); // 打开日志文件失败时抛出异常
+    ~access_log(); // 调用stop()
+
+    bool start(); // 启动后台线程
+    void stop(); // 结束后台线程并写完剩下的日志，之后不能再调用log()
+    void log(const access_entry & e); // 可以在任意线程中调用
+    void reopen(); // 可以在任意线程中调用
+
+    void get_stats(access_log_stats & stats);
+
+private:
+    struct ring {
+        char data[RING_SIZE];
+        std::atomic<size_t> head __attribute__((aligned(64))); // 生产者写入的总字节数
+        std::atomic<size_t> tail __attribute__((aligned(64))); // 后台线程写出的总字节数
+        std::atomic<uint64_t> entries;
+        ring * next;
+    };
+
+    std::string m_path;
+    int m_fd;
+    int m_wakefd; // eventfd，用于唤醒后台线程
+    pthread_t m_thread;
+    bool m_started;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_reopen;
+    std::atomic<ring *> m_rings; // 所有线程的环形缓冲区，只增加，析构时释放
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_bytes_written;
+    std::atomic<uint64_t> m_write_errors;
+
+    static __thread ring * t_ring; // 当前线程的环形缓冲区
+
+    ring * local();
+    int format(char * line, const access_entry & e);
+    void flush(); // 只在后台线程中调用
+    void do_reopen();
+
+    static void * worker(void * arg);
+};
+
+#endif
@@ -0,0 +1,46 @@
+#!/bin/sh
+# 比较epoll和io_uring后端：每个后端、每个场景先不跟踪运行一次，记录吞吐量和p99延迟；
+# 再在bench/syscount跟踪下运行一次，用系统调用总数除以请求数得到每个请求的系统调用数，并列出最多的几个系统调用
+# 用法：bench/backends.sh [场景名 ...]，默认index_keepalive index_pipeline index_close
+# 环境变量：PORT端口（默认9006），SERVER_ARGS放在端口后的参数（默认"1"，一个事件循环，不经过线程池），
+#           DURATION每次压测的秒数（覆盖场景文件中的值）
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+server_args=${SERVER_ARGS:-1}
+scenarios=${*:-index_keepalive index_pipeline index_close}
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+g++ -std=c++11 -O2 bench/loadgen.cpp -lpthread -lssl -lcrypto -o loadgen
+g++ -std=c++11 -O2 bench/syscount.cpp -o syscount
+
+field() {
+    python3 -c 'import json, sys; r = json.load(open(sys.argv[1])); print(eval(sys.argv[2]))' "$1" "$2"
+}
+
+printf "%-16s %-6s %12s %10s %14s  %s\n" scenario backend rps p99_us syscalls/req "top syscalls per request"
+for s in $scenarios; do
+    for backend in epoll uring; do
+        ./server -b $backend "$port" $server_args >"$out/server.log" 2>&1 &
+        server_pid=$!
+        sleep 1
+        ./loadgen -s "bench/scenarios/$s.conf" -p "$port" ${DURATION:+-d $DURATION} -o "$out/plain.json" >/dev/null
+
+        ./syscount $server_pid >"$out/syscalls" &
+        trace_pid=$!
+        sleep 0.5
+        ./loadgen -s "bench/scenarios/$s.conf" -p "$port" ${DURATION:+-d $DURATION} -o "$out/traced.json" >/dev/null
+        kill -INT $trace_pid
+        wait $trace_pid
+        kill $server_pid
+        wait $server_pid || true
+
+        requests=$(field "$out/traced.json" 'r["requests"]')
+        total=$(awk '$1 == "total" { print $2 }' "$out/syscalls")
+        top=$(awk -v n="$requests" 'NR > 1 && NR <= 5 { printf "%s %.2f  ", $1, $2 / n }' "$out/syscalls")
+        printf "%-16s %-6s %12s %10s %14s  %s\n" "$s" $backend "$(field "$out/plain.json" 'r["throughput_rps"]')" \
+            "$(field "$out/plain.json" 'r["latency_us"]["p99"]')" "$(awk -v t="$total" -v n="$requests" 'BEGIN { printf "%.2f", t / n }')" "$top"
+    done
+done
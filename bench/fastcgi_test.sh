@@ -0,0 +1,154 @@
+#!/bin/sh
+# FastCGI转发测试：启动bench/fcgi_echo.py作为后端，检查POST和fastcgi_prefix下的请求被转发，
+# 请求体（Content-Length和chunked）原样返回，chunked请求体的增量解码（块扩展、尾部字段、任意位置拆开的读取、
+# 格式错误和同时有两种长度时的400），流水线中的静态文件请求不受影响，
+# 多路复用时并发的请求同时进行，后端不可用时返回502
+# 用法：bench/fastcgi_test.sh
+# 环境变量：PORT端口（默认9006），SERVER_OPTS放在端口前的选项（如"-b uring"），
+#           SERVER_ARGS放在端口后的参数（如"2 4"）
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+out=$(mktemp -d)
+sock="$out/fcgi.sock"
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+
+cat >"$out/server.conf" <<EOF
+doc_root = resources
+fastcgi_pass = unix:$sock
+fastcgi_max_conns = 2
+fastcgi_multiplex = 4
+fastcgi_prefix = /app
+max_body_size = 4M
+EOF
+
+python3 bench/fcgi_echo.py "unix:$sock" >"$out/echo.log" 2>&1 &
+echo_pid=$!
+./server -f "$out/server.conf" $SERVER_OPTS "$port" $SERVER_ARGS >"$out/server.log" 2>&1 &
+server_pid=$!
+trap 'kill $server_pid $echo_pid 2>/dev/null || true; rm -rf "$out"' EXIT
+sleep 1
+
+fail=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: expected $3, got $2"
+        fail=1
+    else
+        echo "ok: $1"
+    fi
+}
+url="http://127.0.0.1:$port"
+
+check "POST" "$(curl -s -X POST --data 'hello=world' "$url/form?a=1")" "hello=world"
+check "prefix" "$(curl -s -o /dev/null -w '%{http_code}' "$url/app/x?status=404&length=1")" "404"
+check "static" "$(curl -s -o /dev/null -w '%{http_code}' "$url/index.html")" "200"
+
+head -c 1000000 /dev/urandom >"$out/body"
+curl -s -X POST --data-binary @"$out/body" "$url/echo" -o "$out/echoed"
+check "Content-Length body" "$(cmp -s "$out/body" "$out/echoed" && echo same)" "same"
+curl -s -X POST -H 'Transfer-Encoding: chunked' --data-binary @"$out/body" "$url/echo" -o "$out/echoed"
+check "chunked body" "$(cmp -s "$out/body" "$out/echoed" && echo same)" "same"
+check "large response" "$(curl -s -o /dev/null -w '%{size_download}' "$url/app/big?size=5000000")" "5000000"
+
+# chunked请求体的增量解码：每个用例的请求体分成若干次发送，期望回显的内容或者400
+check "chunked decoder" "$(python3 - "$port" <<'EOF'
+import http.client, random, socket, sys, time
+port = int(sys.argv[1])
+head = b'POST /echo HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n'
+
+def send(request, pieces):
+    s = socket.create_connection(('127.0.0.1', port), timeout=5)
+    pos = 0
+    try:
+        for n in pieces:
+            s.sendall(request[pos:pos + n])
+            pos += n
+            time.sleep(0.002)
+        s.sendall(request[pos:])
+    except OSError:
+        # 出错时服务器发送400之后关闭连接，不再读剩下的请求体
+        pass
+    r = http.client.HTTPResponse(s)
+    r.begin()
+    return r.status, r.read()
+
+def chunks(body, size):
+    return b''.join(b'%x\r\n' % len(body[i:i + size]) + body[i:i + size] + b'\r\n'
+                    for i in range(0, len(body), size)) + b'0\r\n\r\n'
+
+random.seed(1)
+big = bytes(random.randrange(256) for _ in range(300000))
+# 名字，请求头，请求体，拆开的方式（bytes每个字节一段，random随机几十段），期望的回显或者400
+cases = [
+    ('extensions and trailers', head + b'\r\n',
+     b'5;a=b\r\nhello\r\n0006;x\r\n world\r\nA\r\n0123456789\r\n0;end\r\nX-T: 1\r\nY: 2\r\n\r\n', 'bytes',
+     b'hello world0123456789'),
+    ('empty body', head + b'\r\n', b'0\r\n\r\n', None, b''),
+    ('one-byte chunks', head + b'\r\n', chunks(big[:3000], 1), None, big[:3000]),
+    ('large chunk in random pieces', head + b'\r\n', chunks(big, len(big)), 'random', big),
+    ('small chunks in random pieces', head + b'\r\n', chunks(big, 777), 'random', big),
+    ('Content-Length 0 with chunked', head + b'Content-Length: 0\r\n\r\n', b'0\r\n\r\n', None, 400),
+    ('Content-Length with chunked', head + b'Content-Length: 5\r\n\r\n', b'5\r\nhello\r\n0\r\n\r\n', None, 400),
+    ('no size digits', head + b'\r\n', b';x\r\nhello\r\n0\r\n\r\n', None, 400),
+    ('size overflow', head + b'\r\n', b'1234567890abcdef\r\nhello\r\n0\r\n\r\n', None, 400),
+    ('data longer than size', head + b'\r\n', b'5\r\nhelloXX\r\n0\r\n\r\n', None, 400),
+    ('bare LF after size', head + b'\r\n', b'5\nhello\r\n0\r\n\r\n', None, 400),
+    ('extension too long', head + b'\r\n', b'5;' + b'x' * 5000 + b'\r\nhello\r\n0\r\n\r\n', 'random', 400),
+]
+failed = []
+for name, h, body, split, want in cases:
+    if split == 'bytes':
+        pieces = [len(h)] + [1] * (len(body) - 1)
+    elif split == 'random':
+        pieces = [len(h)] + [random.randrange(1, 20000) for _ in range(40)]
+    else:
+        pieces = []
+    status, got = send(h + body, pieces)
+    if (status, got) != ((400, got) if want == 400 else (200, want)):
+        failed.append(name)
+print(', '.join(failed) or 'ok')
+EOF
+)" "ok"
+
+# 流水线：静态文件和转发的请求交替，响应按顺序返回
+check "pipeline" "$(python3 - "$port" <<'EOF'
+import socket, sys
+s = socket.create_connection(('127.0.0.1', int(sys.argv[1])))
+s.sendall(b'GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n'
+          b'POST /a HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\nhello'
+          b'GET /index.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n')
+data = b''
+while True:
+    chunk = s.recv(65536)
+    if not chunk:
+        break
+    data += chunk
+print(data.count(b'HTTP/1.1 200 OK'), b'\r\n5\r\nhello\r\n0\r\n\r\n' in data)
+EOF
+)" "3 True"
+
+# 8个各需0.5秒的请求，2个后端连接各同时进行4个，应该在一个周期左右完成
+start=$(date +%s%N)
+pids=
+for i in 1 2 3 4 5 6 7 8; do
+    curl -s -X POST --data "$i" "$url/slow?delay=500" -o "$out/slow$i" &
+    pids="$pids $!"
+done
+wait $pids
+elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+check "multiplex" "$(cat "$out"/slow* | tr -d '\n')" "12345678"
+check "multiplex time" "$([ $elapsed -lt 1000 ] && echo fast || echo "slow ${elapsed}ms")" "fast"
+
+kill $echo_pid
+sleep 0.5
+check "backend down" "$(curl -s -o /dev/null -w '%{http_code}' -X POST --data x "$url/down")" "502"
+check "static after backend down" "$(curl -s -o /dev/null -w '%{http_code}' "$url/index.html")" "200"
+
+if [ $fail -ne 0 ]; then
+    echo "FAIL"
+    cat "$out/server.log"
+    exit 1
+fi
+echo "PASS"
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+# 测试用的FastCGI响应器：读完请求体之后原样返回，响应头中带上几个CGI环境变量。
+# 同一个连接上的多个请求并发处理（支持多路复用），请求结束后按FCGI_KEEP_CONN决定是否关闭连接。
+# 查询字符串控制响应：status=404 返回该状态码，size=N 返回N字节的响应体代替回显，
+# length=1 带Content-Length（否则由服务器用chunked编码），delay=毫秒 延迟响应
+# 用法：bench/fcgi_echo.py unix:/tmp/fcgi.sock 或者 bench/fcgi_echo.py 127.0.0.1:9000
+import asyncio
+import os
+import struct
+import sys
+from urllib.parse import parse_qs
+
+BEGIN_REQUEST, ABORT_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 2, 3, 4, 5, 6
+GET_VALUES, GET_VALUES_RESULT = 9, 10
+KEEP_CONN = 1
+
+
+def record(rtype, rid, content=b''):
+    out = b''
+    while True:
+        part, content = content[:65535], content[65535:]
+        pad = -len(part) % 8
+        out += struct.pack('>BBHHBx', 1, rtype, rid, len(part), pad) + part + b'\0' * pad
+        if not content:
+            return out
+
+
+def pair(name, value):
+    def length(n):
+        return bytes([n]) if n < 128 else struct.pack('>I', n | 0x80000000)
+    return length(len(name)) + length(len(value)) + name + value
+
+
+def parse_params(data):
+    params = {}
+    i = 0
+    while i < len(data):
+        lens = []
+        for _ in range(2):
+            if data[i] < 128:
+                lens.append(data[i])
+                i += 1
+            else:
+                lens.append(struct.unpack('>I', data[i:i + 4])[0] & 0x7fffffff)
+                i += 4
+        name = data[i:i + lens[0]]
+        value = data[i + lens[0]:i + lens[0] + lens[1]]
+        i += lens[0] + lens[1]
+        params[name.decode()] = value.decode('latin-1')
+    return params
+
+
+class Request:
+    def __init__(self, keep):
+        self.keep = keep
+        self.params = b''
+        self.stdin = b''
+        self.done = asyncio.Event()
+
+
+async def respond(rid, req, writer, conn):
+    await req.done.wait()
+    env = parse_params(req.params)
+    query = parse_qs(env.get('QUERY_STRING', ''))
+    delay = int(query.get('delay', ['0'])[0])
+    if delay:
+        await asyncio.sleep(delay / 1000)
+    if rid not in conn['requests']:
+        return  # 已经放弃
+    status = query.get('status', [None])[0]
+    if 'size' in query:
+        body = b'x' * int(query['size'][0])
+    else:
+        body = req.stdin
+    head = 'Content-Type: text/plain\r\n'
+    if status:
+        head += 'Status: %s\r\n' % status
+    if 'length' in query:
+        head += 'Content-Length: %d\r\n' % len(body)
+    for name in ('REQUEST_METHOD', 'REQUEST_URI', 'SCRIPT_NAME', 'QUERY_STRING', 'CONTENT_LENGTH', 'REQUEST_SCHEME',
+                 'HTTPS', 'SERVER_PORT'):
+        head += 'X-%s: %s\r\n' % (name.replace('_', '-'), env.get(name, ''))
+    data = (head + '\r\n').encode() + body
+    # 响应分成多条STDOUT记录
+    out = b''
+    for i in range(0, len(data), 8192):
+        out += record(STDOUT, rid, data[i:i + 8192])
+    out += record(STDOUT, rid) + record(END_REQUEST, rid, struct.pack('>IB3x', 0, 0))
+    del conn['requests'][rid]
+    writer.write(out)
+    await writer.drain()
+    if not req.keep:
+        writer.close()
+
+
+async def serve(reader, writer):
+    conn = {'requests': {}}
+    try:
+        while True:
+            header = await reader.readexactly(8)
+            _, rtype, rid, length, pad = struct.unpack('>BBHHBx', header)
+            content = await reader.readexactly(length + pad)
+            content = content[:length]
+            req = conn['requests'].get(rid)
+            if rtype == BEGIN_REQUEST:
+                req = conn['requests'][rid] = Request(content[2] & KEEP_CONN)
+                asyncio.ensure_future(respond(rid, req, writer, conn))
+            elif rtype == GET_VALUES:
+                writer.write(record(GET_VALUES_RESULT, 0, pair(b'FCGI_MPXS_CONNS', b'1')))
+            elif req is None:
+                continue
+            elif rtype == ABORT_REQUEST:
+                del conn['requests'][rid]
+                writer.write(record(END_REQUEST, rid, struct.pack('>IB3x', 0, 0)))
+            elif rtype == PARAMS:
+                req.params += content
+            elif rtype == STDIN:
+                if content:
+                    req.stdin += content
+                else:
+                    req.done.set()
+    except (asyncio.IncompleteReadError, ConnectionError):
+        pass
+    writer.close()
+
+
+def main():
+    address = sys.argv[1] if len(sys.argv) > 1 else 'unix:/tmp/fcgi_echo.sock'
+    loop = asyncio.new_event_loop()
+    if address.startswith('unix:'):
+        path = address[5:]
+        if os.path.exists(path):
+            os.unlink(path)
+        server = loop.run_until_complete(asyncio.start_unix_server(serve, path))
+    else:
+        host, port = address.rsplit(':', 1)
+        server = loop.run_until_complete(asyncio.start_server(serve, host, int(port)))
+    print('fcgi_echo: listening on %s' % address, flush=True)
+    try:
+        loop.run_forever()
+    finally:
+        server.close()
+
+
+if __name__ == '__main__':
+    main()
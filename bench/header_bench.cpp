@@ -0,0 +1,292 @@
+/*
+    响应头生成的微基准：比较原来逐个vsnprintf的写法和现在直接拼接的写法，以及Date的每秒缓存。
+    两种写法生成同样的200响应头（状态行、Date、ETag、Last-Modified、Content-Length、Content-Type、
+    Vary、Connection），原来的写法用strftime格式化Date和Last-Modified；开始时检查两者输出相同。
+    另外单独比较Date：每次用strftime格式化，和每个线程每秒格式化一次。
+
+    http_conn的这些函数是私有的，依赖整个连接对象，这里照抄了http_conn.cpp中的写法（写缓冲固定大小，
+    不向缓冲区池借用），改动http_conn.cpp的响应头时要同步修改；Content-Type用真实的mime_type()。
+
+    编译：g++ -std=c++11 -O2 bench/header_bench.cpp mime_types.cpp -o header_bench
+    运行：./header_bench [-n 次数]，默认 -n 2000000
+*/
+#include "../mime_types.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char * http_date_format = "%a, %d %b %Y %H:%M:%S GMT";
+static const int BUFFER_SIZE = 2048;
+
+// 一个响应需要的信息
+struct response {
+    struct stat st;
+    const char * path;
+    bool linger;
+    bool vary;
+};
+
+static void make_etag(const response & r, char * buf, int len) {
+    unsigned long long mtime = (unsigned long long)r.st.st_mtim.tv_sec * 1000000000ULL + r.st.st_mtim.tv_nsec;
+    snprintf(buf, len, "\"%llx-%llx-%llx\"", (unsigned long long)r.st.st_ino, mtime, (unsigned long long)r.st.st_size);
+}
+
+// 原来的写法：每个响应头一次vsnprintf
+class printf_builder {
+public:
+    printf_builder() : m_idx(0) {}
+
+    int build(const response & r) {
+        m_idx = 0;
+        bool f = add_response("HTTP/1.1 %d %s\r\n", 200, "OK");
+        char date[64];
+        struct tm tm;
+        time_t now = time(NULL);
+        gmtime_r(&now, &tm);
+        strftime(date, sizeof(date), http_date_format, &tm);
+        f = f && add_response("Date: %s\r\n", date);
+        char etag[64];
+        make_etag(r, etag, sizeof(etag));
+        gmtime_r(&r.st.st_mtime, &tm);
+        strftime(date, sizeof(date), http_date_format, &tm);
+        f = f && add_response("ETag: %s\r\nLast-Modified: %s\r\n", etag, date);
+        f = f && add_response("Content-Length: %lld\r\n", (long long)r.st.st_size);
+        f = f && add_response("Content-Type: %s\r\n", mime_type(r.path));
+        if (r.vary) f = f && add_response("Vary: Accept-Encoding\r\n");
+        f = f && add_response("Connection: %s\r\n", (r.linger ? "keep-alive" : "close"));
+        f = f && add_response("\r\n");
+        return f ? m_idx : -1;
+    }
+
+    const char * data() const { return m_buf; }
+
+private:
+    char m_buf[BUFFER_SIZE];
+    int m_idx;
+
+    bool add_response(const char * format, ...) {
+        va_list arglist;
+        va_start(arglist, format);
+        int len = vsnprintf(m_buf + m_idx, BUFFER_SIZE - m_idx, format, arglist);
+        va_end(arglist);
+        if (len >= BUFFER_SIZE - m_idx) return false;
+        m_idx += len;
+        return true;
+    }
+};
+
+// 按HTTP日期格式输出t，不经过strftime，返回长度（29）
+static int format_http_date(time_t t, char * buf) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    int year = tm.tm_year + 1900;
+    char * p = buf;
+    memcpy(p, days + tm.tm_wday * 3, 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    *p++ = '0' + tm.tm_mday / 10;
+    *p++ = '0' + tm.tm_mday % 10;
+    *p++ = ' ';
+    memcpy(p, months + tm.tm_mon * 3, 3);
+    p += 3;
+    *p++ = ' ';
+    *p++ = '0' + year / 1000 % 10;
+    *p++ = '0' + year / 100 % 10;
+    *p++ = '0' + year / 10 % 10;
+    *p++ = '0' + year % 10;
+    *p++ = ' ';
+    *p++ = '0' + tm.tm_hour / 10;
+    *p++ = '0' + tm.tm_hour % 10;
+    *p++ = ':';
+    *p++ = '0' + tm.tm_min / 10;
+    *p++ = '0' + tm.tm_min % 10;
+    *p++ = ':';
+    *p++ = '0' + tm.tm_sec / 10;
+    *p++ = '0' + tm.tm_sec % 10;
+    memcpy(p, " GMT", 4);
+    p += 4;
+    return p - buf;
+}
+
+// 现在的写法：预先拼好的状态行和常量响应头直接复制，整数和日期手工格式化，Date每秒格式化一次
+class append_builder {
+public:
+    append_builder() : m_idx(0) {}
+
+    int build(const response & r) {
+        static const char status[] = "HTTP/1.1 200 OK\r\n";
+        static const char vary[] = "Vary: Accept-Encoding\r\n";
+        static const char keep_alive[] = "Connection: keep-alive\r\n";
+        static const char close[] = "Connection: close\r\n";
+        m_idx = 0;
+        bool f = append(status, sizeof(status) - 1);
+        f = f && add_date();
+        char etag[64];
+        make_etag(r, etag, sizeof(etag));
+        f = f && append("ETag: ", 6);
+        f = f && append(etag, strlen(etag));
+        f = f && append("\r\n", 2);
+        char line[48] = "Last-Modified: ";
+        int len = 15 + format_http_date(r.st.st_mtime, line + 15);
+        memcpy(line + len, "\r\n", 2);
+        f = f && append(line, len + 2);
+        f = f && append("Content-Length: ", 16);
+        f = f && append_int(r.st.st_size);
+        f = f && append("\r\n", 2);
+        const char * type = mime_type(r.path);
+        f = f && append("Content-Type: ", 14);
+        f = f && append(type, strlen(type));
+        f = f && append("\r\n", 2);
+        if (r.vary) f = f && append(vary, sizeof(vary) - 1);
+        f = f && (r.linger ? append(keep_alive, sizeof(keep_alive) - 1) : append(close, sizeof(close) - 1));
+        f = f && append("\r\n", 2);
+        return f ? m_idx : -1;
+    }
+
+    const char * data() const { return m_buf; }
+
+private:
+    char m_buf[BUFFER_SIZE];
+    int m_idx;
+
+    bool append(const char * data, int len) {
+        if (m_idx + len > BUFFER_SIZE) return false;
+        memcpy(m_buf + m_idx, data, len);
+        m_idx += len;
+        return true;
+    }
+
+    bool append_int(long long value) {
+        char buf[24];
+        char * p = buf + sizeof(buf);
+        unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+        do {
+            *--p = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        if (value < 0) *--p = '-';
+        return append(p, buf + sizeof(buf) - p);
+    }
+
+    bool add_date() {
+        static __thread time_t cached_sec = -1;
+        static __thread char cached_line[48];
+        static __thread int cached_len = 0;
+        time_t now = time(NULL);
+        if (now != cached_sec) {
+            memcpy(cached_line, "Date: ", 6);
+            cached_len = 6 + format_http_date(now, cached_line + 6);
+            memcpy(cached_line + cached_len, "\r\n", 2);
+            cached_len += 2;
+            cached_sec = now;
+        }
+        return append(cached_line, cached_len);
+    }
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 只比较Date：每次strftime，或者每秒格式化一次
+static int date_strftime(char * buf) {
+    struct tm tm;
+    time_t now = time(NULL);
+    gmtime_r(&now, &tm);
+    return strftime(buf, 64, http_date_format, &tm);
+}
+
+static int date_cached(char * buf) {
+    static __thread time_t cached_sec = -1;
+    static __thread char cached[32];
+    time_t now = time(NULL);
+    if (now != cached_sec) {
+        format_http_date(now, cached);
+        cached_sec = now;
+    }
+    memcpy(buf, cached, 29);
+    return 29;
+}
+
+int main(int argc, char * argv[]) {
+    long n = 2000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') n = atol(optarg);
+        else {
+            printf("usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // 请求不同类型的文件，覆盖MIME表的查找
+    static const char * paths[] = { "/index.html", "/images/image1.jpg", "/css/site.css", "/js/app.js",
+                                    "/fonts/a.woff2", "/video/b.mp4", "/docs/c.pdf", "/README" };
+    const int npaths = sizeof(paths) / sizeof(paths[0]);
+    response rs[npaths];
+    for (int i = 0; i < npaths; i++) {
+        memset(&rs[i].st, 0, sizeof(rs[i].st));
+        rs[i].st.st_ino = 1234567 + i;
+        rs[i].st.st_mtim.tv_sec = 1700000000 + i * 86400;
+        rs[i].st.st_mtim.tv_nsec = 123456789;
+        rs[i].st.st_size = 350 + i * 100000;
+        rs[i].path = paths[i];
+        rs[i].linger = i % 2 == 0;
+        rs[i].vary = i % 3 == 0;
+    }
+
+    printf_builder old_builder;
+    append_builder new_builder;
+    for (int i = 0; i < npaths; i++) {
+        int a = old_builder.build(rs[i]);
+        int b = new_builder.build(rs[i]);
+        // 两次调用之间秒数可能变化，Date不比较
+        if (a != b || a < 0 || memcmp(old_builder.data(), new_builder.data(), 17) != 0
+            || memcmp(old_builder.data() + 54, new_builder.data() + 54, a - 54) != 0) {
+            printf("output differs for %s:\n%.*s---\n%.*s", paths[i], a, old_builder.data(), b, new_builder.data());
+            return 1;
+        }
+    }
+
+    long bytes = 0;
+    double start = now_s();
+    for (long i = 0; i < n; i++) {
+        bytes += old_builder.build(rs[i % npaths]);
+    }
+    double old_ns = (now_s() - start) * 1e9 / n;
+    start = now_s();
+    for (long i = 0; i < n; i++) {
+        bytes += new_builder.build(rs[i % npaths]);
+    }
+    double new_ns = (now_s() - start) * 1e9 / n;
+
+    char buf[64];
+    start = now_s();
+    for (long i = 0; i < n; i++) {
+        bytes += date_strftime(buf);
+    }
+    double strftime_ns = (now_s() - start) * 1e9 / n;
+    start = now_s();
+    for (long i = 0; i < n; i++) {
+        bytes += date_cached(buf);
+    }
+    double cached_ns = (now_s() - start) * 1e9 / n;
+
+    printf("%-28s %10s\n", "", "ns/op");
+    printf("%-28s %10.1f\n", "headers, vsnprintf", old_ns);
+    printf("%-28s %10.1f  %.2fx\n", "headers, append", new_ns, old_ns / new_ns);
+    printf("%-28s %10.1f\n", "Date, strftime", strftime_ns);
+    printf("%-28s %10.1f  %.2fx\n", "Date, cached per second", cached_ns, strftime_ns / cached_ns);
+    // 防止循环被优化掉
+    if (bytes == 0) printf("\n");
+    return 0;
+}
@@ -0,0 +1,763 @@
+/*
+    HTTP压力测试工具：通过回环地址向服务器发送请求，统计吞吐量和延迟分布。
+
+    编译：g++ -std=c++11 -O2 bench/loadgen.cpp -o loadgen -lpthread -lssl -lcrypto
+    运行：./loadgen [-s 场景文件] [-H 地址] [-p 端口] [-c 连接数] [-t 线程数] [-d 秒数]
+                    [-k 0|1] [-P 流水线深度] [-m 请求组合] [-n 场景名] [-o 结果.json] [-S]
+
+    -S使用TLS（不验证证书，不复用会话，每个连接都是完整的握手），-k 0时每个请求一次握手，可以用来测量握手的速率。
+
+    请求组合的格式为 "路径:权重,路径:权重"，如 "/index.html:9,/images/image1.jpg:1"；
+    路径中的{a..b}展开为a到b的每个整数，每个路径各自的权重，如 "/f/{0..99}.txt:1" 为100个路径。
+    场景文件每行一个 key=value，key为 connections、threads、duration、keepalive、pipeline、mix、tls、header，
+    header为每个请求附加的请求头（如 header=Accept-Encoding: gzip），可以有多行。
+    命令行参数覆盖场景文件中的值。结果写成JSON，方便比较不同版本。
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+static const int MAX_PIPELINE = 64; // 流水线深度的上限
+static const int MAX_EVENTS = 256;
+
+// 测试参数
+struct config {
+    std::string name;
+    std::string host;
+    int port;
+    int connections;
+    int threads;
+    int duration; // 秒
+    bool keepalive;
+    int pipeline; // 每个连接上同时在途的请求数
+    std::vector<std::string> paths; // 请求组合
+    std::vector<int> weights;
+    int total_weight;
+    std::string output;
+    bool tls;
+    std::string headers; // 每个请求附加的请求头，每个以\r\n结尾
+};
+
+/*
+    HDR风格的延迟直方图（微秒）：小于128的值精确记录，更大的值按2的幂分段，
+    每段再均分为64个桶，相对误差不超过1/64。合并只需要逐桶相加。
+*/
+class histogram {
+public:
+    static const int SUB_BITS = 7;
+    static const int SUB_COUNT = 1 << SUB_BITS; // 128
+    static const int HALF = SUB_COUNT / 2; // 64
+    static const int SEGMENTS = 40;
+    static const int BUCKETS = SUB_COUNT + SEGMENTS * HALF;
+
+    histogram() : m_total(0), m_sum(0), m_max(0) { memset(m_counts, 0, sizeof(m_counts)); }
+
+    void record(uint64_t v) {
+        int idx = index(v);
+        if (idx >= BUCKETS) idx = BUCKETS - 1;
+        m_counts[idx]++;
+        m_total++;
+        m_sum += v;
+        if (v > m_max) m_max = v;
+    }
+
+    void merge(const histogram & h) {
+        for (int i = 0; i < BUCKETS; i++) m_counts[i] += h.m_counts[i];
+        m_total += h.m_total;
+        m_sum += h.m_sum;
+        if (h.m_max > m_max) m_max = h.m_max;
+    }
+
+    // 第q（0~1）分位数，返回所在桶的上界
+    uint64_t percentile(double q) const {
+        if (m_total == 0) return 0;
+        uint64_t rank = (uint64_t)(q * m_total + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                uint64_t upper = upper_bound(i);
+                return upper < m_max ? upper : m_max;
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t total() const { return m_total; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_total ? (double)m_sum / m_total : 0; }
+
+private:
+    uint64_t m_counts[BUCKETS];
+    uint64_t m_total;
+    uint64_t m_sum;
+    uint64_t m_max;
+
+    static int index(uint64_t v) {
+        if (v < (uint64_t)SUB_COUNT) return (int)v;
+        int seg = 63 - __builtin_clzll(v) - (SUB_BITS - 1); // >= 1
+        return SUB_COUNT + (seg - 1) * HALF + (int)(v >> seg) - HALF;
+    }
+
+    static uint64_t upper_bound(int idx) {
+        if (idx < SUB_COUNT) return idx;
+        int seg = (idx - SUB_COUNT) / HALF + 1;
+        uint64_t sub = (idx - SUB_COUNT) % HALF + HALF;
+        return ((sub + 1) << seg) - 1;
+    }
+};
+
+// 每个线程的统计结果
+struct thread_stats {
+    histogram latency;
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t errors; // 连接失败、连接被重置、响应格式错误
+    uint64_t status[6]; // 按状态码的百位计数，status[2]为2xx
+    uint64_t connects;
+    uint64_t handshakes; // 完成的TLS握手数
+
+    thread_stats() : requests(0), bytes(0), errors(0), connects(0), handshakes(0) { memset(status, 0, sizeof(status)); }
+};
+
+// 一个客户端连接
+struct client {
+    int fd;
+    bool connected;
+    SSL * ssl; // NULL表示明文连接
+    bool handshaking; // TLS握手还没有完成
+    std::string out; // 还没有写出去的请求
+    size_t out_off;
+    uint64_t sent_at[MAX_PIPELINE]; // 在途请求的发出时间，按顺序应答
+    int head;
+    int inflight;
+
+    // 响应解析状态
+    std::string header;
+    int crlf; // 已经匹配的"\r\n\r\n"的字符数
+    bool in_body;
+    long long body_left; // -1表示读到连接关闭为止
+    int status;
+    bool close_after;
+};
+
+struct worker {
+    const config * cfg;
+    int index;
+    int connections;
+    pthread_t thread;
+    thread_stats stats;
+    uint64_t seed;
+};
+
+static std::atomic<bool> g_stop(false);
+static struct sockaddr_in g_addr;
+static SSL_CTX * g_ssl_ctx; // -S时使用
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t next_random(uint64_t & s) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+static void close_client(int epfd, client & c) {
+    if (c.ssl) {
+        SSL_free(c.ssl);
+        c.ssl = NULL;
+    }
+    if (c.fd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+        close(c.fd);
+        c.fd = -1;
+    }
+}
+
+static void set_events(int epfd, client & c, uint32_t events) {
+    epoll_event ev;
+    ev.data.ptr = &c;
+    ev.events = events;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+static void update_events(int epfd, client & c) {
+    set_events(epfd, c, !c.connected || c.out_off < c.out.size() ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+// 按请求组合挑选路径，追加一个请求到输出缓冲
+static void queue_request(worker * w, client & c) {
+    const config & cfg = *w->cfg;
+    int r = (int)(next_random(w->seed) % cfg.total_weight);
+    size_t i = 0;
+    while (r >= cfg.weights[i]) {
+        r -= cfg.weights[i];
+        i++;
+    }
+    c.out += "GET ";
+    c.out += cfg.paths[i];
+    c.out += " HTTP/1.1\r\nHost: ";
+    c.out += cfg.host;
+    c.out += cfg.keepalive ? "\r\nConnection: keep-alive\r\n" : "\r\nConnection: close\r\n";
+    c.out += cfg.headers;
+    c.out += "\r\n";
+    c.sent_at[(c.head + c.inflight) % MAX_PIPELINE] = now_us();
+    c.inflight++;
+}
+
+// 新建连接；短连接模式下请求的计时包括建立连接的时间
+static bool open_client(worker * w, int epfd, client & c) {
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd < 0) return false;
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c.connected = false;
+    c.ssl = NULL;
+    c.handshaking = false;
+    c.out.clear();
+    c.out_off = 0;
+    c.head = 0;
+    c.inflight = 0;
+    c.header.clear();
+    c.crlf = 0;
+    c.in_body = false;
+    w->stats.connects++;
+    if (connect(c.fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) < 0 && errno != EINPROGRESS) {
+        close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    if (g_ssl_ctx) {
+        // 连接建立之后先握手，握手完成再发送请求
+        c.ssl = SSL_new(g_ssl_ctx);
+        if (!c.ssl || SSL_set_fd(c.ssl, c.fd) != 1) {
+            SSL_free(c.ssl);
+            c.ssl = NULL;
+            close(c.fd);
+            c.fd = -1;
+            return false;
+        }
+        SSL_set_connect_state(c.ssl);
+        c.handshaking = true;
+    }
+    epoll_event ev;
+    ev.data.ptr = &c;
+    ev.events = EPOLLIN | EPOLLOUT;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    int depth = w->cfg->keepalive ? w->cfg->pipeline : 1;
+    for (int i = 0; i < depth; i++) {
+        queue_request(w, c);
+    }
+    return true;
+}
+
+static void reopen_client(worker * w, int epfd, client & c) {
+    close_client(epfd, c);
+    if (!g_stop && !open_client(w, epfd, c)) {
+        w->stats.errors++;
+    }
+}
+
+// TLS连接的SSL_read、SSL_write失败时：和socket一样设置errno并返回-1，对方关闭时返回0
+static ssize_t ssl_error(client & c, int ret) {
+    int err = SSL_get_error(c.ssl, ret);
+    ERR_clear_error();
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    errno = ECONNRESET;
+    return -1;
+}
+
+static ssize_t recv_client(client & c, char * buf, size_t len) {
+    if (!c.ssl) {
+        return recv(c.fd, buf, len, 0);
+    }
+    int n = SSL_read(c.ssl, buf, len);
+    return n > 0 ? n : ssl_error(c, n);
+}
+
+// 握手还没有完成时不发送
+static bool flush_client(client & c) {
+    if (c.handshaking) {
+        return true;
+    }
+    while (c.out_off < c.out.size()) {
+        ssize_t n;
+        if (c.ssl) {
+            // 允许部分写入，重试时缓冲区可能因为追加请求而移动
+            int ret = SSL_write(c.ssl, c.out.data() + c.out_off, c.out.size() - c.out_off);
+            n = ret > 0 ? ret : ssl_error(c, ret);
+        } else {
+            n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        }
+        if (n <= 0) {
+            return n < 0 && errno == EAGAIN;
+        }
+        c.out_off += n;
+    }
+    c.out.clear();
+    c.out_off = 0;
+    return true;
+}
+
+// 解析完响应头，取出状态码、Content-Length和Connection
+static bool parse_header(client & c) {
+    const char * h = c.header.c_str();
+    if (strncmp(h, "HTTP/1.", 7) != 0 || strlen(h) < 12) return false;
+    c.status = atoi(h + 9);
+    c.body_left = -1;
+    c.close_after = false;
+    const char * line = strchr(h, '\n');
+    while (line && line[1]) {
+        line++;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c.body_left = atoll(line + 15);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char * v = line + 11;
+            v += strspn(v, " \t");
+            if (strncasecmp(v, "close", 5) == 0) c.close_after = true;
+        }
+        line = strchr(line, '\n');
+    }
+    // 304等没有响应体的状态码
+    if (c.status == 304 || c.status == 204 || (c.status >= 100 && c.status < 200)) c.body_left = 0;
+    return true;
+}
+
+// 一个响应接收完毕，返回false表示连接需要重建
+static bool finish_response(worker * w, int epfd, client & c) {
+    uint64_t now = now_us();
+    w->stats.latency.record(now - c.sent_at[c.head]);
+    c.head = (c.head + 1) % MAX_PIPELINE;
+    c.inflight--;
+    w->stats.requests++;
+    w->stats.status[c.status / 100 < 6 ? c.status / 100 : 0]++;
+    c.header.clear();
+    c.crlf = 0;
+    c.in_body = false;
+    if (c.close_after || !w->cfg->keepalive) {
+        return false;
+    }
+    if (!g_stop) {
+        // 补满流水线
+        while (c.inflight < w->cfg->pipeline) {
+            queue_request(w, c);
+        }
+        if (!flush_client(c)) return false;
+        update_events(epfd, c);
+    }
+    return true;
+}
+
+// 处理收到的数据，返回false表示连接需要重建
+static bool consume_input(worker * w, int epfd, client & c, const char * data, size_t len) {
+    while (len > 0) {
+        if (!c.in_body) {
+            // 逐字节查找响应头结尾，把响应头保存下来
+            size_t i = 0;
+            while (i < len && c.crlf < 4) {
+                char ch = data[i++];
+                if ((ch == '\r' && (c.crlf == 0 || c.crlf == 2)) || (ch == '\n' && (c.crlf == 1 || c.crlf == 3))) {
+                    c.crlf++;
+                } else {
+                    c.crlf = ch == '\r' ? 1 : 0;
+                }
+            }
+            c.header.append(data, i);
+            data += i;
+            len -= i;
+            if (c.crlf < 4) {
+                if (c.header.size() > 65536) return false;
+                break;
+            }
+            if (c.inflight == 0 || !parse_header(c)) {
+                w->stats.errors++;
+                return false;
+            }
+            c.in_body = true;
+        }
+        if (c.body_left < 0) {
+            // 读到连接关闭为止
+            len = 0;
+            break;
+        }
+        size_t n = (size_t)c.body_left < len ? (size_t)c.body_left : len;
+        c.body_left -= n;
+        data += n;
+        len -= n;
+        if (c.body_left == 0 && !finish_response(w, epfd, c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void * run_worker(void * arg) {
+    worker * w = (worker *)arg;
+    int epfd = epoll_create1(0);
+    std::vector<client> clients(w->connections);
+    for (size_t i = 0; i < clients.size(); i++) {
+        clients[i].fd = -1;
+        clients[i].ssl = NULL;
+        if (!open_client(w, epfd, clients[i])) {
+            w->stats.errors++;
+        }
+    }
+
+    static const size_t BUF_SIZE = 256 * 1024;
+    char * buf = new char[BUF_SIZE];
+    epoll_event events[MAX_EVENTS];
+    while (!g_stop) {
+        int num = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < num && !g_stop; i++) {
+            client & c = *(client *)events[i].data.ptr;
+            if (c.fd == -1) continue;
+            if (!c.connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    w->stats.errors++;
+                    reopen_client(w, epfd, c);
+                    continue;
+                }
+                c.connected = true;
+            }
+            if (c.handshaking) {
+                int ret = SSL_do_handshake(c.ssl);
+                if (ret != 1) {
+                    int err = SSL_get_error(c.ssl, ret);
+                    ERR_clear_error();
+                    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                        set_events(epfd, c, err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLIN | EPOLLOUT);
+                    } else {
+                        w->stats.errors++;
+                        reopen_client(w, epfd, c);
+                    }
+                    continue;
+                }
+                // 握手完成，发送排队的请求；请求的计时包括握手的时间
+                c.handshaking = false;
+                w->stats.handshakes++;
+                if (!flush_client(c)) {
+                    w->stats.errors++;
+                    reopen_client(w, epfd, c);
+                    continue;
+                }
+                update_events(epfd, c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (!flush_client(c)) {
+                    w->stats.errors++;
+                    reopen_client(w, epfd, c);
+                    continue;
+                }
+                update_events(epfd, c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                bool ok = true;
+                while (ok) {
+                    ssize_t n = recv_client(c, buf, BUF_SIZE);
+                    if (n > 0) {
+                        w->stats.bytes += n;
+                        ok = consume_input(w, epfd, c, buf, n);
+                    } else if (n == 0) {
+                        // 连接关闭：以关闭为结尾的响应到此结束，其余情况说明还有请求没有得到应答
+                        if (c.in_body && c.body_left < 0) {
+                            finish_response(w, epfd, c);
+                        } else if (c.inflight > 0 && w->cfg->keepalive) {
+                            w->stats.errors++;
+                        }
+                        ok = false;
+                    } else {
+                        if (errno != EAGAIN) {
+                            w->stats.errors++;
+                            ok = false;
+                        }
+                        break;
+                    }
+                }
+                if (!ok) {
+                    reopen_client(w, epfd, c);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        close_client(epfd, clients[i]);
+    }
+    close(epfd);
+    delete[] buf;
+    return NULL;
+}
+
+static std::string trim(const std::string & s) {
+    size_t b = s.find_first_not_of(" \t\r\n");
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+// "路径:权重,路径:权重"
+static bool parse_mix(config & cfg, const std::string & mix) {
+    cfg.paths.clear();
+    cfg.weights.clear();
+    cfg.total_weight = 0;
+    size_t pos = 0;
+    while (pos <= mix.size()) {
+        size_t end = mix.find(',', pos);
+        if (end == std::string::npos) end = mix.size();
+        std::string item = trim(mix.substr(pos, end - pos));
+        pos = end + 1;
+        if (item.empty()) continue;
+        int weight = 1;
+        size_t colon = item.rfind(':');
+        if (colon != std::string::npos) {
+            weight = atoi(item.c_str() + colon + 1);
+            item = item.substr(0, colon);
+        }
+        if (item.empty() || item[0] != '/' || weight <= 0) return false;
+        // {a..b}展开为多个路径
+        int first = 0, last = 0, len = 0;
+        size_t brace = item.find('{');
+        if (brace == std::string::npos) {
+            cfg.paths.push_back(item);
+            cfg.weights.push_back(weight);
+            cfg.total_weight += weight;
+        } else if (sscanf(item.c_str() + brace, "{%d..%d}%n", &first, &last, &len) == 2 && len > 0 && first <= last) {
+            for (int i = first; i <= last; i++) {
+                char num[16];
+                snprintf(num, sizeof(num), "%d", i);
+                cfg.paths.push_back(item.substr(0, brace) + num + item.substr(brace + len));
+                cfg.weights.push_back(weight);
+                cfg.total_weight += weight;
+            }
+        } else {
+            return false;
+        }
+    }
+    return !cfg.paths.empty();
+}
+
+static bool set_option(config & cfg, const std::string & key, const std::string & value) {
+    if (key == "connections") cfg.connections = atoi(value.c_str());
+    else if (key == "threads") cfg.threads = atoi(value.c_str());
+    else if (key == "duration") cfg.duration = atoi(value.c_str());
+    else if (key == "keepalive") cfg.keepalive = atoi(value.c_str()) != 0;
+    else if (key == "pipeline") cfg.pipeline = atoi(value.c_str());
+    else if (key == "mix") return parse_mix(cfg, value);
+    else if (key == "tls") cfg.tls = atoi(value.c_str()) != 0;
+    else if (key == "header") {
+        if (value.find(':') == std::string::npos) return false;
+        cfg.headers += value + "\r\n";
+    }
+    else return false;
+    return true;
+}
+
+static bool load_scenario(config & cfg, const char * path) {
+    FILE * fp = fopen(path, "r");
+    if (!fp) {
+        printf("cannot open scenario %s\n", path);
+        return false;
+    }
+    char line[1024];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        std::string s = trim(line);
+        if (s.empty() || s[0] == '#') continue;
+        size_t eq = s.find('=');
+        ok = eq != std::string::npos && set_option(cfg, trim(s.substr(0, eq)), trim(s.substr(eq + 1)));
+        if (!ok) printf("bad scenario line: %s\n", s.c_str());
+    }
+    fclose(fp);
+    // 场景名默认为文件名（去掉扩展名）
+    if (cfg.name.empty()) {
+        std::string copy(path);
+        std::string base = basename(&copy[0]);
+        cfg.name = base.substr(0, base.rfind('.'));
+    }
+    return ok;
+}
+
+static void write_json(FILE * fp, const config & cfg, const thread_stats & total, double seconds) {
+    const histogram & h = total.latency;
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"scenario\": \"%s\",\n", cfg.name.c_str());
+    fprintf(fp, "  \"connections\": %d,\n", cfg.connections);
+    fprintf(fp, "  \"threads\": %d,\n", cfg.threads);
+    fprintf(fp, "  \"duration_s\": %.3f,\n", seconds);
+    fprintf(fp, "  \"keepalive\": %s,\n", cfg.keepalive ? "true" : "false");
+    fprintf(fp, "  \"pipeline\": %d,\n", cfg.pipeline);
+    fprintf(fp, "  \"tls\": %s,\n", cfg.tls ? "true" : "false");
+    fprintf(fp, "  \"mix\": [");
+    for (size_t i = 0; i < cfg.paths.size(); i++) {
+        fprintf(fp, "%s{\"path\": \"%s\", \"weight\": %d}", i ? ", " : "", cfg.paths[i].c_str(), cfg.weights[i]);
+    }
+    fprintf(fp, "],\n");
+    fprintf(fp, "  \"requests\": %lu,\n", (unsigned long)total.requests);
+    fprintf(fp, "  \"bytes\": %lu,\n", (unsigned long)total.bytes);
+    fprintf(fp, "  \"connects\": %lu,\n", (unsigned long)total.connects);
+    fprintf(fp, "  \"handshakes\": %lu,\n", (unsigned long)total.handshakes);
+    fprintf(fp, "  \"handshakes_per_s\": %.1f,\n", total.handshakes / seconds);
+    fprintf(fp, "  \"errors\": %lu,\n", (unsigned long)total.errors);
+    fprintf(fp, "  \"status\": {\"2xx\": %lu, \"3xx\": %lu, \"4xx\": %lu, \"5xx\": %lu},\n",
+            (unsigned long)total.status[2], (unsigned long)total.status[3],
+            (unsigned long)total.status[4], (unsigned long)total.status[5]);
+    fprintf(fp, "  \"throughput_rps\": %.1f,\n", total.requests / seconds);
+    fprintf(fp, "  \"throughput_mbps\": %.2f,\n", total.bytes * 8 / seconds / 1e6);
+    fprintf(fp, "  \"latency_us\": {\"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p99.9\": %lu, \"max\": %lu}\n",
+            h.mean(), (unsigned long)h.percentile(0.5), (unsigned long)h.percentile(0.9),
+            (unsigned long)h.percentile(0.99), (unsigned long)h.percentile(0.999), (unsigned long)h.max());
+    fprintf(fp, "}\n");
+}
+
+static void usage(const char * name) {
+    printf("按照如下格式运行：%s [-s scenario] [-H host] [-p port] [-c connections] [-t threads] [-d seconds] "
+           "[-k 0|1] [-P pipeline] [-m path:weight,...] [-n name] [-o result.json] [-S]\n", name);
+}
+
+int main(int argc, char * argv[]) {
+    config cfg;
+    cfg.host = "127.0.0.1";
+    cfg.port = 9006;
+    cfg.connections = 64;
+    cfg.threads = 0;
+    cfg.duration = 10;
+    cfg.keepalive = true;
+    cfg.pipeline = 1;
+    cfg.tls = false;
+    parse_mix(cfg, "/index.html");
+
+    // 先读场景文件，命令行参数再覆盖它
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && !load_scenario(cfg, argv[i + 1])) {
+            exit(-1);
+        }
+    }
+    int opt;
+    while ((opt = getopt(argc, argv, "s:H:p:c:t:d:k:P:m:n:o:S")) != -1) {
+        switch (opt) {
+            case 's': break;
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = atoi(optarg); break;
+            case 'c': cfg.connections = atoi(optarg); break;
+            case 't': cfg.threads = atoi(optarg); break;
+            case 'd': cfg.duration = atoi(optarg); break;
+            case 'k': cfg.keepalive = atoi(optarg) != 0; break;
+            case 'P': cfg.pipeline = atoi(optarg); break;
+            case 'm':
+                if (!parse_mix(cfg, optarg)) {
+                    printf("bad request mix: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'n': cfg.name = optarg; break;
+            case 'o': cfg.output = optarg; break;
+            case 'S': cfg.tls = true; break;
+            default: usage(basename(argv[0])); exit(-1);
+        }
+    }
+    if (cfg.name.empty()) cfg.name = "custom";
+    if (cfg.threads <= 0) cfg.threads = cfg.connections < 4 ? cfg.connections : 4;
+    if (cfg.connections <= 0 || cfg.duration <= 0 || cfg.pipeline <= 0 || cfg.pipeline > MAX_PIPELINE) {
+        usage(basename(argv[0]));
+        exit(-1);
+    }
+    if (!cfg.keepalive) cfg.pipeline = 1;
+
+    memset(&g_addr, 0, sizeof(g_addr));
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons(cfg.port);
+    if (inet_pton(AF_INET, cfg.host.c_str(), &g_addr.sin_addr) != 1) {
+        printf("bad host: %s\n", cfg.host.c_str());
+        exit(-1);
+    }
+
+    if (cfg.tls) {
+        // 不验证证书（测试用的自签名证书），不缓存会话，每个连接都做完整的握手
+        g_ssl_ctx = SSL_CTX_new(TLS_client_method());
+        if (!g_ssl_ctx) {
+            printf("create TLS context failure\n");
+            exit(-1);
+        }
+        SSL_CTX_set_verify(g_ssl_ctx, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_session_cache_mode(g_ssl_ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(g_ssl_ctx, SSL_OP_NO_TICKET | SSL_OP_IGNORE_UNEXPECTED_EOF);
+        SSL_CTX_set_mode(g_ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    printf("scenario %s: %d connections, %d threads, %ds, keepalive %s, pipeline %d, tls %s\n", cfg.name.c_str(),
+           cfg.connections, cfg.threads, cfg.duration, cfg.keepalive ? "on" : "off", cfg.pipeline, cfg.tls ? "on" : "off");
+
+    // 连接平均分给各个线程
+    std::vector<worker> workers(cfg.threads);
+    uint64_t start = now_us();
+    for (int i = 0; i < cfg.threads; i++) {
+        workers[i].cfg = &cfg;
+        workers[i].index = i;
+        workers[i].connections = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads ? 1 : 0);
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            printf("create thread failure\n");
+            exit(-1);
+        }
+    }
+    sleep(cfg.duration);
+    g_stop = true;
+    thread_stats total;
+    for (int i = 0; i < cfg.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        thread_stats & s = workers[i].stats;
+        total.latency.merge(s.latency);
+        total.requests += s.requests;
+        total.bytes += s.bytes;
+        total.errors += s.errors;
+        total.connects += s.connects;
+        total.handshakes += s.handshakes;
+        for (int j = 0; j < 6; j++) total.status[j] += s.status[j];
+    }
+    double seconds = (now_us() - start) / 1e6;
+
+    write_json(stdout, cfg, total, seconds);
+    if (!cfg.output.empty()) {
+        FILE * fp = fopen(cfg.output.c_str(), "w");
+        if (!fp) {
+            printf("cannot write %s\n", cfg.output.c_str());
+            exit(-1);
+        }
+        write_json(fp, cfg, total, seconds);
+        fclose(fp);
+    }
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+    请求头解析的微基准：比较原来逐字节找行结尾、用strncasecmp逐个比较几个已知请求头的解析，
+    和现在用find_line_end()成块查找、把每个请求头放进请求头表并用lookup_header()查编号的解析。
+    输入是几种真实的浏览器请求（Chrome、Firefox、带几KB Cookie的请求）和curl的最小请求，
+    输出每个请求的纳秒数和每秒解析的字节数。
+
+    find_line_end()和lookup_header()来自http_parser.cpp；逐行的处理在http_conn中，这里照抄了原来和现在的写法，
+    只保留切分和请求头表，两者都要做的值的处理（Accept-Encoding、日期等）不计入。
+    解析会把行结尾改成'\0'，每次先把请求复制到工作缓冲区，两种解析都包括这次复制。
+
+    编译：g++ -std=c++11 -O2 bench/parser_bench.cpp http_parser.cpp -o parser_bench
+    运行：./parser_bench [-n 次数]，默认 -n 1000000
+*/
+#include "../http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+static const int MAX_HEADERS = 64;
+static const int BUFFER_SIZE = 16384;
+
+enum LINE_STATUS { LINE_OK, LINE_BAD, LINE_OPEN };
+
+struct request_buf {
+    char data[BUFFER_SIZE];
+    int read_idx;
+    int checked_index;
+    int start_line;
+};
+
+// 原来的parse_line()：逐字节查找\r\n
+static LINE_STATUS old_parse_line(request_buf & b) {
+    char tmp;
+    for (; b.checked_index < b.read_idx; ++b.checked_index) {
+        tmp = b.data[b.checked_index];
+        if (tmp == '\r') {
+            if ((b.checked_index + 1) == b.read_idx) return LINE_OPEN;
+            else if (b.data[b.checked_index + 1] == '\n') {
+                b.data[b.checked_index++] = '\0';
+                b.data[b.checked_index++] = '\0';
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        } else if (tmp == '\n') {
+            if (b.checked_index > 1 && b.data[b.checked_index - 1] == '\r') {
+                b.data[b.checked_index - 1] = '\0';
+                b.data[b.checked_index++] = '\0';
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        }
+    }
+    return LINE_OPEN;
+}
+
+// 原来的parse_headers()保存的几个请求头
+struct old_request {
+    const char * host;
+    const char * if_none_match;
+    const char * range;
+    const char * if_range;
+    const char * accept_encoding;
+    const char * if_modified_since;
+    bool linger;
+    int content_length;
+};
+
+// 原来的parse_headers()：逐个strncasecmp，不认识的请求头跳过；返回是否遇到空行
+static bool old_parse_header(char * text, old_request & r) {
+    if (text[0] == '\0') {
+        return true;
+    } else if (strncasecmp(text, "Host:", 5) == 0) {
+        text = strpbrk(text, " \t") + 1;
+        r.host = text;
+    } else if (strncasecmp(text, "Connection:", 11) == 0) {
+        text = strpbrk(text, " \t") + 1;
+        if (strncasecmp(text, "keep-alive", 10) == 0) r.linger = true;
+        else if (strncasecmp(text, "close", 5) == 0) r.linger = false;
+    } else if (strncasecmp(text, "Accept-Encoding:", 16) == 0) {
+        r.accept_encoding = text + 16;
+    } else if (strncasecmp(text, "If-None-Match:", 14) == 0) {
+        r.if_none_match = text + 14;
+    } else if (strncasecmp(text, "If-Modified-Since:", 18) == 0) {
+        r.if_modified_since = text + 18;
+    } else if (strncasecmp(text, "Range:", 6) == 0) {
+        r.range = text + 6;
+    } else if (strncasecmp(text, "If-Range:", 9) == 0) {
+        r.if_range = text + 9;
+    } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+        text = strpbrk(text, " \t") + 1;
+        r.content_length = atoi(text);
+    }
+    return false;
+}
+
+// 返回请求头的个数（原来的解析只计数已知的），出错时返回-1
+static int old_parse(request_buf & b) {
+    old_request r;
+    memset(&r, 0, sizeof(r));
+    r.linger = true;
+    bool request_line = true;
+    int known = 0;
+    while (old_parse_line(b) == LINE_OK) {
+        char * text = b.data + b.start_line;
+        b.start_line = b.checked_index;
+        if (request_line) {
+            request_line = false;
+            continue;
+        }
+        if (old_parse_header(text, r)) {
+            return known + (r.host != NULL) + (r.accept_encoding != NULL);
+        }
+        known++;
+    }
+    return -1;
+}
+
+// 现在的parse_line()：成块查找行结尾，单独的\n是错误
+static LINE_STATUS new_parse_line(request_buf & b) {
+    const char * end = b.data + b.read_idx;
+    b.checked_index = find_line_end(b.data + b.checked_index, end) - b.data;
+    if (b.checked_index == b.read_idx) {
+        return LINE_OPEN;
+    }
+    if (b.data[b.checked_index] == '\r') {
+        if ((b.checked_index + 1) == b.read_idx) return LINE_OPEN;
+        else if (b.data[b.checked_index + 1] == '\n') {
+            b.data[b.checked_index++] = '\0';
+            b.data[b.checked_index++] = '\0';
+            return LINE_OK;
+        }
+        return LINE_BAD;
+    }
+    return LINE_BAD;
+}
+
+struct new_request {
+    http_header headers[MAX_HEADERS];
+    int header_count;
+    int header_index[HDR_NUM];
+};
+
+// 现在的parse_headers()中的切分：名字: 值，去掉值前后的空白，放进请求头表；返回1遇到空行，0继续，-1出错
+static int new_parse_header(request_buf & b, char * text, new_request & r) {
+    if (text[0] == '\0') {
+        return 1;
+    }
+    char * colon = strchr(text, ':');
+    int name_len = colon ? colon - text : 0;
+    if (name_len == 0 || text[name_len - 1] == ' ' || text[name_len - 1] == '\t' || text[0] == ' ' || text[0] == '\t') {
+        return -1;
+    }
+    if (r.header_count >= MAX_HEADERS) {
+        return -1;
+    }
+    char * value = colon + 1 + strspn(colon + 1, " \t");
+    char * value_end = value + strlen(value);
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+    }
+    *value_end = '\0';
+
+    HEADER_ID id = lookup_header(text, name_len);
+    http_header & h = r.headers[r.header_count];
+    h.name = text - b.data;
+    h.name_len = name_len;
+    h.value = value - b.data;
+    h.value_len = value_end - value;
+    h.id = id;
+    if (id != HDR_UNKNOWN && r.header_index[id] == -1) {
+        r.header_index[id] = r.header_count;
+    }
+    r.header_count++;
+    return 0;
+}
+
+static int new_parse(request_buf & b) {
+    new_request r;
+    r.header_count = 0;
+    memset(r.header_index, -1, sizeof(r.header_index));
+    bool request_line = true;
+    LINE_STATUS status;
+    while ((status = new_parse_line(b)) == LINE_OK) {
+        char * text = b.data + b.start_line;
+        b.start_line = b.checked_index;
+        if (request_line) {
+            request_line = false;
+            continue;
+        }
+        int ret = new_parse_header(b, text, r);
+        if (ret < 0) return -1;
+        if (ret > 0) return r.header_count;
+    }
+    return -1;
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void load(request_buf & b, const std::string & req) {
+    memcpy(b.data, req.data(), req.size());
+    b.read_idx = req.size();
+    b.checked_index = 0;
+    b.start_line = 0;
+}
+
+int main(int argc, char * argv[]) {
+    long n = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') n = atol(optarg);
+        else {
+            printf("usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::string chrome =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+        "application/signed-exchange;v=b3;q=0.7\r\n"
+        "Sec-Fetch-Site: none\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-User: ?1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+        "If-None-Match: \"2a4c1f-17a3b5c6d7e8f9-15e\"\r\n"
+        "If-Modified-Since: Sat, 18 Oct 2026 08:00:00 GMT\r\n"
+        "\r\n";
+    std::string firefox =
+        "GET /images/image1.jpg HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+        "Accept: image/avif,image/webp,*/*\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Referer: https://www.example.com/index.html\r\n"
+        "Sec-Fetch-Dest: image\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "\r\n";
+    std::string cookie = "Cookie: ";
+    for (int i = 0; i < 40; i++) {
+        char kv[96];
+        snprintf(kv, sizeof(kv), "%ssession_%02d=%040x%08x", i ? "; " : "", i, i * 2654435761u, i);
+        cookie += kv;
+    }
+    std::string with_cookie = chrome.substr(0, chrome.size() - 2) + cookie + "\r\n\r\n";
+    std::string curl = "GET / HTTP/1.1\r\nHost: localhost:9006\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n";
+
+    const struct {
+        const char * name;
+        const std::string * req;
+    } inputs[] = { { "curl", &curl }, { "firefox", &firefox }, { "chrome", &chrome }, { "chrome+cookie", &with_cookie } };
+
+    static request_buf b;
+    printf("%-14s %6s %7s %12s %12s %10s %10s %8s\n", "request", "bytes", "headers", "old ns", "new ns", "old MB/s", "new MB/s", "speedup");
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        const std::string & req = *inputs[i].req;
+        load(b, req);
+        int headers = new_parse(b);
+        load(b, req);
+        if (headers < 0 || old_parse(b) < 0) {
+            printf("%s: parse failed\n", inputs[i].name);
+            return 1;
+        }
+
+        long sum = 0;
+        double start = now_s();
+        for (long j = 0; j < n; j++) {
+            load(b, req);
+            sum += old_parse(b);
+        }
+        double old_ns = (now_s() - start) * 1e9 / n;
+        start = now_s();
+        for (long j = 0; j < n; j++) {
+            load(b, req);
+            sum += new_parse(b);
+        }
+        double new_ns = (now_s() - start) * 1e9 / n;
+        // 防止循环被优化掉
+        if (sum == 0) printf("\n");
+        printf("%-14s %6zu %7d %12.1f %12.1f %10.0f %10.0f %7.2fx\n", inputs[i].name, req.size(), headers,
+               old_ns, new_ns, req.size() * 1e3 / old_ns, req.size() * 1e3 / new_ns, old_ns / new_ns);
+    }
+    return 0;
+}
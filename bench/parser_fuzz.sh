@@ -0,0 +1,282 @@
+#!/bin/sh
+# 请求解析的差分模糊测试：同样的请求分别发给当前版本和改用请求头表、成块查找之前的版本（OLD_REV），比较响应。
+# 请求由真实的浏览器请求变形而来（名字的大小写、值两边的空白、未知请求头、续行、缺冒号、冒号前的空白、
+# 单独的\n、错误或重复的Content-Length、Transfer-Encoding、过多的请求头、请求头中随机改动的字节）。
+# 两个版本的响应（状态码，200时还有响应体）不同时，必须能由有意的改动解释：
+#   - 当前版本对续行、缺冒号或冒号前有空白、单独的\n、过多（超过64个）的请求头、不是数字或者不相同的
+#     Content-Length、不是chunked的Transfer-Encoding、同时有Content-Length和chunked的请求返回400，
+#     旧版本跳过这些请求头或者一直等待（单独的\n）；
+#   - chunked请求体旧版本不认识；
+#   - 旧版本对没有空白的"Host:x"、"Connection:x"、"Content-Length:x"崩溃（strpbrk返回NULL）。
+# 另外检查当前版本对上面的每一种都返回400（不论旧版本如何）。不能解释的差异打印出请求，测试失败。
+# 用法：bench/parser_fuzz.sh [用例数]，默认2000
+# 环境变量：PORT当前版本的端口（默认9006，旧版本用下一个端口），OLD_REV旧版本（默认为添加http_parser.cpp之前的版本），SEED随机数种子
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+old_rev=${OLD_REV:-$(git log --diff-filter=A --format=%H -- http_parser.cpp)~1}
+cases=${1:-2000}
+out=$(mktemp -d)
+trap 'git worktree remove --force "$out/old" 2>/dev/null || true; rm -rf "$out"' EXIT
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o "$out/server"
+# 旧版本的网站根目录写死为绝对路径，改成相对于工作目录的resources
+git worktree add --detach "$out/old" "$old_rev" >/dev/null 2>&1
+sed -i 's#^const char \* doc_root = .*#const char * doc_root = "resources";#' "$out/old/http_conn.cpp"
+(cd "$out/old" && g++ -std=c++11 -O2 *.cpp -lpthread -lz -o "$out/old_server")
+cp -r resources "$out/resources"
+
+python3 - "$out" "$port" "$cases" "${SEED:-1}" <<'EOF'
+import gzip, random, signal, socket, subprocess, sys, time
+out, port, cases, seed = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4])
+servers = {'new': (out + '/server', port), 'old': (out + '/old_server', port + 1)}
+procs = {}
+
+def start(name):
+    exe, p = servers[name]
+    # 端口上已有别的服务器（SO_REUSEPORT）时请求会被分到它那里
+    try:
+        socket.create_connection(('127.0.0.1', p), timeout=1).close()
+        sys.exit('port %d already in use' % p)
+    except OSError:
+        pass
+    procs[name] = subprocess.Popen([exe, str(p), '1'], cwd=out, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    for _ in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', p), timeout=1).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    sys.exit('%s server did not start' % name)
+
+# 只取第一个响应：(状态码, 响应体)，或者('timeout',)、('closed',)、('down',)（服务器崩溃）
+def parse(data):
+    end = data.find(b'\r\n\r\n')
+    if end < 0:
+        return None
+    lines = data[:end].split(b'\r\n')
+    status = int(lines[0].split()[1])
+    headers = {}
+    for line in lines[1:]:
+        k, _, v = line.partition(b':')
+        headers[k.strip().lower()] = v.strip()
+    length = int(headers.get(b'content-length', b'0'))
+    body = data[end + 4:]
+    if len(body) < length:
+        return None
+    body = body[:length]
+    if headers.get(b'content-encoding') == b'gzip':
+        body = gzip.decompress(body)
+    return (status, body if status == 200 else b'')
+
+def fetch(name, req):
+    exe, p = servers[name]
+    try:
+        s = socket.create_connection(('127.0.0.1', p), timeout=1)
+    except OSError:
+        return ('down',)
+    s.settimeout(0.5)
+    data = b''
+    result = None
+    try:
+        s.sendall(req)
+        while result is None:
+            d = s.recv(65536)
+            if not d:
+                break
+            data += d
+            result = parse(data)
+    except socket.timeout:
+        result = result or ('timeout',)
+    except OSError:
+        pass
+    s.close()
+    if result is None:
+        time.sleep(0.05)
+        result = ('down',) if procs[name].poll() is not None else ('closed',)
+    if procs[name].poll() is not None:
+        start(name)
+        result = ('down',)
+    return result
+
+BASE = [
+    (b'Host', b'www.example.com'),
+    (b'Connection', b'keep-alive'),
+    (b'User-Agent', b'Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36'),
+    (b'Accept', b'text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8'),
+    (b'Sec-Fetch-Site', b'none'),
+    (b'Sec-Fetch-Mode', b'navigate'),
+    (b'Accept-Encoding', b'gzip, deflate, br'),
+    (b'Accept-Language', b'zh-CN,zh;q=0.9,en;q=0.8'),
+]
+PATHS = [b'/index.html', b'/images/image1.jpg', b'/', b'/missing.html']
+REJECT = {'obs_fold', 'no_colon', 'space_colon', 'bare_lf', 'many', 'cl_bad', 'cl_dup', 'te_other', 'te_cl'}
+
+def rand_case(name):
+    return b''.join(bytes([c]).upper() if random.random() < 0.5 else bytes([c]).lower() for c in name)
+
+def chunked(body):
+    return b'%x\r\n' % len(body) + body + b'\r\n0\r\n\r\n' if body else b'0\r\n\r\n'
+
+# 生成一个请求，返回(请求, 用到的变形)
+def generate():
+    headers = [list(h) for h in BASE]
+    random.shuffle(headers)
+    body = b''
+    kinds = random.sample(['case', 'ows', 'unknown', 'obs_fold', 'no_colon', 'space_colon', 'bare_lf', 'cl_bad',
+                           'cl_dup', 'cl_same', 'te_chunked', 'te_other', 'te_cl', 'many', 'byte', 'nospace'],
+                          random.randint(0, 2))
+    for kind in kinds:
+        if kind == 'case':
+            for h in headers:
+                if h[0] is not None:
+                    h[0] = rand_case(h[0])
+        elif kind == 'ows':
+            for h in headers:
+                h[1] = random.choice([b'', b' ', b'\t', b'  ']) + h[1] + random.choice([b'', b' ', b'\t'])
+        elif kind == 'unknown':
+            for i in range(random.randint(1, 10)):
+                headers.insert(random.randrange(len(headers) + 1), [b'X-Test-%d' % i, b'v%d' % random.randrange(1000)])
+        elif kind == 'obs_fold':
+            headers.insert(random.randrange(1, len(headers) + 1), [None, random.choice([b' ', b'\t']) + b'folded value'])
+        elif kind == 'no_colon':
+            headers.insert(random.randrange(len(headers) + 1), [None, b'NoColonHere value'])
+        elif kind == 'space_colon':
+            headers.insert(random.randrange(len(headers) + 1), [b'X-Space' + random.choice([b' ', b'\t']), b'v'])
+        elif kind == 'cl_bad':
+            headers.append([b'Content-Length', random.choice([b'abc', b'-1', b'+5', b'1e3', b'', b'5 5', b'99999999999999999999999'])])
+        elif kind == 'cl_dup':
+            body = b'hello'
+            headers.append([b'Content-Length', random.choice([b'0', b'3'])])
+            headers.append([b'Content-Length', b'5'])
+        elif kind == 'cl_same':
+            body = b'hello'
+            headers.append([b'Content-Length', b'5'])
+            headers.append([b'Content-Length', b'5'])
+        elif kind == 'te_chunked':
+            body = chunked(b'hello')
+            headers.append([b'Transfer-Encoding', b'chunked'])
+        elif kind == 'te_other':
+            headers.append([b'Transfer-Encoding', random.choice([b'gzip', b'gzip, chunked', b'identity'])])
+        elif kind == 'te_cl':
+            body = chunked(b'hello')
+            headers.append([b'Transfer-Encoding', b'chunked'])
+            headers.append([b'Content-Length', random.choice([b'0', b'22'])])
+        elif kind == 'many':
+            for i in range(70):
+                headers.append([b'X-Many-%d' % i, b'x'])
+        elif kind == 'nospace':
+            h = random.choice(headers)
+            if h[0] is not None:
+                h[1] = h[1].lstrip(b' \t')
+    lines = [random.choice(PATHS).join([b'GET ', b' HTTP/1.1'])]
+    for name, value in headers:
+        lines.append(value if name is None else name + (b':' if 'nospace' in kinds else b': ') + value)
+    head = b'\r\n'.join(lines) + b'\r\n\r\n'
+    start = head.find(b'\r\n') + 2
+    stop = len(head) - 4
+    if 'bare_lf' in kinds:
+        crlfs = [i for i in range(start, stop + 2) if head.startswith(b'\r\n', i)]
+        i = random.choice(crlfs)
+        head = head[:i] + head[i + 1:]
+    if 'byte' in kinds:
+        for _ in range(random.randint(1, 3)):
+            i = random.randrange(start, len(head) - 4)
+            op = random.randrange(3)
+            c = bytes([random.choice(b'\r\n\t :\x00aZ,;=' + bytes([random.randrange(256)]))])
+            head = head[:i] + (c + head[i:] if op == 0 else c + head[i + 1:] if op == 1 else head[i + 1:])
+    return head + body, kinds
+
+# 按当前版本的规则找出请求中有意不同处理的地方
+def reasons(req):
+    found = set()
+    end = req.find(b'\r\n\r\n')
+    head = req[:end] if end >= 0 else req
+    first = head.find(b'\r\n')
+    if first < 0:
+        return found
+    rest = head[first + 2:]
+    if b'\n' in rest.replace(b'\r\n', b'') or b'\r' in rest.replace(b'\r\n', b'') or end < 0:
+        found.add('bare_lf')
+    lines = rest.replace(b'\r\n', b'\n').replace(b'\r', b'\n').split(b'\n')
+    lengths = []
+    te = []
+    count = 0
+    for raw in lines:
+        line = raw.split(b'\x00')[0]  # 服务器把行当作C字符串
+        if line == b'':
+            if raw != b'':
+                found.add('no_colon')
+            continue
+        count += 1
+        if line[:1] in (b' ', b'\t'):
+            found.add('obs_fold')
+            continue
+        name, colon, value = line.partition(b':')
+        if not colon or not name:
+            found.add('no_colon')
+            continue
+        if name[-1:] in (b' ', b'\t'):
+            found.add('space_colon')
+            continue
+        value = value.strip(b' \t')
+        lname = name.lower()
+        if lname in (b'host', b'connection', b'content-length') and not any(c in line for c in (b' ', b'\t')):
+            found.add('old_crash')
+        if lname == b'content-length':
+            if not value.isdigit() or int(value) >= 2 ** 63:
+                found.add('cl_bad')
+            else:
+                lengths.append(int(value))
+        elif lname == b'transfer-encoding':
+            te.append(value)
+    if count > 64:
+        found.add('many')
+    if len(set(lengths)) > 1:
+        found.add('cl_dup')
+    if te:
+        found.add('te_chunked' if len(te) == 1 and te[0].lower() == b'chunked' else 'te_other')
+        if lengths:
+            found.add('te_cl')
+    return found
+
+# 被终止时也要结束两个服务器
+signal.signal(signal.SIGTERM, lambda *a: sys.exit(1))
+random.seed(seed)
+stats = {'same': 0, 'explained': 0, 'unexplained': 0}
+by_reason = {}
+failures = []
+try:
+    start('new')
+    start('old')
+    for n in range(cases):
+        req, kinds = generate()
+        r = reasons(req)
+        new = fetch('new', req)
+        old = fetch('old', req)
+        reject = r & REJECT
+        ok = True
+        if reject and new != (400, b''):
+            ok = False  # 当前版本应该拒绝
+        elif new == old:
+            stats['same'] += 1
+        elif reject or 'te_chunked' in r or ('old_crash' in r and old == ('down',)):
+            stats['explained'] += 1
+            for k in r:
+                by_reason[k] = by_reason.get(k, 0) + 1
+        else:
+            ok = False
+        if not ok:
+            stats['unexplained'] += 1
+            if len(failures) < 10:
+                failures.append((req, kinds, sorted(r), new[:1], old[:1]))
+finally:
+    for p in procs.values():
+        p.kill()
+print('cases %d: %d same, %d explained, %d unexplained' % (cases, stats['same'], stats['explained'], stats['unexplained']))
+print('explained by: ' + ', '.join('%s %d' % kv for kv in sorted(by_reason.items())))
+for req, kinds, r, new, old in failures:
+    print('UNEXPLAINED mutations=%s reasons=%s new=%s old=%s\n  %r' % (kinds, r, new, old, req))
+sys.exit(1 if stats['unexplained'] else 0)
+EOF
+echo PASS
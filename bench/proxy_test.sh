@@ -0,0 +1,152 @@
+#!/bin/sh
+# 反向代理测试：启动两个服务器实例作为后端（POST再由它们转发给bench/fcgi_echo.py），检查静态文件、
+# splice转发的大响应体、chunked的gzip响应、请求体（Content-Length和chunked）经过代理后不变，
+# least_conn在两个后端之间分配，一致性哈希时同一个URL总是到同一个后端，一个后端停止之后请求仍然成功。
+# BENCH=1时再用loadgen比较直接访问后端、经过代理（splice开和关）下载大文件的吞吐量
+# 用法：bench/proxy_test.sh
+# 环境变量：PORT端口（默认9006，后端和其他实例用之后的几个端口），SERVER_OPTS放在端口前的选项（如"-b uring"），
+#           SERVER_ARGS放在端口后的参数（如"2 4"），BENCH=1运行吞吐量比较，DURATION每项压测秒数（默认5）
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+out=$(mktemp -d)
+sock="$out/fcgi.sock"
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+g++ -std=c++11 -O2 bench/loadgen.cpp -lpthread -lssl -lcrypto -o loadgen
+
+# 两个后端的文件相同，只有whoami.txt和id目录下的文件（一致性哈希的16个不同的键）不同
+for b in a b; do
+    mkdir -p "$out/$b/id"
+    cp resources/index.html "$out/$b/"
+    echo "$b" >"$out/$b/whoami.txt"
+    for i in $(seq 1 16); do
+        echo "$b" >"$out/$b/id/$i"
+    done
+done
+head -c 5000000 /dev/urandom >"$out/a/big.bin"
+seq 1 400000 >"$out/a/text.txt"
+cp "$out/a/big.bin" "$out/a/text.txt" "$out/b/"
+
+backend() {
+    cat >"$out/$1.conf" <<EOF
+doc_root = $out/$1
+fastcgi_pass = unix:$sock
+max_body_size = 4M
+EOF
+    ./server -f "$out/$1.conf" $SERVER_OPTS "$2" $SERVER_ARGS >"$out/$1.log" 2>&1 &
+}
+frontend() {
+    cat >"$out/front$1.conf" <<EOF
+doc_root = resources
+proxy_pass = 127.0.0.1:$((port + 1)), 127.0.0.1:$((port + 2))
+proxy_prefix = /
+proxy_balance = $2
+proxy_splice = $3
+proxy_max_fails = 2
+proxy_fail_timeout_ms = 5000
+max_body_size = 4M
+EOF
+    ./server -f "$out/front$1.conf" $SERVER_OPTS "$4" $SERVER_ARGS >"$out/front$1.log" 2>&1 &
+}
+
+python3 bench/fcgi_echo.py "unix:$sock" >"$out/echo.log" 2>&1 &
+pids=$!
+backend a $((port + 1))
+pids="$pids $!"
+backend b $((port + 2))
+b_pid=$!
+pids="$pids $!"
+frontend 1 least_conn on "$port"
+pids="$pids $!"
+frontend 2 hash on $((port + 3))
+pids="$pids $!"
+trap 'kill $pids 2>/dev/null || true; rm -rf "$out"' EXIT
+sleep 1
+
+fail=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: expected $3, got $2"
+        fail=1
+    else
+        echo "ok: $1"
+    fi
+}
+url="http://127.0.0.1:$port"
+hash_url="http://127.0.0.1:$((port + 3))"
+
+curl -s "$url/index.html" -o "$out/got"
+check "static" "$(cmp -s "$out/a/index.html" "$out/got" && echo same)" "same"
+check "not found" "$(curl -s -o /dev/null -w '%{http_code}' "$url/missing.html")" "404"
+curl -s "$url/big.bin" -o "$out/got"
+check "large body (splice)" "$(cmp -s "$out/a/big.bin" "$out/got" && echo same)" "same"
+curl -s -r 1000-1999 "$url/big.bin" -o "$out/got"
+check "range" "$(tail -c +1001 "$out/a/big.bin" | head -c 1000 | cmp -s - "$out/got" && echo same)" "same"
+curl -s --compressed "$url/text.txt" -o "$out/got"
+check "chunked gzip response" "$(cmp -s "$out/a/text.txt" "$out/got" && echo same)" "same"
+
+head -c 1000000 /dev/urandom >"$out/body"
+curl -s -X POST --data-binary @"$out/body" "$url/echo" -o "$out/echoed"
+check "Content-Length body" "$(cmp -s "$out/body" "$out/echoed" && echo same)" "same"
+curl -s -X POST -H 'Transfer-Encoding: chunked' --data-binary @"$out/body" "$url/echo" -o "$out/echoed"
+check "chunked body" "$(cmp -s "$out/body" "$out/echoed" && echo same)" "same"
+
+# 一个客户端连接上的多个请求经过代理
+check "keep-alive" "$(curl -s "$url/whoami.txt" "$url/index.html" "$url/whoami.txt" -o /dev/null -o /dev/null -o /dev/null \
+    -w '%{http_code}%{num_connects}\n' | tr -d '\n')" "200120002000"
+
+# 并发的请求分到两个后端
+check "least_conn" "$(for i in $(seq 1 20); do curl -s "$url/whoami.txt" & done | sort -u | tr -d '\n')" "ab"
+
+# 同一个URL总是到同一个后端，不同的URL分到两个后端
+before=
+for i in $(seq 1 16); do
+    before="$before$(curl -s "$hash_url/id/$i")"
+done
+again=
+for i in $(seq 1 16); do
+    again="$again$(curl -s "$hash_url/id/$i")"
+done
+check "hash affinity" "$again" "$before"
+check "hash spread" "$(echo "$before" | fold -w1 | sort -u | tr -d '\n')" "ab"
+
+# 停止一个后端：请求重试到另一个后端，哈希到它的URL换到另一个后端，其余的不变
+kill $b_pid
+sleep 0.5
+codes=
+for i in $(seq 1 10); do
+    codes="$codes$(curl -s -o /dev/null -w '%{http_code}' "$url/whoami.txt")"
+done
+check "backend down" "$codes" "200200200200200200200200200200"
+after=
+for i in $(seq 1 16); do
+    after="$after$(curl -s "$hash_url/id/$i")"
+done
+check "hash after backend down" "$after" "$(echo "$before" | tr b a)"
+
+if [ "$BENCH" = 1 ]; then
+    # 后端恢复之后比较吞吐量：直接访问后端、经过代理（splice开、关）
+    backend b $((port + 2))
+    pids="$pids $!"
+    frontend 3 least_conn off $((port + 4))
+    pids="$pids $!"
+    sleep 1
+    duration=${DURATION:-5}
+    for target in "direct $((port + 1))" "proxy-splice $port" "proxy-copy $((port + 4))"; do
+        set -- $target
+        for path in /index.html /big.bin; do
+            ./loadgen -n "$1" -p "$2" -c 32 -t 2 -d "$duration" -k 1 -m "$path" -o "$out/bench.json" >/dev/null
+            python3 -c 'import json, sys; r = json.load(open(sys.argv[1]))
+print("%-13s %-12s %10.1f req/s %10.2f Mbit/s %6d errors" % (sys.argv[2], sys.argv[3], r["throughput_rps"],
+      r["throughput_mbps"], r["errors"]))' "$out/bench.json" "$1" "$path"
+        done
+    done
+fi
+
+if [ $fail -ne 0 ]; then
+    echo "FAIL"
+    cat "$out/front1.log" "$out/front2.log"
+    exit 1
+fi
+echo "PASS"
@@ -0,0 +1,206 @@
+/*
+    线程池请求队列的微基准：比较无锁的mpmc_queue和原来的std::list + 互斥锁 + 信号量的队列。
+    P个生产者共放入N个元素，C个消费者取出，统计每秒传递的元素数。和线程池一样，队列有容量上限，
+    生产者在队列满时让出CPU后重试；原来的队列的消费者在信号量上等待，mpmc_queue的消费者在队列空时让出CPU。
+
+    编译：g++ -std=c++11 -O2 bench/queue_bench.cpp -o queue_bench -lpthread
+    运行：./queue_bench [-n 元素数] [-q 队列容量] [生产者数:消费者数 ...]
+          默认 -n 2000000 -q 10000，组合为1:1 1:4 1:8 1:64 2:2 4:4 8:8 16:16 32:32 64:64
+*/
+#include "../mpmc_queue.h"
+#include "../locker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <list>
+#include <vector>
+
+// 原来线程池中的队列：append()加锁放入链表再post信号量，工作线程等信号量再加锁取出
+class locked_queue {
+public:
+    explicit locked_queue(size_t capacity) : m_capacity(capacity) {}
+
+    bool push(long v) {
+        m_lock.lock();
+        if (m_list.size() >= m_capacity) {
+            m_lock.unlock();
+            return false;
+        }
+        m_list.push_back(v);
+        m_lock.unlock();
+        m_stat.post();
+        return true;
+    }
+
+    long pop() {
+        m_stat.wait();
+        m_lock.lock();
+        long v = m_list.front();
+        m_list.pop_front();
+        m_lock.unlock();
+        return v;
+    }
+
+private:
+    size_t m_capacity;
+    std::list<long> m_list;
+    locker m_lock;
+    sem m_stat;
+};
+
+struct bench {
+    int producers;
+    int consumers;
+    long items;
+    locked_queue * locked;
+    mpmc_queue<long> * ring;
+    std::atomic<long> consumed;
+    std::atomic<long> checksum;
+};
+
+struct worker_arg {
+    bench * b;
+    int index;
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 第index个生产者放入[start, end)
+static void produce_range(const bench & b, int index, long & start, long & end) {
+    start = b.items * index / b.producers;
+    end = b.items * (index + 1) / b.producers;
+}
+
+static void * locked_producer(void * p) {
+    worker_arg * a = (worker_arg *) p;
+    long start, end;
+    produce_range(*a->b, a->index, start, end);
+    for (long i = start; i < end; i++) {
+        while (!a->b->locked->push(i + 1)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void * locked_consumer(void * p) {
+    bench * b = ((worker_arg *) p)->b;
+    long sum = 0;
+    while (true) {
+        long v = b->locked->pop();
+        if (v == 0) {
+            break; // 结束标记
+        }
+        sum += v;
+        if (b->consumed.fetch_add(1) + 1 == b->items) {
+            // 最后一个元素，放入结束标记唤醒所有消费者
+            for (int i = 0; i < b->consumers; i++) {
+                while (!b->locked->push(0)) sched_yield();
+            }
+        }
+    }
+    b->checksum += sum;
+    return NULL;
+}
+
+static void * ring_producer(void * p) {
+    worker_arg * a = (worker_arg *) p;
+    long start, end;
+    produce_range(*a->b, a->index, start, end);
+    for (long i = start; i < end; i++) {
+        while (!a->b->ring->push(i + 1)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void * ring_consumer(void * p) {
+    bench * b = ((worker_arg *) p)->b;
+    long sum = 0;
+    long v;
+    while (b->consumed.load(std::memory_order_relaxed) < b->items) {
+        if (!b->ring->pop(v)) {
+            sched_yield();
+            continue;
+        }
+        sum += v;
+        b->consumed.fetch_add(1);
+    }
+    b->checksum += sum;
+    return NULL;
+}
+
+// 返回每秒传递的元素数，校验和不对时返回-1
+static double run(bench & b, bool ring) {
+    b.consumed = 0;
+    b.checksum = 0;
+    std::vector<pthread_t> threads(b.producers + b.consumers);
+    std::vector<worker_arg> args(b.producers + b.consumers);
+    double start = now_s();
+    for (int i = 0; i < b.consumers + b.producers; i++) {
+        bool producer = i >= b.consumers;
+        args[i].b = &b;
+        args[i].index = producer ? i - b.consumers : i;
+        void * (*fn)(void *) = ring ? (producer ? ring_producer : ring_consumer)
+                                    : (producer ? locked_producer : locked_consumer);
+        pthread_create(&threads[i], NULL, fn, &args[i]);
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_s() - start;
+    if (b.checksum != b.items * (b.items + 1) / 2) {
+        return -1;
+    }
+    return b.items / elapsed;
+}
+
+int main(int argc, char * argv[]) {
+    long items = 2000000;
+    size_t capacity = 10000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+        if (opt == 'n') items = atol(optarg);
+        else if (opt == 'q') capacity = atol(optarg);
+        else {
+            printf("usage: %s [-n items] [-q capacity] [producers:consumers ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    std::vector<const char *> pairs(argv + optind, argv + argc);
+    if (pairs.empty()) {
+        const char * defaults[] = { "1:1", "1:4", "1:8", "1:64", "2:2", "4:4", "8:8", "16:16", "32:32", "64:64" };
+        pairs.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+    }
+
+    printf("%-8s %14s %14s %8s\n", "P:C", "locked ops/s", "mpmc ops/s", "speedup");
+    for (size_t i = 0; i < pairs.size(); i++) {
+        bench b;
+        if (sscanf(pairs[i], "%d:%d", &b.producers, &b.consumers) != 2 || b.producers <= 0 || b.consumers <= 0) {
+            printf("bad pair: %s\n", pairs[i]);
+            return 1;
+        }
+        b.items = items;
+        locked_queue locked(capacity);
+        mpmc_queue<long> ring(capacity);
+        b.locked = &locked;
+        b.ring = &ring;
+        double l = run(b, false);
+        double r = run(b, true);
+        if (l < 0 || r < 0) {
+            printf("%-8s checksum mismatch\n", pairs[i]);
+            return 1;
+        }
+        printf("%-8s %14.0f %14.0f %7.2fx\n", pairs[i], l, r, r / l);
+    }
+    return 0;
+}
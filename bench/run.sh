@@ -0,0 +1,24 @@
+#!/bin/sh
+# 编译服务器和压测工具，在回环地址上依次运行所有场景，结果写到结果目录，便于比较不同版本
+# 用法：bench/run.sh [结果目录]
+# 环境变量：PORT端口（默认9006），SERVER_OPTS放在端口前的选项（如"-b uring"），
+#           SERVER_ARGS放在端口后的参数（如"2 4"）
+set -e
+cd "$(dirname "$0")/.."
+out=${1:-bench/results}
+port=${PORT:-9006}
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+g++ -std=c++11 -O2 bench/loadgen.cpp -lpthread -lssl -lcrypto -o loadgen
+mkdir -p "$out"
+
+./server $SERVER_OPTS "$port" $SERVER_ARGS &
+pid=$!
+trap 'kill $pid 2>/dev/null || true' EXIT
+sleep 1
+
+for s in bench/scenarios/*.conf; do
+    # 这些场景需要bench/skewed.sh、bench/sendfile.sh生成的文件
+    case $(basename "$s") in skewed.conf|file_*.conf) continue ;; esac
+    ./loadgen -s "$s" -p "$port" -o "$out/$(basename "$s" .conf).json"
+done
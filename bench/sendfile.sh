@@ -0,0 +1,55 @@
+#!/bin/sh
+# 比较不进缓存的文件用mmap+writev和用sendfile发送：在临时目录中生成各个大小的文件，关闭缓存
+# （cache_max_entry_size = 0），sendfile_threshold分别为0（都用sendfile）和1G（都用mmap），
+# 每个大小运行bench/scenarios/file_<大小>.conf，没有这个场景时用file_4k.conf换成对应的文件
+# 用法：bench/sendfile.sh [大小 ...]，默认4k 16k 64k 256k 1m 100m
+# 环境变量：PORT端口（默认9006），SERVER_ARGS放在端口后的参数（默认"1"，一个事件循环，不经过线程池），
+#           DURATION每次压测的秒数（覆盖场景文件中的值）
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+server_args=${SERVER_ARGS:-1}
+sizes=${*:-4k 16k 64k 256k 1m 100m}
+repo=$(pwd)
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+g++ -std=c++11 -O2 bench/loadgen.cpp -lpthread -lssl -lcrypto -o loadgen
+
+mkdir -p "$out/resources"
+for size in $sizes; do
+    n=$(echo "$size" | tr kmg KMG | numfmt --from=iec)
+    head -c "$n" /dev/urandom >"$out/resources/file_$size.bin"
+done
+for mode in sendfile mmap; do
+    threshold=0
+    [ $mode = mmap ] && threshold=1G
+    printf "doc_root = resources\ncache_max_entry_size = 0\nsendfile_threshold = %s\n" $threshold >"$out/$mode.conf"
+done
+
+field() {
+    python3 -c 'import json, sys; r = json.load(open(sys.argv[1])); print(eval(sys.argv[2]))' "$1" "$2"
+}
+
+printf "%-6s %-8s %12s %12s %10s\n" size mode rps MB/s p99_us
+for size in $sizes; do
+    n=$(stat -c %s "$out/resources/file_$size.bin")
+    scenario=bench/scenarios/file_$size.conf
+    mix=
+    if [ ! -f "$scenario" ]; then
+        scenario=bench/scenarios/file_4k.conf
+        mix="-m /file_$size.bin"
+    fi
+    for mode in mmap sendfile; do
+        (cd "$out" && exec "$repo/server" -f "$out/$mode.conf" "$port" $server_args) >"$out/server.log" 2>&1 &
+        server_pid=$!
+        sleep 1
+        ./loadgen -s "$scenario" -p "$port" $mix ${DURATION:+-d $DURATION} -o "$out/result.json" >/dev/null
+        kill $server_pid
+        wait $server_pid || true
+        rps=$(field "$out/result.json" 'r["throughput_rps"]')
+        printf "%-6s %-8s %12s %12.1f %10s\n" $size $mode "$rps" "$(awk -v r="$rps" -v n="$n" 'BEGIN { print r * n / 1048576 }')" \
+            "$(field "$out/result.json" 'r["latency_us"]["p99"]')"
+    done
+done
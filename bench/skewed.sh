@@ -0,0 +1,45 @@
+#!/bin/sh
+# 偏斜负载下的尾延迟：在临时目录中生成首页和100个约900KB的文本文件（单个能进缓存，总量超过64MB的缓存容量，
+# 大文件不断被淘汰，每次都要重新读取和压缩），在其中启动服务器，运行bench/scenarios/skewed.conf
+# 用法：bench/skewed.sh [服务器程序 ...]，默认编译当前代码；给出多个程序时依次测量，便于比较不同版本
+# 环境变量：PORT端口（默认9006），SERVER_ARGS放在端口后的参数（默认"0 8"，线程池模式，8个工作线程），
+#           DURATION每次压测的秒数（覆盖场景文件中的值）
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+server_args=${SERVER_ARGS:-0 8}
+repo=$(pwd)
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+g++ -std=c++11 -O2 bench/loadgen.cpp -lpthread -lssl -lcrypto -o loadgen
+servers=$*
+if [ -z "$servers" ]; then
+    g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+    servers=./server
+fi
+
+# 服务器从当前目录的resources中读取文件
+mkdir -p "$out/resources/skew"
+cp resources/index.html "$out/resources/"
+for i in $(seq 0 99); do
+    head -c 675000 /dev/urandom | base64 >"$out/resources/skew/$i.txt"
+done
+
+field() {
+    python3 -c 'import json, sys; r = json.load(open(sys.argv[1])); print(eval(sys.argv[2]))' "$1" "$2"
+}
+
+printf "%-32s %10s %8s %8s %10s %10s\n" server rps p50_us p90_us p99_us p99.9_us
+for s in $servers; do
+    case $s in /*) bin=$s ;; *) bin=$repo/$s ;; esac
+    (cd "$out" && exec "$bin" "$port" $server_args) >"$out/server.log" 2>&1 &
+    server_pid=$!
+    sleep 1
+    ./loadgen -s bench/scenarios/skewed.conf -p "$port" ${DURATION:+-d $DURATION} -o "$out/result.json" >/dev/null
+    kill $server_pid
+    wait $server_pid || true
+    printf "%-32s %10s %8s %8s %10s %10s\n" "$s" "$(field "$out/result.json" 'r["throughput_rps"]')" \
+        "$(field "$out/result.json" 'r["latency_us"]["p50"]')" "$(field "$out/result.json" 'r["latency_us"]["p90"]')" \
+        "$(field "$out/result.json" 'r["latency_us"]["p99"]')" "$(field "$out/result.json" 'r["latency_us"]["p99.9"]')"
+done
@@ -0,0 +1,153 @@
+/*
+    按系统调用统计一个正在运行的进程（所有线程）的系统调用次数，用来比较不同后端每个请求的系统调用数。
+    用ptrace跟踪，被跟踪的进程会明显变慢，所以只用来计数，吞吐量要在不跟踪时另外测量。
+
+    编译：g++ -std=c++11 -O2 bench/syscount.cpp -o syscount
+    运行：./syscount pid，收到SIGINT或SIGTERM时停止跟踪，输出总数和按次数排序的各个系统调用，
+          每行为"名字 次数"，第一行为"total 次数"。
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_stop(int) {
+    g_stop = 1;
+}
+
+// 服务器用到的系统调用的名字，其他的按编号输出
+static const char * syscall_name(long nr) {
+#define NAME(n) if (nr == SYS_##n) return #n;
+    NAME(read) NAME(write) NAME(readv) NAME(writev) NAME(recvfrom) NAME(sendto) NAME(recvmsg) NAME(sendmsg)
+    NAME(sendfile) NAME(splice) NAME(accept) NAME(accept4) NAME(close) NAME(shutdown) NAME(setsockopt)
+    NAME(getpeername) NAME(epoll_wait) NAME(epoll_pwait) NAME(epoll_ctl) NAME(io_uring_enter) NAME(futex)
+    NAME(openat) NAME(fstat) NAME(newfstatat) NAME(statx) NAME(mmap) NAME(munmap) NAME(madvise) NAME(brk)
+    NAME(pipe2) NAME(fcntl) NAME(clock_gettime) NAME(sched_yield) NAME(nanosleep) NAME(getrandom)
+    NAME(connect) NAME(socket) NAME(inotify_add_watch)
+#undef NAME
+    return NULL;
+}
+
+// 开始跟踪一个线程，成功时返回true；线程可能已经退出
+static bool seize(pid_t tid) {
+    if (ptrace(PTRACE_SEIZE, tid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE) != 0) {
+        return false;
+    }
+    // 先停下来，在停止处开始跟踪系统调用
+    ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+    return true;
+}
+
+int main(int argc, char * argv[]) {
+    if (argc != 2 || atoi(argv[1]) <= 0) {
+        printf("usage: %s pid\n", argv[0]);
+        return 1;
+    }
+    pid_t pid = atoi(argv[1]);
+
+    // 不设置SA_RESTART，waitpid被信号打断后检查是否停止
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    std::set<pid_t> tids;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR * dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return 1;
+    }
+    while (struct dirent * e = readdir(dir)) {
+        pid_t tid = atoi(e->d_name);
+        if (tid > 0 && seize(tid)) {
+            tids.insert(tid);
+        }
+    }
+    closedir(dir);
+    if (tids.empty()) {
+        perror("ptrace");
+        return 1;
+    }
+
+    std::map<long, unsigned long> counts;
+    unsigned long total = 0;
+    bool detaching = false;
+    while (!tids.empty()) {
+        if (g_stop && !detaching) {
+            // 让所有线程停下来，停下之后逐个脱离
+            detaching = true;
+            for (std::set<pid_t>::iterator it = tids.begin(); it != tids.end(); ++it) {
+                ptrace(PTRACE_INTERRUPT, *it, 0, 0);
+            }
+        }
+        int status;
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            tids.erase(tid);
+            continue;
+        }
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+        tids.insert(tid); // 新创建的线程自动被跟踪
+        int sig = WSTOPSIG(status);
+        int event = status >> 16;
+        if (detaching) {
+            // 信号投递的停止要把信号交还给线程
+            int deliver = (sig == (SIGTRAP | 0x80) || event) ? 0 : sig;
+            ptrace(PTRACE_DETACH, tid, 0, deliver);
+            tids.erase(tid);
+            continue;
+        }
+        int deliver = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            // 系统调用的进入和返回都会停下来，只在进入时计数
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0
+                && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                counts[info.entry.nr]++;
+                total++;
+            }
+        } else if (event == 0) {
+            // 普通的信号投递
+            deliver = sig;
+        }
+        ptrace(PTRACE_SYSCALL, tid, 0, deliver);
+    }
+
+    std::vector<std::pair<unsigned long, long> > sorted;
+    for (std::map<long, unsigned long>::iterator it = counts.begin(); it != counts.end(); ++it) {
+        sorted.push_back(std::make_pair(it->second, it->first));
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+    printf("total %lu\n", total);
+    for (size_t i = 0; i < sorted.size(); i++) {
+        const char * name = syscall_name(sorted[i].second);
+        if (name) {
+            printf("%s %lu\n", name, sorted[i].first);
+        } else {
+            printf("syscall_%ld %lu\n", sorted[i].second, sorted[i].first);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+    连接定时器的微基准：比较时间轮timer_wheel和原来的升序链表sort_timer_list。
+    N个连接各有一个定时器（超时15秒），每个连接每5秒（模拟时间）发一个请求，每个请求调整一次定时器；
+    另外测量短连接的情况，每次关闭一个连接（删除定时器）再建立一个（添加定时器）。输出每次操作的纳秒数。
+
+    链表的到期时间以秒为单位，调整时要从原来的位置向后找到第一个更晚到期的定时器，
+    连接的到期时间分散在15秒内，调整后的定时器总是最晚到期，平均要走过一半的链表；添加同样从头部开始找。
+    时间轮的添加、调整、删除只是把定时器挂到槽的链表上，测量时每1000次操作调用一次tick()，包括下放的开销。
+
+    编译：g++ -std=c++11 -O2 bench/timer_bench.cpp util_timer.cpp -o timer_bench
+    运行：./timer_bench [-n 每种连接数下的操作数] [连接数 ...]，默认 -n 20000，连接数为1000 10000 100000
+*/
+#include "../util_timer.h"
+#include "../http_conn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static const int TIMEOUT_S = 15;     // 连接的超时时间
+static const int INTERVAL_S = 5;     // 每个连接两个请求之间的间隔
+static const int TICK_EVERY = 1000;  // 时间轮每隔多少次操作调用一次tick()
+
+// util_timer.cpp中用到的，单独编译时不链接服务器的其他部分
+static long g_expired = 0;
+void http_conn::timeout() { g_expired++; }
+void metrics::count(METRIC_COUNTER, uint64_t) {}
+
+// 原来的定时器链表：升序、双向，到期时间为绝对时间（秒）
+class sort_timer_list {
+public:
+    sort_timer_list() : head(NULL), tail(NULL) {}
+
+    void add_timer(util_timer* t) {
+        if (!head) {
+            head = tail = t;
+            return;
+        }
+        if (t->expire < head->expire) {
+            t->next = head;
+            head->prev = t;
+            head = t;
+            return;
+        }
+        add_timer_from(t, head);
+    }
+
+    void adjust_timer(util_timer* t) {
+        if (t == tail) return;
+        util_timer* tmp = t->next;
+        if (t->expire <= tmp->expire) return;
+        if (t == head) {
+            head = t->next;
+            head->prev = NULL;
+            add_timer_from(t, head);
+        } else {
+            t->next->prev = t->prev;
+            t->prev->next = t->next;
+            add_timer_from(t, t->next);
+        }
+    }
+
+    // 只从链表中取下，不释放
+    void del_timer(util_timer* t) {
+        if (t == head && t == tail) {
+            head = tail = NULL;
+        } else if (t == head) {
+            head = t->next;
+            head->prev = NULL;
+        } else if (t == tail) {
+            tail = t->prev;
+            tail->next = NULL;
+        } else {
+            t->prev->next = t->next;
+            t->next->prev = t->prev;
+        }
+        t->prev = t->next = NULL;
+    }
+
+private:
+    util_timer* head;
+    util_timer* tail;
+
+    void add_timer_from(util_timer* t, util_timer* f) {
+        util_timer *p = f, *tmp = f->next;
+        while (tmp) {
+            if (t->expire < tmp->expire) {
+                p->next = t;
+                t->prev = p;
+                tmp->prev = t;
+                t->next = tmp;
+                return;
+            }
+            p = tmp;
+            tmp = tmp->next;
+        }
+        tail->next = t;
+        t->prev = tail;
+        t->next = NULL;
+        tail = t;
+    }
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+    模拟时间：每个连接每INTERVAL_S秒一个请求，N个连接每秒共N / INTERVAL_S个请求，
+    每过这么多次操作模拟时钟前进一秒。开始时各连接的到期时间均匀分布在TIMEOUT_S秒内。
+*/
+struct sim_clock {
+    long ops_per_second;
+    long ops;
+    long now;
+
+    explicit sim_clock(int conns) : ops_per_second(conns / INTERVAL_S), ops(0), now(0) {
+        if (ops_per_second < 1) ops_per_second = 1;
+    }
+
+    void step() {
+        if (++ops % ops_per_second == 0) now++;
+    }
+};
+
+// 返回每次操作的纳秒数；churn为true时每次操作删除并重新添加一个定时器，否则调整一个定时器
+static double run_list(int conns, long ops, bool churn) {
+    std::vector<util_timer> timers(conns);
+    sort_timer_list list;
+    sim_clock clock(conns);
+    for (int i = 0; i < conns; i++) {
+        // 按到期时间升序添加，每次都在尾部，不计入测量
+        timers[i].expire = (long)i * TIMEOUT_S / conns;
+        list.add_timer(&timers[i]);
+    }
+    unsigned seed = 1;
+    double start = now_s();
+    for (long i = 0; i < ops; i++) {
+        util_timer* t = &timers[rand_r(&seed) % conns];
+        t->expire = clock.now + TIMEOUT_S;
+        if (churn) {
+            list.del_timer(t);
+            list.add_timer(t);
+        } else {
+            list.adjust_timer(t);
+        }
+        clock.step();
+    }
+    return (now_s() - start) * 1e9 / ops;
+}
+
+static double run_wheel(int conns, long ops, bool churn) {
+    std::vector<util_timer*> timers(conns);
+    timer_wheel wheel;
+    for (int i = 0; i < conns; i++) {
+        timers[i] = new util_timer;
+        wheel.add_timer(timers[i], (long)i * TIMEOUT_S * 1000 / conns);
+    }
+    unsigned seed = 1;
+    double start = now_s();
+    for (long i = 0; i < ops; i++) {
+        util_timer* t = timers[rand_r(&seed) % conns];
+        if (churn) {
+            // del_timer()会释放定时器，和服务器中一样每次新建一个
+            wheel.del_timer(t);
+            t = timers[rand_r(&seed) % conns] = new util_timer;
+            wheel.add_timer(t, TIMEOUT_S * 1000);
+        } else {
+            wheel.adjust_timer(t, TIMEOUT_S * 1000);
+        }
+        if (i % TICK_EVERY == 0) {
+            wheel.tick();
+        }
+    }
+    // 剩下的定时器由时间轮的析构函数释放
+    return (now_s() - start) * 1e9 / ops;
+}
+
+int main(int argc, char * argv[]) {
+    long ops = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') ops = atol(optarg);
+        else {
+            printf("usage: %s [-n ops] [connections ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    std::vector<int> conns;
+    for (int i = optind; i < argc; i++) {
+        conns.push_back(atoi(argv[i]));
+    }
+    if (conns.empty()) {
+        conns.push_back(1000);
+        conns.push_back(10000);
+        conns.push_back(100000);
+    }
+
+    printf("%-8s %16s %16s %16s %16s\n", "conns", "list adjust ns", "wheel adjust ns", "list del+add ns", "wheel del+add ns");
+    for (size_t i = 0; i < conns.size(); i++) {
+        if (conns[i] <= 0) {
+            printf("bad connection count: %d\n", conns[i]);
+            return 1;
+        }
+        double la = run_list(conns[i], ops, false);
+        double wa = run_wheel(conns[i], ops, false);
+        double lc = run_list(conns[i], ops, true);
+        double wc = run_wheel(conns[i], ops, true);
+        printf("%-8d %16.1f %16.1f %16.1f %16.1f\n", conns[i], la, wa, lc, wc);
+    }
+    return 0;
+}
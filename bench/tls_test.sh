@@ -0,0 +1,157 @@
+#!/bin/sh
+# TLS测试：用自签名证书启动带TLS端口的服务器，检查HTTPS下的静态文件、大文件、字节范围、chunked的gzip响应、
+# 长连接和流水线、转发给FastCGI后端的请求体（包括100 Continue），交给FastCGI和代理后端的协议（HTTPS、X-Forwarded-Proto），
+# TLS 1.2和1.3，明文端口不受影响，明文客户端连到TLS端口时握手失败而服务器继续工作。
+# BENCH=1时再用loadgen比较明文和TLS：短连接（每个请求一次握手）的握手速率、长连接的小文件请求速率和大文件的吞吐量
+# 用法：bench/tls_test.sh
+# 环境变量：PORT端口（默认9006，TLS端口为PORT+1，代理的后端为PORT+2），SERVER_OPTS放在端口前的选项（如"-b uring"，TLS时会改用epoll），
+#           SERVER_ARGS放在端口后的参数（如"2 4"），KTLS=off关闭kTLS，BENCH=1运行性能比较，DURATION每项压测秒数（默认5）
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+tls_port=$((port + 1))
+out=$(mktemp -d)
+sock="$out/fcgi.sock"
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+g++ -std=c++11 -O2 bench/loadgen.cpp -lpthread -lssl -lcrypto -o loadgen
+
+# ECDSA P-256证书：签名比RSA快一个数量级，是握手速率的常见配置
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 -subj /CN=localhost \
+    -keyout "$out/key.pem" -out "$out/cert.pem" 2>/dev/null
+
+mkdir -p "$out/www"
+cp resources/index.html "$out/www/"
+head -c 5000000 /dev/urandom >"$out/www/big.bin"
+seq 1 400000 >"$out/www/text.txt"
+
+cat >"$out/server.conf" <<EOF
+doc_root = $out/www
+tls_port = $tls_port
+tls_cert = $out/cert.pem
+tls_key = $out/key.pem
+ktls = ${KTLS:-on}
+fastcgi_pass = unix:$sock
+proxy_pass = 127.0.0.1:$((port + 2))
+proxy_prefix = /fwd
+max_body_size = 4M
+EOF
+
+# 代理的后端：响应体是收到的X-Forwarded-Proto
+python3 - "$((port + 2))" >"$out/backend.log" 2>&1 <<'EOF' &
+import http.server, sys
+class handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    def do_GET(self):
+        body = ','.join(self.headers.get_all('X-Forwarded-Proto', [])).encode()
+        self.send_response(200)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+http.server.ThreadingHTTPServer(('127.0.0.1', int(sys.argv[1])), handler).serve_forever()
+EOF
+backend_pid=$!
+
+python3 bench/fcgi_echo.py "unix:$sock" >"$out/echo.log" 2>&1 &
+echo_pid=$!
+./server -f "$out/server.conf" $SERVER_OPTS "$port" $SERVER_ARGS >"$out/server.log" 2>&1 &
+server_pid=$!
+trap 'kill $server_pid $echo_pid $backend_pid 2>/dev/null || true; rm -rf "$out"' EXIT
+sleep 1
+
+fail=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: expected $3, got $2"
+        fail=1
+    else
+        echo "ok: $1"
+    fi
+}
+url="https://127.0.0.1:$tls_port"
+
+curl -sk "$url/index.html" -o "$out/got"
+check "static" "$(cmp -s "$out/www/index.html" "$out/got" && echo same)" "same"
+check "not found" "$(curl -sk -o /dev/null -w '%{http_code}' "$url/missing.html")" "404"
+curl -sk "$url/big.bin" -o "$out/got"
+check "large file" "$(cmp -s "$out/www/big.bin" "$out/got" && echo same)" "same"
+curl -sk --tlsv1.2 --tls-max 1.2 "$url/big.bin" -o "$out/got"
+check "TLS 1.2" "$(cmp -s "$out/www/big.bin" "$out/got" && echo same)" "same"
+curl -sk -r 1000-1999 "$url/big.bin" -o "$out/got"
+check "range" "$(tail -c +1001 "$out/www/big.bin" | head -c 1000 | cmp -s - "$out/got" && echo same)" "same"
+curl -sk --compressed "$url/text.txt" -o "$out/got"
+check "chunked gzip response" "$(cmp -s "$out/www/text.txt" "$out/got" && echo same)" "same"
+check "keep-alive" "$(curl -sk "$url/index.html" "$url/big.bin" "$url/index.html" -o /dev/null -o /dev/null -o /dev/null \
+    -w '%{http_code}%{num_connects}\n' | tr -d '\n')" "200120002000"
+
+head -c 1000000 /dev/urandom >"$out/body"
+curl -sk -X POST --data-binary @"$out/body" "$url/echo" -o "$out/echoed"
+check "POST body" "$(cmp -s "$out/body" "$out/echoed" && echo same)" "same"
+curl -sk -X POST -H 'Expect: 100-continue' -H 'Transfer-Encoding: chunked' --data-binary @"$out/body" "$url/echo" \
+    -o "$out/echoed"
+check "100 Continue, chunked body" "$(cmp -s "$out/body" "$out/echoed" && echo same)" "same"
+
+# 后端要知道请求是否来自HTTPS；客户端自己发的X-Forwarded-Proto不转发
+fcgi_scheme() {
+    curl -sk -D - -o /dev/null -X POST --data x "$1/echo" | grep -iE '^x-(request-scheme|https|server-port):' | tr -d '\r' | tr '\n' ' '
+}
+check "FastCGI HTTPS params" "$(fcgi_scheme "$url")" "X-REQUEST-SCHEME: https X-HTTPS: on X-SERVER-PORT: $tls_port "
+check "FastCGI plain params" "$(fcgi_scheme "http://127.0.0.1:$port")" "X-REQUEST-SCHEME: http X-HTTPS:  X-SERVER-PORT: $port "
+check "proxy X-Forwarded-Proto" "$(curl -sk -H 'X-Forwarded-Proto: http' "$url/fwd/x")" "https"
+check "proxy plain X-Forwarded-Proto" "$(curl -s -H 'X-Forwarded-Proto: https' "http://127.0.0.1:$port/fwd/x")" "http"
+
+# 流水线：一条TLS记录中的请求比读缓冲大，读不下的部分留在OpenSSL的缓冲中，socket已经不再可读
+check "pipeline" "$(python3 - "$tls_port" <<'EOF'
+import socket, ssl, sys
+ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ctx.check_hostname = False
+ctx.verify_mode = ssl.CERT_NONE
+s = ctx.wrap_socket(socket.create_connection(('127.0.0.1', int(sys.argv[1])), timeout=10))
+s.sendall(b'GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n' * 199 + b'GET /index.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n')
+data = b''
+while True:
+    try:
+        chunk = s.recv(65536)
+    except (ssl.SSLError, socket.timeout):
+        break
+    if not chunk:
+        break
+    data += chunk
+print(data.count(b'HTTP/1.1 200 OK'))
+EOF
+)" "200"
+
+# 明文客户端连到TLS端口：握手失败，连接被关闭，服务器照常工作
+check "plaintext on TLS port" "$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$tls_port/index.html" || true)" "000"
+check "plain port" "$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$port/index.html")" "200"
+curl -sk "$url/metrics" -o "$out/metrics"
+check "handshake metrics" "$(grep -q '^webserver_tls_handshakes_total [1-9]' "$out/metrics" \
+    && grep -q '^webserver_tls_handshake_failures_total [1-9]' "$out/metrics" && echo counted)" "counted"
+echo "kTLS connections: $(grep '^webserver_ktls_connections_total' "$out/metrics" | cut -d' ' -f2)" \
+     "of $(grep '^webserver_tls_handshakes_total' "$out/metrics" | cut -d' ' -f2)"
+
+if [ "$BENCH" = 1 ]; then
+    duration=${DURATION:-5}
+    for target in "handshake -k 0 -m /index.html" "keepalive -k 1 -m /index.html" "bulk -k 1 -m /big.bin"; do
+        set -- $target
+        name=$1
+        shift
+        for proto in http https; do
+            if [ $proto = http ]; then
+                ./loadgen -p "$port" -c 32 -t 2 -d "$duration" "$@" -o "$out/bench.json" >/dev/null
+            else
+                ./loadgen -p "$tls_port" -S -c 32 -t 2 -d "$duration" "$@" -o "$out/bench.json" >/dev/null
+            fi
+            python3 -c 'import json, sys; r = json.load(open(sys.argv[1]))
+print("%-10s %-6s %10.1f req/s %10.1f handshakes/s %10.2f Mbit/s %6d errors" % (sys.argv[2], sys.argv[3],
+      r["throughput_rps"], r["handshakes_per_s"], r["throughput_mbps"], r["errors"]))' "$out/bench.json" "$name" "$proto"
+        done
+    done
+fi
+
+if [ $fail -ne 0 ]; then
+    echo "FAIL"
+    cat "$out/server.log"
+    exit 1
+fi
+echo "PASS"
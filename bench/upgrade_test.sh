@@ -0,0 +1,72 @@
+#!/bin/sh
+# 平滑升级测试：压测过程中向服务器发送SIGUSR2，检查没有连接失败或者被重置，
+# 旧进程在排空之后退出，新进程继续服务
+# 用法：bench/upgrade_test.sh
+# 环境变量：PORT端口（默认9006），SERVER_OPTS放在端口前的选项（如"-b uring"），
+#           SERVER_ARGS放在端口后的参数（如"2 4"），DURATION压测秒数（默认6）
+set -e
+cd "$(dirname "$0")/.."
+port=${PORT:-9006}
+duration=${DURATION:-6}
+out=$(mktemp -d)
+
+g++ -std=c++11 -O2 *.cpp -lpthread -lz -lssl -lcrypto -o server
+g++ -std=c++11 -O2 bench/loadgen.cpp -lpthread -lssl -lcrypto -o loadgen
+
+./server $SERVER_OPTS "$port" $SERVER_ARGS >"$out/server.log" 2>&1 &
+old=$!
+new=
+trap 'kill $old $new 2>/dev/null || true; rm -rf "$out"' EXIT
+sleep 1
+
+# 短连接测试升级期间新连接都被接受，长连接测试已有的连接被正常关闭
+./loadgen -n storm -p "$port" -c 32 -t 2 -d "$duration" -k 0 -m /index.html -o "$out/storm.json" >/dev/null &
+storm=$!
+./loadgen -n keepalive -p "$port" -c 32 -t 2 -d "$duration" -k 1 -P 2 -m /index.html -o "$out/keepalive.json" >/dev/null &
+keepalive=$!
+
+sleep $((duration / 2))
+kill -USR2 $old
+
+# 旧进程排空之后退出
+i=0
+while kill -0 $old 2>/dev/null; do
+    i=$((i + 1))
+    if [ $i -gt 400 ]; then
+        echo "FAIL: old process $old did not exit"
+        exit 1
+    fi
+    sleep 0.1
+done
+new=$(sed -n 's/^upgrade: new process \([0-9]*\) is ready.*/\1/p' "$out/server.log")
+if [ -z "$new" ] || ! kill -0 "$new" 2>/dev/null; then
+    echo "FAIL: new process is not running"
+    cat "$out/server.log"
+    exit 1
+fi
+
+wait $storm $keepalive
+fail=0
+for r in storm keepalive; do
+    requests=$(sed -n 's/^  "requests": \([0-9]*\),$/\1/p' "$out/$r.json")
+    errors=$(sed -n 's/^  "errors": \([0-9]*\),$/\1/p' "$out/$r.json")
+    status=$(sed -n 's/^  "status": \(.*\),$/\1/p' "$out/$r.json")
+    echo "$r: $requests requests, $errors errors, $status"
+    if [ "$errors" != 0 ] || ! echo "$status" | grep -q '"4xx": 0, "5xx": 0'; then
+        fail=1
+    fi
+done
+
+# 压测结束之后新进程仍然接受新连接
+if ! ./loadgen -n check -p "$port" -c 1 -t 1 -d 1 -k 0 -m /index.html -o "$out/check.json" >/dev/null ||
+   ! grep -q '"errors": 0,' "$out/check.json"; then
+    fail=1
+fi
+kill -TERM "$new"
+
+if [ $fail -ne 0 ]; then
+    echo "FAIL"
+    cat "$out/server.log"
+    exit 1
+fi
+echo "PASS: old process $old handed over to $new"
@@ -0,0 +1,45 @@
+#include "body_source.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <exception>
+
+gzip_file_source::gzip_file_source(int fd) : m_fd(fd), m_offset(0), m_eof(false) {
+    memset(&m_zs, 0, sizeof(m_zs));
+    // windowBits加16表示输出gzip格式
+    if (deflateInit2(&m_zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::exception();
+    }
+}
+
+gzip_file_source::~gzip_file_source() {
+    deflateEnd(&m_zs);
+    close(m_fd);
+}
+
+// 压缩到输出满或者压缩流结束，压缩器内部缓存的输入不够一块输出时继续读文件
+int gzip_file_source::produce(char * buf, int len) {
+    m_zs.next_out = (unsigned char *) buf;
+    m_zs.avail_out = len;
+    while (m_zs.avail_out > 0) {
+        if (m_zs.avail_in == 0 && !m_eof) {
+            ssize_t n = pread(m_fd, m_in, READ_SIZE, m_offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            m_offset += n;
+            m_eof = n == 0;
+            m_zs.next_in = m_in;
+            m_zs.avail_in = n;
+        }
+        int ret = deflate(&m_zs, m_eof ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return -1;
+        }
+    }
+    return len - m_zs.avail_out;
+}
@@ -0,0 +1,36 @@
+#ifndef BODYSOURCE_H
+#define BODYSOURCE_H
+
+#include <sys/types.h>
+#include <zlib.h>
+
+// 事先不知道长度的响应体，按块生成，用chunked编码发送。
+// 每次连接发送完上一块之后调用produce()生成下一块，所以内存占用和响应体的长度无关
+class body_source {
+public:
+    virtual ~body_source() {}
+    // 生成最多len字节放到buf中，返回字节数，0表示结束，-1表示出错
+    virtual int produce(char * buf, int len) = 0;
+};
+
+// 边读边压缩的文件：不进缓存、也没有.gz兄弟文件的大文件，在发送时压缩成gzip。
+// 压缩在发送响应的线程（事件循环线程）中进行，所以使用最快的压缩级别
+class gzip_file_source : public body_source {
+public:
+    static const int READ_SIZE = 16 * 1024; // 每次从文件读取的字节数
+
+    // 接管fd，析构时关闭；zlib初始化失败时抛出异常
+    explicit gzip_file_source(int fd);
+    ~gzip_file_source();
+
+    int produce(char * buf, int len);
+
+private:
+    int m_fd;
+    off_t m_offset;
+    bool m_eof;
+    z_stream m_zs;
+    unsigned char m_in[READ_SIZE];
+};
+
+#endif
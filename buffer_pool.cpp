@@ -0,0 +1,91 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+buffer_pool::buffer_pool() : m_allocs(0), m_reuses(0), m_in_use_bytes(0) {
+    for (int i = 0; i < CLASS_NUM; i++) {
+        m_free[i] = NULL;
+        m_free_bytes[i] = 0;
+    }
+}
+
+buffer_pool::~buffer_pool() {
+    for (int i = 0; i < CLASS_NUM; i++) {
+        while (m_free[i]) {
+            free_node * next = m_free[i]->next;
+            ::free(m_free[i]);
+            m_free[i] = next;
+        }
+    }
+}
+
+// 能容纳size的最小一级，-1表示太大
+int buffer_pool::size_class(int size) {
+    int cls = 0;
+    int cap = MIN_SIZE;
+    while (cap < size) {
+        cap <<= 1;
+        cls++;
+    }
+    return cls < CLASS_NUM ? cls : -1;
+}
+
+char * buffer_pool::alloc(int size, int & capacity) {
+    int cls = size_class(size);
+    if (cls < 0) {
+        return NULL;
+    }
+    capacity = MIN_SIZE << cls;
+    m_allocs++;
+    m_in_use_bytes += capacity;
+
+    m_locks[cls].lock();
+    free_node * node = m_free[cls];
+    if (node) {
+        m_free[cls] = node->next;
+        m_free_bytes[cls] -= capacity;
+    }
+    m_locks[cls].unlock();
+
+    if (node) {
+        m_reuses++;
+        return (char *)node;
+    }
+    char * buf = (char *)malloc(capacity);
+    if (!buf) {
+        m_in_use_bytes -= capacity;
+    }
+    return buf;
+}
+
+void buffer_pool::free(char * buf, int capacity) {
+    if (!buf) return;
+    int cls = size_class(capacity);
+    m_in_use_bytes -= capacity;
+
+    m_locks[cls].lock();
+    if (m_free_bytes[cls] + capacity <= MAX_FREE_BYTES) {
+        free_node * node = (free_node *)buf;
+        node->next = m_free[cls];
+        m_free[cls] = node;
+        m_free_bytes[cls] += capacity;
+        buf = NULL;
+    }
+    m_locks[cls].unlock();
+
+    // 池中空闲的缓冲区已经足够多，直接释放
+    if (buf) {
+        ::free(buf);
+    }
+}
+
+void buffer_pool::get_stats(buffer_pool_stats & stats) {
+    stats.allocs = m_allocs;
+    stats.reuses = m_reuses;
+    stats.in_use_bytes = m_in_use_bytes;
+    stats.free_bytes = 0;
+    for (int i = 0; i < CLASS_NUM; i++) {
+        m_locks[i].lock();
+        stats.free_bytes += m_free_bytes[i];
+        m_locks[i].unlock();
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "locker.h"
+
+// 缓冲区池的统计数据
+struct buffer_pool_stats {
+    uint64_t allocs; // 借出次数
+    uint64_t reuses; // 借出时复用了空闲缓冲区的次数
+    size_t in_use_bytes; // 借出中的字节数
+    size_t free_bytes; // 池中空闲的字节数
+};
+
+/*
+    按大小分级的I/O缓冲区池，所有线程共享。
+    连接只在有数据收发时借用读写缓冲区，空闲（keep-alive等待下一个请求）时归还，
+    请求太大时换成更大一级的缓冲区。每一级的空闲缓冲区用单链表串起来，链表指针存放在缓冲区本身中。
+*/
+class buffer_pool {
+public:
+    static const int MIN_SIZE = 2048; // 最小一级的大小
+    static const int CLASS_NUM = 6; // 级数，最大一级为 MIN_SIZE << (CLASS_NUM - 1)
+    static const int MAX_SIZE = MIN_SIZE << (CLASS_NUM - 1);
+    static const size_t MAX_FREE_BYTES = 16 * 1024 * 1024; // 每一级最多保留的空闲字节数
+
+    buffer_pool();
+    ~buffer_pool();
+
+    // 借用一个不小于size的缓冲区，capacity返回实际大小；size超过MAX_SIZE或内存不足时返回NULL
+    char * alloc(int size, int & capacity);
+    // 归还alloc()得到的缓冲区
+    void free(char * buf, int capacity);
+
+    void get_stats(buffer_pool_stats & stats);
+
+private:
+    struct free_node {
+        free_node * next;
+    };
+
+    free_node * m_free[CLASS_NUM]; // 每一级的空闲缓冲区
+    size_t m_free_bytes[CLASS_NUM];
+    locker m_locks[CLASS_NUM];
+
+    std::atomic<uint64_t> m_allocs;
+    std::atomic<uint64_t> m_reuses;
+    std::atomic<size_t> m_in_use_bytes;
+
+    static int size_class(int size);
+};
+
+#endif
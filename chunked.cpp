@@ -0,0 +1,126 @@
+#include "chunked.h"
+#include <string.h>
+
+void chunked_decoder::reset() {
+    m_state = SIZE;
+    m_size = 0;
+    m_digits = 0;
+    m_line_len = 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// chunk = size [ext] CRLF data CRLF，最后是0 [ext] CRLF *(trailer CRLF) CRLF
+chunked_decoder::RESULT chunked_decoder::decode(char * data, int len, int & consumed, int & out) {
+    int i = 0;
+    out = 0;
+    while (i < len) {
+        char c = data[i];
+        switch (m_state) {
+            case SIZE: {
+                int v = hex_value(c);
+                if (v >= 0) {
+                    // 最多15位，不会溢出
+                    if (++m_digits > 15) return CHUNK_BAD;
+                    m_size = m_size * 16 + v;
+                    i++;
+                    break;
+                }
+                if (m_digits == 0) return CHUNK_BAD;
+                m_line_len = m_digits;
+                m_state = SIZE_EXT;
+                break;
+            } case SIZE_EXT: {
+                // 块扩展，直接跳过
+                i++;
+                if (c == '\r') {
+                    m_state = SIZE_LF;
+                } else if (c == '\n' || ++m_line_len > MAX_LINE) {
+                    return CHUNK_BAD;
+                }
+                break;
+            } case SIZE_LF: {
+                if (c != '\n') return CHUNK_BAD;
+                i++;
+                m_digits = 0;
+                m_line_len = 0;
+                m_state = m_size > 0 ? DATA : TRAILER;
+                break;
+            } case DATA: {
+                // 块数据成段移动
+                int n = len - i;
+                if ((unsigned long long)n > m_size) n = m_size;
+                memmove(data + out, data + i, n);
+                out += n;
+                i += n;
+                m_size -= n;
+                if (m_size == 0) m_state = DATA_CR;
+                break;
+            } case DATA_CR: {
+                if (c != '\r') return CHUNK_BAD;
+                i++;
+                m_state = DATA_LF;
+                break;
+            } case DATA_LF: {
+                if (c != '\n') return CHUNK_BAD;
+                i++;
+                m_state = SIZE;
+                break;
+            } case TRAILER: {
+                // 行首：空行表示结束，否则是一个尾部字段
+                i++;
+                if (c == '\r') {
+                    m_state = FINAL_LF;
+                } else if (c == '\n') {
+                    return CHUNK_BAD;
+                } else {
+                    m_line_len = 1;
+                    m_state = TRAILER_LINE;
+                }
+                break;
+            } case TRAILER_LINE: {
+                i++;
+                if (c == '\r') {
+                    m_state = TRAILER_LF;
+                } else if (c == '\n' || ++m_line_len > MAX_LINE) {
+                    return CHUNK_BAD;
+                }
+                break;
+            } case TRAILER_LF: {
+                if (c != '\n') return CHUNK_BAD;
+                i++;
+                m_state = TRAILER;
+                break;
+            } case FINAL_LF: {
+                if (c != '\n') return CHUNK_BAD;
+                consumed = i + 1;
+                reset();
+                return CHUNK_DONE;
+            }
+        }
+    }
+    consumed = i;
+    return CHUNK_AGAIN;
+}
+
+int chunk_header(char * buf, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char tmp[16];
+    int n = 0;
+    do {
+        tmp[n++] = hex[len & 0xf];
+        len >>= 4;
+    } while (len);
+    int i = 0;
+    while (n > 0) {
+        buf[i++] = tmp[--n];
+    }
+    buf[i++] = '\r';
+    buf[i++] = '\n';
+    return i;
+}
@@ -0,0 +1,39 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+
+/*
+    chunked传输编码。
+    请求体的解码是增量的：每次处理读缓冲中已经到达的部分，解码出来的数据原地移到开头，
+    不需要整个请求体都在内存中。块扩展和尾部字段被跳过。
+*/
+class chunked_decoder {
+public:
+    enum RESULT { CHUNK_AGAIN, CHUNK_DONE, CHUNK_BAD }; // 需要更多数据；请求体结束；格式错误
+    static const int MAX_LINE = 4096; // 块大小行（包括扩展）和每个尾部字段的最大长度
+
+    chunked_decoder() { reset(); }
+    void reset();
+
+    // 解码[data, data + len)，consumed为用掉的输入字节数，解码出来的out字节放在data开头；
+    // 返回CHUNK_DONE时consumed之后的数据属于下一个请求
+    RESULT decode(char * data, int len, int & consumed, int & out);
+
+private:
+    enum STATE { SIZE, SIZE_EXT, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, TRAILER_LF, FINAL_LF };
+
+    STATE m_state;
+    unsigned long long m_size; // 当前块剩下的字节数
+    int m_digits; // 块大小的十六进制位数
+    int m_line_len; // 当前行已经读过的长度
+};
+
+// 响应体的块：块头为"十六进制长度\r\n"，数据之后是"\r\n"，最后是长度为0的块
+static const int CHUNK_HEADER_MAX = 18; // 16位十六进制数加上\r\n
+static const char LAST_CHUNK[] = "0\r\n\r\n";
+
+// 把len的块头写到buf中，返回长度
+int chunk_header(char * buf, size_t len);
+
+#endif
@@ -0,0 +1,298 @@
+#include "config.h"
+#include "buffer_pool.h"
+#include "proxy_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+static const server_config default_config;
+
+std::atomic<const server_config *> config::m_current(&default_config);
+std::string config::m_path;
+server_config config::m_file;
+
+server_config::server_config()
+    : port(0), reactors(0), threads(8), cpu_affinity(false), queue_depth(10000), use_uring(false),
+      backlog(1024), max_connections(0), max_events(10000), fastcgi_max_conns(8), fastcgi_multiplex(1),
+      proxy_balance_hash(false), proxy_max_conns(32), proxy_max_fails(3), proxy_fail_timeout_ms(10000),
+      proxy_splice(true), tls_port(0), ktls(true),
+      doc_root("resources"), conn_timeout_ms(15000), max_request_size(buffer_pool::MAX_SIZE),
+      cache_max_bytes(64 * 1024 * 1024), cache_max_entry_size(1024 * 1024), sendfile_threshold(0),
+      drain_timeout_ms(30000), max_body_size(1024 * 1024), gzip_stream(true) {
+}
+
+static std::string trim(const std::string & s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+static bool parse_int(const std::string & value, long long min, long long max, int & out) {
+    char * end;
+    errno = 0;
+    long long v = strtoll(value.c_str(), &end, 10);
+    if (value.empty() || *end || errno || v < min || v > max) {
+        return false;
+    }
+    out = (int)v;
+    return true;
+}
+
+// 可以带K、M、G后缀
+static bool parse_size(const std::string & value, size_t & out) {
+    char * end;
+    errno = 0;
+    unsigned long long v = strtoull(value.c_str(), &end, 10);
+    if (value.empty() || value[0] == '-' || errno) {
+        return false;
+    }
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') shift = 10, end++;
+    else if (*end == 'M' || *end == 'm') shift = 20, end++;
+    else if (*end == 'G' || *end == 'g') shift = 30, end++;
+    if (*end || v > (~0ULL >> shift)) {
+        return false;
+    }
+    out = (size_t)(v << shift);
+    return true;
+}
+
+static bool parse_bool(const std::string & value, bool & out) {
+    const char * v = value.c_str();
+    if (strcasecmp(v, "1") == 0 || strcasecmp(v, "true") == 0 || strcasecmp(v, "on") == 0) {
+        out = true;
+    } else if (strcasecmp(v, "0") == 0 || strcasecmp(v, "false") == 0 || strcasecmp(v, "off") == 0) {
+        out = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// 空格或逗号分隔的列表
+static bool parse_list(const std::string & value, std::vector<std::string> & out) {
+    std::vector<std::string> items;
+    size_t pos = 0;
+    while ((pos = value.find_first_not_of(" \t,", pos)) != std::string::npos) {
+        size_t end = value.find_first_of(" \t,", pos);
+        if (end == std::string::npos) end = value.size();
+        items.push_back(value.substr(pos, end - pos));
+        pos = end;
+    }
+    out.swap(items);
+    return true;
+}
+
+static bool set_option(server_config & cfg, const std::string & key, const std::string & value) {
+    if (key == "port") return parse_int(value, 1, 65535, cfg.port);
+    if (key == "reactors") return parse_int(value, 0, 1024, cfg.reactors);
+    if (key == "threads") return parse_int(value, 1, 1024, cfg.threads);
+    if (key == "cpu_affinity") return parse_bool(value, cfg.cpu_affinity);
+    if (key == "queue_depth") return parse_int(value, 1, INT_MAX, cfg.queue_depth);
+    if (key == "backend") {
+        if (value != "epoll" && value != "uring") return false;
+        cfg.use_uring = value == "uring";
+        return true;
+    }
+    if (key == "backlog") return parse_int(value, 1, INT_MAX, cfg.backlog);
+    if (key == "max_connections") return parse_int(value, 0, INT_MAX, cfg.max_connections);
+    if (key == "max_events") return parse_int(value, 1, 1000000, cfg.max_events);
+    if (key == "access_log") {
+        cfg.access_log = value;
+        return true;
+    }
+    if (key == "fastcgi_pass") {
+        cfg.fastcgi_pass = value;
+        return true;
+    }
+    if (key == "fastcgi_max_conns") return parse_int(value, 1, 65535, cfg.fastcgi_max_conns);
+    // 请求编号只有16位
+    if (key == "fastcgi_multiplex") return parse_int(value, 1, 65535, cfg.fastcgi_multiplex);
+    if (key == "proxy_pass") return parse_list(value, cfg.proxy_pass);
+    if (key == "proxy_balance") {
+        if (value != "least_conn" && value != "hash") return false;
+        cfg.proxy_balance_hash = value == "hash";
+        return true;
+    }
+    if (key == "proxy_max_conns") return parse_int(value, 1, 65535, cfg.proxy_max_conns);
+    if (key == "proxy_max_fails") return parse_int(value, 0, INT_MAX, cfg.proxy_max_fails);
+    if (key == "proxy_fail_timeout_ms") return parse_int(value, 0, INT_MAX, cfg.proxy_fail_timeout_ms);
+    if (key == "proxy_splice") return parse_bool(value, cfg.proxy_splice);
+    if (key == "tls_port") return parse_int(value, 0, 65535, cfg.tls_port);
+    if (key == "tls_cert") {
+        cfg.tls_cert = value;
+        return true;
+    }
+    if (key == "tls_key") {
+        cfg.tls_key = value;
+        return true;
+    }
+    if (key == "ktls") return parse_bool(value, cfg.ktls);
+    if (key == "doc_root") {
+        cfg.doc_root = value;
+        return !value.empty();
+    }
+    // 时间轮的精度为100毫秒
+    if (key == "conn_timeout_ms") return parse_int(value, 100, INT_MAX, cfg.conn_timeout_ms);
+    if (key == "max_request_size") return parse_int(value, buffer_pool::MIN_SIZE, buffer_pool::MAX_SIZE, cfg.max_request_size);
+    if (key == "cache_max_bytes") return parse_size(value, cfg.cache_max_bytes);
+    if (key == "cache_max_entry_size") return parse_size(value, cfg.cache_max_entry_size);
+    if (key == "sendfile_threshold") return parse_size(value, cfg.sendfile_threshold);
+    if (key == "drain_timeout_ms") return parse_int(value, 0, INT_MAX, cfg.drain_timeout_ms);
+    if (key == "max_body_size") return parse_size(value, cfg.max_body_size);
+    if (key == "gzip_stream") return parse_bool(value, cfg.gzip_stream);
+    if (key == "fastcgi_prefix") return parse_list(value, cfg.fastcgi_prefix);
+    if (key == "proxy_prefix") return parse_list(value, cfg.proxy_prefix);
+    return false;
+}
+
+bool config::parse(const char * path, server_config & cfg, std::string & error) {
+    FILE * fp = fopen(path, "r");
+    if (!fp) {
+        error = std::string("cannot open ") + path + ": " + strerror(errno);
+        return false;
+    }
+    server_config tmp = cfg;
+    char line[4096];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        lineno++;
+        std::string s = trim(line);
+        if (s.empty() || s[0] == '#') continue;
+        size_t eq = s.find('=');
+        ok = eq != std::string::npos && set_option(tmp, trim(s.substr(0, eq)), trim(s.substr(eq + 1)));
+        if (!ok) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), ":%d: ", lineno);
+            error = std::string(path) + buf + "bad line: " + s;
+        }
+    }
+    fclose(fp);
+    if (ok) {
+        cfg = tmp;
+    }
+    return ok;
+}
+
+bool config::validate(server_config & cfg, std::string & error) {
+    char real[PATH_MAX];
+    struct stat st;
+    if (!realpath(cfg.doc_root.c_str(), real) || stat(real, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        error = "doc_root is not a directory: " + cfg.doc_root;
+        return false;
+    }
+    cfg.doc_root = real;
+    if (cfg.cache_max_entry_size > cfg.cache_max_bytes) {
+        error = "cache_max_entry_size is larger than cache_max_bytes";
+        return false;
+    }
+    sockaddr_storage addr;
+    socklen_t len;
+    if (!cfg.fastcgi_pass.empty() && !upstream_pool::parse_address(cfg.fastcgi_pass, addr, len)) {
+        error = "bad fastcgi_pass: " + cfg.fastcgi_pass;
+        return false;
+    }
+    for (size_t i = 0; i < cfg.fastcgi_prefix.size(); i++) {
+        if (cfg.fastcgi_prefix[i][0] != '/') {
+            error = "fastcgi_prefix must start with '/': " + cfg.fastcgi_prefix[i];
+            return false;
+        }
+    }
+    if (cfg.proxy_pass.size() > (size_t)proxy_pool::MAX_BACKENDS) {
+        error = "too many proxy_pass backends";
+        return false;
+    }
+    for (size_t i = 0; i < cfg.proxy_pass.size(); i++) {
+        if (!upstream_pool::parse_address(cfg.proxy_pass[i], addr, len)) {
+            error = "bad proxy_pass: " + cfg.proxy_pass[i];
+            return false;
+        }
+    }
+    for (size_t i = 0; i < cfg.proxy_prefix.size(); i++) {
+        if (cfg.proxy_prefix[i][0] != '/') {
+            error = "proxy_prefix must start with '/': " + cfg.proxy_prefix[i];
+            return false;
+        }
+    }
+    if (cfg.tls_port) {
+        if (cfg.tls_port == cfg.port) {
+            error = "tls_port must differ from port";
+            return false;
+        }
+        if (cfg.tls_cert.empty() || cfg.tls_key.empty()) {
+            error = "tls_port needs tls_cert and tls_key";
+            return false;
+        }
+    }
+    return true;
+}
+
+void config::init(const server_config & cfg, const char * path) {
+    m_path = path ? path : "";
+    if (path) {
+        std::string error;
+        parse(path, m_file, error);
+    }
+    m_current.store(new server_config(cfg), std::memory_order_release);
+}
+
+bool config::reload() {
+    if (m_path.empty()) {
+        printf("reload config: no config file\n");
+        return false;
+    }
+    // 在当前配置上修改，配置文件中没有的项（包括启动时由命令行指定的）保持当前的值
+    const server_config & old = get();
+    server_config cfg = old;
+    server_config file;
+    std::string error;
+    if (!parse(m_path.c_str(), cfg, error) || !parse(m_path.c_str(), file, error) || !validate(cfg, error)) {
+        printf("reload config: %s, keep the current config\n", error.c_str());
+        return false;
+    }
+
+    // 只在启动时生效的项保持原来的值。和上一次读取的配置文件比较，只提示配置文件中真正改动过的项：
+    // 命令行覆盖的项（如按位置的端口号）的当前值本来就和配置文件不同
+#define KEEP(field) \
+    if (!(file.field == m_file.field)) { \
+        printf("reload config: " #field " takes effect after restart\n"); \
+    } \
+    cfg.field = old.field;
+    KEEP(port)
+    KEEP(reactors)
+    KEEP(threads)
+    KEEP(cpu_affinity)
+    KEEP(queue_depth)
+    KEEP(use_uring)
+    KEEP(backlog)
+    KEEP(max_connections)
+    KEEP(max_events)
+    KEEP(access_log)
+    KEEP(fastcgi_pass)
+    KEEP(fastcgi_max_conns)
+    KEEP(fastcgi_multiplex)
+    KEEP(proxy_pass)
+    KEEP(proxy_balance_hash)
+    KEEP(proxy_max_conns)
+    KEEP(proxy_max_fails)
+    KEEP(proxy_fail_timeout_ms)
+    KEEP(proxy_splice)
+    KEEP(tls_port)
+    KEEP(tls_cert)
+    KEEP(tls_key)
+    KEEP(ktls)
+#undef KEEP
+
+    m_file = file;
+    m_current.store(new server_config(cfg), std::memory_order_release);
+    printf("reload config: doc_root %s, conn_timeout_ms %d, max_request_size %d, cache %lu/%lu bytes\n",
+           cfg.doc_root.c_str(), cfg.conn_timeout_ms, cfg.max_request_size,
+           (unsigned long)cfg.cache_max_bytes, (unsigned long)cfg.cache_max_entry_size);
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// 服务器配置，默认值见构造函数
+struct server_config {
+    // 以下只在启动时生效，重新加载时改动会被忽略
+    int port;
+    int reactors; // 事件循环的数量，0表示单Reactor加线程池
+    int threads; // 线程池的线程数量
+    bool cpu_affinity; // 是否把工作线程绑定到CPU上
+    int queue_depth; // 线程池请求队列的长度
+    bool use_uring; // 是否使用io_uring后端
+    int backlog; // 监听队列的长度
+    int max_connections; // 最大连接数，0表示由文件描述符数的限制决定
+    int max_events; // 每次epoll_wait最多返回的事件数
+    std::string access_log; // 访问日志文件，空表示不记录
+    std::string fastcgi_pass; // FastCGI后端的地址，"unix:/path"或者"ip:port"，空表示不转发
+    int fastcgi_max_conns; // 每个事件循环到后端的最多连接数
+    int fastcgi_multiplex; // 每个后端连接上同时进行的最多请求数，大于1需要后端支持多路复用
+    std::vector<std::string> proxy_pass; // 反向代理的HTTP后端地址列表，空格或逗号分隔，空表示不代理
+    bool proxy_balance_hash; // 按请求目标一致性哈希选择后端（proxy_balance = hash），否则选请求最少的（least_conn）
+    int proxy_max_conns; // 每个事件循环到每个后端的最多连接数
+    int proxy_max_fails; // 连续失败多少次之后暂时不再选择这个后端，0表示不检查
+    int proxy_fail_timeout_ms; // 失败的后端多长时间之后重新参加选择
+    bool proxy_splice; // 是否用splice转发大的响应体
+    int tls_port; // HTTPS端口，0表示不监听
+    std::string tls_cert; // 证书链文件（PEM）
+    std::string tls_key; // 私钥文件（PEM）
+    bool ktls; // 握手之后是否尝试把记录的加解密交给内核（kTLS），不支持时在用户空间加密
+
+    // 以下可以通过SIGHUP重新加载
+    std::string doc_root; // 网站根目录，加载时转换成绝对路径
+    int conn_timeout_ms; // 连接空闲超时时间，已有的连接在下一次活动时使用新值
+    int max_request_size; // 请求行和请求头的最大字节数，按读缓冲区的级别向上取整
+    size_t cache_max_bytes; // 静态文件缓存的容量
+    size_t cache_max_entry_size; // 超过该大小的文件不缓存
+    size_t sendfile_threshold; // 不进缓存的文件不小于该大小时用sendfile发送，否则mmap后writev；0表示都用sendfile
+    int drain_timeout_ms; // 平滑升级时旧进程等待已有连接结束的最长时间
+    size_t max_body_size; // 请求体的最大字节数，超过时返回413，0表示不限制
+    bool gzip_stream; // 是否边读边压缩发送不进缓存的大文件
+    std::vector<std::string> fastcgi_prefix; // 除POST外也转发给FastCGI后端的URL前缀，空格或逗号分隔
+    std::vector<std::string> proxy_prefix; // 代理给HTTP后端的URL前缀，优先于FastCGI
+
+    server_config();
+};
+
+/*
+    配置文件每行一个 key = value，'#'开始的行是注释，key和server_config的成员同名（backend为epoll或uring）。
+    当前配置所有线程共享、只读；重新加载时先完整地解析和检查新的配置文件，有任何错误都保持原来的配置，
+    全部正确时才换成新的配置，所以不会出现一半新一半旧的状态。配置文件中没有的项保持当前的值。
+*/
+class config {
+public:
+    // 解析配置文件，在cfg上修改出现的项；出错时返回false，error为出错的行和原因
+    static bool parse(const char * path, server_config & cfg, std::string & error);
+    // 检查取值，转换doc_root为绝对路径
+    static bool validate(server_config & cfg, std::string & error);
+
+    static void init(const server_config & cfg, const char * path); // 启动时设置，path为NULL表示没有配置文件
+    static const server_config & get() { return *m_current.load(std::memory_order_acquire); }
+    // 重新读取启动时的配置文件，成功时返回true；只能在一个线程中调用
+    static bool reload();
+
+private:
+    // 旧的配置不释放，工作线程可能还在使用，重新加载很少发生
+    static std::atomic<const server_config *> m_current;
+    static std::string m_path;
+    // 上一次读取的配置文件本身的值（在默认值上修改，不含命令行的覆盖），用来判断只在启动时生效的项是否真的被改动
+    static server_config m_file;
+};
+
+#endif
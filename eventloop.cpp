@@ -0,0 +1,1118 @@
+#include "eventloop.h"
+#include "http_conn.h"
+#include "fcgi_pool.h"
+#include "proxy_pool.h"
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <vector>
+
+extern int setnonblocking(int fd);
+extern int addfd(int epoll_fd, int fd, void *ptr, bool one_shot, bool ET, bool rdhup = true);
+extern int removefd(int epoll_fd, int fd);
+extern void modfd(int epoll_fd, int fd, void *ptr, int ev);
+
+// 服务器过载时直接写给新连接的响应
+static const char overload_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 44\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "The server is too busy, please retry later.\n";
+
+eventloop::eventloop(int port, int max_conns, threadpool<http_conn> *pool, bool use_uring, int backlog, int listenfd,
+                     int tls_port, int tls_listenfd)
+    : m_listenfd(-1), m_tls_listenfd(-1), m_epollfd(-1), m_wakeupfd(-1), m_sigfd(-1), m_slots(max_conns),
+      m_max_conns(max_conns), m_pool(pool), m_timer_wheel(NULL), m_started(false), m_stop(false), m_accept_paused(false),
+      m_on_upgrade(NULL), m_drain(false), m_drain_deadline(0), m_ring(NULL), m_ready(NULL),
+      m_upstreams() {
+    if (listenfd != -1) {
+        // 继承来的监听socket已经绑定，只按当前配置修改监听队列的长度
+        m_listenfd = listenfd;
+        listen(m_listenfd, backlog);
+    } else {
+        m_listenfd = create_listener(port, backlog);
+    }
+    if (tls_listenfd != -1) {
+        m_tls_listenfd = tls_listenfd;
+        listen(m_tls_listenfd, backlog);
+    } else if (tls_port) {
+        try {
+            m_tls_listenfd = create_listener(tls_port, backlog);
+        } catch(...) {
+            close(m_listenfd);
+            throw;
+        }
+    }
+
+    m_wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeupfd == -1) {
+        close_listeners();
+        throw std::exception();
+    }
+    try {
+        m_timer_wheel = new timer_wheel;
+    } catch(...) {
+        close_listeners();
+        close(m_wakeupfd);
+        throw;
+    }
+    // 后端的连接在第一次用到时才建立
+    const server_config &cfg = config::get();
+    try {
+        if (!cfg.fastcgi_pass.empty()) {
+            m_upstreams[UPSTREAM_FASTCGI] = new fcgi_pool(this, cfg.fastcgi_pass, cfg.fastcgi_max_conns, cfg.fastcgi_multiplex);
+        }
+        if (!cfg.proxy_pass.empty()) {
+            m_upstreams[UPSTREAM_PROXY] = new proxy_pool(this, cfg.proxy_pass,
+                cfg.proxy_balance_hash ? proxy_pool::CONSISTENT_HASH : proxy_pool::LEAST_CONN, cfg.proxy_max_conns,
+                cfg.proxy_max_fails, cfg.proxy_fail_timeout_ms, cfg.proxy_splice);
+        }
+    } catch(...) {
+        close_listeners();
+        close(m_wakeupfd);
+        delete m_timer_wheel;
+        for (int i = 0; i < UPSTREAM_KINDS; i++) delete m_upstreams[i];
+        throw;
+    }
+
+    // io_uring后端：监听socket、timerfd、eventfd都通过io_uring的操作监听，在loop()中提交
+    if (use_uring) {
+        try {
+            m_ring = new uring(URING_ENTRIES, URING_BUF_NUM, URING_BUF_SIZE);
+            // 每个连接同时最多在队列中出现一次
+            m_ready = new mpmc_queue<uint32_t>(max_conns < MAX_URING_READY ? max_conns : MAX_URING_READY);
+            return;
+        } catch(...) {
+            printf("io_uring is not available, use epoll\n");
+            delete m_ring;
+            delete m_ready;
+            m_ring = NULL;
+            m_ready = NULL;
+        }
+    }
+
+    // 创建epoll对象，将监听的文件描述符添加到epoll中
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollfd == -1) {
+        close_listeners();
+        close(m_wakeupfd);
+        delete m_timer_wheel;
+        for (int i = 0; i < UPSTREAM_KINDS; i++) delete m_upstreams[i];
+        throw std::exception();
+    }
+    // 连接注册的是连接对象的指针，这几个fd注册的是保存它们的成员的地址，用来区分事件来源
+    // 监听socket为水平触发，一次最多accept ACCEPT_BATCH个连接，没有accept完的下一轮还会通知
+    setnonblocking(m_listenfd);
+    addfd(m_epollfd, m_listenfd, &m_listenfd, false, false);
+    if (m_tls_listenfd != -1) {
+        setnonblocking(m_tls_listenfd);
+        addfd(m_epollfd, m_tls_listenfd, &m_tls_listenfd, false, false);
+    }
+    addfd(m_epollfd, m_wakeupfd, &m_wakeupfd, false, false, false);
+    // 时间轮的timerfd也注册到epoll中
+    addfd(m_epollfd, m_timer_wheel->get_timerfd(), m_timer_wheel, false, false, false);
+}
+
+int eventloop::create_listener(int port, int backlog) {
+    // 创建监听套接字，升级时由upgrade把它传给新进程，exec时不继承
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+        throw std::exception();
+    }
+
+    // 设置端口复用，每个事件循环绑定同一个端口，由内核在它们之间分发新连接
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+        close(listenfd);
+        throw std::exception();
+    }
+
+    // 绑定
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listenfd, backlog) == -1) {
+        close(listenfd);
+        throw std::exception();
+    }
+    return listenfd;
+}
+
+void eventloop::close_listeners() {
+    if (m_listenfd != -1) {
+        close(m_listenfd);
+        m_listenfd = -1;
+    }
+    if (m_tls_listenfd != -1) {
+        close(m_tls_listenfd);
+        m_tls_listenfd = -1;
+    }
+}
+
+eventloop::~eventloop() {
+    // 先关闭io_uring，取消所有还在进行的操作
+    delete m_ring;
+    for (uint32_t i = 0; i < m_slots.constructed(); i++) {
+        uring_conn &c = m_slots.at(i)->uring;
+        if (c.pipe[0] != -1) {
+            close(c.pipe[0]);
+            close(c.pipe[1]);
+        }
+    }
+    delete m_ready;
+    for (int i = 0; i < UPSTREAM_KINDS; i++) delete m_upstreams[i];
+    if (m_epollfd != -1) close(m_epollfd);
+    close_listeners();
+    close(m_wakeupfd);
+    delete m_timer_wheel;
+}
+
+void eventloop::watch_signals(int sigfd, void (*on_upgrade)()) {
+    m_sigfd = sigfd;
+    m_on_upgrade = on_upgrade;
+    setnonblocking(m_sigfd);
+    if (!m_ring) {
+        addfd(m_epollfd, m_sigfd, &m_sigfd, false, true, false);
+    }
+}
+
+bool eventloop::start() {
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void *eventloop::worker(void *arg) {
+    eventloop *el = (eventloop *) arg;
+    el->loop();
+    return el;
+}
+
+void eventloop::stop() {
+    m_stop = true;
+    uint64_t one = 1;
+    ::write(m_wakeupfd, &one, sizeof(one));
+}
+
+void eventloop::join() {
+    if (m_started) {
+        pthread_join(m_thread, NULL);
+        m_started = false;
+    }
+}
+
+void eventloop::loop() {
+    m_loop_thread = pthread_self();
+    if (m_ring) {
+        uring_loop();
+    } else {
+        epoll_loop();
+    }
+}
+
+void eventloop::epoll_loop() {
+    // 每次epoll_wait最多返回的事件数只在启动时读取
+    int max_events = config::get().max_events;
+    std::vector<epoll_event> events(max_events);
+    bool timeout = false;
+
+    while (!m_stop) {
+        int num = epoll_wait(m_epollfd, &events[0], max_events, -1); // 阻塞
+        if (num < 0 && errno != EINTR) {  // 中断
+            printf("epoll failure\n");
+            break;
+        }
+
+        // 循环遍历事件数组
+        for (int i = 0; i < num; i++) {
+            void *ptr = events[i].data.ptr;
+            upstream_pool *upstream;
+            int index;
+            if (ptr == &m_listenfd) {
+                handle_accept(false);
+            } else if (ptr == &m_tls_listenfd) {
+                handle_accept(true);
+            } else if (ptr == m_timer_wheel) {
+                timeout = true;
+            } else if (ptr == &m_wakeupfd) {
+                uint64_t cnt;
+                ::read(m_wakeupfd, &cnt, sizeof(cnt));
+            } else if (ptr == &m_sigfd) {
+                if (events[i].events & EPOLLIN) {
+                    handle_signal();
+                }
+            } else if ((upstream = find_upstream(ptr, index))) {
+                // 后端连接
+                upstream->handle_event(index, events[i].events);
+            } else if (((http_conn *) ptr)->end_queued()) {
+                // 工作线程处理期间空闲超时已经到期，处理完交还之后再关闭
+                ((http_conn *) ptr)->close_conn();
+            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                // 对方异常断开或者错误等事件
+                // 关闭连接
+                ((http_conn *) ptr)->close_conn();
+            } else if (events[i].events & EPOLLIN) {
+                handle_read((http_conn *) ptr);
+            } else if (events[i].events & EPOLLOUT) {
+                handle_write((http_conn *) ptr);
+            }
+        }
+
+        // 最后处理定时事件，因为I/O事件有更高的优先级。当然，这样做将导致定时任务不能精准的按照预定的时间执行。
+        if (timeout) {
+            m_timer_wheel->tick();
+            timeout = false;
+            // 暂停accept时定期重试，文件描述符可能已经被其他事件循环释放
+            resume_accept();
+        }
+        for (int i = 0; i < UPSTREAM_KINDS; i++) {
+            if (m_upstreams[i]) m_upstreams[i]->flush();
+        }
+        check_drain();
+    }
+}
+
+void eventloop::handle_accept(bool tls) {
+    // 有客户端连接进来，分批把监听队列中的连接都取出来
+    int listenfd = tls ? m_tls_listenfd : m_listenfd;
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        uint64_t start = metrics::now_ns();
+        struct sockaddr_in client_address;
+        socklen_t client_addrlen = sizeof(client_address);
+        int connfd = accept4(listenfd, (struct sockaddr *)&client_address, &client_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // 文件描述符用完，水平触发的监听socket会一直可读，先暂停，否则事件循环会空转
+                pause_accept();
+            }
+            // EAGAIN表示已经取完；ECONNABORTED等只影响这一个连接
+            if (errno == EAGAIN || errno == EMFILE || errno == ENFILE) {
+                return;
+            }
+            continue;
+        }
+        new_conn(connfd, client_address, tls);
+        metrics::record(STAGE_ACCEPT, metrics::now_ns() - start);
+    }
+}
+
+void eventloop::new_conn(int connfd, const sockaddr_in &addr, bool tls) {
+    uint32_t slot;
+    conn_slot *s = http_conn::m_user_count < m_max_conns ? m_slots.alloc(slot) : NULL;
+    if (!s) {
+        // 目前连接数满，告诉客户端服务器正忙，稍后重试；TLS连接没有握手无法回复，直接关闭
+        if (tls) {
+            metrics::count(COUNTER_REJECTED);
+            close(connfd);
+        } else {
+            reject_conn(connfd);
+        }
+        return;
+    }
+    metrics::count(COUNTER_ACCEPTED);
+    // 从连接表中借一个连接对象，初始化新客户的数据
+    s->user.init(connfd, addr, this, slot, tls);
+}
+
+void eventloop::reject_conn(int connfd) {
+    metrics::count(COUNTER_REJECTED);
+    // 先读掉已经到达的请求，避免关闭时因为有未读数据而发送RST，导致客户端收不到503
+    char buf[1024];
+    while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+    send(connfd, overload_503, sizeof(overload_503) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(connfd, SHUT_WR);
+    close(connfd);
+}
+
+void eventloop::pause_accept() {
+    if (m_accept_paused) {
+        return;
+    }
+    m_accept_paused = true;
+    if (!m_ring) {
+        // 保留在epoll中但不监听任何事件
+        set_accept_events(0);
+    }
+}
+
+// 有连接关闭或者定时器到期时调用
+void eventloop::resume_accept() {
+    if (!m_accept_paused || m_listenfd == -1) {
+        return;
+    }
+    m_accept_paused = false;
+    if (!m_ring) {
+        set_accept_events(EPOLLIN | EPOLLRDHUP);
+    } else {
+        arm_accept();
+    }
+}
+
+void eventloop::set_accept_events(int events) {
+    int *fds[] = { &m_listenfd, &m_tls_listenfd };
+    for (int i = 0; i < 2; i++) {
+        if (*fds[i] != -1) {
+            epoll_event event;
+            event.data.ptr = fds[i];
+            event.events = events;
+            epoll_ctl(m_epollfd, EPOLL_CTL_MOD, *fds[i], &event);
+        }
+    }
+}
+
+void eventloop::drain(uint64_t deadline_ns) {
+    m_drain_deadline = deadline_ns;
+    m_drain = true;
+    uint64_t one = 1;
+    ::write(m_wakeupfd, &one, sizeof(one));
+}
+
+void eventloop::check_drain() {
+    if (!m_drain) {
+        return;
+    }
+    if (m_listenfd != -1) {
+        // 监听socket已经由新进程持有，这里只是关闭自己的引用，不能shutdown，监听队列中的连接留给新进程
+        if (!m_ring) {
+            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, NULL);
+        } else {
+            // 取消多发accept，已经accept的连接仍然会产生完成项
+            io_uring_sqe *sqe = m_ring->get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)OP_ACCEPT << 56;
+            sqe->user_data = (uint64_t)OP_CANCEL << 56;
+        }
+        close(m_listenfd);
+        m_listenfd = -1;
+        m_accept_paused = false;
+    }
+    if (m_tls_listenfd != -1) {
+        // TLS端口只在epoll后端中
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_tls_listenfd, NULL);
+        close(m_tls_listenfd);
+        m_tls_listenfd = -1;
+    }
+    // 连接在下一个响应之后关闭，空闲的连接由空闲超时关闭，都关闭或者到期限时结束
+    if (m_slots.in_use() == 0 || metrics::now_ns() >= m_drain_deadline) {
+        m_stop = true;
+    }
+}
+
+void eventloop::add_conn(http_conn *user) {
+    if (!m_ring) {
+        addfd(m_epollfd, user->get_sockfd(), user, true, true);
+        return;
+    }
+    // io_uring的socket保持阻塞模式，由内核在可读写时完成操作
+    uring_conn &c = m_slots.at(user->get_slot())->uring;
+    c.gen++;
+    c.busy = false;
+    c.closing = false;
+    c.error = false;
+    c.throttled = false;
+    c.inflight = 0;
+    c.pipe_bytes = 0;
+    c.file_offset = NULL;
+    arm_recv(user->get_slot());
+}
+
+void eventloop::remove_conn(http_conn *user, int sockfd) {
+    uint32_t slot = user->get_slot();
+    if (!m_ring) {
+        removefd(m_epollfd, sockfd);
+        m_slots.free(slot);
+        resume_accept();
+        return;
+    }
+    // 还在进行的操作持有socket的引用，先shutdown让它们尽快结束，代数加1之后它们的完成项被丢弃，
+    // 所以连接对象可以马上回收
+    uring_conn &c = m_slots.at(slot)->uring;
+    c.gen++;
+    c.busy = false;
+    std::string().swap(c.backlog);
+    if (c.pipe[0] != -1) {
+        close(c.pipe[0]);
+        close(c.pipe[1]);
+        c.pipe[0] = c.pipe[1] = -1;
+    }
+    shutdown(sockfd, SHUT_RDWR);
+    close(sockfd);
+    m_slots.free(slot);
+    resume_accept();
+}
+
+void eventloop::modify(http_conn *user, int ev) {
+    if (!m_ring) {
+        if (ev == EPOLLIN && user->tls_pending()) {
+            // 下一个请求已经在OpenSSL的缓冲中，socket可能不会再可读；socket几乎总是可写，借可写事件回到事件循环读取
+            user->defer_read();
+            ev = EPOLLOUT;
+        }
+        modfd(m_epollfd, user->get_sockfd(), user, ev);
+        return;
+    }
+    // 交给事件循环线程，由它根据连接的状态决定发送响应还是继续接收
+    while (!m_ready->push(user->get_slot())) {
+        cpu_relax();
+    }
+    if (!pthread_equal(pthread_self(), m_loop_thread)) {
+        uint64_t one = 1;
+        ::write(m_wakeupfd, &one, sizeof(one));
+    }
+}
+
+void eventloop::handle_signal() {
+    // 处理信号
+    char signals[1024];
+    int ret = recv(m_sigfd, signals, sizeof(signals), 0);
+    if (ret <= 0) return;
+    for (int i = 0; i < ret; i++) {
+        switch (signals[i]) {
+            case SIGTERM: {
+                m_stop = true;
+                break;
+            } case SIGHUP: {
+                reload_config();
+                break;
+            } case SIGUSR2: {
+                // 平滑升级，由main启动新的进程
+                if (m_on_upgrade) {
+                    m_on_upgrade();
+                }
+                break;
+            } case SIGUSR1: {
+                // 日志文件已经被移走，重新打开
+                if (http_conn::m_access_log) {
+                    http_conn::m_access_log->reopen();
+                }
+                break;
+            }
+        }
+    }
+}
+
+void eventloop::reload_config() {
+    if (!config::reload()) {
+        return;
+    }
+    // 网站根目录、超时时间、请求大小在使用时读取当前配置，这里只需要调整缓存的容量
+    const server_config &cfg = config::get();
+    if (http_conn::m_file_cache) {
+        http_conn::m_file_cache->set_limits(cfg.cache_max_bytes, cfg.cache_max_entry_size);
+    }
+}
+
+void eventloop::handle_read(http_conn *user) {
+    if (user->tls_handshaking() && !handle_handshake(user)) {
+        return;
+    }
+    // 读事件发生，一次性把所有数据读完
+    if (!user->read()) {
+        user->close_conn();
+        return;
+    }
+    if (user->upstream_active()) {
+        // 转发给后端的请求体
+        handle_upstream(user);
+        return;
+    }
+    dispatch(user);
+}
+
+// 解析请求并生成响应
+void eventloop::dispatch(http_conn *user) {
+    if (m_pool) {
+        user->mark_queued();
+        if (!m_pool->append(user)) {
+            // 请求队列已满
+            user->close_conn();
+        }
+    } else {
+        // 在本线程中解析请求并生成响应
+        user->process();
+    }
+}
+
+// 握手推进一步，完成时返回true；没有完成时等待握手需要的事件，失败时关闭连接
+bool eventloop::handle_handshake(http_conn *user) {
+    switch (user->tls_handshake()) {
+        case http_conn::HS_DONE: {
+            return true;
+        } case http_conn::HS_READ: {
+            modify(user, EPOLLIN);
+            break;
+        } case http_conn::HS_WRITE: {
+            modify(user, EPOLLOUT);
+            break;
+        } case http_conn::HS_CLOSE: {
+            user->close_conn();
+            break;
+        }
+    }
+    return false;
+}
+
+void eventloop::handle_write(http_conn *user) {
+    if (user->take_deferred_read()) {
+        handle_read(user);
+        return;
+    }
+    if (user->tls_handshaking()) {
+        // 握手中发送缓冲满，完成之后客户端可能已经发来了请求
+        if (handle_handshake(user)) {
+            handle_read(user);
+        }
+        return;
+    }
+    if (user->upstream_active()) {
+        handle_upstream(user);
+    } else {
+        write_response(user);
+    }
+}
+
+void eventloop::write_response(http_conn *user) {
+    if (!user->write()) {  // 一次性写完
+        user->close_conn();
+    } else if (user->has_buffered_requests()) {
+        // 流水线中还有已经读入但没有处理的请求
+        dispatch(user);
+    }
+}
+
+// 转发给后端的请求由连接上的事件和连接池的唤醒推进，都在事件循环线程中，不经过线程池
+void eventloop::handle_upstream(http_conn *user) {
+    switch (user->upstream_step()) {
+        case http_conn::UP_READ: {
+            modify(user, EPOLLIN);
+            break;
+        } case http_conn::UP_WRITE: {
+            write_response(user);
+            break;
+        } case http_conn::UP_WAIT: {
+            break;
+        } case http_conn::UP_CLOSE: {
+            user->close_conn();
+            break;
+        }
+    }
+}
+
+void eventloop::wake_upstream(http_conn *user) {
+    if (!m_ring) {
+        handle_upstream(user);
+    } else {
+        uring_upstream(user->get_slot());
+    }
+}
+
+upstream_pool *eventloop::find_upstream(const void *ptr, int &index) {
+    for (int i = 0; i < UPSTREAM_KINDS; i++) {
+        if (m_upstreams[i] && (index = m_upstreams[i]->index_of(ptr)) != -1) {
+            return m_upstreams[i];
+        }
+    }
+    return NULL;
+}
+
+// epoll中注册的是后端连接在连接池中的地址，水平触发
+void eventloop::watch_upstream(upstream_pool *pool, int index, uint32_t gen, int fd, int old_events, int events) {
+    if (!m_ring) {
+        epoll_event event;
+        event.data.ptr = pool->key(index);
+        event.events = events == -1 ? 0 : events;
+        epoll_ctl(m_epollfd, old_events == -1 ? EPOLL_CTL_ADD : events == -1 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &event);
+        return;
+    }
+    // io_uring：多发的POLLIN一直保留（暂停读取时连接池忽略它的通知），POLLOUT需要时提交一次性的
+    if (events == -1) {
+        int ops[] = { OP_UPSTREAM_IN, OP_UPSTREAM_OUT };
+        for (int i = 0; i < 2; i++) {
+            io_uring_sqe *sqe = m_ring->get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = ((uint64_t)ops[i] << 56) | ((uint64_t)(gen & 0xffffff) << 32) | ((uint32_t)pool->kind() << 24) | index;
+            sqe->user_data = (uint64_t)OP_CANCEL << 56;
+        }
+        return;
+    }
+    if (old_events == -1) {
+        arm_upstream(pool, index, gen, fd, OP_UPSTREAM_IN);
+    }
+    if ((events & EPOLLOUT) && (old_events == -1 || !(old_events & EPOLLOUT))) {
+        arm_upstream(pool, index, gen, fd, OP_UPSTREAM_OUT);
+    }
+}
+
+// 连接上的操作的user_data：高8位为操作，中间24位为连接的代数，低32位为连接的编号
+uint64_t eventloop::user_data(int op, uint32_t slot) {
+    uint64_t gen = m_slots.at(slot)->uring.gen & 0xffffff;
+    return ((uint64_t)op << 56) | (gen << 32) | slot;
+}
+
+void eventloop::arm_accept() {
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT; // 一次提交，每个新连接产生一个完成项
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)OP_ACCEPT << 56;
+}
+
+void eventloop::arm_poll(int fd, int op) {
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ((uint64_t)op << 56) | (uint32_t)fd;
+}
+
+// 后端连接的user_data和连接的格式相同，低32位中高8位为连接池的种类，低24位为在连接池中的编号
+void eventloop::arm_upstream(upstream_pool *pool, int index, uint32_t gen, int fd, int op) {
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = op == OP_UPSTREAM_IN ? POLLIN : POLLOUT;
+    sqe->len = op == OP_UPSTREAM_IN ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = ((uint64_t)op << 56) | ((uint64_t)(gen & 0xffffff) << 32) | ((uint32_t)pool->kind() << 24) | index;
+}
+
+void eventloop::arm_recv(uint32_t slot) {
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = m_slots.at(slot)->user.get_sockfd();
+    sqe->ioprio = IORING_RECV_MULTISHOT; // 每次收到数据产生一个完成项，数据放在内核从缓冲区环中挑选的缓冲区里
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uring::BUF_GROUP;
+    sqe->user_data = user_data(OP_RECV, slot);
+    m_slots.at(slot)->uring.recv_armed = true;
+}
+
+// 多发recv不能暂停，只能取消，已经完成的接收仍然会产生完成项，暂存的数据最多再多出缓冲区环的大小
+void eventloop::throttle_recv(uint32_t slot) {
+    uring_conn &c = m_slots.at(slot)->uring;
+    if (c.throttled) {
+        return;
+    }
+    c.throttled = true;
+    if (c.recv_armed) {
+        io_uring_sqe *sqe = m_ring->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(OP_RECV, slot);
+        sqe->user_data = (uint64_t)OP_CANCEL << 56;
+    }
+}
+
+void eventloop::uring_loop() {
+    arm_accept();
+    arm_poll(m_timer_wheel->get_timerfd(), OP_TIMER);
+    arm_poll(m_wakeupfd, OP_WAKEUP);
+    if (m_sigfd != -1) {
+        arm_poll(m_sigfd, OP_SIGNAL);
+    }
+
+    bool timeout = false;
+    while (!m_stop) {
+        // 一次系统调用提交上一轮产生的所有操作并等待完成
+        int ret = m_ring->submit_and_wait(1);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            printf("io_uring failure\n");
+            break;
+        }
+
+        io_uring_cqe *cqe;
+        while ((cqe = m_ring->peek_cqe())) {
+            io_uring_cqe done = *cqe;
+            m_ring->cqe_seen();
+            handle_completion(&done, timeout);
+        }
+
+        // 处理完请求的连接
+        uint32_t slot;
+        while (m_ready->pop(slot)) {
+            handle_ready(slot);
+        }
+
+        if (timeout) {
+            m_timer_wheel->tick();
+            timeout = false;
+            resume_accept();
+        }
+        for (int i = 0; i < UPSTREAM_KINDS; i++) {
+            if (m_upstreams[i]) m_upstreams[i]->flush();
+        }
+        check_drain();
+    }
+}
+
+void eventloop::handle_completion(io_uring_cqe *cqe, bool &timeout) {
+    int op = cqe->user_data >> 56;
+    uint32_t id = (uint32_t)cqe->user_data; // 连接的编号，或者timerfd等的fd
+    uint32_t gen = (cqe->user_data >> 32) & 0xffffff;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+        case OP_ACCEPT: {
+            if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+                // 文件描述符用完，多发accept已经结束，暂停到有连接关闭或者定时器到期
+                if (!more && m_listenfd != -1) pause_accept();
+                break;
+            }
+            if (cqe->res >= 0) {
+                // 多发accept不返回对端地址，accept本身由内核完成，只统计初始化连接的时间
+                uint64_t start = metrics::now_ns();
+                struct sockaddr_in client_address;
+                socklen_t client_addrlen = sizeof(client_address);
+                memset(&client_address, 0, sizeof(client_address));
+                getpeername(cqe->res, (struct sockaddr *)&client_address, &client_addrlen);
+                new_conn(cqe->res, client_address);
+                metrics::record(STAGE_ACCEPT, metrics::now_ns() - start);
+            }
+            // 排空时监听socket已经关闭，不再继续accept
+            if (!more && m_listenfd != -1) arm_accept();
+            break;
+        } case OP_CANCEL: {
+            break;
+        } case OP_TIMER: {
+            timeout = true;
+            if (!more) arm_poll(id, op);
+            break;
+        } case OP_WAKEUP: {
+            uint64_t cnt;
+            ::read(m_wakeupfd, &cnt, sizeof(cnt));
+            if (!more) arm_poll(id, op);
+            break;
+        } case OP_SIGNAL: {
+            handle_signal();
+            if (!more) arm_poll(id, op);
+            break;
+        } case OP_UPSTREAM_IN:
+          case OP_UPSTREAM_OUT: {
+            // 后端连接就绪，丢弃已经关闭的后端连接的完成项
+            uint32_t kind = id >> 24;
+            int index = id & 0xffffff;
+            upstream_pool *pool = kind < UPSTREAM_KINDS ? m_upstreams[kind] : NULL;
+            if (!pool || !pool->current(index, gen)) break;
+            pool->handle_event(index, cqe->res > 0 ? cqe->res : 0, op == OP_UPSTREAM_OUT);
+            if (op == OP_UPSTREAM_IN && !more && pool->current(index, gen)) {
+                arm_upstream(pool, index, gen, pool->fd(index), op);
+            }
+            break;
+        } default: {
+            // 连接上的操作，丢弃已经关闭的连接的完成项，归还它占用的缓冲区
+            conn_slot *s = m_slots.at(id);
+            if (!s || gen != (s->uring.gen & 0xffffff)) {
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    m_ring->recycle_buf(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                break;
+            }
+            if (op == OP_RECV) {
+                handle_recv(id, cqe->res, cqe->flags);
+            } else {
+                handle_sent(id, op, cqe->res);
+            }
+        }
+    }
+}
+
+void eventloop::handle_recv(uint32_t slot, int res, unsigned flags) {
+    conn_slot *s = m_slots.at(slot);
+    uring_conn &c = s->uring;
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        c.recv_armed = false;
+    }
+    if (res > 0) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        char *data = m_ring->get_buf(bid);
+        if (c.closing) {
+            // 已经要关闭，丢弃
+        } else if ((c.busy && !s->user.upstream_reading()) || !c.backlog.empty()) {
+            // 请求处理期间不能改动连接，或者前面还有暂存的数据，先暂存；转发给后端的请求体直接放进读缓冲
+            c.backlog.append(data, res);
+        } else {
+            int n = s->user.feed(data, res);
+            if (n < 0) {
+                m_ring->recycle_buf(bid);
+                s->user.close_conn();
+                return;
+            }
+            // 读缓冲放不下的部分等读缓冲中的数据处理完再放进去
+            c.backlog.append(data + n, res - n);
+        }
+        m_ring->recycle_buf(bid);
+        if (c.backlog.size() > (size_t)http_conn::MAX_READ_BUFFER_SIZE) {
+            throttle_recv(slot);
+        }
+        if (!more && !c.throttled) {
+            arm_recv(slot);
+        }
+        if (!c.busy) {
+            uring_dispatch(slot);
+        } else if (s->user.upstream_reading()) {
+            uring_upstream(slot);
+        }
+    } else if (res == -ENOBUFS || res == -ECANCELED) {
+        // 缓冲区环暂时用完，处理完本轮的完成项后缓冲区会被归还；或者因为暂存的数据太多被取消
+        if (!c.throttled) {
+            arm_recv(slot);
+        }
+    } else {
+        // 对方关闭连接或者出错
+        if (c.busy) {
+            c.closing = true;
+            if (s->user.upstream_reading()) {
+                uring_upstream(slot);
+            }
+        } else {
+            s->user.close_conn();
+        }
+    }
+}
+
+void eventloop::uring_dispatch(uint32_t slot) {
+    conn_slot *s = m_slots.at(slot);
+    s->uring.busy = true;
+    dispatch(&s->user);
+}
+
+// 请求处理完（process()调用了modify()），在事件循环线程中继续
+void eventloop::handle_ready(uint32_t slot) {
+    conn_slot *s = m_slots.at(slot);
+    if (!s->uring.busy) {
+        // 连接在处理期间已经被关闭
+        return;
+    }
+    if (s->user.end_queued()) {
+        // 工作线程处理期间空闲超时已经到期
+        s->user.close_conn();
+        return;
+    }
+    if (s->user.upstream_active()) {
+        uring_upstream(slot);
+    } else if (s->user.has_responses()) {
+        uring_send(slot);
+    } else {
+        uring_idle(slot);
+    }
+}
+
+// 没有要发送的响应了，处理暂存的数据，读缓冲放不下的部分下一轮再放
+void eventloop::uring_idle(uint32_t slot) {
+    conn_slot *s = m_slots.at(slot);
+    uring_conn &c = s->uring;
+    c.busy = false;
+    if (!c.backlog.empty()) {
+        int n = s->user.feed(c.backlog.data(), c.backlog.size());
+        if (n < 0) {
+            s->user.close_conn();
+            return;
+        }
+        c.backlog.erase(0, n);
+        if (c.backlog.empty() && c.throttled) {
+            // 取消还没有完成时，由它的完成项重新开始接收
+            c.throttled = false;
+            if (!c.recv_armed) {
+                arm_recv(slot);
+            }
+        }
+        uring_dispatch(slot);
+    } else if (c.closing) {
+        s->user.close_conn();
+    }
+}
+
+// 发送排队的响应：内存中的数据用一个sendmsg发送；用文件发送的响应体用链接在一起的两个splice，
+// 文件 -> 管道 -> socket，第一个splice读到的字节数不足时内核取消第二个；
+// 反向代理已经splice到管道中的响应体用一个splice从管道发送
+void eventloop::uring_send(uint32_t slot) {
+    conn_slot *s = m_slots.at(slot);
+    uring_conn &c = s->uring;
+    http_conn &user = s->user;
+
+    if (c.pipe_bytes > 0) {
+        // 上次留在管道中的数据
+        io_uring_sqe *sqe = m_ring->get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = c.pipe[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->fd = user.get_sockfd();
+        sqe->off = (uint64_t)-1;
+        sqe->len = c.pipe_bytes;
+        sqe->user_data = user_data(OP_SPLICE_OUT, slot);
+        c.inflight = 1;
+        return;
+    }
+
+    int file_fd;
+    size_t len;
+    if (user.pending_pipe(file_fd, len)) {
+        // 反向代理的响应体已经在管道中，直接转到socket
+        io_uring_sqe *sqe = m_ring->get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = file_fd;
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->fd = user.get_sockfd();
+        sqe->off = (uint64_t)-1;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = user_data(OP_SPLICE_PIPE, slot);
+        c.inflight = 1;
+        return;
+    }
+    if (user.pending_file(file_fd, c.file_offset, len)) {
+        if (c.pipe[0] == -1) {
+            if (pipe2(c.pipe, O_CLOEXEC) != 0) {
+                c.pipe[0] = c.pipe[1] = -1;
+                user.close_conn();
+                return;
+            }
+            c.pipe_size = fcntl(c.pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+            if (c.pipe_size <= 0) {
+                c.pipe_size = fcntl(c.pipe[1], F_GETPIPE_SZ);
+            }
+        }
+        unsigned chunk = len < (size_t)c.pipe_size ? len : c.pipe_size;
+
+        io_uring_sqe *sqe = m_ring->get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = file_fd;
+        sqe->splice_off_in = *c.file_offset;
+        sqe->fd = c.pipe[1];
+        sqe->off = (uint64_t)-1;
+        sqe->len = chunk;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = user_data(OP_SPLICE_IN, slot);
+
+        sqe = m_ring->get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = c.pipe[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->fd = user.get_sockfd();
+        sqe->off = (uint64_t)-1;
+        sqe->len = chunk;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = user_data(OP_SPLICE_OUT, slot);
+        c.inflight = 2;
+        return;
+    }
+
+    int flags = user.prepare_send(c.msg);
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = user.get_sockfd();
+    sqe->addr = (unsigned long)&c.msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags | MSG_NOSIGNAL;
+    sqe->user_data = user_data(OP_SEND, slot);
+    c.inflight = 1;
+}
+
+void eventloop::handle_sent(uint32_t slot, int op, int res) {
+    conn_slot *s = m_slots.at(slot);
+    uring_conn &c = s->uring;
+    http_conn &user = s->user;
+    c.inflight--;
+
+    if (op == OP_SPLICE_IN) {
+        if (res > 0) {
+            *c.file_offset += res;
+            c.pipe_bytes += res;
+        } else {
+            // 文件被截断或者读取出错
+            c.error = true;
+        }
+    } else if (res > 0) {
+        if (op == OP_SPLICE_OUT) {
+            c.pipe_bytes -= res;
+        }
+        user.sent(res);
+    } else if (res != -ECANCELED) {
+        // 对方关闭连接等错误；-ECANCELED表示前一个splice读到的字节数不足，剩下的在管道中
+        c.error = true;
+    }
+
+    if (c.inflight > 0) {
+        return;
+    }
+    if (c.error) {
+        user.close_conn();
+    } else if (user.upstream_active()) {
+        uring_upstream(slot);
+    } else if (user.has_responses() || c.pipe_bytes > 0) {
+        uring_send(slot);
+    } else {
+        uring_finish(slot);
+    }
+}
+
+void eventloop::uring_finish(uint32_t slot) {
+    http_conn &user = m_slots.at(slot)->user;
+    if (!user.finish_write()) {
+        user.close_conn();
+    } else if (user.has_buffered_requests()) {
+        // 流水线中还有已经读入但没有处理的请求
+        dispatch(&user);
+    } else {
+        uring_idle(slot);
+    }
+}
+
+// 转发给后端的请求期间busy一直为true：收到的请求体直接放进读缓冲（放不下的暂存），
+// 由连接上的完成项和连接池的唤醒推进，有发送操作在进行时等它完成
+void eventloop::uring_upstream(uint32_t slot) {
+    conn_slot *s = m_slots.at(slot);
+    uring_conn &c = s->uring;
+    http_conn &user = s->user;
+    if (!c.busy || c.inflight > 0 || !user.upstream_active()) {
+        return;
+    }
+    while (true) {
+        switch (user.upstream_step()) {
+            case http_conn::UP_READ: {
+                if (c.backlog.empty()) {
+                    if (c.closing) {
+                        // 请求体没有收完对方就关闭了连接
+                        user.close_conn();
+                    } else if (c.throttled) {
+                        c.throttled = false;
+                        if (!c.recv_armed) {
+                            arm_recv(slot);
+                        }
+                    }
+                    return;
+                }
+                int n = user.feed(c.backlog.data(), c.backlog.size());
+                if (n <= 0) {
+                    user.close_conn();
+                    return;
+                }
+                c.backlog.erase(0, n);
+                break;
+            } case http_conn::UP_WRITE: {
+                if (user.has_responses()) {
+                    uring_send(slot);
+                } else {
+                    uring_finish(slot);
+                }
+                return;
+            } case http_conn::UP_WAIT: {
+                return;
+            } case http_conn::UP_CLOSE: {
+                user.close_conn();
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "threadpool.h"
+#include "util_timer.h"
+#include "mpmc_queue.h"
+#include "uring.h"
+#include "slab_pool.h"
+#include "http_conn.h"
+#include "upstream.h"
+
+// 事件循环（Reactor）
+// 每个事件循环拥有自己的监听socket（SO_REUSEPORT）、epoll对象、时间轮，以及由它accept的所有连接，
+// 连接的读写和定时器只会在所属的事件循环线程中被操作。
+// 连接对象在accept时从事件循环自己的slab池中借出，关闭时归还，epoll中注册的是连接对象的指针，不按fd索引，
+// 所以fd的大小不受限制，空闲时也不需要为每个可能的fd预先构造连接对象。
+// 配置了tls_port时每个事件循环还有一个TLS端口的监听socket，从它accept的连接先在连接的状态机中完成TLS握手。
+// 有两种后端：epoll（默认），以及io_uring（多发accept、使用缓冲区环的多发recv、用链接的splice发送文件），
+// io_uring不可用时退回epoll。
+// 配置了FastCGI后端或者反向代理时，每个事件循环有自己的后端连接池，后端连接和客户端连接在同一个事件循环中处理。
+// 平滑升级时监听socket由旧进程交来，旧进程的事件循环随后进入排空状态：不再accept，
+// 已有的连接在下一个响应后关闭（Connection: close），连接都关闭或者到期限时事件循环结束
+class eventloop {
+public:
+    static const int URING_ENTRIES = 1024; // io_uring提交队列的大小
+    static const int URING_BUF_NUM = 1024; // 缓冲区环中缓冲区的数量
+    static const int URING_BUF_SIZE = 2048; // 缓冲区环中每个缓冲区的大小
+    static const int URING_PIPE_SIZE = 256 * 1024; // splice发送文件时使用的管道的大小
+    static const int DEFAULT_BACKLOG = 1024; // 监听队列的默认长度，实际上限还受net.core.somaxconn限制
+    static const int ACCEPT_BATCH = 64; // 每次监听socket可读时最多accept的连接数，剩下的下一轮再处理
+
+    static const int MAX_URING_READY = 65536; // 请求处理完等待事件循环继续的连接队列的最大容量
+
+    // max_conns为所有事件循环合计的最大连接数，超过时回复503；
+    // pool为NULL时，请求的解析和响应直接在本事件循环线程中完成；use_uring时尝试使用io_uring后端；
+    // backlog为监听队列的长度；listenfd不为-1时使用这个已经在监听的socket（平滑升级时从旧进程继承），不再创建；
+    // tls_port不为0时再监听TLS端口，tls_listenfd同listenfd；TLS端口只支持epoll后端
+    eventloop(int port, int max_conns, threadpool<http_conn> *pool = NULL, bool use_uring = false,
+              int backlog = DEFAULT_BACKLOG, int listenfd = -1, int tls_port = 0, int tls_listenfd = -1);
+    ~eventloop();
+
+    void loop(); // 在当前线程中运行事件循环，直到stop()
+    bool start(); // 创建一个新线程运行事件循环
+    void stop(); // 结束事件循环，可以在任意线程中调用
+    void join(); // 等待start()创建的线程结束
+
+    // 由该事件循环处理信号管道，on_upgrade为收到SIGUSR2时调用的函数，在事件循环线程中调用
+    void watch_signals(int sigfd, void (*on_upgrade)() = NULL);
+    // 停止accept并排空已有的连接，deadline_ns（单调时钟）之后不再等待；可以在任意线程中调用
+    void drain(uint64_t deadline_ns);
+    bool draining() const { return m_drain; }
+
+    timer_wheel *get_timer_wheel() { return m_timer_wheel; }
+    bool uses_uring() const { return m_ring != NULL; }
+    int get_listenfd() const { return m_listenfd; } // 排空开始后为-1
+    int get_tls_listenfd() const { return m_tls_listenfd; } // 没有TLS端口或者排空开始后为-1
+
+    // 由连接调用：注册新连接；注销并关闭连接；请求处理完之后等待读（EPOLLIN）或者写（EPOLLOUT）
+    // modify()可以在工作线程中调用，其余只能在事件循环线程中调用；remove_conn()之后连接对象被回收
+    void add_conn(http_conn *user);
+    void remove_conn(http_conn *user, int sockfd);
+    void modify(http_conn *user, int ev);
+
+    // 由后端连接池调用，只在事件循环线程中：监听pool中编号为index的后端连接上的事件（EPOLLIN、EPOLLOUT，水平触发），
+    // old_events为-1时注册，events为-1时注销；事件发生时调用连接池的handle_event()
+    void watch_upstream(upstream_pool *pool, int index, uint32_t gen, int fd, int old_events, int events);
+    // 请求转发给后端的连接有了进展（后端的响应到达、请求体有了发送空间等），继续处理它
+    void wake_upstream(http_conn *user);
+    upstream_pool *get_upstream(UPSTREAM_KIND kind) { return m_upstreams[kind]; } // 没有配置时为NULL
+
+private:
+    // io_uring操作的种类，和连接的编号、代数一起编码在user_data中
+    enum URING_OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_TIMER, OP_WAKEUP, OP_SIGNAL, OP_CANCEL,
+                    OP_UPSTREAM_IN, OP_UPSTREAM_OUT, OP_SPLICE_PIPE };
+
+    // io_uring后端中每个连接的状态
+    struct uring_conn {
+        uring_conn() : gen(0), busy(false), closing(false), error(false), recv_armed(false), throttled(false),
+                       inflight(0), pipe_size(0), pipe_bytes(0), file_offset(NULL) {
+            pipe[0] = pipe[1] = -1;
+        }
+
+        uint32_t gen; // 代数，每次注册、注销加1，用来丢弃已关闭连接的完成项
+        bool busy; // 请求正在处理或者响应正在发送，这时收到的数据先放进backlog
+        bool closing; // 对方已经关闭连接，空闲时关闭连接
+        bool error; // 发送出错，发送操作都完成之后关闭
+        bool recv_armed; // 多发recv还在进行
+        bool throttled; // 暂存的数据太多，已经取消recv，暂存的数据都放进读缓冲之后再继续接收
+        int inflight; // 正在进行的发送操作数
+        std::string backlog; // busy时收到的数据，或者读缓冲放不下的数据
+        struct msghdr msg; // 正在进行的sendmsg
+        int pipe[2]; // splice发送文件用的管道，-1表示还没有创建
+        int pipe_size;
+        size_t pipe_bytes; // 管道中还没有发送的字节数
+        off_t * file_offset; // 正在发送的文件的读取位置
+    };
+
+    // 连接表中的一项，编号即在slab池中的编号
+    struct conn_slot {
+        http_conn user;
+        uring_conn uring; // 只在io_uring后端中使用
+    };
+
+    int m_listenfd; // 监听socket
+    int m_tls_listenfd; // TLS端口的监听socket，-1表示没有
+    int m_epollfd; // epoll对象
+    int m_wakeupfd; // eventfd，用于从其他线程唤醒epoll_wait
+    int m_sigfd; // 信号管道读端，-1表示不处理信号
+    slab_pool<conn_slot> m_slots; // 本事件循环的连接
+    int m_max_conns;
+    threadpool<http_conn> *m_pool; // 线程池，可以为NULL
+    timer_wheel *m_timer_wheel; // 时间轮
+    pthread_t m_thread;
+    bool m_started;
+    std::atomic<bool> m_stop;
+    pthread_t m_loop_thread; // 运行loop()的线程
+    bool m_accept_paused; // 文件描述符用完（EMFILE），暂停accept，有连接关闭或者定时器到期时恢复
+    void (*m_on_upgrade)(); // 收到SIGUSR2时调用，可以为NULL
+    std::atomic<bool> m_drain; // 排空已有的连接
+    std::atomic<uint64_t> m_drain_deadline;
+
+    uring *m_ring; // io_uring，NULL表示使用epoll
+    mpmc_queue<uint32_t> *m_ready; // 请求处理完的连接的编号，可以由工作线程放入
+    upstream_pool *m_upstreams[UPSTREAM_KINDS]; // 各种后端的连接池，NULL表示没有配置
+
+    int create_listener(int port, int backlog); // 返回监听socket，失败时抛出异常
+    void close_listeners();
+    void epoll_loop();
+    void uring_loop();
+    void new_conn(int connfd, const sockaddr_in &addr, bool tls = false);
+    void reject_conn(int connfd); // 服务器过载，回复503之后关闭
+    void handle_accept(bool tls);
+    void pause_accept();
+    void resume_accept();
+    void set_accept_events(int events); // epoll后端：修改所有监听socket监听的事件
+    void check_drain(); // 每轮事件处理完之后调用
+    void handle_signal();
+    void reload_config(); // SIGHUP：重新加载配置文件，应用可以在运行中改变的配置
+    void handle_read(http_conn *user);
+    void handle_write(http_conn *user);
+    bool handle_handshake(http_conn *user);
+    void write_response(http_conn *user);
+    void handle_upstream(http_conn *user);
+    void dispatch(http_conn *user);
+
+    // io_uring后端
+    void arm_accept();
+    void arm_poll(int fd, int op);
+    void arm_recv(uint32_t slot);
+    void throttle_recv(uint32_t slot); // 暂存的数据太多时停止接收
+    void handle_completion(io_uring_cqe *cqe, bool &timeout);
+    void handle_recv(uint32_t slot, int res, unsigned flags);
+    void handle_sent(uint32_t slot, int op, int res);
+    void handle_ready(uint32_t slot);
+    void uring_dispatch(uint32_t slot);
+    void uring_send(uint32_t slot);
+    void uring_idle(uint32_t slot);
+    void uring_finish(uint32_t slot); // 响应都发送完之后
+    void uring_upstream(uint32_t slot);
+    void arm_upstream(upstream_pool *pool, int index, uint32_t gen, int fd, int op);
+    upstream_pool *find_upstream(const void *ptr, int &index); // epoll中注册的指针对应的后端连接
+    uint64_t user_data(int op, uint32_t slot);
+
+    static void *worker(void *arg);
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "fastcgi.h"
+#include <string.h>
+
+static void append_header(std::string & out, int type, int id, int len, int padding) {
+    char h[FCGI_HEADER_LEN];
+    h[0] = FCGI_VERSION;
+    h[1] = type;
+    h[2] = (id >> 8) & 0xff;
+    h[3] = id & 0xff;
+    h[4] = (len >> 8) & 0xff;
+    h[5] = len & 0xff;
+    h[6] = padding;
+    h[7] = 0;
+    out.append(h, FCGI_HEADER_LEN);
+}
+
+// 内容填充到8字节对齐
+void fcgi_append_record(std::string & out, int type, int id, const char * data, size_t len) {
+    do {
+        int n = len > (size_t)FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+        int padding = (8 - n % 8) % 8;
+        append_header(out, type, id, n, padding);
+        out.append(data, n);
+        out.append(padding, '\0');
+        data += n;
+        len -= n;
+    } while (len > 0);
+}
+
+void fcgi_append_begin_request(std::string & out, int id, bool keep_conn) {
+    char body[8];
+    memset(body, 0, sizeof(body));
+    body[1] = FCGI_RESPONDER;
+    body[2] = keep_conn ? FCGI_KEEP_CONN : 0;
+    fcgi_append_record(out, FCGI_BEGIN_REQUEST, id, body, sizeof(body));
+}
+
+// 长度小于128时用1字节，否则用4字节并置最高位
+static void append_length(std::string & out, size_t len) {
+    if (len < 128) {
+        out += (char)len;
+        return;
+    }
+    out += (char)(((len >> 24) & 0x7f) | 0x80);
+    out += (char)((len >> 16) & 0xff);
+    out += (char)((len >> 8) & 0xff);
+    out += (char)(len & 0xff);
+}
+
+void fcgi_append_param(std::string & out, const char * name, size_t name_len, const char * value, size_t value_len) {
+    append_length(out, name_len);
+    append_length(out, value_len);
+    out.append(name, name_len);
+    out.append(value, value_len);
+}
+
+void fcgi_append_param(std::string & out, const char * name, const char * value) {
+    fcgi_append_param(out, name, strlen(name), value, strlen(value));
+}
+
+int fcgi_parse_record(const char * data, size_t len, fcgi_record & rec) {
+    if (len < (size_t)FCGI_HEADER_LEN) {
+        return 0;
+    }
+    const unsigned char * h = (const unsigned char *) data;
+    if (h[0] != FCGI_VERSION) {
+        return -1;
+    }
+    int content_len = (h[4] << 8) | h[5];
+    size_t total = FCGI_HEADER_LEN + content_len + h[6];
+    if (len < total) {
+        return 0;
+    }
+    rec.type = h[1];
+    rec.id = (h[2] << 8) | h[3];
+    rec.content = data + FCGI_HEADER_LEN;
+    rec.len = content_len;
+    return total;
+}
@@ -0,0 +1,53 @@
+#ifndef FASTCGI_H
+#define FASTCGI_H
+
+#include <stddef.h>
+#include <string>
+
+/*
+    FastCGI协议的记录编码和解码。
+    每条记录为8字节的头（版本、类型、请求编号、内容长度、填充长度）加上内容和填充，
+    同一个连接上可以交错多个请求的记录，用请求编号区分。
+*/
+static const int FCGI_VERSION = 1;
+static const int FCGI_HEADER_LEN = 8;
+static const int FCGI_MAX_CONTENT = 65535; // 一条记录最多的内容字节数
+
+// 记录类型
+enum FCGI_TYPE {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+    FCGI_DATA = 8,
+    FCGI_GET_VALUES = 9,
+    FCGI_GET_VALUES_RESULT = 10,
+    FCGI_UNKNOWN_TYPE = 11
+};
+
+static const int FCGI_RESPONDER = 1; // BEGIN_REQUEST中的角色
+static const int FCGI_KEEP_CONN = 1; // BEGIN_REQUEST中的标志：请求结束后不关闭连接
+static const int FCGI_REQUEST_COMPLETE = 0; // END_REQUEST中的协议状态，其余为拒绝请求
+
+// 解码出来的一条记录，content指向输入缓冲
+struct fcgi_record {
+    int type;
+    int id;
+    const char * content;
+    int len;
+};
+
+// 追加记录，超过FCGI_MAX_CONTENT时拆成多条；len为0时追加一条空记录（流结束）
+void fcgi_append_record(std::string & out, int type, int id, const char * data, size_t len);
+void fcgi_append_begin_request(std::string & out, int id, bool keep_conn);
+// 追加一个名-值对到PARAMS流的内容中
+void fcgi_append_param(std::string & out, const char * name, size_t name_len, const char * value, size_t value_len);
+void fcgi_append_param(std::string & out, const char * name, const char * value);
+
+// 从[data, data + len)解码一条完整的记录，返回用掉的字节数，数据不够一条记录时返回0，版本不对时返回-1
+int fcgi_parse_record(const char * data, size_t len, fcgi_record & rec);
+
+#endif
@@ -0,0 +1,542 @@
+#include "fcgi_pool.h"
+#include "fastcgi.h"
+#include "eventloop.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <exception>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+fcgi_pool::fcgi_pool(eventloop * loop, const std::string & address, int max_conns, int multiplex)
+    : upstream_pool(loop, UPSTREAM_FASTCGI), m_multiplex(multiplex), m_conns(max_conns) {
+    if (!parse_address(address, m_addr, m_addr_len) || max_conns < 1 || multiplex < 1) {
+        throw std::exception();
+    }
+    for (size_t i = 0; i < m_conns.size(); i++) {
+        m_conns[i].requests.assign(multiplex, (upstream_request *) NULL);
+    }
+}
+
+// 事件循环已经结束，连接对象不会再使用请求
+fcgi_pool::~fcgi_pool() {
+    for (size_t i = 0; i < m_conns.size(); i++) {
+        conn & c = m_conns[i];
+        if (c.fd != -1) close(c.fd);
+        for (int j = 0; j < m_multiplex; j++) {
+            delete c.requests[j];
+        }
+    }
+    for (size_t i = 0; i < m_waiting.size(); i++) {
+        delete m_waiting[i];
+    }
+}
+
+int fcgi_pool::index_of(const void * ptr) const {
+    if (m_conns.empty() || ptr < (const void *) &m_conns[0] || ptr > (const void *) &m_conns.back()) {
+        return -1;
+    }
+    return (const conn *) ptr - &m_conns[0];
+}
+
+bool fcgi_pool::current(int index, uint32_t gen) const {
+    return index >= 0 && (size_t)index < m_conns.size() && m_conns[index].fd != -1
+        && (m_conns[index].gen & 0xffffff) == gen;
+}
+
+void fcgi_pool::submit(upstream_request * req) {
+    bool error;
+    int index = acquire(error);
+    if (error) {
+        req->failed = true;
+    } else if (index == -1) {
+        m_waiting.push_back(req);
+    } else {
+        start(index, req);
+    }
+}
+
+// 请求尽量集中在已经建立的连接上
+int fcgi_pool::acquire(bool & error) {
+    error = false;
+    int unused = -1;
+    for (size_t i = 0; i < m_conns.size(); i++) {
+        conn & c = m_conns[i];
+        if (c.fd == -1) {
+            if (unused == -1) unused = i;
+        } else if (c.active < m_multiplex) {
+            return i;
+        }
+    }
+    if (unused == -1) {
+        return -1;
+    }
+    if (!open_conn(unused)) {
+        error = true;
+        return -1;
+    }
+    return unused;
+}
+
+bool fcgi_pool::open_conn(int index) {
+    conn & c = m_conns[index];
+    int fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        printf("fastcgi: socket failure: %s\n", strerror(errno));
+        return false;
+    }
+    if (m_addr.ss_family == AF_INET) {
+        // 记录都是一次写完的，不需要Nagle算法合并
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    // Unix socket一般马上连接成功，TCP等可写时再检查结果
+    bool connected = ::connect(fd, (struct sockaddr *) &m_addr, m_addr_len) == 0;
+    if (!connected && errno != EINPROGRESS) {
+        printf("fastcgi: connect failure: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    c.fd = fd;
+    c.gen++;
+    c.connected = connected;
+    c.want_out = false;
+    c.paused = false;
+    c.resume = false;
+    c.events = -1;
+    c.active = 0;
+    c.served = 0;
+    update_events(index);
+    return true;
+}
+
+void fcgi_pool::close_conn(int index) {
+    conn & c = m_conns[index];
+    m_loop->watch_upstream(this, index, c.gen, c.fd, c.events, -1);
+    close(c.fd);
+    c.fd = -1;
+    c.events = -1;
+    std::string().swap(c.out);
+    c.out_pos = 0;
+    std::string().swap(c.in);
+}
+
+// 复用的连接在请求有输出、发送请求体之前断开时重试一次，其余的请求失败
+void fcgi_pool::fail_conn(int index) {
+    conn & c = m_conns[index];
+    if (c.active > 0) {
+        printf("fastcgi: backend connection closed with %d active requests\n", c.active);
+    }
+    bool reused = c.served > 0;
+    close_conn(index);
+    for (int i = 0; i < m_multiplex; i++) {
+        upstream_request * req = c.requests[i];
+        if (!req) continue;
+        c.requests[i] = NULL;
+        req->conn = -1;
+        if (!req->owner) {
+            discard(req);
+        } else if (reused && !req->got_output && req->body_sent == 0 && !req->retried) {
+            req->retried = true;
+            m_waiting.push_front(req);
+        } else {
+            req->failed = true;
+            notify(req);
+        }
+    }
+    c.active = 0;
+    start_waiting();
+}
+
+// BEGIN_REQUEST和PARAMS流一起放入发送缓冲；重试的请求如果请求体已经结束（没有请求体），补上STDIN的结束
+void fcgi_pool::start(int index, upstream_request * req) {
+    conn & c = m_conns[index];
+    int id = 1;
+    while (c.requests[id - 1]) id++;
+    c.requests[id - 1] = req;
+    c.active++;
+    req->conn = index;
+    req->id = id;
+    fcgi_append_begin_request(c.out, id, true);
+    if (!req->head.empty()) {
+        fcgi_append_record(c.out, FCGI_PARAMS, id, req->head.data(), req->head.size());
+    }
+    fcgi_append_record(c.out, FCGI_PARAMS, id, "", 0);
+    if (req->body_done) {
+        fcgi_append_record(c.out, FCGI_STDIN, id, "", 0);
+    }
+    m_pending = true;
+}
+
+// 有请求结束或者连接关闭之后，按顺序开始排队的请求；建立连接失败时排在最前面的请求失败
+void fcgi_pool::start_waiting() {
+    while (!m_waiting.empty()) {
+        bool error;
+        int index = acquire(error);
+        if (index == -1 && !error) {
+            return;
+        }
+        upstream_request * req = m_waiting.front();
+        m_waiting.pop_front();
+        if (error) {
+            req->failed = true;
+        } else {
+            start(index, req);
+        }
+        notify(req);
+    }
+}
+
+int fcgi_pool::body_room(const upstream_request * req) const {
+    if (req->conn == -1) {
+        return 0;
+    }
+    const conn & c = m_conns[req->conn];
+    size_t pending = c.out.size() - c.out_pos;
+    return pending < (size_t)MAX_PENDING_OUTPUT ? MAX_PENDING_OUTPUT - pending : 0;
+}
+
+void fcgi_pool::send_body(upstream_request * req, const char * data, int len) {
+    if (len == 0) {
+        req->body_done = true;
+    }
+    if (req->conn == -1) {
+        // 请求已经结束，后端不再需要请求体
+        return;
+    }
+    fcgi_append_record(m_conns[req->conn].out, FCGI_STDIN, req->id, len ? data : "", len);
+    req->body_sent += len;
+    m_pending = true;
+}
+
+void fcgi_pool::consumed(upstream_request * req) {
+    if (req->conn != -1 && req->out.size() < (size_t)MAX_RESPONSE_BUFFER / 2) {
+        pause(req->conn, false);
+    }
+}
+
+// 连接上只有这一个请求时直接关闭后端连接，比等后端处理完ABORT_REQUEST更可靠；
+// 复用的连接上还有别的请求时只通知后端放弃这一个
+void fcgi_pool::release(upstream_request * req) {
+    req->owner = NULL;
+    std::string().swap(req->out);
+    if (req->conn == -1) {
+        std::deque<upstream_request *>::iterator it = std::find(m_waiting.begin(), m_waiting.end(), req);
+        if (it != m_waiting.end()) {
+            m_waiting.erase(it);
+        }
+        discard(req);
+        return;
+    }
+    int index = req->conn;
+    conn & c = m_conns[index];
+    if (c.active == 1) {
+        c.requests[req->id - 1] = NULL;
+        c.active = 0;
+        req->conn = -1;
+        discard(req);
+        close_conn(index);
+        start_waiting();
+        return;
+    }
+    fcgi_append_record(c.out, FCGI_ABORT_REQUEST, req->id, "", 0);
+    pause(index, false);
+    m_pending = true;
+}
+
+void fcgi_pool::update_events(int index) {
+    conn & c = m_conns[index];
+    // 没有暂停读取时可读，发送缓冲满或者正在连接时可写
+    watch_events(index, c.gen, c.fd, !c.paused, c.want_out || !c.connected, c.events);
+}
+
+void fcgi_pool::pause(int index, bool paused) {
+    conn & c = m_conns[index];
+    if (c.fd == -1 || c.paused == paused) {
+        return;
+    }
+    c.paused = paused;
+    if (!paused) {
+        // io_uring的POLL_ADD不会为已经在缓冲中的数据再次通知，先读一次
+        c.resume = true;
+        m_pending = true;
+    }
+    update_events(index);
+}
+
+void fcgi_pool::handle_event(int index, int events, bool out_disarmed) {
+    conn & c = m_conns[index];
+    if (c.fd == -1) {
+        return;
+    }
+    if (out_disarmed && c.events != -1) {
+        c.events &= ~EPOLLOUT;
+    }
+    if (!c.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+            printf("fastcgi: connect failure: %s\n", strerror(error ? error : errno));
+            fail_conn(index);
+            deliver();
+            return;
+        }
+        c.connected = true;
+        events |= EPOLLOUT;
+    }
+    if (events & EPOLLOUT) {
+        c.want_out = false;
+        write_conn(index);
+    }
+    // 出错或者对方关闭时水平触发的事件会一直报告，暂停时也要读完
+    if (c.fd != -1 && (events & (EPOLLERR | EPOLLHUP))) {
+        read_conn(index, true);
+    } else if (c.fd != -1 && !c.paused && (events & EPOLLIN)) {
+        read_conn(index, false);
+    }
+    if (c.fd != -1) {
+        update_events(index);
+    }
+    deliver();
+}
+
+void fcgi_pool::flush() {
+    while (m_pending) {
+        m_pending = false;
+        for (size_t i = 0; i < m_conns.size(); i++) {
+            conn & c = m_conns[i];
+            if (c.fd != -1 && c.resume) {
+                c.resume = false;
+                read_conn(i, false);
+            }
+            // 等待可写的连接由可写事件继续发送
+            if (c.fd != -1 && c.connected && !c.want_out && c.out_pos < c.out.size()) {
+                write_conn(i);
+                if (c.fd != -1) update_events(i);
+            }
+        }
+        deliver();
+    }
+}
+
+// 发送缓冲从满变为有空间时，唤醒在等待的请求体
+void fcgi_pool::write_conn(int index) {
+    conn & c = m_conns[index];
+    bool full = c.out.size() - c.out_pos >= (size_t)MAX_PENDING_OUTPUT;
+    while (c.out_pos < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                c.want_out = true;
+                break;
+            }
+            fail_conn(index);
+            return;
+        }
+        c.out_pos += n;
+    }
+    if (c.out_pos == c.out.size()) {
+        c.out.clear();
+        c.out_pos = 0;
+    } else if (c.out_pos >= (size_t)MAX_PENDING_OUTPUT) {
+        c.out.erase(0, c.out_pos);
+        c.out_pos = 0;
+    }
+    if (full && c.out.size() - c.out_pos < (size_t)MAX_PENDING_OUTPUT) {
+        for (int i = 0; i < m_multiplex; i++) {
+            upstream_request * req = c.requests[i];
+            if (req && !req->body_done) {
+                notify(req);
+            }
+        }
+    }
+}
+
+void fcgi_pool::read_conn(int index, bool drain) {
+    conn & c = m_conns[index];
+    char buf[READ_SIZE];
+    while (drain || !c.paused) {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                fail_conn(index);
+            }
+            return;
+        }
+        if (n == 0) {
+            // 后端关闭连接，空闲的连接直接关闭
+            fail_conn(index);
+            return;
+        }
+        c.in.append(buf, n);
+        if (!parse_records(index)) {
+            printf("fastcgi: bad record from backend\n");
+            fail_conn(index);
+            return;
+        }
+    }
+}
+
+bool fcgi_pool::parse_records(int index) {
+    conn & c = m_conns[index];
+    size_t pos = 0;
+    while (true) {
+        fcgi_record rec;
+        int n = fcgi_parse_record(c.in.data() + pos, c.in.size() - pos, rec);
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        pos += n;
+        // 管理记录（编号0）和已经结束的请求的记录忽略
+        if (rec.id < 1 || rec.id > m_multiplex || !c.requests[rec.id - 1]) {
+            continue;
+        }
+        upstream_request * req = c.requests[rec.id - 1];
+        if (rec.type == FCGI_STDOUT) {
+            if (req->owner && !req->failed && rec.len > 0) {
+                stdout_data(index, req, rec.content, rec.len);
+            }
+        } else if (rec.type == FCGI_STDERR) {
+            int len = rec.len;
+            while (len > 0 && (rec.content[len - 1] == '\n' || rec.content[len - 1] == '\r')) len--;
+            if (len > 0) {
+                printf("fastcgi stderr: %.*s\n", len, rec.content);
+            }
+        } else if (rec.type == FCGI_END_REQUEST) {
+            // appStatus（4字节）之后是protocolStatus
+            int protocol_status = rec.len >= 5 ? (unsigned char) rec.content[4] : FCGI_REQUEST_COMPLETE;
+            end_request(index, req, protocol_status);
+        }
+    }
+    c.in.erase(0, pos);
+    return true;
+}
+
+// CGI响应头：Status给出状态码，只有Location时为302，Content-Length由连接重新生成，
+// 逐跳的头去掉，其余转发给客户端
+static bool parse_cgi_headers(upstream_request * req, const char * p, const char * end) {
+    bool has_status = false;
+    bool has_location = false;
+    while (p < end) {
+        const char * line_end = (const char *) memchr(p, '\n', end - p);
+        if (!line_end) line_end = end;
+        const char * colon = (const char *) memchr(p, ':', line_end - p);
+        if (!colon || colon == p) {
+            return false;
+        }
+        std::string name(p, colon);
+        std::string value = trim_header_value(colon + 1, line_end);
+        p = line_end + 1;
+        if (strcasecmp(name.c_str(), "Status") == 0) {
+            char * rest;
+            long status = strtol(value.c_str(), &rest, 10);
+            if (status < 100 || status > 999) {
+                return false;
+            }
+            req->status = status;
+            req->reason = trim_header_value(rest, value.c_str() + value.size());
+            has_status = true;
+            continue;
+        }
+        if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            char * e;
+            long long length = strtoll(value.c_str(), &e, 10);
+            if (value.empty() || *e || length < 0) {
+                return false;
+            }
+            req->content_length = length;
+            continue;
+        }
+        if (strcasecmp(name.c_str(), "Connection") == 0 || strcasecmp(name.c_str(), "Keep-Alive") == 0
+            || strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+            continue;
+        }
+        if (strcasecmp(name.c_str(), "Location") == 0) {
+            has_location = true;
+        }
+        req->headers += name;
+        req->headers += ": ";
+        req->headers += value;
+        req->headers += "\r\n";
+    }
+    if (!has_status) {
+        req->status = has_location ? 302 : 200;
+        req->reason = has_location ? "Found" : "OK";
+    }
+    return true;
+}
+
+// 响应头以空行结束，之后的都是响应体
+void fcgi_pool::stdout_data(int index, upstream_request * req, const char * data, int len) {
+    req->got_output = true;
+    if (req->header_done) {
+        req->out.append(data, len);
+    } else {
+        req->header_buf.append(data, len);
+        size_t crlf = req->header_buf.find("\r\n\r\n");
+        size_t lf = req->header_buf.find("\n\n");
+        size_t end = crlf < lf ? crlf : lf;
+        if (end == std::string::npos) {
+            if (req->header_buf.size() > (size_t)MAX_CGI_HEADER) {
+                printf("fastcgi: response header too large\n");
+                req->failed = true;
+                notify(req);
+            }
+            return;
+        }
+        size_t body = end + (end == crlf ? 4 : 2);
+        if (end > (size_t)MAX_CGI_HEADER ||
+            !parse_cgi_headers(req, req->header_buf.data(), req->header_buf.data() + end)) {
+            printf("fastcgi: bad response header\n");
+            req->failed = true;
+            notify(req);
+            return;
+        }
+        req->out.assign(req->header_buf, body, std::string::npos);
+        std::string().swap(req->header_buf);
+        std::string().swap(req->head);
+        req->header_done = true;
+    }
+    notify(req);
+    if (req->out.size() >= (size_t)MAX_RESPONSE_BUFFER) {
+        pause(index, true);
+    }
+}
+
+// 后端拒绝请求（如不支持多路复用时的FCGI_CANT_MPX_CONN）或者没有完整的响应头时响应失败
+void fcgi_pool::end_request(int index, upstream_request * req, int protocol_status) {
+    conn & c = m_conns[index];
+    c.requests[req->id - 1] = NULL;
+    c.active--;
+    c.served++;
+    req->conn = -1;
+    if (!req->owner) {
+        discard(req);
+    } else {
+        if (protocol_status != FCGI_REQUEST_COMPLETE) {
+            printf("fastcgi: request rejected by backend, protocol status %d\n", protocol_status);
+            req->failed = true;
+        } else if (!req->header_done) {
+            req->failed = true;
+        }
+        req->ended = true;
+        std::string().swap(req->head);
+        notify(req);
+    }
+    // 这个请求缓存的响应体不会再增加
+    pause(index, false);
+    start_waiting();
+}
@@ -0,0 +1,86 @@
+#ifndef FCGIPOOL_H
+#define FCGIPOOL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/socket.h>
+#include "upstream.h"
+
+/*
+    到一个FastCGI后端的连接池，每个事件循环一个，只在事件循环线程中使用。
+    后端连接是非阻塞的长连接（FCGI_KEEP_CONN），请求结束后留给下一个请求；
+    multiplex大于1时一个后端连接上同时进行多个请求（需要后端支持FCGI_MPXS_CONNS）。
+    连接都忙、数量也到上限时请求排队，有请求结束时再开始。
+    请求体和响应体都有缓存的上限：后端连接待发送的数据超过MAX_PENDING_OUTPUT时不再接受请求体，
+    一个请求缓存的响应体超过MAX_RESPONSE_BUFFER时暂停读这个后端连接，所以内存占用和请求、响应的大小无关。
+    复用的长连接在请求还没有收到输出、也没有发送请求体时断开（后端关闭了空闲的连接），换一个连接重试一次。
+*/
+class fcgi_pool : public upstream_pool {
+public:
+    static const int MAX_PENDING_OUTPUT = 64 * 1024; // 每个后端连接待发送数据的上限
+    static const int MAX_RESPONSE_BUFFER = 64 * 1024; // 每个请求缓存的响应体的上限
+    static const int MAX_CGI_HEADER = 8192; // CGI响应头的最大字节数，超过时回复502
+    static const int READ_SIZE = 16 * 1024; // 每次从后端连接读取的字节数
+
+    // address为"unix:/path"或者"ip:port"，max_conns为最多的后端连接数，multiplex为每个连接上同时进行的最多请求数；
+    // 地址不对时抛出异常
+    fcgi_pool(eventloop * loop, const std::string & address, int max_conns, int multiplex);
+    ~fcgi_pool();
+
+    void submit(upstream_request * req);
+    int body_room(const upstream_request * req) const;
+    void send_body(upstream_request * req, const char * data, int len);
+    void consumed(upstream_request * req);
+    // 请求还没有结束时通知后端放弃
+    void release(upstream_request * req);
+
+    int index_of(const void * ptr) const;
+    void * key(int index) { return &m_conns[index]; }
+    bool current(int index, uint32_t gen) const;
+    int fd(int index) const { return m_conns[index].fd; }
+    void handle_event(int index, int events, bool out_disarmed = false);
+    void flush();
+
+private:
+    struct conn {
+        conn() : fd(-1), gen(0), connected(false), want_out(false), paused(false), resume(false),
+                 events(-1), active(0), served(0), out_pos(0) {}
+        int fd; // -1表示没有使用
+        uint32_t gen; // 代数，每次建立连接加1，用来丢弃已经关闭的连接的事件
+        bool connected; // 非阻塞的connect已经完成
+        bool want_out; // 发送缓冲满，等待可写
+        bool paused; // 有请求缓存的响应体太多，暂停读取
+        bool resume; // 恢复读取，在flush()中先读一次
+        int events; // 事件循环正在监听的事件，-1表示没有注册
+        int active; // 进行中的请求数，包括已经放弃、等待END_REQUEST的
+        int served; // 在这个连接上结束的请求数，大于0说明是复用的长连接
+        std::string out; // 待发送的记录，从out_pos开始
+        size_t out_pos;
+        std::string in; // 收到的还不够一条记录的数据
+        std::vector<upstream_request *> requests; // 下标为请求编号减1
+    };
+
+    sockaddr_storage m_addr;
+    socklen_t m_addr_len;
+    int m_multiplex;
+    std::vector<conn> m_conns; // 大小固定，epoll中注册的是其中元素的地址
+    std::deque<upstream_request *> m_waiting; // 等待空闲连接的请求
+
+    int acquire(bool & error); // 有空闲请求编号的连接，必要时新建；都忙时返回-1，新建失败时error为true
+    bool open_conn(int index);
+    void close_conn(int index);
+    void fail_conn(int index); // 后端连接出错或者被关闭
+    void start(int index, upstream_request * req);
+    void start_waiting();
+    void update_events(int index);
+    void write_conn(int index);
+    void read_conn(int index, bool drain); // drain时不管是否暂停，读到EAGAIN或者出错
+    bool parse_records(int index);
+    void stdout_data(int index, upstream_request * req, const char * data, int len);
+    void end_request(int index, upstream_request * req, int protocol_status);
+    void pause(int index, bool paused);
+};
+
+#endif
@@ -0,0 +1,402 @@
+#include "file_cache.h"
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+// 会使目录中的缓存项失效的事件
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF)
+
+file_cache::file_cache(size_t max_bytes, size_t max_entry_size)
+    : m_max_bytes(max_bytes), m_max_entry_size(max_entry_size < max_bytes ? max_entry_size : max_bytes), m_bytes(0), m_head(NULL), m_tail(NULL),
+      m_inotifyfd(-1), m_stopfd(-1), m_started(false), m_generation(0),
+      m_hits(0), m_misses(0), m_evictions(0), m_invalidations(0),
+      m_gzip_compressions(0), m_gzip_compress_us(0), m_gzip_bytes_in(0), m_gzip_bytes_out(0) {
+    m_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    m_stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_inotifyfd == -1 || m_stopfd == -1) {
+        if (m_inotifyfd != -1) close(m_inotifyfd);
+        if (m_stopfd != -1) close(m_stopfd);
+        throw std::exception();
+    }
+}
+
+file_cache::~file_cache() {
+    if (m_started) {
+        uint64_t one = 1;
+        write(m_stopfd, &one, sizeof(one));
+        pthread_join(m_thread, NULL);
+    }
+    while (m_head) {
+        remove_entry(m_head);
+    }
+    close(m_inotifyfd);
+    close(m_stopfd);
+}
+
+bool file_cache::start() {
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void * file_cache::worker(void * arg) {
+    file_cache * cache = (file_cache *) arg;
+    struct pollfd fds[2];
+    fds[0].fd = cache->m_inotifyfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = cache->m_stopfd;
+    fds[1].events = POLLIN;
+    while (true) {
+        int ret = poll(fds, 2, -1);
+        if (ret < 0 && errno != EINTR) break;
+        if (fds[1].revents & POLLIN) break;
+        if (fds[0].revents & POLLIN) {
+            cache->handle_events();
+        }
+    }
+    return cache;
+}
+
+cache_entry * file_cache::lookup(const char * path) {
+    m_lock.lock();
+    cache_entry * e = find_entry(m_entries, path);
+    m_lock.unlock();
+    if (e) m_hits++;
+    else m_misses++;
+    return e;
+}
+
+cache_entry * file_cache::lookup_gzip(const char * path) {
+    m_lock.lock();
+    cache_entry * e = find_entry(m_gzip_entries, path);
+    m_lock.unlock();
+    return e;
+}
+
+cache_entry * file_cache::load(const char * path) {
+    std::string key(path);
+    std::string dir = key.substr(0, key.rfind('/'));
+
+    // 先监视目录再读文件，读文件期间发生的修改会使m_generation变化，这时读到的内容不放入缓存
+    m_lock.lock();
+    bool watched = watch_dir(dir);
+    uint64_t generation = m_generation;
+    m_lock.unlock();
+    if (!watched) return NULL;
+
+    cache_entry * e = read_file(path, path);
+    if (!e) return NULL;
+    insert_entry(e, generation);
+    return e;
+}
+
+cache_entry * file_cache::load_gzip(const char * path, cache_entry * identity) {
+    // path.gz和path在同一个目录中，调用者已经通过load()或lookup()得到了identity，目录已经被监视
+    m_lock.lock();
+    uint64_t generation = m_generation;
+    m_lock.unlock();
+
+    // 优先使用预先压缩好的.gz兄弟文件
+    std::string sibling = std::string(path) + ".gz";
+    cache_entry * e = read_file(sibling.c_str(), path);
+    if (e && !(e->st.st_mode & S_IROTH)) {
+        release(e);
+        e = NULL;
+    }
+    if (e) {
+        e->gzip = true;
+        insert_entry(e, generation);
+        return e;
+    }
+
+    e = new cache_entry;
+    e->path = path;
+    e->data = NULL;
+    e->size = 0;
+    e->st = identity->st;
+    e->gzip = true;
+    e->refcount = 1;
+    e->prev = e->next = NULL;
+
+    if (identity->size >= GZIP_MIN_LENGTH) {
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // windowBits加16表示输出gzip格式
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            size_t bound = deflateBound(&zs, identity->size);
+            char * out = (char *)malloc(bound);
+            zs.next_in = (Bytef *)identity->data;
+            zs.avail_in = identity->size;
+            zs.next_out = (Bytef *)out;
+            zs.avail_out = bound;
+            if (out && deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < identity->size) {
+                e->data = out;
+                e->size = zs.total_out;
+            } else {
+                // 压缩之后没有变小，记住不需要压缩
+                free(out);
+            }
+            deflateEnd(&zs);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        m_gzip_compressions++;
+        m_gzip_compress_us += (end.tv_sec - begin.tv_sec) * 1000000 + (end.tv_nsec - begin.tv_nsec) / 1000;
+        m_gzip_bytes_in += identity->size;
+        m_gzip_bytes_out += e->data ? e->size : identity->size;
+    }
+    e->st.st_size = e->size;
+
+    insert_entry(e, generation);
+    return e;
+}
+
+// 在entries中查找path，找到时增加引用并移动到LRU链表头部。调用者持有m_lock
+cache_entry * file_cache::find_entry(std::unordered_map<std::string, cache_entry*> & entries, const char * path) {
+    std::unordered_map<std::string, cache_entry*>::iterator it = entries.find(path);
+    if (it == entries.end()) {
+        return NULL;
+    }
+    cache_entry * e = it->second;
+    e->refcount++;
+    if (e != m_head) {
+        e->prev->next = e->next;
+        if (e->next) e->next->prev = e->prev;
+        else m_tail = e->prev;
+        e->prev = NULL;
+        e->next = m_head;
+        m_head->prev = e;
+        m_head = e;
+    }
+    return e;
+}
+
+// 读取文件，返回引用计数为1、还没有加入缓存的缓存项，键为key
+cache_entry * file_cache::read_file(const char * path, const char * key) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    cache_entry * e = new cache_entry;
+    e->path = key;
+    e->data = NULL;
+    e->gzip = false;
+    e->refcount = 1;
+    e->prev = e->next = NULL;
+    if (fstat(fd, &e->st) < 0 || !S_ISREG(e->st.st_mode) || (size_t)e->st.st_size > m_max_entry_size) {
+        close(fd);
+        delete e;
+        return NULL;
+    }
+    e->size = e->st.st_size;
+    e->data = (char *)malloc(e->size ? e->size : 1);
+    size_t have_read = 0;
+    while (e->data && have_read < e->size) {
+        ssize_t bytes = read(fd, e->data + have_read, e->size - have_read);
+        if (bytes <= 0) break;
+        have_read += bytes;
+    }
+    close(fd);
+    if (!e->data || have_read != e->size) {
+        // 文件在读取期间被截断
+        free(e->data);
+        delete e;
+        return NULL;
+    }
+    return e;
+}
+
+// 将缓存项加入缓存，如果读取之后发生过失效或者已经有相同的缓存项，则不加入
+void file_cache::insert_entry(cache_entry * e, uint64_t generation) {
+    std::unordered_map<std::string, cache_entry*> & entries = e->gzip ? m_gzip_entries : m_entries;
+    m_lock.lock();
+    if (generation == m_generation && entries.find(e->path) == entries.end()) {
+        // 淘汰最久没有使用的缓存项，直到放得下
+        while (m_tail && m_bytes + e->size > m_max_bytes) {
+            remove_entry(m_tail);
+            m_evictions++;
+        }
+        e->refcount++;
+        e->next = m_head;
+        if (m_head) m_head->prev = e;
+        else m_tail = e;
+        m_head = e;
+        entries[e->path] = e;
+        m_bytes += e->size;
+    }
+    m_lock.unlock();
+}
+
+void file_cache::set_limits(size_t max_bytes, size_t max_entry_size) {
+    if (max_entry_size > max_bytes) {
+        max_entry_size = max_bytes;
+    }
+    m_lock.lock();
+    m_max_bytes = max_bytes;
+    m_max_entry_size = max_entry_size;
+    // 先去掉太大的缓存项，再按LRU淘汰到放得下
+    cache_entry * e = m_head;
+    while (e) {
+        cache_entry * next = e->next;
+        if (e->size > max_entry_size) {
+            remove_entry(e);
+            m_invalidations++;
+        }
+        e = next;
+    }
+    while (m_tail && m_bytes > max_bytes) {
+        remove_entry(m_tail);
+        m_evictions++;
+    }
+    m_lock.unlock();
+}
+
+void file_cache::release(cache_entry * e) {
+    if (e && e->refcount.fetch_sub(1) == 1) {
+        free(e->data);
+        delete e;
+    }
+}
+
+void file_cache::get_stats(file_cache_stats & stats) {
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.invalidations = m_invalidations;
+    stats.gzip_compressions = m_gzip_compressions;
+    stats.gzip_compress_us = m_gzip_compress_us;
+    stats.gzip_bytes_in = m_gzip_bytes_in;
+    stats.gzip_bytes_out = m_gzip_bytes_out;
+    m_lock.lock();
+    stats.entries = m_entries.size() + m_gzip_entries.size();
+    stats.bytes = m_bytes;
+    m_lock.unlock();
+}
+
+// 调用者持有m_lock
+bool file_cache::watch_dir(const std::string & dir) {
+    if (m_dir_watches.find(dir) != m_dir_watches.end()) {
+        return true;
+    }
+    int wd = inotify_add_watch(m_inotifyfd, dir.c_str(), WATCH_MASK);
+    if (wd < 0) {
+        return false;
+    }
+    m_dir_watches[dir] = wd;
+    m_watch_dirs[wd] = dir;
+    return true;
+}
+
+// 调用者持有m_lock
+void file_cache::remove_entry(cache_entry * e) {
+    if (e->prev) e->prev->next = e->next;
+    else m_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else m_tail = e->prev;
+    e->prev = e->next = NULL;
+    if (e->gzip) m_gzip_entries.erase(e->path);
+    else m_entries.erase(e->path);
+    m_bytes -= e->size;
+    release(e);
+}
+
+// 调用者持有m_lock
+void file_cache::invalidate(const std::string & path) {
+    std::unordered_map<std::string, cache_entry*>::iterator it = m_entries.find(path);
+    if (it != m_entries.end()) {
+        remove_entry(it->second);
+        m_invalidations++;
+    }
+    // 文件的gzip版本
+    it = m_gzip_entries.find(path);
+    if (it != m_gzip_entries.end()) {
+        remove_entry(it->second);
+        m_invalidations++;
+    }
+    // .gz兄弟文件变化时，对应文件的gzip版本也失效
+    if (path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0) {
+        it = m_gzip_entries.find(path.substr(0, path.size() - 3));
+        if (it != m_gzip_entries.end()) {
+            remove_entry(it->second);
+            m_invalidations++;
+        }
+    }
+}
+
+// 目录本身被删除或移动，其中（包括子目录中）所有的缓存项和目录监视都失效。调用者持有m_lock
+void file_cache::invalidate_dir(const std::string & dir) {
+    std::string prefix = dir + "/";
+    cache_entry * e = m_head;
+    while (e) {
+        cache_entry * next = e->next;
+        if (e->path.compare(0, prefix.size(), prefix) == 0) {
+            remove_entry(e);
+            m_invalidations++;
+        }
+        e = next;
+    }
+
+    std::unordered_map<std::string, int>::iterator it = m_dir_watches.begin();
+    while (it != m_dir_watches.end()) {
+        if (it->first == dir || it->first.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(m_inotifyfd, it->second);
+            m_watch_dirs.erase(it->second);
+            it = m_dir_watches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void file_cache::handle_events() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t len = read(m_inotifyfd, buf, sizeof(buf));
+        if (len <= 0) break;
+
+        m_lock.lock();
+        m_generation++;
+        for (char * p = buf; p < buf + len; ) {
+            struct inotify_event * event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // 事件丢失，清空整个缓存
+                while (m_head) {
+                    remove_entry(m_head);
+                    m_invalidations++;
+                }
+                continue;
+            }
+
+            std::unordered_map<int, std::string>::iterator it = m_watch_dirs.find(event->wd);
+            if (it == m_watch_dirs.end()) continue;
+            std::string dir = it->second;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                invalidate_dir(dir);
+            } else if (event->len > 0) {
+                std::string path = dir + "/" + event->name;
+                if (event->mask & IN_ISDIR) {
+                    invalidate_dir(path);
+                } else {
+                    invalidate(path);
+                }
+            }
+        }
+        m_lock.unlock();
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+// 缓存项，创建之后只读。缓存本身持有一个引用，每个正在发送它的连接持有一个引用，
+// 引用计数为0时释放，所以被淘汰或者失效的缓存项仍然可以被正在发送的连接安全地使用
+struct cache_entry {
+    std::string path; // 键，doc_root下规范化之后的路径
+    char * data; // 文件内容
+    size_t size; // 文件大小
+    struct stat st; // 文件的元数据
+    bool gzip; // 是否是path的gzip编码版本，这时data为NULL表示path没有值得使用的gzip版本
+    std::atomic<int> refcount;
+
+    cache_entry * prev; // LRU链表，越靠近头部越是最近使用的
+    cache_entry * next;
+};
+
+// 缓存的统计数据
+struct file_cache_stats {
+    uint64_t hits; // 命中次数
+    uint64_t misses; // 未命中次数
+    uint64_t evictions; // 因为容量不足被淘汰的缓存项数量
+    uint64_t invalidations; // 因为文件变化而失效的缓存项数量
+    uint64_t gzip_compressions; // 压缩文件的次数
+    uint64_t gzip_compress_us; // 压缩花费的时间（微秒）
+    uint64_t gzip_bytes_in; // 压缩前的字节数
+    uint64_t gzip_bytes_out; // 压缩后的字节数
+    size_t entries; // 当前缓存项数量
+    size_t bytes; // 当前缓存的字节数
+};
+
+/*
+    静态文件内容缓存，所有线程共享。
+    按字节数限制容量，超出时按LRU淘汰；缓存项所在的目录用inotify监视，
+    目录中的文件被修改、删除、移动时对应的缓存项失效。命中时不需要任何文件系统调用。
+    除了文件本身，还缓存文件的gzip版本：有.gz兄弟文件时使用它，否则在第一次请求时压缩。
+*/
+class file_cache {
+public:
+    static const size_t GZIP_MIN_LENGTH = 256; // 小于该大小的文件不压缩
+
+    file_cache(size_t max_bytes, size_t max_entry_size);
+    ~file_cache();
+
+    bool start(); // 启动处理inotify事件的线程
+
+    // 查找缓存，命中时返回增加了引用的缓存项，否则返回NULL
+    cache_entry * lookup(const char * path);
+    // 读取文件并加入缓存，返回增加了引用的缓存项；文件太大或读取失败时返回NULL
+    cache_entry * load(const char * path);
+    // 查找path的gzip版本，命中时返回增加了引用的缓存项（data可能为NULL），否则返回NULL
+    cache_entry * lookup_gzip(const char * path);
+    // 读取path.gz，或者压缩identity（path的缓存项），得到path的gzip版本并加入缓存
+    cache_entry * load_gzip(const char * path, cache_entry * identity);
+    // 释放lookup()、load()等得到的引用
+    static void release(cache_entry * e);
+
+    size_t max_entry_size() const { return m_max_entry_size; }
+    // 修改容量，超出新容量的缓存项被淘汰，超过新的单个文件大小的缓存项失效
+    void set_limits(size_t max_bytes, size_t max_entry_size);
+    void get_stats(file_cache_stats & stats);
+
+private:
+    std::atomic<size_t> m_max_bytes; // 缓存的最大字节数
+    std::atomic<size_t> m_max_entry_size; // 单个文件的最大字节数
+    size_t m_bytes; // 当前缓存的字节数
+    std::unordered_map<std::string, cache_entry*> m_entries;
+    std::unordered_map<std::string, cache_entry*> m_gzip_entries; // gzip版本，键为原文件的路径
+    cache_entry * m_head; // LRU链表
+    cache_entry * m_tail;
+    locker m_lock; // 保护以上成员以及目录监视表
+
+    int m_inotifyfd;
+    int m_stopfd; // eventfd，用于结束inotify线程
+    pthread_t m_thread;
+    bool m_started;
+    std::unordered_map<int, std::string> m_watch_dirs; // inotify watch描述符 -> 目录
+    std::unordered_map<std::string, int> m_dir_watches; // 目录 -> inotify watch描述符
+    std::atomic<uint64_t> m_generation; // 每次失效加1，用来发现读文件期间发生的修改
+
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_evictions;
+    std::atomic<uint64_t> m_invalidations;
+    std::atomic<uint64_t> m_gzip_compressions;
+    std::atomic<uint64_t> m_gzip_compress_us;
+    std::atomic<uint64_t> m_gzip_bytes_in;
+    std::atomic<uint64_t> m_gzip_bytes_out;
+
+    bool watch_dir(const std::string & dir);
+    cache_entry * find_entry(std::unordered_map<std::string, cache_entry*> & entries, const char * path);
+    cache_entry * read_file(const char * path, const char * key);
+    void insert_entry(cache_entry * e, uint64_t generation);
+    void remove_entry(cache_entry * e);
+    void invalidate(const std::string & path);
+    void invalidate_dir(const std::string & dir);
+    void handle_events();
+
+    static void * worker(void * arg);
+};
+
+#endif
@@ -1,25 +1,170 @@
 #include "http_conn.h"
-
-#define TIMESLOT 5 // SIGALARM信号频率
+#include "eventloop.h"
+#include <limits.h>
+#include "mime_types.h"
+#include "fastcgi.h"
+#include "fcgi_pool.h"
+#include "proxy_pool.h"
+#include <openssl/err.h>
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* partial_206_title = "Partial Content";
+const char* not_modified_304_title = "Not Modified";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body is larger than the server is willing to process.\n";
+const char* error_416_title = "Range Not Satisfiable";
+const char* error_416_form = "The requested range is not satisfiable.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server did not return a valid response.\n";
+
+// 保留的url，返回运行指标（Prometheus文本格式、JSON格式），不对应文件
+const char * metrics_url = "/metrics";
+const char * metrics_json_url = "/metrics.json";
+
+std::atomic<int> http_conn::m_user_count(0); // 统计用户数量
+file_cache *http_conn::m_file_cache = NULL;
+buffer_pool http_conn::m_buffer_pool;
+access_log *http_conn::m_access_log = NULL;
+std::atomic<bool> http_conn::m_draining(false);
+tls_context *http_conn::m_tls_context = NULL;
+
+static const char * method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+
+// 规范化url中的路径：合并多余的'/'，去掉"."，处理".."（不会超出根目录）
+static void normalize_path(char * path) {
+    char * r = path;
+    char * w = path;
+    while (*r) {
+        while (*r == '/') r++;
+        if (!*r) break;
+        char * seg = r;
+        while (*r && *r != '/') r++;
+        int len = r - seg;
+        if (len == 1 && seg[0] == '.') continue;
+        if (len == 2 && seg[0] == '.' && seg[1] == '.') {
+            // 回退到上一段的开头
+            while (w > path && *--w != '/') {}
+            continue;
+        }
+        *w++ = '/';
+        memmove(w, seg, len);
+        w += len;
+    }
+    if (w == path) *w++ = '/';
+    *w = '\0';
+}
+
+// 请求目标中规范化之后的路径，query为'?'之后的查询字符串
+static std::string split_target(const char * url, std::string & query) {
+    const char * q = strchr(url, '?');
+    std::string path = q ? std::string(url, q) : std::string(url);
+    query = q ? q + 1 : "";
+    normalize_path(&path[0]);
+    path.resize(strlen(path.c_str()));
+    return path;
+}
+
+// 解析Accept-Encoding，判断客户端是否接受gzip，如 "gzip, deflate, br"、"gzip;q=0"、"*"
+static bool accepts_gzip(const char * value) {
+    bool star = false;
+    while (*value) {
+        value += strspn(value, " \t,");
+        if (!*value) break;
+        const char * name = value;
+        int name_len = strcspn(value, " \t;,");
+        value += strcspn(value, ",");
+
+        // q=0表示不接受
+        bool accepted = true;
+        const char * q = strchr(name, ';');
+        if (q && q < value) {
+            q += 1 + strspn(q + 1, " \t");
+            if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                accepted = atof(q + 2) > 0;
+            }
+        }
+        if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) || (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            return accepted;
+        } else if (name_len == 1 && name[0] == '*') {
+            star = accepted;
+        }
+    }
+    return star;
+}
+
+// HTTP日期格式，如 "Sun, 06 Nov 1994 08:49:37 GMT"
+static const char * http_date_format = "%a, %d %b %Y %H:%M:%S GMT";
+
+// 按HTTP日期格式输出t，不经过strftime，返回长度（29）
+static int format_http_date(time_t t, char * buf) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    int year = tm.tm_year + 1900;
+    char * p = buf;
+    memcpy(p, days + tm.tm_wday * 3, 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    *p++ = '0' + tm.tm_mday / 10;
+    *p++ = '0' + tm.tm_mday % 10;
+    *p++ = ' ';
+    memcpy(p, months + tm.tm_mon * 3, 3);
+    p += 3;
+    *p++ = ' ';
+    *p++ = '0' + year / 1000 % 10;
+    *p++ = '0' + year / 100 % 10;
+    *p++ = '0' + year / 10 % 10;
+    *p++ = '0' + year % 10;
+    *p++ = ' ';
+    *p++ = '0' + tm.tm_hour / 10;
+    *p++ = '0' + tm.tm_hour % 10;
+    *p++ = ':';
+    *p++ = '0' + tm.tm_min / 10;
+    *p++ = '0' + tm.tm_min % 10;
+    *p++ = ':';
+    *p++ = '0' + tm.tm_sec / 10;
+    *p++ = '0' + tm.tm_sec % 10;
+    memcpy(p, " GMT", 4);
+    p += 4;
+    return p - buf;
+}
 
-// 路径
-const char * root = "/home/lxy1115/Desktop/Linux-lesson/webserver";
-const char * doc_root = "/home/lxy1115/Desktop/Linux-lesson/webserver/resources";
+// 解析HTTP日期，失败返回-1
+static time_t parse_http_date(const char * value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    value += strspn(value, " \t");
+    if (!strptime(value, http_date_format, &tm)) {
+        return -1;
+    }
+    return timegm(&tm);
+}
 
-int http_conn::m_epollfd = -1; // 所有socket上的事件都被注册到一个epoll中
-int http_conn::m_user_count = 0; // 统计用户数量
-sort_timer_list *http_conn::m_timer_list = NULL;
+// If-None-Match的值（"*"或者逗号分隔的ETag列表）中是否有etag，按弱比较，忽略W/前缀
+static bool etag_matches(const char * list, const char * etag) {
+    int etag_len = strlen(etag);
+    while (*list) {
+        list += strspn(list, " \t,");
+        if (!*list) break;
+        if (list[0] == '*') return true;
+        if (strncmp(list, "W/", 2) == 0) list += 2;
+        int len = strcspn(list, " \t,");
+        if (len == etag_len && strncmp(list, etag, len) == 0) return true;
+        list += len;
+    }
+    return false;
+}
 
 // 设置文件描述符非阻塞
 int setnonblocking(int fd) {
@@ -29,17 +174,16 @@ int setnonblocking(int fd) {
     return old_flag;
 }
 
-// 向epoll文件添加需要监听的文件描述符
-int addfd(int epoll_fd, int fd, bool one_shot, bool ET, bool rdhup = true) {
+// 向epoll文件添加需要监听的文件描述符，fd需要已经是非阻塞的（accept4、eventfd、timerfd创建时指定，其余用setnonblocking）
+// ptr为事件发生时返回的数据：连接对象，或者事件循环用来区分监听socket等的标记
+int addfd(int epoll_fd, int fd, void *ptr, bool one_shot, bool ET, bool rdhup = true) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.ptr = ptr;
     event.events = EPOLLIN;
     if (rdhup) event.events |= EPOLLRDHUP; // RDHUP:异常断开
     if (one_shot) event.events |= EPOLLONESHOT;
     if (ET) event.events |= EPOLLET;
     epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
-    // 设置文件描述符非阻塞
-    setnonblocking(fd);
     return 1;
 }
 
@@ -51,96 +195,235 @@ int removefd(int epoll_fd, int fd) {
 }
 
 // 修改文件描述符，重置socket上的EPOLLONESHOT事件，确保下一次可读时，EPOLLIN事件能被触发
-void modfd(int epoll_fd, int fd, int ev) {
+void modfd(int epoll_fd, int fd, void *ptr, int ev) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.ptr = ptr;
     event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
 }
 
 // 初始化
-void http_conn::init(int sockfd, const sockaddr_in & addr) {
+void http_conn::init(int sockfd, const sockaddr_in & addr, eventloop *loop, uint32_t slot, bool tls) {
+    m_loop = loop;
     m_sockfd = sockfd;
+    m_slot = slot;
     m_address = addr;
+    // TLS连接先握手，握手和之后的读写都在连接的非阻塞状态机中进行
+    m_ssl = tls ? m_tls_context->create(sockfd) : NULL;
+    m_tls_ready = false;
+    m_tls_error = false;
+    m_ktls_send = false;
+    m_tls_read_deferred = false;
+    m_tls_start_ns = tls ? metrics::now_ns() : 0;
+    m_tls_buf = NULL;
+    m_tls_buf_size = 0;
+    m_tls_len = 0;
+    m_in_worker = false;
+    m_timeout_pending = false;
 
     // 设置端口复用
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-    // 添加到epoll对象中
-    addfd(m_epollfd, m_sockfd, true, true);
+    // 注册到所属的事件循环
+    m_loop->add_conn(this);
     m_user_count++; // 总用户数增加
 
     // 初始化计时器
-    // 创建定时器，设置其回调函数与超时时间，然后绑定定时器与用户数据，最后将定时器添加到链表timer_lst中
+    // 创建定时器，绑定定时器与用户数据，然后将定时器添加到所属事件循环的时间轮中
     if (!m_timer) {
         m_timer = new util_timer;
-        m_timer->user_conn = this;  
-        m_timer_list->add_timer(m_timer);
+        m_timer->user_conn = this;
+        m_loop->get_timer_wheel()->add_timer(m_timer, config::get().conn_timeout_ms);
+    } else {
+        m_loop->get_timer_wheel()->adjust_timer(m_timer, config::get().conn_timeout_ms);
     }
-    m_timer->expire = (int)time(NULL) + 3 * TIMESLOT;
-    // printf("m_timer: %d\n", m_timer);
 
     init();
+    if (tls && !m_ssl) {
+        close_conn();
+    }
 }
 
 void http_conn::init() {
-    bytes_to_send = 0;
-    bytes_have_send = 0;
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_read_idx = 0;
+    m_write_buf = NULL;
+    m_write_size = 0;
+    m_write_idx = 0;
+    m_resp_head = 0;
+    m_resp_count = 0;
+    m_close_after = false;
+    m_more_requests = false;
+    m_queued_ns = 0;
+    m_write_start_ns = 0;
+    m_upstream = NULL;
+    m_upstream_pool = NULL;
+    m_upstream_deferred = false;
+
+    init_request();
+}
 
+void http_conn::init_request() {
     m_check_state = CHECK_STATE_REQUESTLINE;
+    m_status = 0;
     m_checked_index = 0;
     m_start_line = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
 
     m_method = GET;
     m_url = NULL;
     m_version = NULL;
-    m_host = NULL;
-    m_linger = false;
+    m_if_modified_since = -1;
+    m_header_count = 0;
+    memset(m_header_index, -1, sizeof(m_header_index));
+    m_range_count = 0;
+    m_linger = true; // HTTP/1.1默认保持连接
+    m_accept_gzip = false;
+    m_gzip = false;
+    m_vary = false;
     m_content_length = 0;
+    m_has_content_length = false;
     m_content_start = 0;
+    m_chunked = false;
+    m_chunk_decoder.reset();
+    m_body_remaining = 0;
+    m_body_received = 0;
     m_file_address = NULL;
+    m_cache_entry = NULL;
+    m_file_fd = -1;
+    m_file_offset = 0;
+    m_heap_body = false;
+    m_content_type = NULL;
+    m_body_source = NULL;
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, WRITE_BUFFER_SIZE);
     bzero(m_file, FILENAME_LEN);
 }
 
+void http_conn::finish_request() {
+    // 把流水线中剩下的数据移到读缓冲的开头
+    int remain = m_read_idx - m_checked_index;
+    if (remain > 0) {
+        memmove(m_read_buf, m_read_buf + m_checked_index, remain);
+    }
+    m_read_idx = remain;
+    init_request();
+}
+
+bool http_conn::grow_read_buf() {
+    if (m_read_size >= config::get().max_request_size) {
+        // 请求行和请求头太大
+        return false;
+    }
+    int size;
+    char * buf = m_buffer_pool.alloc(m_read_size + 1, size);
+    if (!buf) {
+        // 请求行和请求头太大
+        return false;
+    }
+    memcpy(buf, m_read_buf, m_read_idx);
+    // 已经解析出来的字段指向旧的缓冲区
+    if (m_url) m_url = buf + (m_url - m_read_buf);
+    if (m_version) m_version = buf + (m_version - m_read_buf);
+    m_buffer_pool.free(m_read_buf, m_read_size);
+    m_read_buf = buf;
+    m_read_size = size;
+    return true;
+}
+
+void http_conn::release_read_buf() {
+    if (m_read_buf && m_read_idx == 0) {
+        m_buffer_pool.free(m_read_buf, m_read_size);
+        m_read_buf = NULL;
+        m_read_size = 0;
+        init_request();
+    }
+}
+
+void http_conn::release_write_buf() {
+    if (m_write_buf) {
+        m_buffer_pool.free(m_write_buf, m_write_size);
+        m_write_buf = NULL;
+        m_write_size = 0;
+        m_write_idx = 0;
+    }
+}
+
 // 关闭连接
 void http_conn::close_conn() {
+    unmap();
+    release_responses();
+    m_read_idx = 0;
+    release_read_buf();
+    release_write_buf();
+    if (m_ssl) {
+        // 尽量发送close_notify，不等待对方的回复；出过致命错误的连接不能再调用SSL_shutdown
+        if (m_tls_ready && !m_tls_error) {
+            ERR_clear_error();
+            SSL_shutdown(m_ssl);
+        }
+        SSL_free(m_ssl);
+        m_ssl = NULL;
+    }
+    if (m_tls_buf) {
+        m_buffer_pool.free(m_tls_buf, m_tls_buf_size);
+        m_tls_buf = NULL;
+        m_tls_len = 0;
+    }
+    if (m_timer) {
+        m_loop->get_timer_wheel()->del_timer(m_timer);
+        // printf("delete\n");
+        m_timer = NULL;
+    }
+
     if (m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        int sockfd = m_sockfd;
         m_sockfd = -1;
         m_user_count--;
+        // 注销之后连接对象被回收，必须是最后一步
+        m_loop->remove_conn(this, sockfd);
     }
+}
 
-    if (m_timer) {
-        m_timer_list->del_timer(m_timer);
-        // printf("delete\n");
-        m_timer = NULL;
+void http_conn::timeout() {
+    if (m_in_worker) {
+        // 工作线程还在使用连接的缓冲区和SSL对象，不能回收，等它交还给事件循环时再关闭
+        m_timeout_pending = true;
+        return;
     }
+    close_conn();
 }
 
 // 调整计时器
 void http_conn::adjust_timer() {
     if (m_timer) {
-        m_timer->expire = (int)time(NULL) + 3 * TIMESLOT;
-        // printf("adjust timer once\n");
-        m_timer_list->adjust_timer(m_timer);
+        m_loop->get_timer_wheel()->adjust_timer(m_timer, config::get().conn_timeout_ms);
     }
 }
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read() {
-    if (m_read_idx >= READ_BUFFER_SIZE) {
-        return false;
+    uint64_t start = metrics::now_ns();
+    if (!m_read_buf) {
+        m_read_buf = m_buffer_pool.alloc(READ_BUFFER_SIZE, m_read_size);
+        if (!m_read_buf) {
+            return false;
+        }
     }
     // 读取到的字节
     int bytes = 0;
     while (true) {
-        bytes = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        if (m_read_idx >= m_read_size) {
+            // 读缓冲满时，如果还有没有解析的数据（如请求体），先处理它们腾出空间，剩下的数据留在socket中；
+            // 都解析过了说明请求头还不完整，才换成更大的读缓冲
+            if (has_unparsed()) {
+                break;
+            }
+            if (!grow_read_buf()) {
+                return false;
+            }
+        }
+        bytes = recv_data(m_read_buf + m_read_idx, m_read_size - m_read_idx);
         if (bytes == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据
@@ -156,65 +439,767 @@ bool http_conn::read() {
     }
     // printf("读取到数据：%s\n", m_read_buf);
     // printf("一次性读完数据\n");
+    metrics::record(STAGE_READ, metrics::now_ns() - start);
+    // 更新定时器
+    adjust_timer();
+    return true;
+}
+
+int http_conn::recv_data(char * buf, int len) {
+    if (!m_ssl) {
+        return recv(m_sockfd, buf, len, 0);
+    }
+    // 解密交给内核时OpenSSL直接从socket读出明文
+    ERR_clear_error();
+    int ret = SSL_read(m_ssl, buf, len);
+    return ret > 0 ? ret : tls_error(ret);
+}
+
+int http_conn::tls_error(int ret) {
+    switch (SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: {
+            // 记录不完整或者发送缓冲满，和非阻塞socket一样等下一次事件
+            errno = EAGAIN;
+            return -1;
+        } case SSL_ERROR_ZERO_RETURN: {
+            return 0;
+        } default: {
+            m_tls_error = true;
+            errno = ECONNRESET;
+            return -1;
+        }
+    }
+}
+
+http_conn::HANDSHAKE http_conn::tls_handshake() {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret == 1) {
+        m_tls_ready = true;
+        m_ktls_send = tls_context::ktls_send(m_ssl);
+        metrics::count(COUNTER_TLS_HANDSHAKES);
+        if (m_ktls_send) {
+            metrics::count(COUNTER_KTLS);
+        }
+        metrics::record(STAGE_TLS_HANDSHAKE, metrics::now_ns() - m_tls_start_ns);
+        adjust_timer();
+        return HS_DONE;
+    }
+    switch (SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_WANT_READ: {
+            return HS_READ;
+        } case SSL_ERROR_WANT_WRITE: {
+            return HS_WRITE;
+        } default: {
+            // 对方不是TLS客户端、不接受证书或者中途断开
+            m_tls_error = true;
+            metrics::count(COUNTER_TLS_HANDSHAKE_FAILURES);
+            return HS_CLOSE;
+        }
+    }
+}
+
+bool http_conn::take_deferred_read() {
+    bool deferred = m_tls_read_deferred;
+    m_tls_read_deferred = false;
+    return deferred;
+}
+
+void http_conn::send_interim(const char * data, int len) {
+    if (!m_ssl || m_ktls_send) {
+        send(m_sockfd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return;
+    }
+    if (m_tls_len > 0) {
+        return;
+    }
+    if (!m_tls_buf) {
+        m_tls_buf = m_buffer_pool.alloc(tls_context::RECORD_SIZE, m_tls_buf_size);
+        if (!m_tls_buf) {
+            return;
+        }
+    }
+    memcpy(m_tls_buf, data, len);
+    m_tls_len = len;
+    ERR_clear_error();
+    if (SSL_write(m_ssl, m_tls_buf, m_tls_len) > 0) {
+        m_tls_len = 0;
+    }
+}
+
+// 用排队的响应填充m_iv，遇到用sendfile发送的响应时只放入它的响应头，并设置MSG_MORE
+int http_conn::fill_iov(int & flags) {
+    int count = 0;
+    flags = 0;
+    for (int i = m_resp_head; i < m_resp_count; i++) {
+        response & r = m_responses[i];
+        if (r.sent < (size_t)r.header_len) {
+            m_iv[count].iov_base = m_write_buf + r.header_start + r.sent;
+            m_iv[count].iov_len = r.header_len - r.sent;
+            count++;
+        }
+        if (r.file_fd != -1 || r.pipe_fd != -1) {
+            // MSG_MORE让内核把响应头和随后sendfile、splice发送的响应体合并发送
+            if (count > 0) flags = MSG_MORE;
+            break;
+        }
+        size_t body_sent = r.sent > (size_t)r.header_len ? r.sent - r.header_len : 0;
+        if (r.body_len > body_sent) {
+            m_iv[count].iov_base = r.body + body_sent;
+            m_iv[count].iov_len = r.body_len - body_sent;
+            count++;
+        }
+    }
+    return count;
+}
+
+// 记录发送了bytes字节，释放已经发送完的响应
+void http_conn::consume(size_t bytes) {
+    while (bytes > 0 && m_resp_head < m_resp_count) {
+        response & r = m_responses[m_resp_head];
+        size_t left = r.header_len + r.body_len - r.sent;
+        size_t n = bytes < left ? bytes : left;
+        r.sent += n;
+        bytes -= n;
+        if (r.sent == r.header_len + r.body_len && !((r.source && next_chunk(r)) || (r.upstream && next_upstream(r)))) {
+            release_response(r);
+            m_resp_head++;
+        }
+    }
+    // 响应体为空的响应；后端的响应在等待后端时也是空的
+    while (m_resp_head < m_resp_count && !m_responses[m_resp_head].upstream
+           && m_responses[m_resp_head].sent == m_responses[m_resp_head].header_len + m_responses[m_resp_head].body_len) {
+        release_response(m_responses[m_resp_head]);
+        m_resp_head++;
+    }
+}
+
+// 按块生成的响应总是队列中的最后一个，轮到它时前面的响应都已经发送完，写缓冲可以从头使用：
+// 块头、数据和结尾的\r\n连续地放在写缓冲中，作为响应的"响应头"发送。
+// 响应体结束时放入最后一块并释放body_source；出错时只能关闭连接，客户端因为没有收到最后一块而知道响应不完整
+bool http_conn::next_chunk(response & r) {
+    if (!r.source) {
+        return false;
+    }
+    int n = -1;
+    if (reserve_write(MAX_WRITE_BUFFER_SIZE - m_write_idx)) {
+        m_write_idx = 0;
+        n = r.source->produce(m_write_buf + CHUNK_HEADER_MAX, m_write_size - CHUNK_HEADER_MAX - 2);
+    }
+    if (n < 0) {
+        delete r.source;
+        r.source = NULL;
+        m_close_after = true;
+        return false;
+    }
+    if (n == 0) {
+        delete r.source;
+        r.source = NULL;
+        memcpy(m_write_buf, LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
+        r.header_start = 0;
+        r.header_len = sizeof(LAST_CHUNK) - 1;
+    } else {
+        char header[CHUNK_HEADER_MAX];
+        int len = chunk_header(header, n);
+        r.header_start = CHUNK_HEADER_MAX - len;
+        memcpy(m_write_buf + r.header_start, header, len);
+        memcpy(m_write_buf + CHUNK_HEADER_MAX + n, "\r\n", 2);
+        r.header_len = len + n + 2;
+    }
+    m_write_idx = r.header_start + r.header_len;
+    r.sent = 0;
+    return true;
+}
+
+// 后端的响应总是队列中唯一的一项，写缓冲可以从头使用：响应头和每次从连接池取出的响应体（chunked时加上块头）
+// 作为响应的"响应头"发送，发送完再取下一部分；暂时没有数据时header_len为0，等连接池唤醒。
+// 连接池splice到管道中的响应体作为响应体用splice发送，不经过写缓冲。
+// 后端出错时还没有发送响应头的回复502，已经发送的只能关闭连接
+bool http_conn::next_upstream(response & r) {
+    upstream_request * req = m_upstream;
+    if (r.pipe_fd != -1) {
+        // 上一部分从管道发送完
+        req->pipe_bytes -= r.body_len;
+        r.pipe_fd = -1;
+        r.body_len = 0;
+    }
+    if (m_upstream_state == UPSTREAM_DONE) {
+        return false;
+    }
+    if (!reserve_write(MAX_WRITE_BUFFER_SIZE - m_write_idx)) {
+        m_close_after = true;
+        return false;
+    }
+    m_write_idx = 0;
+    if (m_upstream_state == UPSTREAM_HEADER) {
+        bool f = true;
+        if (req->header_done) {
+            f = add_upstream_headers();
+            m_upstream_state = UPSTREAM_BODY;
+        } else if (req->failed) {
+            f = add_status_line(502, error_502_title);
+            f = f && add_headers(strlen(error_502_form), "text/html");
+            f = f && add_content(error_502_form);
+            m_upstream_state = UPSTREAM_DONE;
+        }
+        if (!f) {
+            m_close_after = true;
+            return false;
+        }
+    }
+    size_t piped = 0;
+    if (m_upstream_state == UPSTREAM_BODY) {
+        std::string & out = req->out;
+        size_t n = 0;
+        if (out.empty() && req->pipe_bytes > 0) {
+            // 管道中的响应体总在out之后，有Content-Length，不超过剩下的长度
+            piped = req->pipe_bytes;
+            m_upstream_remaining -= piped;
+        } else if (m_upstream_remaining == -1) {
+            size_t room = m_write_size - m_write_idx - CHUNK_HEADER_MAX - 2 - sizeof(LAST_CHUNK);
+            n = out.size() < room ? out.size() : room;
+            if (n > 0) {
+                char header[CHUNK_HEADER_MAX];
+                append(header, chunk_header(header, n));
+                append(out.data(), n);
+                append("\r\n", 2);
+            }
+        } else {
+            // 超过Content-Length的部分丢弃
+            size_t room = m_write_size - m_write_idx;
+            n = out.size() < room ? out.size() : room;
+            if ((long long)n > m_upstream_remaining) n = m_upstream_remaining;
+            append(out.data(), n);
+            m_upstream_remaining -= n;
+            if (m_upstream_remaining == 0) n = out.size();
+        }
+        out.erase(0, n);
+        m_upstream_pool->consumed(req);
+        if (out.empty() && req->pipe_bytes == piped && (req->ended || req->failed)) {
+            if (req->failed || m_upstream_remaining > 0) {
+                // 响应不完整，客户端由连接关闭（chunked时没有最后一块）知道
+                m_close_after = true;
+            } else if (m_upstream_remaining == -1) {
+                append(LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
+            }
+            m_upstream_state = UPSTREAM_DONE;
+        }
+    }
+    r.header_start = 0;
+    r.header_len = m_write_idx;
+    r.sent = 0;
+    if (piped > 0) {
+        r.pipe_fd = req->pipe[0];
+        r.body_len = piped;
+    }
+    m_upstream_bytes += m_write_idx + piped;
+    return m_write_idx > 0 || piped > 0 || m_upstream_state != UPSTREAM_DONE;
+}
+
+// 后端给出的状态和响应头，Content-Length已知时照用，否则用chunked编码
+bool http_conn::add_upstream_headers() {
+    upstream_request * req = m_upstream;
+    bool f = add_status_line(req->status, req->reason.c_str());
+    f = f && append(req->headers.data(), req->headers.size());
+    if (req->status < 200 || req->status == 204 || req->status == 304) {
+        m_upstream_remaining = 0;
+    } else if (req->content_length >= 0) {
+        m_upstream_remaining = req->content_length;
+        f = f && add_content_length(req->content_length);
+    } else {
+        m_upstream_remaining = -1;
+        f = f && add_chunked();
+    }
+    f = f && add_linger();
+    return f && add_blank_line();
+}
+
+static bool match_prefix(const std::string & path, const std::vector<std::string> & prefixes) {
+    for (size_t i = 0; i < prefixes.size(); i++) {
+        if (path.compare(0, prefixes[i].size(), prefixes[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool http_conn::use_upstream() {
+    upstream_pool * proxy = m_loop->get_upstream(UPSTREAM_PROXY);
+    upstream_pool * fcgi = m_loop->get_upstream(UPSTREAM_FASTCGI);
+    if (!proxy && !fcgi) {
+        return false;
+    }
+    const server_config & cfg = config::get();
+    std::string query;
+    std::string path = split_target(m_url, query);
+    if (proxy && match_prefix(path, cfg.proxy_prefix)) {
+        m_upstream_pool = proxy;
+    } else if (fcgi && (m_method == POST || match_prefix(path, cfg.fastcgi_prefix))) {
+        m_upstream_pool = fcgi;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// chunked的请求体事先不知道长度，FastCGI后端读到STDIN结束为止，HTTP后端仍然用chunked编码转发
+bool http_conn::build_upstream() {
+    std::string head;
+    if (m_upstream_pool->kind() == UPSTREAM_PROXY) {
+        build_proxy_head(head);
+    } else {
+        build_fcgi_params(head);
+    }
+    upstream_request * req = new upstream_request(this);
+    req->head.swap(head);
+    req->body_length = m_chunked ? -1 : m_content_length;
+    req->hash = proxy_pool::hash_key(m_url, strlen(m_url));
+    m_upstream = req;
+    m_upstream_state = UPSTREAM_START;
+    m_upstream_remaining = -1;
+    m_upstream_bytes = 0;
+    m_upstream_start_ns = metrics::now_ns();
+    response & r = push_response(m_write_idx);
+    r.upstream = true;
+    if (!m_linger) {
+        m_close_after = true;
+    }
+    return true;
+}
+
+// 请求行原样转发；逐跳的头和请求体的长度由这里重新生成，Expect由本服务器回复100 Continue，不转发。
+// X-Forwarded-For追加客户端的地址，X-Forwarded-Proto按连接是否TLS生成（客户端发来的不转发），
+// 没有Host时补上，后端连接总是长连接
+void http_conn::build_proxy_head(std::string & head) {
+    static const char * const hop_by_hop[] = { "Keep-Alive", "Proxy-Connection", "Trailer", "X-Forwarded-Proto", NULL };
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, addr, sizeof(addr));
+    head = method_names[m_method];
+    head += ' ';
+    head += m_url;
+    head += " HTTP/1.1\r\n";
+    for (int i = 0; i < m_header_count; i++) {
+        const http_header & h = m_headers[i];
+        const char * n = m_read_buf + h.name;
+        if (h.id == HDR_CONNECTION || h.id == HDR_CONTENT_LENGTH || h.id == HDR_TRANSFER_ENCODING
+            || h.id == HDR_UPGRADE || h.id == HDR_TE || h.id == HDR_EXPECT || h.id == HDR_X_FORWARDED_FOR) {
+            continue;
+        }
+        bool skip = false;
+        for (int j = 0; hop_by_hop[j] && !skip; j++) {
+            skip = h.name_len == (int)strlen(hop_by_hop[j]) && strncasecmp(n, hop_by_hop[j], h.name_len) == 0;
+        }
+        if (skip) {
+            continue;
+        }
+        head.append(n, h.name_len);
+        head += ": ";
+        head.append(m_read_buf + h.value, h.value_len);
+        head += "\r\n";
+    }
+    head += "X-Forwarded-For: ";
+    const char * forwarded = get_header(HDR_X_FORWARDED_FOR);
+    if (forwarded && *forwarded) {
+        head += forwarded;
+        head += ", ";
+    }
+    head += addr;
+    head += m_ssl ? "\r\nX-Forwarded-Proto: https\r\n" : "\r\nX-Forwarded-Proto: http\r\n";
+    if (!get_header(HDR_HOST)) {
+        head += "Host: localhost\r\n";
+    }
+    if (m_chunked) {
+        head += "Transfer-Encoding: chunked\r\n";
+    } else if (m_content_length > 0 || m_method == POST) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "Content-Length: %lld\r\n", m_content_length);
+        head += buf;
+    }
+    head += "Connection: keep-alive\r\n\r\n";
+}
+
+// CGI/1.1的环境变量，请求头转成HTTP_名字；Proxy不传（httpoxy），逐跳的头和已经单独传递的长度、类型不传。
+// chunked请求体的长度事先不知道，没有CONTENT_LENGTH
+void http_conn::build_fcgi_params(std::string & params) {
+    const server_config & cfg = config::get();
+    std::string query;
+    std::string path = split_target(m_url, query);
+    char buf[64];
+    fcgi_append_param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    fcgi_append_param(params, "SERVER_SOFTWARE", "WebServer");
+    fcgi_append_param(params, "SERVER_PROTOCOL", "HTTP/1.1");
+    fcgi_append_param(params, "REQUEST_SCHEME", m_ssl ? "https" : "http");
+    if (m_ssl) {
+        fcgi_append_param(params, "HTTPS", "on");
+    }
+    fcgi_append_param(params, "REQUEST_METHOD", method_names[m_method]);
+    fcgi_append_param(params, "REQUEST_URI", m_url);
+    fcgi_append_param(params, "QUERY_STRING", query.c_str());
+    fcgi_append_param(params, "SCRIPT_NAME", path.c_str());
+    fcgi_append_param(params, "DOCUMENT_URI", path.c_str());
+    fcgi_append_param(params, "DOCUMENT_ROOT", cfg.doc_root.c_str());
+    fcgi_append_param(params, "SCRIPT_FILENAME", (cfg.doc_root + path).c_str());
+    const char * type = get_header(HDR_CONTENT_TYPE);
+    if (type) {
+        fcgi_append_param(params, "CONTENT_TYPE", type);
+    }
+    if (!m_chunked && m_content_length > 0) {
+        snprintf(buf, sizeof(buf), "%lld", m_content_length);
+        fcgi_append_param(params, "CONTENT_LENGTH", buf);
+    }
+    inet_ntop(AF_INET, &m_address.sin_addr, buf, sizeof(buf));
+    fcgi_append_param(params, "REMOTE_ADDR", buf);
+    snprintf(buf, sizeof(buf), "%d", ntohs(m_address.sin_port));
+    fcgi_append_param(params, "REMOTE_PORT", buf);
+    snprintf(buf, sizeof(buf), "%d", m_ssl ? cfg.tls_port : cfg.port);
+    fcgi_append_param(params, "SERVER_PORT", buf);
+    const char * host = get_header(HDR_HOST);
+    if (host && *host) {
+        fcgi_append_param(params, "SERVER_NAME", 11, host, strcspn(host, ":"));
+    } else {
+        fcgi_append_param(params, "SERVER_NAME", "localhost");
+    }
+    std::string name;
+    for (int i = 0; i < m_header_count; i++) {
+        const http_header & h = m_headers[i];
+        const char * n = m_read_buf + h.name;
+        if (h.id == HDR_CONTENT_TYPE || h.id == HDR_CONTENT_LENGTH || h.id == HDR_TRANSFER_ENCODING
+            || h.id == HDR_CONNECTION || (h.name_len == 5 && strncasecmp(n, "Proxy", 5) == 0)) {
+            continue;
+        }
+        name = "HTTP_";
+        for (int j = 0; j < h.name_len; j++) {
+            name += n[j] == '-' ? '_' : (char) toupper((unsigned char) n[j]);
+        }
+        fcgi_append_param(params, name.data(), name.size(), m_read_buf + h.value, h.value_len);
+    }
+}
+
+// 没有请求体时直接结束请求体
+http_conn::HTTP_CODE http_conn::forward_body() {
+    HTTP_CODE ret = m_check_state == CHECK_STATE_CONTENT ? parse_contents() : GET_REQUEST;
+    if (ret == GET_REQUEST) {
+        m_upstream_pool->send_body(m_upstream, NULL, 0);
+    }
+    return ret;
+}
+
+bool http_conn::upstream_reading() const {
+    return m_upstream && !m_upstream->body_done && !m_upstream->ended && !m_upstream->failed;
+}
+
+// 先转发完请求体再发送响应：读请求体时连接只等待可读，后端的响应在连接池中缓存
+http_conn::UPSTREAM_NEXT http_conn::upstream_step() {
+    upstream_pool * pool = m_upstream_pool;
+    adjust_timer();
+    if (m_upstream_state == UPSTREAM_START) {
+        m_upstream_state = UPSTREAM_HEADER;
+        pool->submit(m_upstream);
+        // 客户端等100 Continue之后才发送请求体；这时没有排队的数据，直接发送
+        const char * expect = get_header(HDR_EXPECT);
+        if (expect && strcasecmp(expect, "100-continue") == 0 && m_check_state == CHECK_STATE_CONTENT
+            && m_read_idx == m_content_start && !m_upstream->failed) {
+            static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            send_interim(cont, sizeof(cont) - 1);
+        }
+    }
+    if (upstream_reading()) {
+        HTTP_CODE ret = forward_body();
+        if (ret == BAD_REQUEST || ret == BODY_TOO_LARGE) {
+            return upstream_error(ret);
+        }
+        if (upstream_reading()) {
+            // 连接池的发送缓冲满时等它唤醒
+            return pool->body_room(m_upstream) > 0 ? UP_READ : UP_WAIT;
+        }
+    }
+    response & r = m_responses[m_resp_head];
+    if (r.sent == r.header_len + r.body_len) {
+        if (!next_upstream(r)) {
+            release_response(r);
+            m_resp_head++;
+            return UP_WRITE;
+        }
+        if (r.header_len + r.body_len == 0) {
+            return UP_WAIT;
+        }
+    }
+    return UP_WRITE;
+}
+
+// 后端的响应头还没有放入写缓冲时，放弃转发，回复错误并关闭连接
+http_conn::UPSTREAM_NEXT http_conn::upstream_error(HTTP_CODE ret) {
+    if (m_upstream_state != UPSTREAM_HEADER) {
+        return UP_CLOSE;
+    }
+    m_upstream_pool->release(m_upstream);
+    m_upstream = NULL;
+    m_resp_head = 0;
+    m_resp_count = 0;
+    m_write_idx = 0;
+    m_linger = false;
+    if (!process_write(ret)) {
+        return UP_CLOSE;
+    }
+    if (m_access_log) {
+        log_access(m_responses[0].header_len + m_responses[0].body_len, 0, 0, 0);
+    }
+    return UP_WRITE;
+}
+
+// 请求体已经读完时继续处理流水线中后面的请求，否则后面的数据无法再解析，关闭连接
+void http_conn::end_upstream() {
+    if (m_access_log) {
+        log_access(m_upstream_bytes, 0, 0, metrics::now_ns() - m_upstream_start_ns);
+    }
+    bool body_done = m_upstream->body_done;
+    m_upstream_pool->release(m_upstream);
+    m_upstream = NULL;
+    if (!body_done) {
+        m_close_after = true;
+        return;
+    }
+    finish_request();
+    m_more_requests = m_read_idx > 0;
+    release_read_buf();
+}
+
+// 所有响应发送完之后调用，返回false表示需要关闭连接
+bool http_conn::finish_write() {
+    // 发送结束，归还写缓冲区
+    m_resp_head = 0;
+    m_resp_count = 0;
+    release_write_buf();
+    if (m_write_start_ns) {
+        metrics::record(STAGE_WRITE, metrics::now_ns() - m_write_start_ns);
+        m_write_start_ns = 0;
+    }
+    if (m_close_after) {
+        return false;
+    }
     // 更新定时器
     adjust_timer();
     return true;
 }
 
-// 写HTTP响应
+// 把收到的数据追加到读缓冲中，读缓冲满的规则和read()一样，放不下的部分由调用者暂存；请求太大时返回-1
+int http_conn::feed(const char * data, int len) {
+    uint64_t start = metrics::now_ns();
+    if (!m_read_buf) {
+        m_read_buf = m_buffer_pool.alloc(READ_BUFFER_SIZE, m_read_size);
+        if (!m_read_buf) {
+            return -1;
+        }
+    }
+    if (m_read_idx == m_read_size && !has_unparsed() && !grow_read_buf()) {
+        return -1;
+    }
+    int n = m_read_size - m_read_idx < len ? m_read_size - m_read_idx : len;
+    memcpy(m_read_buf + m_read_idx, data, n);
+    m_read_idx += n;
+    metrics::record(STAGE_READ, metrics::now_ns() - start);
+    adjust_timer();
+    return n;
+}
+
+// 用排队的响应填充msg，返回sendmsg的flags
+int http_conn::prepare_send(struct msghdr & msg) {
+    int flags;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = m_iv;
+    msg.msg_iovlen = fill_iov(flags);
+    return flags;
+}
+
+// 队首响应的响应头已经发送完、响应体需要从文件发送时返回true，offset指向文件的读取位置，len为剩余的字节数
+bool http_conn::pending_file(int & fd, off_t *& offset, size_t & len) {
+    if (m_resp_head == m_resp_count) {
+        return false;
+    }
+    response & r = m_responses[m_resp_head];
+    if (r.file_fd == -1 || r.sent < (size_t)r.header_len) {
+        return false;
+    }
+    fd = r.file_fd;
+    offset = &r.file_offset;
+    len = r.header_len + r.body_len - r.sent;
+    return true;
+}
+
+// 队首响应的响应头已经发送完、响应体需要从管道发送时返回true，len为剩余的字节数
+bool http_conn::pending_pipe(int & fd, size_t & len) {
+    if (m_resp_head == m_resp_count) {
+        return false;
+    }
+    response & r = m_responses[m_resp_head];
+    if (r.pipe_fd == -1 || r.sent < (size_t)r.header_len) {
+        return false;
+    }
+    fd = r.pipe_fd;
+    len = r.header_len + r.body_len - r.sent;
+    return true;
+}
+
+// 写HTTP响应，排队的多个响应尽量用一次sendmsg发送；加密交给内核的TLS连接也一样，sendfile和splice仍然零拷贝
 bool http_conn::write() {
-    int tmp = 0;
-    
-    // 没有数据发送，不会触发
-    if (bytes_to_send == 0) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
-        return true;
+    if (m_ssl && !m_ktls_send) {
+        return write_tls();
     }
+    int tmp = 0;
+    size_t total = 0;
 
-    while (true) {
-        tmp = writev(m_sockfd, m_iv, m_iv_count);
+    while (m_resp_head < m_resp_count) {
+        response & r = m_responses[m_resp_head];
+        if (r.upstream && r.sent == r.header_len + r.body_len) {
+            // 后端的响应暂时没有更多的数据，由连接池唤醒
+            return true;
+        }
+        if (r.file_fd != -1 && r.sent >= (size_t)r.header_len) {
+            // 文件内容由内核直接从页缓存发送，file_offset由sendfile更新
+            tmp = sendfile(m_sockfd, r.file_fd, &r.file_offset, r.header_len + r.body_len - r.sent);
+            if (tmp == 0) {
+                // 文件在发送过程中被截短，再发也不会有进展，关闭连接
+                return false;
+            }
+        } else if (r.pipe_fd != -1 && r.sent >= (size_t)r.header_len) {
+            // 后端的响应体从管道移到socket，不经过用户空间
+            tmp = splice(r.pipe_fd, NULL, m_sockfd, NULL, r.header_len + r.body_len - r.sent,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            int flags;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = m_iv;
+            msg.msg_iovlen = fill_iov(flags);
+            tmp = sendmsg(m_sockfd, &msg, flags);
+        }
         if (tmp <= -1) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if (errno == EAGAIN) {
                 // 重新再发
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                m_loop->modify(this, EPOLLOUT);
                 return true;
             } else {
-                // 出错，释放空间，关闭连接
-                unmap();
+                // 出错，关闭连接，由close_conn释放资源
                 return false;
             }
         }
+        consume(tmp);
+        total += tmp;
+        if (total >= STREAM_WRITE_QUANTUM && m_resp_head < m_resp_count && m_responses[m_resp_head].source) {
+            // 生成响应体占用事件循环线程，发送一定的量之后让出，等下一次可写事件再继续
+            m_loop->modify(this, EPOLLOUT);
+            return true;
+        }
+    }
 
-        bytes_have_send += tmp;
-        bytes_to_send -= tmp;
+    if (!finish_write()) {
+        return false;
+    }
+    if (!m_more_requests) {
+        m_loop->modify(this, EPOLLIN);
+    }
+    return true;
+}
 
-        if (bytes_to_send <= 0) {
-            // 发送结束
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-            if (m_linger) {
-                init();
-                // 更新定时器
-                adjust_timer();
+// 用户空间加密：每次从响应队列取出一条记录的明文，由SSL_write加密发送。
+// 明文取出时就记为已发送（管道中的数据读出之后不能放回），SSL_write没有接受的留在m_tls_buf中，下一次先用同样的数据重试
+bool http_conn::write_tls() {
+    size_t total = 0;
+    while (true) {
+        if (m_tls_len > 0) {
+            ERR_clear_error();
+            int ret = SSL_write(m_ssl, m_tls_buf, m_tls_len);
+            if (ret <= 0) {
+                if (tls_error(ret) == -1 && errno == EAGAIN) {
+                    m_loop->modify(this, EPOLLOUT);
+                    return true;
+                }
+                return false;
+            }
+            total += m_tls_len;
+            m_tls_len = 0;
+            if (total >= STREAM_WRITE_QUANTUM && m_resp_head < m_resp_count && m_responses[m_resp_head].source) {
+                // 同write()，按块生成的响应发送一定的量之后让出事件循环线程
+                m_loop->modify(this, EPOLLOUT);
                 return true;
-            } else return false;
-        } else if (bytes_have_send >= m_iv[0].iov_len) {
-            // 发送完成m_iv[1]
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_len = bytes_to_send;
-            m_iv[1].iov_base = m_file_address + m_file_stat.st_size - bytes_to_send;
-        } else {
-            m_iv[0].iov_len -= tmp;
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
+            }
+        }
+        if (m_resp_head == m_resp_count) {
+            break;
+        }
+        response & r = m_responses[m_resp_head];
+        if (r.upstream && r.sent == r.header_len + r.body_len) {
+            // 后端的响应暂时没有更多的数据，由连接池唤醒
+            return true;
+        }
+        if (!m_tls_buf) {
+            m_tls_buf = m_buffer_pool.alloc(tls_context::RECORD_SIZE, m_tls_buf_size);
+            if (!m_tls_buf) {
+                return false;
+            }
+        }
+        m_tls_len = fill_tls_buf();
+        if (m_tls_len < 0) {
+            m_tls_len = 0;
+            return false;
         }
     }
 
+    // 连接空闲时不占用明文缓冲区
+    if (m_tls_buf) {
+        m_buffer_pool.free(m_tls_buf, m_tls_buf_size);
+        m_tls_buf = NULL;
+    }
+    if (!finish_write()) {
+        return false;
+    }
+    if (!m_more_requests) {
+        m_loop->modify(this, EPOLLIN);
+    }
     return true;
 }
 
+// 依次取出响应头、内存中的响应体、文件和管道中的响应体，直到放满一条记录或者后端的响应暂时没有数据
+int http_conn::fill_tls_buf() {
+    int n = 0;
+    while (n < tls_context::RECORD_SIZE && m_resp_head < m_resp_count) {
+        response & r = m_responses[m_resp_head];
+        size_t left = r.header_len + r.body_len - r.sent;
+        if (left == 0) {
+            break;
+        }
+        size_t want = (size_t)(tls_context::RECORD_SIZE - n) < left ? tls_context::RECORD_SIZE - n : left;
+        char * buf = m_tls_buf + n;
+        ssize_t got;
+        if (r.sent < (size_t)r.header_len) {
+            got = want < r.header_len - r.sent ? want : r.header_len - r.sent;
+            memcpy(buf, m_write_buf + r.header_start + r.sent, got);
+        } else if (r.file_fd != -1) {
+            got = pread(r.file_fd, buf, want, r.file_offset);
+            if (got <= 0) {
+                // 文件在发送过程中被截短
+                return -1;
+            }
+            r.file_offset += got;
+        } else if (r.pipe_fd != -1) {
+            // body_len是管道中已有的字节数，不会阻塞
+            got = ::read(r.pipe_fd, buf, want);
+            if (got <= 0) {
+                return -1;
+            }
+        } else {
+            got = want;
+            memcpy(buf, r.body + (r.sent - r.header_len), got);
+        }
+        n += got;
+        consume(got);
+    }
+    return n;
+}
+
 // 主状态机，解析请求
 http_conn::HTTP_CODE http_conn::process_read() {
     LINE_STATUS line_status = LINE_OK;
@@ -238,26 +1223,29 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 break;
             } case CHECK_STATE_HEADER: {
                 ret = parse_headers(text);
-                if (ret == BAD_REQUEST) {
-                    return BAD_REQUEST;
+                if (ret == BAD_REQUEST || ret == BODY_TOO_LARGE || ret == UPSTREAM_REQUEST) {
+                    return ret;
                 } else if (ret == GET_REQUEST) {
                     return do_request();
                 }
                 break;
             } case CHECK_STATE_CONTENT: {
-                ret = parse_contents(text);
-                if (ret == BAD_REQUEST) {
-                    return BAD_REQUEST;
-                } else if (ret == GET_REQUEST) {
+                ret = parse_contents();
+                if (ret == GET_REQUEST) {
+                    // 流水线中的下一个请求从m_checked_index开始
                     return do_request();
                 }
-                line_status = LINE_OPEN;
-                break;
+                // 出错，或者请求体不完整，不能再按行解析
+                return ret;
             } default: {
                 return INTERNAL_ERROR;
             }
         }
     }
+    if (line_status == LINE_BAD) {
+        // 行结尾不是\r\n
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
 
@@ -297,176 +1285,787 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text) {
     return NO_REQUEST;
 }
 
-// 解析HTTP请求头
+// Connection等逗号分隔的列表中是否有token（不区分大小写）
+static bool has_token(const char * list, const char * token) {
+    int token_len = strlen(token);
+    while (*list) {
+        list += strspn(list, " \t,");
+        int len = strcspn(list, " \t,;");
+        if (len == token_len && strncasecmp(list, token, len) == 0) return true;
+        list += strcspn(list, ",");
+    }
+    return false;
+}
+
+// 解析HTTP请求头，每一行放入请求头表，常见的请求头按编号处理
 http_conn::HTTP_CODE http_conn::parse_headers(char * text) {
     // 遇到空行
     if (text[0] == '\0') {
-        if (m_content_length != 0) { // 有请求体
+        if (m_chunked && m_has_content_length) {
+            // 同时有两种长度时（即使Content-Length为0）不能确定请求的边界（请求走私），拒绝
+            return BAD_REQUEST;
+        }
+        // 转发给后端的请求现在就开始，请求体由事件循环边读边转发
+        bool upstream = use_upstream();
+        if (m_chunked || m_content_length != 0) { // 有请求体
+            long long max_body = config::get().max_body_size;
+            if (max_body && m_content_length > max_body) {
+                return BODY_TOO_LARGE;
+            }
             m_check_state = CHECK_STATE_CONTENT;
             m_content_start = m_checked_index;
-            return NO_REQUEST;
-        } else return GET_REQUEST; // 没有请求体，结束
-    } else if (strncasecmp(text, "Host:", 5) == 0) {
-        text = strpbrk(text, " \t") + 1;
-        m_host = text;
-    } else if (strncasecmp(text, "Connection:", 11) == 0) {
-        text = strpbrk(text, " \t") + 1;
-        if (strncasecmp(text, "keep-alive", 10) == 0) m_linger = true;
-    } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-        text = strpbrk(text, " \t") + 1;
-        m_content_length = atoi(text);
-    } else {
-        // printf( "skip! unknown header %s\n", text);
+            m_body_remaining = m_content_length;
+            return upstream ? UPSTREAM_REQUEST : NO_REQUEST;
+        } else return upstream ? UPSTREAM_REQUEST : GET_REQUEST; // 没有请求体，结束
+    }
+
+    // 名字: 值，名字和冒号之间不能有空白，不支持以空白开头的续行
+    char * colon = strchr(text, ':');
+    int name_len = colon ? colon - text : 0;
+    if (name_len == 0 || text[name_len - 1] == ' ' || text[name_len - 1] == '\t' || text[0] == ' ' || text[0] == '\t') {
+        return BAD_REQUEST;
+    }
+    if (m_header_count >= MAX_HEADERS) {
+        return BAD_REQUEST;
+    }
+    char * value = colon + 1 + strspn(colon + 1, " \t");
+    char * value_end = value + strlen(value);
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+    }
+    *value_end = '\0';
+
+    HEADER_ID id = lookup_header(text, name_len);
+    http_header & h = m_headers[m_header_count];
+    h.name = text - m_read_buf;
+    h.name_len = name_len;
+    h.value = value - m_read_buf;
+    h.value_len = value_end - value;
+    h.id = id;
+    if (id != HDR_UNKNOWN && m_header_index[id] == -1) {
+        m_header_index[id] = m_header_count;
+    }
+    m_header_count++;
+
+    switch (id) {
+        case HDR_CONNECTION: {
+            if (has_token(value, "close")) m_linger = false;
+            else if (has_token(value, "keep-alive")) m_linger = true;
+            break;
+        } case HDR_ACCEPT_ENCODING: {
+            m_accept_gzip = accepts_gzip(value);
+            break;
+        } case HDR_IF_MODIFIED_SINCE: {
+            m_if_modified_since = parse_http_date(value);
+            break;
+        } case HDR_CONTENT_LENGTH: {
+            // 只能是数字，多个Content-Length必须相同（包括第一个为0时）
+            char * end;
+            errno = 0;
+            long long length = strtoll(value, &end, 10);
+            if (!isdigit(value[0]) || *end || errno || (m_has_content_length && length != m_content_length)) {
+                return BAD_REQUEST;
+            }
+            m_content_length = length;
+            m_has_content_length = true;
+            break;
+        } case HDR_TRANSFER_ENCODING: {
+            // 只支持chunked，其他编码无法确定请求体的边界
+            if (strcasecmp(value, "chunked") != 0 || m_chunked) {
+                return BAD_REQUEST;
+            }
+            m_chunked = true;
+            break;
+        } default: {
+            break;
+        }
     }
     return NO_REQUEST;
 }
 
-// 没有解析
-http_conn::HTTP_CODE http_conn::parse_contents(char * text) {
-    if (m_read_idx >= m_checked_index + m_content_length) {
-        text[m_content_length] = '\0';
-        // printf("text: %s\n", text);
-        // printf("read idx: %d, check idx: %d, content l: %d, content start: %d\n", m_read_idx, m_checked_index, m_content_length, m_content_start);
-        return GET_REQUEST;
+const char * http_conn::get_header(HEADER_ID id) const {
+    int i = m_header_index[id];
+    return i == -1 ? NULL : m_read_buf + m_headers[i].value;
+}
+
+// 请求体边到边处理：读缓冲中已经到达的部分（chunked时先解码）处理完就从读缓冲中去掉，
+// 读缓冲只保留请求头和还没有处理的数据，所以请求体的大小不受读缓冲的限制。
+// 转发给后端的请求体交给连接池，连接池的发送缓冲满时剩下的留在读缓冲中；其余的处理即丢弃
+http_conn::HTTP_CODE http_conn::parse_contents() {
+    char * data = m_read_buf + m_content_start;
+    int total = m_read_idx - m_content_start;
+    int len = total;
+    upstream_pool * pool = m_upstream ? m_upstream_pool : NULL;
+    if (pool) {
+        int room = pool->body_room(m_upstream);
+        len = len < room ? len : room;
     }
-    return NO_REQUEST;
+    int consumed, out;
+    bool done;
+    if (m_chunked) {
+        chunked_decoder::RESULT r = m_chunk_decoder.decode(data, len, consumed, out);
+        if (r == chunked_decoder::CHUNK_BAD) {
+            return BAD_REQUEST;
+        }
+        done = r == chunked_decoder::CHUNK_DONE;
+    } else {
+        consumed = out = len < m_body_remaining ? len : (int)m_body_remaining;
+        m_body_remaining -= consumed;
+        done = m_body_remaining == 0;
+    }
+    m_body_received += out;
+    long long max_body = config::get().max_body_size;
+    if (max_body && m_body_received > max_body) {
+        return BODY_TOO_LARGE;
+    }
+    if (pool && out > 0) {
+        pool->send_body(m_upstream, data, out);
+    }
+
+    // 去掉处理过的部分，请求体之后的数据（流水线中的下一个请求）移上来
+    int remain = total - consumed;
+    memmove(data, data + consumed, remain);
+    m_read_idx = m_content_start + remain;
+    m_checked_index = m_content_start;
+    return done ? GET_REQUEST : NO_REQUEST;
 }
 
-// 解析一行，判断依据\r\n
+// 解析一行，判断依据\r\n。用find_line_end()成块查找行结尾，LINE_OPEN时m_checked_index停在已经查找过的位置
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char tmp;
-    for (; m_checked_index < m_read_idx; ++m_checked_index) {
-        tmp = m_read_buf[m_checked_index];
-        if (tmp == '\r') {
-            if ((m_checked_index + 1) == m_read_idx) return LINE_OPEN;
-            else if (m_read_buf[m_checked_index + 1] == '\n') {
-                m_read_buf[m_checked_index++] = '\0';
-                m_read_buf[m_checked_index++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        } else if (tmp == '\n') {
-            if (m_checked_index > 1 && m_read_buf[m_checked_index-1] == '\r') {
-                m_read_buf[m_checked_index-1] = '\0';
-                m_read_buf[m_checked_index++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+    const char * end = m_read_buf + m_read_idx;
+    m_checked_index = find_line_end(m_read_buf + m_checked_index, end) - m_read_buf;
+    if (m_checked_index == m_read_idx) {
+        return LINE_OPEN;
+    }
+    if (m_read_buf[m_checked_index] == '\r') {
+        if ((m_checked_index + 1) == m_read_idx) return LINE_OPEN;
+        else if (m_read_buf[m_checked_index + 1] == '\n') {
+            m_read_buf[m_checked_index++] = '\0';
+            m_read_buf[m_checked_index++] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
     }
-    return LINE_OPEN;
+    // 单独的\n
+    return LINE_BAD;
 }
 
-// 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
+// 当得到一个完整、正确的HTTP请求时，找到目标文件，再确定要发送哪些字节
 http_conn::HTTP_CODE http_conn::do_request() {
-    strcpy(m_file, doc_root);
-    int len = strlen(doc_root);
+    if (strcmp(m_url, metrics_url) == 0 || strcmp(m_url, metrics_json_url) == 0) {
+        return serve_metrics(strcmp(m_url, metrics_json_url) == 0);
+    }
+    HTTP_CODE ret = find_file();
+    if (ret == FILE_REQUEST) {
+        ret = parse_range();
+    }
+    return ret;
+}
+
+// 运行指标报告放在malloc的内存中，和文件一样作为响应体，发送完之后释放
+http_conn::HTTP_CODE http_conn::serve_metrics(bool json) {
+    std::string body;
+    file_cache_stats cache_stats;
+    if (m_file_cache) {
+        m_file_cache->get_stats(cache_stats);
+    }
+    const file_cache_stats * cache = m_file_cache ? &cache_stats : NULL;
+    if (json) {
+        metrics::render_json(body, m_user_count, cache);
+        m_content_type = "application/json";
+    } else {
+        metrics::render_prometheus(body, m_user_count, cache);
+        m_content_type = "text/plain; version=0.0.4";
+    }
+    m_file_address = (char *)malloc(body.size());
+    if (!m_file_address) {
+        return INTERNAL_ERROR;
+    }
+    memcpy(m_file_address, body.data(), body.size());
+    m_heap_body = true;
+    memset(&m_file_stat, 0, sizeof(m_file_stat));
+    m_file_stat.st_size = body.size();
+    return METRICS_REQUEST;
+}
+
+// 分析目标文件的属性，如果目标文件存在、对所有用户可读，且不是目录，则从缓存中取得它的内容，
+// 或者使用mmap将其映射到内存地址m_file_address处，并告诉调用者获取文件成功
+http_conn::HTTP_CODE http_conn::find_file() {
+    normalize_path(m_url);
+    // 网站根目录可能被重新加载，一个请求中只取一次
+    const std::string & doc_root = config::get().doc_root;
+    strncpy(m_file, doc_root.c_str(), FILENAME_LEN - 1);
+    int len = strlen(m_file);
     strncpy(m_file + len, m_url, FILENAME_LEN - len - 1);
 
-    // 获取m_file文件的相关的状态信息，-1失败，0成功
+    // 可压缩的类型根据Accept-Encoding选择是否发送gzip版本
+    bool compressible;
+    mime_type(m_file, &compressible);
+    bool want_gzip = compressible && m_accept_gzip;
+
+    // 缓存中只有可以访问的普通文件，命中时不需要任何文件系统调用
+    if (m_file_cache) {
+        if (want_gzip && (m_cache_entry = m_file_cache->lookup_gzip(m_file))) {
+            if (m_cache_entry->data) {
+                m_vary = true;
+                m_gzip = true;
+                m_file_stat = m_cache_entry->st;
+                m_file_address = m_cache_entry->data;
+                if (not_modified()) {
+                    unmap();
+                    return NOT_MODIFIED;
+                }
+                return FILE_REQUEST;
+            }
+            // 该文件没有值得使用的gzip版本
+            file_cache::release(m_cache_entry);
+            m_cache_entry = NULL;
+            want_gzip = false;
+        }
+        if ((m_cache_entry = m_file_cache->lookup(m_file))) {
+            m_vary = compressible;
+            return use_cache_entry(want_gzip);
+        }
+    }
+
+    // 获取m_file文件的相关的状态信息，-1失败，0成功；
+    // 以下的错误由访问日志按状态码记录，不再同步地打印到标准输出
     if (stat(m_file, &m_file_stat) < 0) {
-        printf("wrong path!\n");
         return NO_RESOURCE;
     }
 
     // 判断访问权限
     if (!(m_file_stat.st_mode & S_IROTH)) {
-        printf("forbidden access!\n");
         return FORBIDDEN_REQUEST;
     }
 
     // 判断是否是目录
     if (S_ISDIR(m_file_stat.st_mode)) {
-        printf("it's a directory!\n");
         return BAD_REQUEST;
     }
 
+    m_vary = compressible;
+
+    // 不太大的文件读入缓存
+    if (m_file_cache && (size_t)m_file_stat.st_size <= m_file_cache->max_entry_size()
+        && (m_cache_entry = m_file_cache->load(m_file))) {
+        return use_cache_entry(want_gzip);
+    }
+
+    // 不缓存的文件只使用预先压缩好的.gz兄弟文件
+    const char * path = m_file;
+    char gz_file[FILENAME_LEN + 3];
+    if (want_gzip) {
+        struct stat gz_stat;
+        snprintf(gz_file, sizeof(gz_file), "%s.gz", m_file);
+        if (stat(gz_file, &gz_stat) == 0 && S_ISREG(gz_stat.st_mode) && (gz_stat.st_mode & S_IROTH)) {
+            path = gz_file;
+            m_file_stat = gz_stat;
+            m_gzip = true;
+        }
+    }
+
+    // 验证器匹配时不需要打开文件
+    if (not_modified()) {
+        return NOT_MODIFIED;
+    }
+
     // 读文件
-    int fd = open(m_file, O_RDONLY);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NO_RESOURCE;
+    }
+    // 没有gzip版本的大文件边读边压缩；Range针对的是压缩后的字节，这时不压缩
+    if (want_gzip && !m_gzip && config::get().gzip_stream && (size_t)m_file_stat.st_size >= file_cache::GZIP_MIN_LENGTH
+        && !get_header(HDR_RANGE)) {
+        return stream_gzip(fd);
+    }
+    if ((size_t)m_file_stat.st_size >= config::get().sendfile_threshold) {
+        // 不映射，保留文件描述符，写的时候用sendfile发送
+        m_file_fd = fd;
+        m_file_offset = 0;
+        return FILE_REQUEST;
+    }
     // 内存映射
     m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
+    if (m_file_address == MAP_FAILED) {
+        m_file_address = NULL;
+        return INTERNAL_ERROR;
+    }
+    return FILE_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::stream_gzip(int fd) {
+    try {
+        m_body_source = new gzip_file_source(fd);
+    } catch(...) {
+        close(fd);
+        return INTERNAL_ERROR;
+    }
+    m_gzip = true;
+    return STREAM_REQUEST;
+}
+
+// 用缓存项m_cache_entry作为响应体，want_gzip时尽量换成它的gzip版本
+http_conn::HTTP_CODE http_conn::use_cache_entry(bool want_gzip) {
+    if (want_gzip) {
+        cache_entry * gz = m_file_cache->lookup_gzip(m_file);
+        if (!gz) {
+            gz = m_file_cache->load_gzip(m_file, m_cache_entry);
+        }
+        if (gz && gz->data) {
+            file_cache::release(m_cache_entry);
+            m_cache_entry = gz;
+            m_gzip = true;
+        } else {
+            file_cache::release(gz);
+        }
+    }
+    m_file_stat = m_cache_entry->st;
+    m_file_address = m_cache_entry->data;
+    if (not_modified()) {
+        unmap();
+        return NOT_MODIFIED;
+    }
     return FILE_REQUEST;
 }
 
-// 往写缓冲中写入待发送的数据
+// Range: bytes=0-499, 1000-, -500
+// 语法错误、范围太多或者If-Range不匹配时忽略Range，发送整个文件；所有范围都超出文件时返回416
+http_conn::HTTP_CODE http_conn::parse_range() {
+    m_range_count = 0;
+    const char * range = get_header(HDR_RANGE);
+    if (!range) {
+        return FILE_REQUEST;
+    }
+
+    // If-Range是ETag或者Last-Modified，不匹配说明客户端已有的部分已经过期
+    const char * v = get_header(HDR_IF_RANGE);
+    if (v) {
+        if (v[0] == '"') {
+            char etag[64];
+            make_etag(etag, sizeof(etag));
+            if ((size_t)strcspn(v, " \t") != strlen(etag) || strncmp(v, etag, strlen(etag)) != 0) {
+                return FILE_REQUEST;
+            }
+        } else if (parse_http_date(v) != m_file_stat.st_mtime) {
+            return FILE_REQUEST;
+        }
+    }
+
+    const char * p = range;
+    if (strncasecmp(p, "bytes=", 6) != 0) {
+        return FILE_REQUEST;
+    }
+    p += 6;
+
+    off_t size = m_file_stat.st_size;
+    int specs = 0;
+    int count = 0;
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (!*p) break;
+        if (++specs > MAX_RANGES) {
+            return FILE_REQUEST;
+        }
+        off_t start, end;
+        char * e;
+        if (*p == '-') {
+            // 最后n个字节
+            if (!isdigit(p[1])) return FILE_REQUEST;
+            long long n = strtoll(p + 1, &e, 10);
+            start = n < size ? size - n : 0;
+            end = size - 1;
+        } else {
+            if (!isdigit(*p)) return FILE_REQUEST;
+            start = strtoll(p, &e, 10);
+            if (*e != '-') return FILE_REQUEST;
+            p = e + 1;
+            if (isdigit(*p)) {
+                end = strtoll(p, &e, 10);
+                if (end < start) return FILE_REQUEST;
+                if (end > size - 1) end = size - 1;
+            } else {
+                e = (char *)p;
+                end = size - 1;
+            }
+        }
+        p = e + strspn(e, " \t");
+        if (*p && *p != ',') return FILE_REQUEST;
+        // 起点超出文件的范围不满足，跳过
+        if (start < size && start <= end) {
+            m_ranges[count].start = start;
+            m_ranges[count].end = end;
+            count++;
+        }
+    }
+    if (specs == 0) {
+        return FILE_REQUEST;
+    }
+    if (count == 0) {
+        unmap();
+        return RANGE_NOT_SATISFIABLE;
+    }
+    m_range_count = count;
+    return FILE_REQUEST;
+}
+
+// 强ETag，由inode、修改时间（纳秒）和大小组成，gzip版本加上"-gz"后缀以区别于原文件
+void http_conn::make_etag(char * buf, int len) {
+    unsigned long long mtime = (unsigned long long)m_file_stat.st_mtim.tv_sec * 1000000000ULL + m_file_stat.st_mtim.tv_nsec;
+    snprintf(buf, len, "\"%llx-%llx-%llx%s\"", (unsigned long long)m_file_stat.st_ino, mtime,
+        (unsigned long long)m_file_stat.st_size, m_gzip ? "-gz" : "");
+}
+
+// 有If-None-Match时只比较ETag，否则比较If-Modified-Since和文件的修改时间
+bool http_conn::not_modified() {
+    const char * if_none_match = get_header(HDR_IF_NONE_MATCH);
+    if (if_none_match) {
+        char etag[64];
+        make_etag(etag, sizeof(etag));
+        return etag_matches(if_none_match, etag);
+    }
+    return m_if_modified_since != -1 && m_file_stat.st_mtime <= m_if_modified_since;
+}
+
+// 保证写缓冲中还有len字节的空间
+bool http_conn::reserve_write(int len) {
+    if (!m_write_buf) {
+        m_write_buf = m_buffer_pool.alloc(WRITE_BUFFER_SIZE, m_write_size);
+        if (!m_write_buf) return false;
+    }
+    if (m_write_idx + len <= m_write_size) {
+        return true;
+    }
+    // 写缓冲不够，换成更大一级的，排队的响应只记录了响应头在写缓冲中的位置
+    int size;
+    char * buf = m_write_idx + len <= MAX_WRITE_BUFFER_SIZE ? m_buffer_pool.alloc(m_write_idx + len, size) : NULL;
+    if (!buf) return false;
+    memcpy(buf, m_write_buf, m_write_idx);
+    m_buffer_pool.free(m_write_buf, m_write_size);
+    m_write_buf = buf;
+    m_write_size = size;
+    return true;
+}
+
+// 往写缓冲中写入待发送的数据，只用于不常见的响应头，常见的用append()拼接
 bool http_conn::add_response(const char* format, ...) {
-    if (m_write_idx >= WRITE_BUFFER_SIZE) return false;
-    va_list arglist;
-    va_start(arglist, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - m_write_idx - 1, format, arglist);
-    if (len > (WRITE_BUFFER_SIZE - m_write_idx - 1)) return false;
+    if (!reserve_write(1)) return false;
+    while (true) {
+        va_list arglist;
+        va_start(arglist, format);
+        int len = vsnprintf(m_write_buf + m_write_idx, m_write_size - m_write_idx, format, arglist);
+        va_end(arglist);
+        if (len < m_write_size - m_write_idx) {
+            m_write_idx += len;
+            return true;
+        }
+        if (!reserve_write(len + 1)) return false;
+    }
+}
+
+bool http_conn::append(const char * data, int len) {
+    if (!reserve_write(len)) return false;
+    memcpy(m_write_buf + m_write_idx, data, len);
     m_write_idx += len;
-    va_end(arglist);
     return true;
 }
 
+bool http_conn::append_int(long long value) {
+    char buf[24];
+    char * p = buf + sizeof(buf);
+    unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0) *--p = '-';
+    return append(p, buf + sizeof(buf) - p);
+}
+
+#define STATUS_LINE(status, title) { status, "HTTP/1.1 " #status " " title "\r\n", sizeof("HTTP/1.1 " #status " " title "\r\n") - 1 }
+
+// 预先拼好的状态行
+static const struct {
+    int status;
+    const char * line;
+    int len;
+} status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(500, "Internal Error"),
+    STATUS_LINE(502, "Bad Gateway"),
+};
+
+// 状态行之后紧跟Date
 bool http_conn::add_status_line(int status, const char* title) {
-    return add_response("HTTP/1.1 %d %s\r\n", status, title);
+    m_status = status;
+    bool f = false;
+    for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+        if (status_lines[i].status == status) {
+            f = append(status_lines[i].line, status_lines[i].len);
+            break;
+        }
+    }
+    if (!f) {
+        f = add_response("HTTP/1.1 %d %s\r\n", status, title);
+    }
+    return f && add_date();
+}
+
+// Date每个线程每秒格式化一次
+bool http_conn::add_date() {
+    static __thread time_t cached_sec = -1;
+    static __thread char cached_line[48];
+    static __thread int cached_len = 0;
+    time_t now = time(NULL);
+    if (now != cached_sec) {
+        memcpy(cached_line, "Date: ", 6);
+        cached_len = 6 + format_http_date(now, cached_line + 6);
+        memcpy(cached_line + cached_len, "\r\n", 2);
+        cached_len += 2;
+        cached_sec = now;
+    }
+    return append(cached_line, cached_len);
 }
 
-bool http_conn::add_headers(int content_length) {
+bool http_conn::add_headers(long long content_length, const char * type) {
     bool f = add_content_length(content_length);
-    f = f && add_content_type();
+    f = f && add_content_type(type);
+    f = f && add_content_encoding();
     f = f && add_linger();
     f = f && add_blank_line();
     return f;
 }
 
-bool http_conn::add_content_length(int content_length) {
-    return add_response("Content-Length: %d\r\n", content_length);
+bool http_conn::add_content_length(long long content_length) {
+    static const char name[] = "Content-Length: ";
+    bool f = append(name, sizeof(name) - 1);
+    f = f && append_int(content_length);
+    return f && append("\r\n", 2);
+}
+
+bool http_conn::add_content_type(const char * type) {
+    static const char name[] = "Content-Type: ";
+    bool f = append(name, sizeof(name) - 1);
+    f = f && append(type, strlen(type));
+    return f && append("\r\n", 2);
+}
+
+// 生成的响应体用m_content_type，文件按扩展名确定
+const char * http_conn::content_type() {
+    if (m_content_type) {
+        return m_content_type;
+    }
+    return mime_type(m_file);
+}
+
+bool http_conn::add_content_encoding() {
+    static const char gzip[] = "Content-Encoding: gzip\r\n";
+    static const char vary[] = "Vary: Accept-Encoding\r\n";
+    bool f = true;
+    if (m_gzip) f = append(gzip, sizeof(gzip) - 1);
+    if (m_vary) f = f && append(vary, sizeof(vary) - 1);
+    return f;
+}
+
+bool http_conn::add_validators() {
+    char etag[64];
+    make_etag(etag, sizeof(etag));
+    bool f = append("ETag: ", 6);
+    f = f && append(etag, strlen(etag));
+    f = f && append("\r\n", 2);
+    return f && add_last_modified();
 }
 
-bool http_conn::add_content_type() {
-    return add_response("Content-Type: text/html\r\n");
+bool http_conn::add_last_modified() {
+    char line[48] = "Last-Modified: ";
+    int len = 15 + format_http_date(m_file_stat.st_mtime, line + 15);
+    memcpy(line + len, "\r\n", 2);
+    len += 2;
+    return append(line, len);
+}
+
+// 多范围响应：multipart/byteranges，每个部分的头部放在写缓冲中，部分的内容和单个响应体一样
+// 直接来自缓存、映射或者sendfile，不复制文件
+bool http_conn::add_multipart(int header_start) {
+    static std::atomic<unsigned> boundary_seq(0);
+    static const char * part_format = "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n";
+    static const char * last_format = "\r\n--%s--\r\n";
+    char boundary[24];
+    snprintf(boundary, sizeof(boundary), "%08x%08x", (unsigned)time(NULL), boundary_seq++);
+    const char * type = content_type();
+    long long size = m_file_stat.st_size;
+
+    // 先算出响应体的长度
+    long long content_length = snprintf(NULL, 0, last_format, boundary);
+    for (int i = 0; i < m_range_count; i++) {
+        long long start = m_ranges[i].start, end = m_ranges[i].end;
+        content_length += snprintf(NULL, 0, part_format, boundary, type, start, end, size) + end - start + 1;
+    }
+
+    int first = m_resp_count;
+    bool f = add_status_line(206, partial_206_title);
+    f = f && add_validators();
+    f = f && add_content_length(content_length);
+    f = f && add_response("Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+    f = f && add_content_encoding();
+    f = f && add_linger();
+    f = f && add_blank_line();
+    for (int i = 0; f && i < m_range_count; i++) {
+        long long start = m_ranges[i].start, end = m_ranges[i].end;
+        f = add_response(part_format, boundary, type, start, end, size);
+        if (f) {
+            set_body(push_response(header_start), start, end - start + 1);
+            header_start = m_write_idx;
+        }
+    }
+    f = f && add_response(last_format, boundary);
+    if (!f) {
+        m_resp_count = first;
+        return false;
+    }
+    take_body(push_response(header_start));
+    return true;
 }
 
 bool http_conn::add_linger() {
-    return add_response("Connection: %s\r\n", (m_linger ? "keep-alive" : "close"));
+    static const char keep_alive[] = "Connection: keep-alive\r\n";
+    static const char close[] = "Connection: close\r\n";
+    return m_linger ? append(keep_alive, sizeof(keep_alive) - 1) : append(close, sizeof(close) - 1);
+}
+
+bool http_conn::add_chunked() {
+    static const char chunked[] = "Transfer-Encoding: chunked\r\n";
+    return append(chunked, sizeof(chunked) - 1);
 }
 
 bool http_conn::add_blank_line() {
-    return add_response("\r\n");
+    return append("\r\n", 2);
 }
 
 bool http_conn::add_content(const char* content) {
-    return add_response("%s", content);
+    return append(content, strlen(content));
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(http_conn::HTTP_CODE ret) {
     bool ok = false;
+    int header_start = m_write_idx;
     switch (ret) {
         case INTERNAL_ERROR: {
             bool f = add_status_line(500, error_500_title);
-            f = f && add_headers(strlen(error_500_form));
+            f = f && add_headers(strlen(error_500_form), "text/html");
             f = f && add_content(error_500_form);
             if (!f) return false;
             break;
         } case BAD_REQUEST: {
             bool f = add_status_line(400, error_400_title);
-            f = f && add_headers(strlen(error_400_form));
+            f = f && add_headers(strlen(error_400_form), "text/html");
             f = f && add_content(error_400_form);
             if (!f) return false;
             break;
         } case NO_RESOURCE: {
             bool f = add_status_line(404, error_404_title);
-            f = f && add_headers(strlen(error_404_form));
+            f = f && add_headers(strlen(error_404_form), "text/html");
             f = f && add_content(error_404_form);
             if (!f) return false;
             break;
+        } case BODY_TOO_LARGE: {
+            bool f = add_status_line(413, error_413_title);
+            f = f && add_headers(strlen(error_413_form), "text/html");
+            f = f && add_content(error_413_form);
+            if (!f) return false;
+            break;
         } case FORBIDDEN_REQUEST: {
             bool f = add_status_line(403, error_403_title);
-            f = f && add_headers(strlen(error_403_form));
+            f = f && add_headers(strlen(error_403_form), "text/html");
             f = f && add_content(error_403_form);
             if (!f) return false;
             break;
-        } case FILE_REQUEST: {
+        } case NOT_MODIFIED: {
+            // 304没有响应体，也不带Content-Length
+            bool f = add_status_line(304, not_modified_304_title);
+            f = f && add_validators();
+            f = f && add_content_encoding();
+            f = f && add_linger();
+            f = f && add_blank_line();
+            if (!f) return false;
+            break;
+        } case METRICS_REQUEST: {
             bool f = add_status_line(200, ok_200_title);
-            f = f && add_headers(m_file_stat.st_size);
+            f = f && add_response("Cache-Control: no-store\r\n");
+            f = f && add_headers(m_file_stat.st_size, content_type());
+            if (!f) {
+                unmap();
+                return false;
+            }
+            ok = true;
+            break;
+        } case STREAM_REQUEST: {
+            // 响应体的长度事先不知道，用chunked编码；没有ETag，因为压缩的结果没有保证不变
+            bool f = add_status_line(200, ok_200_title);
+            f = f && add_last_modified();
+            f = f && add_content_type(content_type());
+            f = f && add_content_encoding();
+            f = f && add_chunked();
+            f = f && add_linger();
+            f = f && add_blank_line();
+            if (!f) {
+                unmap();
+                return false;
+            }
+            response & r = push_response(header_start);
+            r.source = m_body_source;
+            m_body_source = NULL;
+            if (!m_linger) {
+                m_close_after = true;
+            }
+            return true;
+        } case UPSTREAM_REQUEST: {
+            return build_upstream();
+        } case RANGE_NOT_SATISFIABLE: {
+            bool f = add_status_line(416, error_416_title);
+            f = f && add_response("Content-Range: bytes */%lld\r\n", (long long)m_file_stat.st_size);
+            f = f && add_headers(strlen(error_416_form), "text/html");
+            f = f && add_content(error_416_form);
             if (!f) return false;
+            break;
+        } case FILE_REQUEST: {
+            if (m_range_count > 1) {
+                if (!add_multipart(header_start)) {
+                    unmap();
+                    return false;
+                }
+                if (!m_linger) {
+                    m_close_after = true;
+                }
+                return true;
+            }
+            bool f;
+            if (m_range_count == 1) {
+                f = add_status_line(206, partial_206_title);
+                f = f && add_validators();
+                f = f && add_response("Content-Range: bytes %lld-%lld/%lld\r\n", (long long)m_ranges[0].start,
+                    (long long)m_ranges[0].end, (long long)m_file_stat.st_size);
+                f = f && add_headers(m_ranges[0].end - m_ranges[0].start + 1, content_type());
+            } else {
+                f = add_status_line(200, ok_200_title);
+                f = f && add_validators();
+                f = f && add_response("Accept-Ranges: bytes\r\n");
+                f = f && add_headers(m_file_stat.st_size, content_type());
+            }
+            if (!f) {
+                unmap();
+                return false;
+            }
             ok = true;
             break;
         } default: {
@@ -474,47 +2073,212 @@ bool http_conn::process_write(http_conn::HTTP_CODE ret) {
         }
     }
 
-    // printf("发送响应：%s\n", m_write_buf);
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
-
+    // 响应体交给响应队列，发送完之后释放
+    response & r = push_response(header_start);
     if (ok) {
         // printf("响应体：%s\n", m_file_address);
-        m_iv[1].iov_base = m_file_address;
-        m_iv[1].iov_len = m_file_stat.st_size;
-        m_iv_count += 1;
-        bytes_to_send += m_file_stat.st_size;
+        if (m_range_count == 1) {
+            set_body(r, m_ranges[0].start, m_ranges[0].end - m_ranges[0].start + 1);
+        } else {
+            set_body(r, 0, m_file_stat.st_size);
+        }
+        take_body(r);
+    }
+    if (!m_linger) {
+        m_close_after = true;
     }
 
     return true;
 }
 
+http_conn::response & http_conn::push_response(int header_start) {
+    response & r = m_responses[m_resp_count++];
+    r.header_start = header_start;
+    r.header_len = m_write_idx - header_start;
+    r.sent = 0;
+    r.body = NULL;
+    r.body_len = 0;
+    r.entry = NULL;
+    r.map_address = NULL;
+    r.map_len = 0;
+    r.file_fd = -1;
+    r.file_offset = 0;
+    r.close_fd = -1;
+    r.heap_body = NULL;
+    r.source = NULL;
+    r.upstream = false;
+    r.pipe_fd = -1;
+    return r;
+}
+
+void http_conn::set_body(response & r, off_t start, size_t len) {
+    r.body = m_file_address ? m_file_address + start : NULL;
+    r.body_len = len;
+    r.file_fd = m_file_fd;
+    r.file_offset = m_file_offset + start;
+}
+
+void http_conn::take_body(response & r) {
+    r.entry = m_cache_entry;
+    r.map_address = m_cache_entry || m_heap_body ? NULL : m_file_address;
+    r.heap_body = m_heap_body ? m_file_address : NULL;
+    r.map_len = m_file_stat.st_size;
+    r.close_fd = m_file_fd;
+    m_file_address = NULL;
+    m_cache_entry = NULL;
+    m_file_fd = -1;
+    m_heap_body = false;
+}
+
 // 由线程池中的工作线程调用，处理HTTP请求的入口函数
 void http_conn::process() {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST) {
+    // 流水线：依次处理读缓冲中所有完整的请求，响应排队之后一起发送
+    m_more_requests = false;
+    uint64_t queue_ns = 0;
+    if (m_queued_ns) {
+        queue_ns = metrics::now_ns() - m_queued_ns;
+        metrics::record(STAGE_QUEUE, queue_ns);
+        m_queued_ns = 0;
+    }
+    while (!m_close_after) {
+        if (m_resp_count >= MAX_PIPELINE || (m_resp_count > 0 && m_write_idx + MIN_RESPONSE_SPACE > MAX_WRITE_BUFFER_SIZE)
+            || (m_resp_count > 0 && m_responses[m_resp_count - 1].source)) {
+            // 响应队列已满，或者队尾是按块生成的响应（它要使用整个写缓冲），剩下的请求等发送完再处理
+            m_more_requests = m_read_idx > 0;
+            break;
+        }
+
+        // 解析HTTP请求
+        uint64_t start = metrics::now_ns();
+        HTTP_CODE read_ret = m_upstream_deferred ? UPSTREAM_REQUEST : process_read();
+        if (read_ret == NO_REQUEST) {
+            break;
+        }
+        if (read_ret == UPSTREAM_REQUEST && m_resp_count > 0) {
+            // 后端的响应要从头使用写缓冲，等前面的响应发送完再开始转发
+            m_upstream_deferred = true;
+            m_more_requests = true;
+            break;
+        }
+        m_upstream_deferred = false;
+        uint64_t parsed = metrics::now_ns();
+        metrics::record(STAGE_PARSE, parsed - start);
+        metrics::count(COUNTER_REQUESTS);
+        if (read_ret == BAD_REQUEST || read_ret == INTERNAL_ERROR || read_ret == BODY_TOO_LARGE) {
+            // 后面的数据无法再可靠地解析，发送响应后关闭连接
+            m_linger = false;
+        }
+        if (m_draining) {
+            // 新的请求由新进程处理
+            m_linger = false;
+        }
+
+        // 生成响应
+        int first_resp = m_resp_count;
+        bool write_ret = process_write(read_ret);
+        uint64_t built = metrics::now_ns();
+        metrics::record(STAGE_BUILD, built - parsed);
+        if (m_access_log && read_ret != UPSTREAM_REQUEST) {
+            // 转发给后端的请求在响应结束时记录
+            long long bytes = 0;
+            for (int i = first_resp; i < m_resp_count; i++) {
+                bytes += m_responses[i].header_len + m_responses[i].body_len;
+            }
+            log_access(bytes, queue_ns, parsed - start, built - parsed);
+            queue_ns = 0;
+        }
+        if (!write_ret) {
+            // 可能在工作线程中，不能直接操作时间轮，关闭socket的读写后交给事件循环关闭连接
+            shutdown(m_sockfd, SHUT_RDWR);
+            m_loop->modify(this, EPOLLIN);
+            return;
+        }
+        if (read_ret == UPSTREAM_REQUEST) {
+            // 请求体和响应由事件循环转发，转发结束之后再处理流水线中后面的请求
+            break;
+        }
+        finish_request();
+    }
+
+    // 读缓冲中的请求都已经处理完，连接空闲时不占用读缓冲区
+    release_read_buf();
+    if (m_resp_count == 0) {
         // 修改socket epoll
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        m_loop->modify(this, EPOLLIN);
         return;
     }
-    
-    // 生成响应
-    bool write_ret = process_write(read_ret);
-    if (!write_ret) {
-        close_conn();
-        // printf("close\n");
-        return;
+    if (!m_write_start_ns) {
+        m_write_start_ns = metrics::now_ns();
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT); // 可以写了
+    m_loop->modify(this, EPOLLOUT); // 可以写了
+}
+
+// 记录访问日志，bytes为本次请求的响应的字节数
+void http_conn::log_access(long long bytes, uint64_t queue_ns, uint64_t parse_ns, uint64_t build_ns) {
+    access_entry e;
+    e.addr = &m_address;
+    // 请求行没有解析成功时URL不可靠
+    bool has_line = m_check_state != CHECK_STATE_REQUESTLINE;
+    e.method = has_line ? method_names[m_method] : NULL;
+    e.url = has_line ? m_url : NULL;
+    e.status = m_status;
+    e.bytes = bytes;
+    e.queue_ns = queue_ns;
+    e.parse_ns = parse_ns;
+    e.build_ns = build_ns;
+    m_access_log->log(e);
 }
 
 void http_conn::unmap() {
-    if (m_file_address) {
+    if (m_cache_entry) {
+        file_cache::release(m_cache_entry);
+        m_cache_entry = NULL;
+        m_file_address = NULL;
+    }
+    if (m_file_address && m_heap_body) {
+        free(m_file_address);
+        m_file_address = NULL;
+        m_heap_body = false;
+    } else if (m_file_address) {
         munmap(m_file_address, m_file_stat.st_size);
         m_file_address = NULL;
     }
+    if (m_file_fd != -1) {
+        close(m_file_fd);
+        m_file_fd = -1;
+    }
+    delete m_body_source;
+    m_body_source = NULL;
 }
 
+void http_conn::release_response(response & r) {
+    if (r.entry) {
+        file_cache::release(r.entry);
+        r.entry = NULL;
+    } else if (r.map_address) {
+        munmap(r.map_address, r.map_len);
+    }
+    r.map_address = NULL;
+    free(r.heap_body);
+    r.heap_body = NULL;
+    if (r.close_fd != -1) {
+        close(r.close_fd);
+        r.close_fd = -1;
+    }
+    r.file_fd = -1;
+    delete r.source;
+    r.source = NULL;
+    if (r.upstream && m_upstream) {
+        end_upstream();
+    }
+    r.upstream = false;
+    r.pipe_fd = -1;
+}
+
+void http_conn::release_responses() {
+    for (int i = m_resp_head; i < m_resp_count; i++) {
+        release_response(m_responses[i]);
+    }
+    m_resp_head = 0;
+    m_resp_count = 0;
+}
\ No newline at end of file
@@ -16,18 +16,47 @@
 #include <stdarg.h>
 #include "locker.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <string.h>
 #include "util_timer.h"
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "metrics.h"
+#include "http_parser.h"
+#include "access_log.h"
+#include "config.h"
+#include "chunked.h"
+#include "body_source.h"
+#include "tls.h"
+#include <atomic>
+#include <time.h>
+#include <ctype.h>
+
+class eventloop;
+struct upstream_request;
+class upstream_pool;
 
 // 任务和信息都放进去
 class http_conn {
 public:
-    static sort_timer_list *m_timer_list;
-    static int m_epollfd; // 所有socket上的事件都被注册到一个epoll中
-    static int m_user_count; // 统计用户数量
-    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲大小
+    static std::atomic<int> m_user_count; // 统计用户数量（所有事件循环）
+    static file_cache *m_file_cache; // 所有线程共享的静态文件缓存，可以为NULL
+    static buffer_pool m_buffer_pool; // 读写缓冲区池
+    static access_log *m_access_log; // 访问日志，NULL表示不记录
+    static std::atomic<bool> m_draining; // 平滑升级后旧进程排空连接，之后的响应都关闭连接
+    static tls_context *m_tls_context; // TLS端口的上下文，NULL表示没有TLS端口
+    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲的初始大小
+    static const int MAX_READ_BUFFER_SIZE = buffer_pool::MAX_SIZE; // 读缓冲的最大大小，请求行和请求头不能超过它
+    static const int WRITE_BUFFER_SIZE = 2048; // 写缓冲的初始大小
+    static const int MAX_WRITE_BUFFER_SIZE = 16 * 1024; // 写缓冲的最大大小
     static const int FILENAME_LEN = 200; // 文件名最大长度
+    static const int MAX_PIPELINE = 16; // 一个连接上最多排队等待发送的响应数
+    static const int MAX_HEADERS = 64; // 一个请求最多的请求头数，超过时返回400
+    static const int MAX_RANGES = 8; // 一个请求最多的字节范围数，超过时忽略Range发送整个文件
+    // 响应队列的大小：多范围响应的每个部分占一项，队列中不到MAX_PIPELINE项时总能放下一个多范围响应
+    static const int MAX_QUEUE = MAX_PIPELINE + MAX_RANGES + 1;
+    static const int MIN_RESPONSE_SPACE = 512; // 写缓冲剩余空间少于该值时，先发送已经排队的响应再继续解析
+    static const size_t STREAM_WRITE_QUANTUM = 256 * 1024; // 按块生成的响应一次可写事件中最多发送的字节数
 
     // HTTP请求方法，只支持GET
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT };
@@ -46,29 +75,101 @@ public:
         NO_RESOURCE         :   表示服务器没有资源
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求,获取文件成功
+        RANGE_NOT_SATISFIABLE : 请求的字节范围都超出了文件
+        NOT_MODIFIED        :   条件请求的验证器匹配，文件没有变化
+        METRICS_REQUEST     :   请求运行指标，响应体已经生成
+        STREAM_REQUEST      :   响应体由m_body_source边发送边生成，用chunked编码
+        BODY_TOO_LARGE      :   请求体超过max_body_size
+        UPSTREAM_REQUEST    :   请求转发给FastCGI或者HTTP后端，请求体和响应由事件循环边收边转发
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, NOT_MODIFIED, RANGE_NOT_SATISFIABLE, METRICS_REQUEST, STREAM_REQUEST, BODY_TOO_LARGE, UPSTREAM_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // 转发给后端的请求推进一步之后，事件循环接下来要做的：读请求体、发送响应、等待后端、关闭连接
+    enum UPSTREAM_NEXT { UP_READ, UP_WRITE, UP_WAIT, UP_CLOSE };
+    // TLS握手推进一步之后：已经完成、等待可读、等待可写、失败需要关闭连接
+    enum HANDSHAKE { HS_DONE, HS_READ, HS_WRITE, HS_CLOSE };
 
     http_conn() = default;
     ~http_conn() = default;
 
     void process(); // 处理客户端的请求，解析http
-    void init(int sockfd, const sockaddr_in &addr); // 初始化新接收的连接
-    void close_conn(); // 关闭连接
+    // 初始化新接收的连接，slot为连接对象在所属事件循环的连接表中的编号，tls表示从TLS端口接收，先握手
+    void init(int sockfd, const sockaddr_in &addr, eventloop *loop, uint32_t slot, bool tls = false);
+    void close_conn(); // 关闭连接，之后连接对象被事件循环回收，不能再访问
+    int get_sockfd() const { return m_sockfd; }
+    uint32_t get_slot() const { return m_slot; }
     bool read(); // 非阻塞
     bool write(); // 非阻塞
+    // 读缓冲中是否还有因为响应队列已满而没有处理的请求，write()发送完之后需要再次process()
+    bool has_buffered_requests() const { return m_more_requests; }
+    // 放入线程池队列之前调用，用于统计排队时间；同时标记连接在工作线程中，这期间空闲超时不能关闭连接
+    void mark_queued() { m_queued_ns = metrics::now_ns(); m_in_worker = true; }
+    // 事件循环收到连接的事件（工作线程处理完之后交还）时调用，返回处理期间空闲超时是否已经到期，到期时应该关闭连接
+    bool end_queued() { m_in_worker = false; return m_timeout_pending; }
+    void timeout(); // 空闲超时到期，由所属事件循环的时间轮调用
+
+    // 以下供io_uring后端使用，只在所属事件循环线程中调用
+    int feed(const char * data, int len); // 把收到的数据追加到读缓冲，返回放进去的字节数，-1表示请求太大
+    bool has_responses() const { return m_resp_head < m_resp_count; } // 是否还有没有发送完的响应
+    int prepare_send(struct msghdr & msg); // 用排队的响应填充msg，返回sendmsg的flags
+    bool pending_file(int & fd, off_t *& offset, size_t & len); // 队首响应是否需要从文件发送响应体
+    bool pending_pipe(int & fd, size_t & len); // 队首响应是否需要从管道发送响应体（反向代理splice的响应体）
+    void sent(size_t bytes) { consume(bytes); } // 记录发送了bytes字节
+    bool finish_write(); // 所有响应发送完之后调用，返回false表示需要关闭连接
+
+    // 以下供转发给后端的请求使用，只在所属事件循环线程中调用
+    bool upstream_active() const { return m_upstream != NULL; } // 是否有正在转发的请求
+    bool upstream_reading() const; // 是否还在读取要转发的请求体
+    UPSTREAM_NEXT upstream_step(); // 转发读缓冲中的请求体，取出后端的响应放入写缓冲
+
+    // 以下供TLS连接使用，只在所属事件循环线程中调用（tls_pending()也可以在处理请求的工作线程中调用）
+    bool tls_handshaking() const { return m_ssl && !m_tls_ready; }
+    HANDSHAKE tls_handshake(); // 推进握手
+    // OpenSSL中是否还有已经从socket读出、没有交给read()的数据，这时socket可能不再可读，epoll不会通知
+    bool tls_pending() const { return m_ssl && m_tls_ready && SSL_has_pending(m_ssl); }
+    void defer_read() { m_tls_read_deferred = true; } // 改为等可写事件，然后直接读取OpenSSL中的数据
+    bool take_deferred_read(); // 可写事件是否是defer_read()要的读取
 
 private:
+    // 排队等待发送的响应，响应头依次存放在写缓冲中。
+    // 多范围响应的每个部分各占一项，部分的头部（分隔符等）也放在写缓冲中，由最后一项释放文件的资源
+    struct response {
+        int header_start; // 响应头在写缓冲中的位置
+        int header_len;
+        char * body; // 内存中的响应体，用sendfile发送时为NULL
+        size_t body_len;
+        size_t sent; // 已经发送的字节数，包括响应头
+        cache_entry * entry; // 响应体所在的缓存项
+        char * map_address; // 响应体所在的内存映射
+        size_t map_len;
+        int file_fd; // 用sendfile发送的文件，-1表示没有
+        off_t file_offset; // 文件下一个要发送的字节的位置
+        int close_fd; // 发送完之后要关闭的文件，-1表示没有
+        char * heap_body; // 发送完之后要释放的生成的响应体
+        body_source * source; // 不为NULL时响应体按块生成：已经放入写缓冲的部分发送完之后再生成下一块
+        bool upstream; // 后端的响应：已经放入写缓冲的部分发送完之后再取下一部分
+        int pipe_fd; // 后端的响应体在这个管道中，用splice发送，-1表示没有
+    };
+
+    // 字节范围，包括end
+    struct byte_range {
+        off_t start;
+        off_t end;
+    };
+
+    eventloop *m_loop; // 连接所属的事件循环，socket上的事件注册在它的epoll中
     int m_sockfd; // 该HTTP连接的socket
+    uint32_t m_slot; // 在所属事件循环的连接表中的编号
     sockaddr_in m_address; // 通信socket地址
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
+    char * m_read_buf; // 读缓冲区，从缓冲区池中借用，连接空闲时为NULL
+    int m_read_size; // 读缓冲区的大小
     int m_read_idx; // 标识读缓冲区中以及读入的客户端数据的最后一个字节的位置
-    char m_write_buf[WRITE_BUFFER_SIZE];
+    char * m_write_buf; // 写缓冲区，从缓冲区池中借用，没有排队的响应时为NULL
+    int m_write_size; // 写缓冲区的大小
     int m_write_idx;
     
     int m_checked_index; // 当前正在分析的字符在读缓冲区的位置
@@ -77,51 +178,149 @@ private:
     char * m_url; // 请求目标文件的文件名
     char * m_version; // 协议版本，只支持HTTP 1.1
     METHOD m_method; // 请求方法
-    char * m_host; // 主机名
     bool m_linger; // 是否保持连接
-    int m_content_length; // 请求体长度
-    int m_content_start; // 请求体开始位置
+    bool m_accept_gzip; // 客户端是否接受gzip编码
+    bool m_gzip; // 响应体是否是gzip编码
+    bool m_vary; // 响应是否随Accept-Encoding变化
+    time_t m_if_modified_since; // If-Modified-Since的时间，-1表示没有
+    byte_range m_ranges[MAX_RANGES]; // 要发送的字节范围
+    int m_range_count; // 字节范围的数量，0表示发送整个文件
+    http_header m_headers[MAX_HEADERS]; // 请求的所有请求头
+    int m_header_count;
+    int m_header_index[HDR_NUM]; // 常见请求头在m_headers中第一次出现的位置，-1表示没有
+    long long m_content_length; // Content-Length，0表示没有
+    bool m_has_content_length; // 是否有Content-Length请求头（值可能为0）
+    int m_content_start; // 请求体开始位置，请求体处理过的部分从读缓冲中去掉，还没处理的部分从这里开始
+    bool m_chunked; // 请求体使用chunked编码
+    chunked_decoder m_chunk_decoder;
+    long long m_body_remaining; // 按Content-Length还没有读到的请求体字节数
+    long long m_body_received; // 已经收到的请求体字节数（解码后）
     char m_file[FILENAME_LEN]; // 客户请求的目标文件的目录
     struct stat m_file_stat; // 客户请求的目标文件状态，通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
     char * m_file_address; // 客户请求的目标文件在内存中地址
+    cache_entry * m_cache_entry; // 目标文件的缓存项，不为NULL时m_file_address指向它的数据
+    int m_file_fd; // 用sendfile发送的目标文件，-1表示没有
+    off_t m_file_offset; // 目标文件下一个要发送的字节的位置
+    bool m_heap_body; // m_file_address是malloc得到的生成的响应体（如运行指标），不是文件
+    const char * m_content_type; // 生成的响应体的类型，NULL表示按目标文件确定
+    body_source * m_body_source; // 按块生成的响应体，STREAM_REQUEST时由响应接管
     
-    struct iovec m_iv[2]; // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
+    response m_responses[MAX_QUEUE]; // 响应队列
+    int m_resp_head; // 第一个没有发送完的响应
+    int m_resp_count; // 排队的响应数
+    bool m_close_after; // 队列中有Connection: close的响应，发送完之后关闭连接
+    bool m_more_requests; // 读缓冲中还有没有处理的请求
+    uint64_t m_queued_ns; // 放入线程池队列的时间，0表示不在队列中
+    bool m_in_worker; // 连接已经交给线程池，还没有交还给事件循环，只在事件循环线程中读写
+    bool m_timeout_pending; // 在工作线程中时空闲超时已经到期，交还时关闭
+    uint64_t m_write_start_ns; // 响应开始排队等待发送的时间，0表示没有排队的响应
 
-    int bytes_to_send; // 将要发送的数据的字节数
-    int bytes_have_send; // 已经发送的字节数
+    struct iovec m_iv[2 * MAX_QUEUE]; // 采用sendmsg一次发送多个响应的响应头和内存中的响应体
 
     CHECK_STATE m_check_state; // 主状态机当前所处的状态
+    int m_status; // 当前请求的响应状态码，用于访问日志
 
     util_timer* m_timer; // 定时器
 
+    // 转发给后端的请求，响应为响应队列中唯一的一项
+    enum UPSTREAM_STATE { UPSTREAM_START, UPSTREAM_HEADER, UPSTREAM_BODY, UPSTREAM_DONE };
+    upstream_request * m_upstream; // 正在转发的请求，NULL表示没有
+    upstream_pool * m_upstream_pool; // 请求所在的连接池
+    bool m_upstream_deferred; // 请求头已经解析，等前面的响应发送完再开始转发
+    UPSTREAM_STATE m_upstream_state; // 响应进行到哪里
+    long long m_upstream_remaining; // 按Content-Length还要发送的响应体字节数，-1表示用chunked编码
+    long long m_upstream_bytes; // 已经放入写缓冲的字节数，用于访问日志
+    uint64_t m_upstream_start_ns; // 开始转发的时间
+
+    // TLS连接：握手之后读取都通过SSL_read；加密交给内核时发送和明文连接一样，否则取出明文用SSL_write发送
+    SSL * m_ssl; // NULL表示明文连接
+    bool m_tls_ready; // 握手已经完成
+    bool m_tls_error; // 出现了致命错误，关闭时不能再发送close_notify
+    bool m_ktls_send; // 记录的加密已经交给内核
+    bool m_tls_read_deferred; // 见defer_read()
+    uint64_t m_tls_start_ns; // accept的时间，用于统计握手的耗时
+    char * m_tls_buf; // 用户空间加密时从响应队列取出、还没有被SSL_write接受的明文，从缓冲区池中借用
+    int m_tls_buf_size;
+    int m_tls_len; // m_tls_buf中明文的长度，SSL_write要求用同样的数据重试
+
     void init(); // 初始化其余的信息
+    void init_request(); // 初始化解析一个请求用到的信息
+    void finish_request(); // 丢弃处理完的请求，保留流水线中后面的数据
+    void log_access(long long bytes, uint64_t queue_ns, uint64_t parse_ns, uint64_t build_ns); // 记录访问日志
+    bool grow_read_buf(); // 换成更大一级的读缓冲区
+    // 读缓冲中是否还有没有解析的数据，parse_line()在行不完整时停在末尾，最多剩下一个'\r'
+    bool has_unparsed() const { return m_read_idx - m_checked_index > 1; }
+    void release_read_buf(); // 没有未处理的数据时归还读缓冲区
+    void release_write_buf(); // 归还写缓冲区
     
     HTTP_CODE process_read(); // 解析HTTP请求
     HTTP_CODE parse_request_line(char * text); // 解析请求首行
     HTTP_CODE parse_headers(char * text); // 解析请求头
-    HTTP_CODE parse_contents(char * text); // 解析请求体
+    HTTP_CODE parse_contents(); // 处理读缓冲中已经到达的请求体
 
     LINE_STATUS parse_line(); // 解析一行
     HTTP_CODE do_request();
+    HTTP_CODE find_file(); // 找到请求的文件，取得它的内容或者打开它
+    HTTP_CODE parse_range(); // 根据Range和If-Range确定要发送的字节范围
+    HTTP_CODE serve_metrics(bool json); // 生成运行指标报告作为响应体
+    HTTP_CODE use_cache_entry(bool want_gzip);
+    HTTP_CODE stream_gzip(int fd); // 边读边压缩发送文件
+    bool not_modified(); // 条件请求是否可以用304响应，根据m_file_stat和m_gzip判断
+    void make_etag(char * buf, int len); // 生成响应体的ETag
 
-    void unmap(); // 释放映射
+    void unmap(); // 释放映射、缓存项或者关闭sendfile的文件
+    void release_response(response & r); // 释放响应体占用的资源
+    void release_responses(); // 释放所有排队的响应
 
     bool process_write(HTTP_CODE ret);
+    int fill_iov(int & flags); // 用排队的响应填充m_iv
+    void consume(size_t bytes); // 记录发送了bytes字节，释放发送完的响应
+    bool next_chunk(response & r); // 按块生成的响应的下一块放入写缓冲，没有更多的块时返回false
+    // 请求是否转发给后端：proxy_prefix下的URL代理给HTTP后端，POST和fastcgi_prefix下的URL转发给FastCGI后端
+    bool use_upstream();
+    bool build_upstream(); // 生成转发的请求头，开始转发的请求放入响应队列
+    void build_fcgi_params(std::string & params); // CGI环境变量
+    void build_proxy_head(std::string & head); // 代理给HTTP后端的请求行和请求头
+    HTTP_CODE forward_body(); // 把读缓冲中的请求体交给连接池
+    bool next_upstream(response & r); // 后端响应的下一部分放入写缓冲，响应结束时返回false
+    bool add_upstream_headers(); // 后端的状态和响应头
+    UPSTREAM_NEXT upstream_error(HTTP_CODE ret); // 请求体出错，还没有开始发送后端的响应时改为错误响应
+    void end_upstream(); // 后端的响应发送完或者连接关闭，释放请求
+    response & push_response(int header_start); // 把写缓冲中从header_start开始的响应头放入响应队列
+    void set_body(response & r, off_t start, size_t len); // 用目标文件从start开始的len字节作为响应体
+    void take_body(response & r); // 由r负责释放目标文件的资源
 
     // 这一组函数被process_write调用以填充HTTP应答
+    bool reserve_write(int len); // 保证写缓冲中还有len字节的空间
     bool add_response(const char* format, ...);
+    bool append(const char * data, int len);
+    bool append_int(long long value); // 不经过printf输出整数
     bool add_content(const char* content);
-    bool add_content_type();
-    bool add_status_line(int status, const char* title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_content_type(const char * type);
+    bool add_status_line(int status, const char* title); // 同时添加Date
+    bool add_date();
+    bool add_headers(long long content_length, const char * type);
+    bool add_content_length(long long content_length);
+    bool add_content_encoding();
+    bool add_validators(); // ETag和Last-Modified
+    bool add_last_modified();
+    bool add_multipart(int header_start); // 生成多范围响应并放入响应队列
+    const char * content_type(); // 目标文件的类型
     bool add_linger();
+    bool add_chunked(); // Transfer-Encoding: chunked
     bool add_blank_line();
 
     inline char * getline() { return m_read_buf + m_start_line; } // 获取一行数据
+    const char * get_header(HEADER_ID id) const; // 常见请求头的值，没有时返回NULL
 
     void adjust_timer(); // 调整计时器
+
+    int recv_data(char * buf, int len); // 和recv()一样返回，TLS连接通过SSL_read
+    // 立即发送的临时响应（100 Continue），发送缓冲满时明文连接丢弃它，用户空间加密的连接留给下一次write()先发送
+    void send_interim(const char * data, int len);
+    bool write_tls(); // 用户空间加密时的write()
+    int fill_tls_buf(); // 从响应队列取出明文放入m_tls_buf，读文件、管道出错时返回-1
+    int tls_error(int ret); // SSL_read、SSL_write失败时：设置errno并返回-1，对方正常关闭时返回0
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "http_parser.h"
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static const char * find_line_end_scalar(const char * p, const char * end) {
+    while (p < end && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+static const char * find_line_end_sse2(const char * p, const char * end) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find_line_end_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char * find_line_end_avx2(const char * p, const char * end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return find_line_end_sse2(p, end);
+}
+#endif
+
+typedef const char * (*line_scanner)(const char *, const char *);
+
+// 启动时根据CPU选择实现
+static line_scanner choose_scanner() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return find_line_end_avx2;
+    }
+    return find_line_end_sse2;
+#else
+    return find_line_end_scalar;
+#endif
+}
+
+static const line_scanner scanner = choose_scanner();
+
+const char * find_line_end(const char * p, const char * end) {
+    return scanner(p, end);
+}
+
+static const char * header_names[HDR_NUM] = {
+    NULL,
+    "Host",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Transfer-Encoding",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "User-Agent",
+    "Referer",
+    "Cookie",
+    "Authorization",
+    "Cache-Control",
+    "Pragma",
+    "If-None-Match",
+    "If-Modified-Since",
+    "If-Match",
+    "If-Unmodified-Since",
+    "Range",
+    "If-Range",
+    "Expect",
+    "Upgrade",
+    "Origin",
+    "TE",
+    "X-Forwarded-For",
+};
+
+// 按名字长度分组，查找时只和长度相同的名字比较
+static const int MAX_NAME_LEN = 20;
+static const int MAX_SAME_LEN = 8;
+static HEADER_ID by_length[MAX_NAME_LEN + 1][MAX_SAME_LEN];
+
+static bool build_index() {
+    for (int i = 1; i < HDR_NUM; i++) {
+        int len = strlen(header_names[i]);
+        for (int j = 0; j < MAX_SAME_LEN; j++) {
+            if (by_length[len][j] == HDR_UNKNOWN) {
+                by_length[len][j] = (HEADER_ID)i;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+static const bool index_built = build_index();
+
+HEADER_ID lookup_header(const char * name, int len) {
+    if (len <= 0 || len > MAX_NAME_LEN) {
+        return HDR_UNKNOWN;
+    }
+    for (int j = 0; j < MAX_SAME_LEN && by_length[len][j] != HDR_UNKNOWN; j++) {
+        HEADER_ID id = by_length[len][j];
+        if (strncasecmp(name, header_names[id], len) == 0) {
+            return id;
+        }
+    }
+    return HDR_UNKNOWN;
+}
+
+const char * header_name(HEADER_ID id) {
+    return id > HDR_UNKNOWN && id < HDR_NUM ? header_names[id] : NULL;
+}
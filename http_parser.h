@@ -0,0 +1,58 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <stddef.h>
+
+// 常见请求头的编号，其余请求头为HDR_UNKNOWN
+enum HEADER_ID {
+    HDR_UNKNOWN = 0,
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_USER_AGENT,
+    HDR_REFERER,
+    HDR_COOKIE,
+    HDR_AUTHORIZATION,
+    HDR_CACHE_CONTROL,
+    HDR_PRAGMA,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_MATCH,
+    HDR_IF_UNMODIFIED_SINCE,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_EXPECT,
+    HDR_UPGRADE,
+    HDR_ORIGIN,
+    HDR_TE,
+    HDR_X_FORWARDED_FOR,
+    HDR_NUM
+};
+
+// 一个请求头，名字和值用相对读缓冲区开头的偏移表示，读缓冲区换成更大的之后仍然有效
+struct http_header {
+    int name;
+    int name_len;
+    int value; // 值以'\0'结尾，去掉了前后的空白
+    int value_len;
+    HEADER_ID id;
+};
+
+/*
+    在[p, end)中找到第一个'\r'或'\n'，没有时返回end。
+    x86-64上每次比较16字节（SSE2），CPU支持AVX2时每次比较32字节，运行时选择；其他平台逐字节查找。
+*/
+const char * find_line_end(const char * p, const char * end);
+
+// 根据名字（不区分大小写）查找请求头的编号
+HEADER_ID lookup_header(const char * name, int len);
+
+// 请求头的规范名字，HDR_UNKNOWN返回NULL
+const char * header_name(HEADER_ID id);
+
+#endif
@@ -4,6 +4,10 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <atomic>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 // 线程同步机制封装类
 
@@ -97,4 +101,57 @@ private:
 };
 
 
+// 自旋等待时提示CPU
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// 事件计数器，基于futex，让等待无锁数据结构的线程休眠。用法：
+//     int key = ec.prepare_wait(); 再检查一次条件，满足则 ec.cancel_wait()，否则 ec.wait(key)
+// 通知方在改变条件之后调用notify，没有线程等待时notify只是一次原子读
+class eventcount {
+public:
+    eventcount() : m_seq(0), m_waiters(0) {}
+
+    int prepare_wait() {
+        m_waiters.fetch_add(1);
+        return m_seq.load();
+    }
+
+    void cancel_wait() {
+        m_waiters.fetch_sub(1);
+    }
+
+    // 从prepare_wait()之后没有notify时休眠
+    void wait(int key) {
+        syscall(SYS_futex, (int *)&m_seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+        m_waiters.fetch_sub(1);
+    }
+
+    void notify_one() {
+        notify(1);
+    }
+
+    void notify_all() {
+        notify(0x7fffffff);
+    }
+
+private:
+    std::atomic<int> m_seq;
+    std::atomic<int> m_waiters;
+
+    void notify(int count) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load() > 0) {
+            m_seq.fetch_add(1);
+            syscall(SYS_futex, (int *)&m_seq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+        }
+    }
+};
+
+
 #endif
\ No newline at end of file
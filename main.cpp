@@ -11,18 +11,30 @@
 #include <sys/epoll.h>
 #include <signal.h>
 #include <assert.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "eventloop.h"
+#include "config.h"
+#include "upgrade.h"
 
-#define MAX_FD 65535 // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000 // 监听的最大的事件数量
-#define TIMESLOT 5 // SIGALARM信号频率
+#define RESERVED_FD 64 // 最大连接数之外为监听socket、epoll、缓存的文件等保留的文件描述符数
 
 static int pipefd[2];
-static sort_timer_list *timer_list;
-static int epoll_fd = 0;
+
+// 平滑升级用：启动时的可执行文件路径和参数，事件循环
+static char exe_path[PATH_MAX];
+static char ** saved_argv;
+static eventloop ** loops;
+static int reactor_num;
+static std::atomic<bool> upgrading(false);
+static pthread_t upgrade_thread;
+static bool upgrade_thread_started = false;
 
 void sig_handler(int sig) {
     int save_errno = errno;
@@ -41,170 +53,318 @@ void addsig(int sig, void(handler)(int), bool restart = false) {
     sigaction(sig, &sa, NULL);
 }
 
-void timer_handler() {
-    // 定时处理任务，实际上就是调用tick()函数
-    timer_list->tick();
-    // 因为一次 alarm 调用只会引起一次SIGALARM 信号，所以我们要重新定时，以不断触发 SIGALARM信号。
-    alarm(TIMESLOT);
+extern int setnonblocking(int fd);
+
+// 启动新的进程并把监听socket交给它，成功后排空本进程的连接；在单独的线程中运行，等待新进程时不阻塞事件循环
+static void * upgrade_worker(void *) {
+    int fds[upgrade::MAX_LISTENERS];
+    int n = 0;
+    for (int i = 0; i < reactor_num && n < upgrade::MAX_LISTENERS; i++) {
+        if (loops[i]->get_listenfd() != -1) {
+            fds[n++] = loops[i]->get_listenfd();
+        }
+        // 新进程按端口区分TLS端口的监听socket
+        if (loops[i]->get_tls_listenfd() != -1 && n < upgrade::MAX_LISTENERS) {
+            fds[n++] = loops[i]->get_tls_listenfd();
+        }
+    }
+    if (n > 0 && upgrade::hand_off(exe_path, saved_argv, fds, n)) {
+        http_conn::m_draining = true;
+        uint64_t deadline = metrics::now_ns() + (uint64_t)config::get().drain_timeout_ms * 1000000;
+        for (int i = 0; i < reactor_num; i++) {
+            loops[i]->drain(deadline);
+        }
+        // 升级成功后不再重置，排空期间的SIGUSR2被忽略
+        return NULL;
+    }
+    upgrading = false;
+    return NULL;
 }
 
-extern int setnonblocking(int fd);
-extern int addfd(int epoll_fd, int fd, bool one_shot, bool ET, bool rdhup = true);
-extern int removefd(int epoll_fd, int fd);
-extern void modfd(int epoll_fd, int fd, int ev);
+// 收到SIGUSR2时在第一个事件循环中调用
+static void on_upgrade() {
+    if (upgrading.exchange(true)) {
+        printf("upgrade: already in progress\n");
+        return;
+    }
+    if (upgrade_thread_started) {
+        // 上一次失败的升级线程已经结束
+        pthread_join(upgrade_thread, NULL);
+        upgrade_thread_started = false;
+    }
+    if (pthread_create(&upgrade_thread, NULL, upgrade_worker, NULL) != 0) {
+        printf("upgrade: create thread failure\n");
+        upgrading = false;
+        return;
+    }
+    upgrade_thread_started = true;
+}
+
+// 把能打开的文件描述符数提高到硬限制，返回新的软限制
+static long raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return 1024;
+    }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rlim_t old = rl.rlim_cur;
+        rl.rlim_cur = rl.rlim_max;
+        // 硬限制为RLIM_INFINITY时可能超过fs.nr_open而失败，保持原来的软限制
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            rl.rlim_cur = old;
+        }
+    }
+    return rl.rlim_cur == RLIM_INFINITY ? INT_MAX : (long)rl.rlim_cur;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc <= 1) {
-        printf("按照如下格式运行：%s port_number\n", basename(argv[0]));
+    // -f指定配置文件，其余选项和按位置的参数覆盖配置文件中的同名项：
+    // -b uring使用io_uring后端，默认epoll；-l设置监听队列的长度；-c设置最大连接数，默认由文件描述符数的限制决定；
+    // -a记录访问日志到指定的文件
+    const char * name = basename(argv[0]);
+    // 平滑升级时用同样的参数启动新的进程；可执行文件可能在升级前被替换，所以在启动时记下路径
+    saved_argv = argv;
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[len > 0 ? len : 0] = '\0';
+    const char * config_path = NULL;
+    const char * backend = NULL;
+    const char * access_log_path = NULL;
+    int backlog = 0;
+    int max_conns = 0;
+    bool bad_option = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:b:l:c:a:")) != -1) {
+        if (opt == 'f') {
+            config_path = optarg;
+        } else if (opt == 'b' && (strcmp(optarg, "uring") == 0 || strcmp(optarg, "epoll") == 0)) {
+            backend = optarg;
+        } else if (opt == 'l' && atoi(optarg) > 0) {
+            backlog = atoi(optarg);
+        } else if (opt == 'c' && atoi(optarg) > 0) {
+            max_conns = atoi(optarg);
+        } else if (opt == 'a') {
+            access_log_path = optarg;
+        } else {
+            bad_option = true;
+        }
+    }
+    // 其余参数按位置解析，argv[1]为端口号
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    server_config cfg;
+    std::string error;
+    if (config_path && !config::parse(config_path, cfg, error)) {
+        printf("%s\n", error.c_str());
         exit(-1);
     }
+    if (backend) cfg.use_uring = strcmp(backend, "uring") == 0;
+    if (backlog) cfg.backlog = backlog;
+    if (max_conns) cfg.max_connections = max_conns;
+    if (access_log_path) cfg.access_log = access_log_path;
 
-    // 获取端口号
-    int port = atoi(argv[1]);
+    // 端口号；事件循环的数量，为0时为单Reactor，请求交给线程池处理，
+    // 大于0时为多Reactor，每个事件循环独占一个线程，请求在所属的事件循环中处理；
+    // 单Reactor时线程池的线程数量，以及是否把工作线程绑定到CPU上
+    if (argc > 1) cfg.port = atoi(argv[1]);
+    if (argc > 2) cfg.reactors = atoi(argv[2]);
+    if (argc > 3) cfg.threads = atoi(argv[3]);
+    if (argc > 4) cfg.cpu_affinity = atoi(argv[4]) != 0;
+
+    if (cfg.port <= 0 || bad_option) {
+        printf("按照如下格式运行：%s [-f config_file] [-b epoll|uring] [-l backlog] [-c max_connections] [-a access_log] port_number [reactor_number] [thread_number] [cpu_affinity]\n", name);
+        exit(-1);
+    }
+    if (!config::validate(cfg, error)) {
+        printf("%s\n", error.c_str());
+        exit(-1);
+    }
+    if (cfg.tls_port && cfg.use_uring) {
+        // TLS的读写由OpenSSL在非阻塞socket上进行，io_uring后端没有这样的路径
+        printf("io_uring backend does not support TLS, use epoll\n");
+        cfg.use_uring = false;
+    }
+    // 之后所有线程通过config::get()读取配置，收到SIGHUP时重新读取配置文件
+    config::init(cfg, config_path);
 
     // 对SIGPIPE信号处理
     addsig(SIGPIPE, SIG_IGN);
 
     // 初始化线程池
+    reactor_num = cfg.reactors;
     threadpool<http_conn> * pool = NULL;
+    if (reactor_num <= 0) {
+        try {
+            pool = new threadpool<http_conn>(cfg.threads, cfg.queue_depth, cfg.cpu_affinity);
+        } catch(...) {
+            exit(-1);
+        }
+        reactor_num = 1;
+    }
+
+    // 创建静态文件缓存
+    file_cache * cache = NULL;
     try {
-        pool = new threadpool<http_conn>();
+        cache = new file_cache(cfg.cache_max_bytes, cfg.cache_max_entry_size);
     } catch(...) {
         exit(-1);
     }
+    if (!cache->start()) {
+        exit(-1);
+    }
+    http_conn::m_file_cache = cache;
 
-    // 创建数组保存所有客户端信息
-    http_conn * users = new http_conn[MAX_FD];
-
-    // 创建监听套接字
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0); // 没有判断
-    assert(listenfd >= 0);
-
-    // 设置端口复用
-    int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // 加载TLS证书
+    tls_context * tls = NULL;
+    if (cfg.tls_port) {
+        try {
+            tls = new tls_context(cfg.tls_cert.c_str(), cfg.tls_key.c_str(), cfg.ktls);
+        } catch(...) {
+            exit(-1);
+        }
+        http_conn::m_tls_context = tls;
+    }
 
-    // 绑定
-    int ret = 0;
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    assert(ret != -1);
+    // 创建访问日志
+    access_log * alog = NULL;
+    if (!cfg.access_log.empty()) {
+        try {
+            alog = new access_log(cfg.access_log.c_str());
+        } catch(...) {
+            printf("open access log failure\n");
+            exit(-1);
+        }
+        if (!alog->start()) {
+            exit(-1);
+        }
+        http_conn::m_access_log = alog;
+    }
 
-    // 监听
-    ret = listen(listenfd, 5);
-    assert(ret != -1);
+    // 最大连接数不能超过能打开的文件描述符数，连接对象在accept时才分配
+    long fd_limit = raise_fd_limit() - RESERVED_FD;
+    if (fd_limit < 1) {
+        fd_limit = 1;
+    }
+    max_conns = cfg.max_connections;
+    if (max_conns == 0 || max_conns > fd_limit) {
+        max_conns = fd_limit > INT_MAX ? INT_MAX : (int)fd_limit;
+    }
 
-    // 创建epoll对象，事件数组，添加
-    epoll_event events[MAX_EVENT_NUMBER];
-    epoll_fd = epoll_create(5); // 参数大于0即可，无意义
-    assert(epoll_fd != -1);
+    // 由平滑升级启动时，从旧进程继承监听socket，每个socket一个事件循环，不能关闭其中任何一个，
+    // 否则它的监听队列中的连接会被重置；数量不够时按同一个端口创建新的。
+    // 端口为tls_port的是TLS端口的监听socket，其余的是HTTP端口的
+    int fds[upgrade::MAX_LISTENERS];
+    int fd_num = upgrade::inherit(fds, upgrade::MAX_LISTENERS);
+    int inherited[upgrade::MAX_LISTENERS], tls_inherited[upgrade::MAX_LISTENERS];
+    int inherited_num = 0, tls_inherited_num = 0;
+    int port = cfg.port;
+    for (int i = 0; i < fd_num; i++) {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd_port = getsockname(fds[i], (struct sockaddr *)&addr, &addrlen) == 0 ? ntohs(addr.sin_port) : 0;
+        if (cfg.tls_port && fd_port == cfg.tls_port) {
+            tls_inherited[tls_inherited_num++] = fds[i];
+            continue;
+        }
+        if (inherited_num == 0 && fd_port) {
+            port = fd_port;
+        }
+        inherited[inherited_num++] = fds[i];
+    }
+    if (reactor_num < inherited_num) {
+        reactor_num = inherited_num;
+    }
+    if (reactor_num < tls_inherited_num) {
+        reactor_num = tls_inherited_num;
+    }
 
-    // 将监听的文件描述符添加到epoll中
-    addfd(epoll_fd, listenfd, false, false);
+    // 创建事件循环，每个事件循环都有自己的监听套接字和epoll对象
+    loops = new eventloop*[reactor_num];
+    try {
+        for (int i = 0; i < reactor_num; i++) {
+            loops[i] = new eventloop(port, max_conns, pool, cfg.use_uring, cfg.backlog,
+                                     i < inherited_num ? inherited[i] : -1, cfg.tls_port,
+                                     i < tls_inherited_num ? tls_inherited[i] : -1);
+        }
+    } catch(...) {
+        printf("create event loop failure\n");
+        exit(-1);
+    }
 
-    // 创建管道
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
+    // 创建管道，信号由第一个事件循环处理
+    int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
     assert(ret != -1);
     setnonblocking(pipefd[1]);
-    addfd(epoll_fd, pipefd[0], false, true, false);
+    loops[0]->watch_signals(pipefd[0], on_upgrade);
 
-    // 设置信号处理函数
-    addsig(SIGALRM, sig_handler, true);
+    // 设置信号处理函数，SIGHUP用于重新加载配置文件，SIGUSR1用于轮转访问日志，SIGUSR2用于平滑升级
     addsig(SIGTERM, sig_handler, true);
+    addsig(SIGHUP, sig_handler, true);
+    addsig(SIGUSR1, sig_handler, true);
+    addsig(SIGUSR2, sig_handler, true);
 
-    bool stop_server = false;
-    bool timeout = false;
-    alarm(TIMESLOT); // 定时,5秒后产生SIGALARM信号
-
-    http_conn::m_epollfd = epoll_fd;
-    timer_list = new sort_timer_list;
-    http_conn::m_timer_list = timer_list;
-
-    // printf("listen fd %d, pipe fd %d\n", listenfd, pipefd[0]);
-    
-    while (!stop_server) {
-        int num = epoll_wait(epoll_fd, events, MAX_EVENT_NUMBER, -1); // 阻塞
-        if (num < 0 && errno != EINTR) {  // 中断
-            printf("epoll failure\n");
-            break;
+    for (int i = 1; i < reactor_num; i++) {
+        if (!loops[i]->start()) {
+            printf("create event loop thread failure\n");
+            exit(-1);
         }
+    }
 
-        // 循环遍历事件数组
-        for (int i = 0; i < num; i++) {
-            int sockfd = events[i].data.fd;
-            // printf("fd: %d\n", sockfd);
-            if (sockfd == listenfd) {
-                // 有客户端连接进来
-                struct sockaddr_in client_address;
-                socklen_t client_addrlen = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlen);
-                // printf("connfd: %d\n", connfd);
-                if (http_conn::m_user_count >= MAX_FD) {
-                    // 目前连接数满
-                    // 给客户端写一个信息，服务器内部正忙
-                    close(connfd);
-                    continue;
-                }
-                // 将新客户的数据初始化，放到数组中
-                users[connfd].init(connfd, client_address);
-            } else if (sockfd == pipefd[0] && events[i].events & EPOLLIN) {
-                // 处理信号
-                int sig;
-                char signals[1024];
-                ret = recv(pipefd[0], signals, sizeof(signals), 0);
-                if (ret <= 0) continue;
-                else {
-                    for (int i = 0; i < ret; i++) {
-                        switch (signals[i]) {
-                            case SIGALRM: {
-                                timeout = true;
-                                break;
-                            } case SIGTERM: {
-                                stop_server = true;
-                            }
-                        }
-                    }
-                }
-            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                // 对方异常断开或者错误等事件
-                // 关闭连接
-                users[sockfd].close_conn();
-            } else if (events[i].events & EPOLLIN) {
-                // 读事件发生
-                if (users[sockfd].read()) {
-                    // 一次性把所有数据读完
-                    pool->append(users + sockfd);
-                } else {
-                    users[sockfd].close_conn();
-                }
-                // printf("read\n");
-            } else if (events[i].events & EPOLLOUT) {
-                if (!users[sockfd].write()) {  // 一次性写完
-                    users[sockfd].close_conn();
-                }
-                // printf("write\n");
-            }
-        }
+    // 监听socket都已经在事件循环中，通知旧进程停止accept
+    upgrade::ready();
 
-        // 最后处理定时事件，因为I/O事件有更高的优先级。当然，这样做将导致定时任务不能精准的按照预定的时间执行。
-        if (timeout) {
-            timer_handler();
-            timeout = false;
-        }
+    // 主线程运行第一个事件循环，收到SIGTERM或者升级后排空完成时返回
+    loops[0]->loop();
 
+    // 排空时其他事件循环在自己的连接都关闭或者到期限时结束
+    bool drained = loops[0]->draining();
+    for (int i = 1; i < reactor_num; i++) {
+        if (!drained) loops[i]->stop();
+        loops[i]->join();
+    }
+    if (upgrade_thread_started) {
+        pthread_join(upgrade_thread, NULL);
     }
 
-    close(epoll_fd);
-    close(listenfd);
     close(pipefd[0]);
     close(pipefd[1]);
 
-    delete[] users;
+    // 先结束线程池，工作线程可能还在处理某个连接，处理完会访问它所属的事件循环
     delete pool;
-    delete timer_list;
+    for (int i = 0; i < reactor_num; i++) {
+        delete loops[i];
+    }
+    delete[] loops;
+
+    file_cache_stats stats;
+    cache->get_stats(stats);
+    printf("file cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, %lu entries, %lu bytes\n",
+           (unsigned long)stats.hits, (unsigned long)stats.misses, (unsigned long)stats.evictions,
+           (unsigned long)stats.invalidations, (unsigned long)stats.entries, (unsigned long)stats.bytes);
+    printf("gzip: %lu compressions, %lu us, %lu bytes in, %lu bytes out\n",
+           (unsigned long)stats.gzip_compressions, (unsigned long)stats.gzip_compress_us,
+           (unsigned long)stats.gzip_bytes_in, (unsigned long)stats.gzip_bytes_out);
+    delete cache;
+    http_conn::m_tls_context = NULL;
+    delete tls;
+
+    if (alog) {
+        // 写完剩下的日志
+        http_conn::m_access_log = NULL;
+        alog->stop();
+        access_log_stats log_stats;
+        alog->get_stats(log_stats);
+        printf("access log: %lu entries, %lu dropped, %lu bytes written, %lu write errors\n",
+               (unsigned long)log_stats.entries, (unsigned long)log_stats.dropped,
+               (unsigned long)log_stats.bytes_written, (unsigned long)log_stats.write_errors);
+        delete alog;
+    }
+
+    buffer_pool_stats buf_stats;
+    http_conn::m_buffer_pool.get_stats(buf_stats);
+    printf("buffer pool: %lu allocs, %lu reuses, %lu bytes in use, %lu bytes free\n",
+           (unsigned long)buf_stats.allocs, (unsigned long)buf_stats.reuses,
+           (unsigned long)buf_stats.in_use_bytes, (unsigned long)buf_stats.free_bytes);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,217 @@
+#include "metrics.h"
+#include "file_cache.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <new>
+
+std::atomic<metrics::block *> metrics::m_blocks(NULL);
+__thread metrics::block * metrics::t_block = NULL;
+
+static const char * stage_names[STAGE_NUM] = { "accept", "read", "queue", "parse", "build", "write", "tls_handshake" };
+
+// 只有所属线程写，不需要原子加
+static inline void bump(std::atomic<uint64_t> & c, uint64_t n) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static void appendf(std::string & out, const char * format, ...) {
+    char buf[256];
+    va_list arglist;
+    va_start(arglist, format);
+    int len = vsnprintf(buf, sizeof(buf), format, arglist);
+    va_end(arglist);
+    if (len > 0) {
+        out.append(buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+    }
+}
+
+uint64_t metrics::now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+metrics::block * metrics::local() {
+    block * b = t_block;
+    if (b) {
+        return b;
+    }
+    void * mem = NULL;
+    if (posix_memalign(&mem, 64, sizeof(block)) != 0) {
+        return NULL;
+    }
+    memset(mem, 0, sizeof(block));
+    b = new (mem) block;
+    // 放到链表头部
+    block * head = m_blocks.load(std::memory_order_relaxed);
+    do {
+        b->next = head;
+    } while (!m_blocks.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+    t_block = b;
+    return b;
+}
+
+int metrics::bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    if (us <= 1) return 0;
+    int i = 64 - __builtin_clzll(us - 1); // 不小于us的最小的2的幂的指数
+    return i < BUCKETS - 1 ? i : BUCKETS - 1;
+}
+
+void metrics::record(METRIC_STAGE stage, uint64_t ns) {
+    block * b = local();
+    if (!b) return;
+    bump(b->counts[stage][bucket(ns)], 1);
+    bump(b->sum_ns[stage], ns);
+}
+
+void metrics::count(METRIC_COUNTER counter, uint64_t n) {
+    block * b = local();
+    if (!b) return;
+    bump(b->counters[counter], n);
+}
+
+void metrics::collect(snapshot & s) {
+    memset(&s, 0, sizeof(s));
+    for (block * b = m_blocks.load(std::memory_order_acquire); b; b = b->next) {
+        for (int i = 0; i < STAGE_NUM; i++) {
+            for (int j = 0; j < BUCKETS; j++) {
+                s.counts[i][j] += b->counts[i][j].load(std::memory_order_relaxed);
+            }
+            s.sum_ns[i] += b->sum_ns[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < COUNTER_NUM; i++) {
+            s.counters[i] += b->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t metrics::percentile_us(const uint64_t * counts, double q) {
+    uint64_t total = 0;
+    for (int i = 0; i < BUCKETS; i++) total += counts[i];
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS - 1; i++) {
+        seen += counts[i];
+        if (seen >= rank) return (uint64_t)1 << i;
+    }
+    return (uint64_t)1 << (BUCKETS - 1);
+}
+
+// 线程池队列的长度由放入和取出的次数相减得到，两者在不同线程中计数，汇总时可能短暂地不一致
+static uint64_t queue_depth(const metrics::snapshot & s) {
+    uint64_t pushes = s.counters[COUNTER_QUEUE_PUSHES], pops = s.counters[COUNTER_QUEUE_POPS];
+    return pushes > pops ? pushes - pops : 0;
+}
+
+void metrics::render_prometheus(std::string & out, int open_conns, const file_cache_stats * cache) {
+    snapshot s;
+    collect(s);
+
+    out += "# HELP webserver_stage_duration_seconds Time spent in each request processing stage.\n";
+    out += "# TYPE webserver_stage_duration_seconds histogram\n";
+    for (int i = 0; i < STAGE_NUM; i++) {
+        uint64_t cumulative = 0;
+        for (int j = 0; j < BUCKETS - 1; j++) {
+            cumulative += s.counts[i][j];
+            appendf(out, "webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    stage_names[i], ((uint64_t)1 << j) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += s.counts[i][BUCKETS - 1];
+        appendf(out, "webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                stage_names[i], (unsigned long long)cumulative);
+        appendf(out, "webserver_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[i], s.sum_ns[i] / 1e9);
+        appendf(out, "webserver_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                stage_names[i], (unsigned long long)cumulative);
+    }
+
+    out += "# HELP webserver_open_connections Currently open client connections.\n";
+    out += "# TYPE webserver_open_connections gauge\n";
+    appendf(out, "webserver_open_connections %d\n", open_conns);
+    out += "# HELP webserver_queue_depth Requests waiting in the thread pool queues.\n";
+    out += "# TYPE webserver_queue_depth gauge\n";
+    appendf(out, "webserver_queue_depth %llu\n", (unsigned long long)queue_depth(s));
+    out += "# HELP webserver_connections_accepted_total Accepted client connections.\n";
+    out += "# TYPE webserver_connections_accepted_total counter\n";
+    appendf(out, "webserver_connections_accepted_total %llu\n", (unsigned long long)s.counters[COUNTER_ACCEPTED]);
+    out += "# HELP webserver_connections_rejected_total Connections answered with 503 because the server was full.\n";
+    out += "# TYPE webserver_connections_rejected_total counter\n";
+    appendf(out, "webserver_connections_rejected_total %llu\n", (unsigned long long)s.counters[COUNTER_REJECTED]);
+    out += "# HELP webserver_requests_total Parsed HTTP requests.\n";
+    out += "# TYPE webserver_requests_total counter\n";
+    appendf(out, "webserver_requests_total %llu\n", (unsigned long long)s.counters[COUNTER_REQUESTS]);
+    out += "# HELP webserver_timer_expirations_total Connections closed by the idle timer.\n";
+    out += "# TYPE webserver_timer_expirations_total counter\n";
+    appendf(out, "webserver_timer_expirations_total %llu\n", (unsigned long long)s.counters[COUNTER_TIMER_EXPIRATIONS]);
+    out += "# HELP webserver_tls_handshakes_total Completed TLS handshakes.\n";
+    out += "# TYPE webserver_tls_handshakes_total counter\n";
+    appendf(out, "webserver_tls_handshakes_total %llu\n", (unsigned long long)s.counters[COUNTER_TLS_HANDSHAKES]);
+    out += "# HELP webserver_tls_handshake_failures_total TLS handshakes that failed or were abandoned by the client.\n";
+    out += "# TYPE webserver_tls_handshake_failures_total counter\n";
+    appendf(out, "webserver_tls_handshake_failures_total %llu\n",
+            (unsigned long long)s.counters[COUNTER_TLS_HANDSHAKE_FAILURES]);
+    out += "# HELP webserver_ktls_connections_total TLS connections whose record encryption was offloaded to the kernel.\n";
+    out += "# TYPE webserver_ktls_connections_total counter\n";
+    appendf(out, "webserver_ktls_connections_total %llu\n", (unsigned long long)s.counters[COUNTER_KTLS]);
+    if (!cache) {
+        return;
+    }
+    out += "# HELP webserver_file_cache_hits_total Static file cache lookups that found the file.\n";
+    out += "# TYPE webserver_file_cache_hits_total counter\n";
+    appendf(out, "webserver_file_cache_hits_total %llu\n", (unsigned long long)cache->hits);
+    out += "# HELP webserver_file_cache_misses_total Static file cache lookups that did not find the file.\n";
+    out += "# TYPE webserver_file_cache_misses_total counter\n";
+    appendf(out, "webserver_file_cache_misses_total %llu\n", (unsigned long long)cache->misses);
+    out += "# HELP webserver_file_cache_evictions_total Cache entries evicted to stay within the size limit.\n";
+    out += "# TYPE webserver_file_cache_evictions_total counter\n";
+    appendf(out, "webserver_file_cache_evictions_total %llu\n", (unsigned long long)cache->evictions);
+    out += "# HELP webserver_file_cache_invalidations_total Cache entries dropped because the file changed.\n";
+    out += "# TYPE webserver_file_cache_invalidations_total counter\n";
+    appendf(out, "webserver_file_cache_invalidations_total %llu\n", (unsigned long long)cache->invalidations);
+    out += "# HELP webserver_file_cache_entries Entries in the static file cache, including gzip variants.\n";
+    out += "# TYPE webserver_file_cache_entries gauge\n";
+    appendf(out, "webserver_file_cache_entries %llu\n", (unsigned long long)cache->entries);
+    out += "# HELP webserver_file_cache_bytes Bytes held by the static file cache.\n";
+    out += "# TYPE webserver_file_cache_bytes gauge\n";
+    appendf(out, "webserver_file_cache_bytes %llu\n", (unsigned long long)cache->bytes);
+}
+
+void metrics::render_json(std::string & out, int open_conns, const file_cache_stats * cache) {
+    snapshot s;
+    collect(s);
+
+    appendf(out, "{\"open_connections\":%d,\"queue_depth\":%llu,\"connections_accepted\":%llu,\"connections_rejected\":%llu,"
+            "\"requests\":%llu,\"timer_expirations\":%llu,\"tls_handshakes\":%llu,\"tls_handshake_failures\":%llu,"
+            "\"ktls_connections\":%llu,\"stages\":{",
+            open_conns, (unsigned long long)queue_depth(s), (unsigned long long)s.counters[COUNTER_ACCEPTED],
+            (unsigned long long)s.counters[COUNTER_REJECTED],
+            (unsigned long long)s.counters[COUNTER_REQUESTS], (unsigned long long)s.counters[COUNTER_TIMER_EXPIRATIONS],
+            (unsigned long long)s.counters[COUNTER_TLS_HANDSHAKES],
+            (unsigned long long)s.counters[COUNTER_TLS_HANDSHAKE_FAILURES], (unsigned long long)s.counters[COUNTER_KTLS]);
+    for (int i = 0; i < STAGE_NUM; i++) {
+        uint64_t total = 0;
+        for (int j = 0; j < BUCKETS; j++) total += s.counts[i][j];
+        appendf(out, "%s\"%s\":{\"count\":%llu,\"sum_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"buckets\":[",
+                i ? "," : "", stage_names[i], (unsigned long long)total, (unsigned long long)(s.sum_ns[i] / 1000),
+                (unsigned long long)percentile_us(s.counts[i], 0.5), (unsigned long long)percentile_us(s.counts[i], 0.99),
+                (unsigned long long)percentile_us(s.counts[i], 0.999));
+        for (int j = 0; j < BUCKETS; j++) {
+            appendf(out, "%s%llu", j ? "," : "", (unsigned long long)s.counts[i][j]);
+        }
+        out += "]}";
+    }
+    out += "}";
+    if (cache) {
+        appendf(out, ",\"file_cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"invalidations\":%llu,"
+                "\"entries\":%llu,\"bytes\":%llu}",
+                (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+                (unsigned long long)cache->evictions, (unsigned long long)cache->invalidations,
+                (unsigned long long)cache->entries, (unsigned long long)cache->bytes);
+    }
+    out += "}\n";
+}
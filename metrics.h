@@ -0,0 +1,77 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+struct file_cache_stats;
+
+// 请求处理的各个阶段，每个阶段一个延迟直方图
+enum METRIC_STAGE {
+    STAGE_ACCEPT = 0, // accept并初始化连接
+    STAGE_READ, // 读取请求数据
+    STAGE_QUEUE, // 在线程池队列中等待
+    STAGE_PARSE, // 解析请求（process_read）
+    STAGE_BUILD, // 生成响应（process_write）
+    STAGE_WRITE, // 从响应排队到全部发送完
+    STAGE_TLS_HANDSHAKE, // 从accept到TLS握手完成
+    STAGE_NUM
+};
+
+// 计数器
+enum METRIC_COUNTER {
+    COUNTER_ACCEPTED = 0, // 接受的连接数
+    COUNTER_REJECTED, // 因为过载回复503并关闭的连接数
+    COUNTER_REQUESTS, // 处理的请求数
+    COUNTER_TIMER_EXPIRATIONS, // 超时关闭的连接数
+    COUNTER_QUEUE_PUSHES, // 放入线程池队列的请求数
+    COUNTER_QUEUE_POPS, // 从线程池队列取出的请求数
+    COUNTER_TLS_HANDSHAKES, // 完成的TLS握手数
+    COUNTER_TLS_HANDSHAKE_FAILURES, // 失败（出错或者对方断开）的TLS握手数
+    COUNTER_KTLS, // 握手之后把加密交给了内核（kTLS）的连接数
+    COUNTER_NUM
+};
+
+/*
+    低开销的运行指标。每个线程第一次记录时分配自己的计数块，挂到全局的无锁链表上，
+    之后只有这个线程写它（普通的读-改-写，没有锁和原子加），读取时遍历链表汇总，不影响记录的线程。
+    延迟直方图按微秒取2的幂分桶：第0个桶为不超过1微秒，第i个桶为(2^(i-1), 2^i]微秒，最后一个桶不设上限。
+*/
+class metrics {
+public:
+    static const int BUCKETS = 26; // 最后一个有上界的桶约为16.8秒
+
+    // 汇总后的数据
+    struct snapshot {
+        uint64_t counts[STAGE_NUM][BUCKETS];
+        uint64_t sum_ns[STAGE_NUM];
+        uint64_t counters[COUNTER_NUM];
+    };
+
+    static uint64_t now_ns(); // 单调时钟（纳秒）
+    static void record(METRIC_STAGE stage, uint64_t ns); // 记录一个阶段的耗时
+    static void count(METRIC_COUNTER counter, uint64_t n = 1);
+
+    static void collect(snapshot & s); // 汇总所有线程的数据
+    // 生成Prometheus文本格式或者JSON格式的报告，open_conns为当前的连接数，cache为静态文件缓存的统计（没有缓存时为NULL）
+    static void render_prometheus(std::string & out, int open_conns, const file_cache_stats * cache);
+    static void render_json(std::string & out, int open_conns, const file_cache_stats * cache);
+
+private:
+    struct block {
+        std::atomic<uint64_t> counts[STAGE_NUM][BUCKETS];
+        std::atomic<uint64_t> sum_ns[STAGE_NUM];
+        std::atomic<uint64_t> counters[COUNTER_NUM];
+        block * next;
+    } __attribute__((aligned(64)));
+
+    static std::atomic<block *> m_blocks; // 所有线程的计数块，只增加，不释放
+    static __thread block * t_block; // 当前线程的计数块
+
+    static block * local();
+    static int bucket(uint64_t ns);
+    static uint64_t percentile_us(const uint64_t * counts, double q); // 分位数所在桶的上界
+};
+
+#endif
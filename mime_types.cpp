@@ -0,0 +1,79 @@
+#include "mime_types.h"
+#include <string.h>
+#include <ctype.h>
+
+struct mime_entry {
+    const char * ext; // 小写，不带'.'
+    const char * type;
+    bool compressible;
+};
+
+// 必须按ext排序
+static const mime_entry mime_table[] = {
+    { "avif", "image/avif", false },
+    { "bmp", "image/bmp", false },
+    { "css", "text/css", true },
+    { "csv", "text/csv", true },
+    { "gif", "image/gif", false },
+    { "gz", "application/gzip", false },
+    { "htm", "text/html", true },
+    { "html", "text/html", true },
+    { "ico", "image/x-icon", false },
+    { "jpeg", "image/jpeg", false },
+    { "jpg", "image/jpeg", false },
+    { "js", "text/javascript", true },
+    { "json", "application/json", true },
+    { "md", "text/markdown", true },
+    { "mjs", "text/javascript", true },
+    { "mp3", "audio/mpeg", false },
+    { "mp4", "video/mp4", false },
+    { "ogg", "audio/ogg", false },
+    { "otf", "font/otf", false },
+    { "pdf", "application/pdf", false },
+    { "png", "image/png", false },
+    { "svg", "image/svg+xml", true },
+    { "ttf", "font/ttf", false },
+    { "txt", "text/plain", true },
+    { "wasm", "application/wasm", false },
+    { "wav", "audio/wav", false },
+    { "webm", "video/webm", false },
+    { "webp", "image/webp", false },
+    { "woff", "font/woff", false },
+    { "woff2", "font/woff2", false },
+    { "xml", "application/xml", true },
+    { "zip", "application/zip", false },
+};
+
+static const char * default_type = "application/octet-stream";
+
+const char * mime_type(const char * path, bool * compressible) {
+    if (compressible) *compressible = false;
+    const char * dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) {
+        return default_type;
+    }
+
+    // 扩展名转成小写，太长的一定不在表中
+    char ext[8];
+    int len = 0;
+    for (const char * p = dot + 1; *p; p++) {
+        if (len == (int)sizeof(ext) - 1) {
+            return default_type;
+        }
+        ext[len++] = tolower((unsigned char)*p);
+    }
+    ext[len] = '\0';
+
+    int lo = 0, hi = sizeof(mime_table) / sizeof(mime_table[0]) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(ext, mime_table[mid].ext);
+        if (cmp == 0) {
+            if (compressible) *compressible = mime_table[mid].compressible;
+            return mime_table[mid].type;
+        }
+        if (cmp < 0) hi = mid - 1;
+        else lo = mid + 1;
+    }
+    return default_type;
+}
@@ -0,0 +1,11 @@
+#ifndef MIMETYPES_H
+#define MIMETYPES_H
+
+/*
+    按扩展名（不区分大小写）查找Content-Type。表在编译时按扩展名排好序，查找时二分。
+    没有扩展名或者扩展名不认识时返回application/octet-stream。
+    compressible不为NULL时返回这种类型是否值得gzip压缩（文本类型）。
+*/
+const char * mime_type(const char * path, bool * compressible = 0);
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef MPMCQUEUE_H
+#define MPMCQUEUE_H
+
+#include <atomic>
+#include <exception>
+#include <new>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+    有界的多生产者多消费者无锁队列（环形数组），模板类。
+    每个槽带一个序号：序号等于入队位置时槽可写，等于入队位置+1时槽可读，
+    生产者和消费者各自用CAS推进自己的位置，不需要锁，也不会在入队时分配内存。
+    槽按缓存行对齐，入队位置和出队位置用填充隔开，避免生产者和消费者之间的伪共享。
+*/
+template <typename T>
+class mpmc_queue {
+public:
+    explicit mpmc_queue(size_t capacity);
+    ~mpmc_queue();
+
+    bool push(const T & data); // 队列满时返回false
+    bool pop(T & data); // 队列空时返回false
+    size_t size() const; // 近似的元素个数
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    // 用填充隔开，不要求队列对象本身按缓存行对齐
+    char m_pad0[CACHE_LINE_SIZE];
+    cell * m_cells;
+    size_t m_mask;
+    char m_pad1[CACHE_LINE_SIZE - sizeof(cell *) - sizeof(size_t)];
+    std::atomic<size_t> m_enqueue_pos;
+    char m_pad2[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_pad3[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+
+    mpmc_queue(const mpmc_queue &);
+    mpmc_queue & operator=(const mpmc_queue &);
+};
+
+template <typename T>
+mpmc_queue<T>::mpmc_queue(size_t capacity) : m_cells(NULL), m_mask(0), m_enqueue_pos(0), m_dequeue_pos(0) {
+    // 容量向上取整为2的幂，用位与代替取模
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    void * mem = NULL;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(cell) * size) != 0) {
+        throw std::exception();
+    }
+    m_cells = (cell *) mem;
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        new (&m_cells[i]) cell();
+        m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+mpmc_queue<T>::~mpmc_queue() {
+    for (size_t i = 0; i <= m_mask; i++) {
+        m_cells[i].~cell();
+    }
+    free(m_cells);
+}
+
+template <typename T>
+bool mpmc_queue<T>::push(const T & data) {
+    cell * c;
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // 槽可写，抢占这个位置
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 槽还没有被消费者取走，队列满
+            return false;
+        } else {
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    c->data = data;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool mpmc_queue<T>::pop(T & data) {
+    cell * c;
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            // 槽可读，抢占这个位置
+            if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 槽还没有被生产者写入，队列空
+            return false;
+        } else {
+            pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    data = c->data;
+    // 槽在下一圈可写
+    c->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+size_t mpmc_queue<T>::size() const {
+    size_t enqueue = m_enqueue_pos.load(std::memory_order_relaxed);
+    size_t dequeue = m_dequeue_pos.load(std::memory_order_relaxed);
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+#endif
@@ -0,0 +1,761 @@
+#include "proxy_pool.h"
+#include "eventloop.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <exception>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+proxy_pool::proxy_pool(eventloop * loop, const std::vector<std::string> & backends, BALANCE balance, int max_conns,
+                       int max_fails, int fail_timeout_ms, bool use_splice)
+    : upstream_pool(loop, UPSTREAM_PROXY), m_balance(balance), m_max_conns(max_conns), m_max_fails(max_fails),
+      m_fail_timeout_ns((uint64_t)fail_timeout_ms * 1000000), m_splice(use_splice), m_backends(backends.size()),
+      m_next(0) {
+    if (backends.empty() || backends.size() > (size_t)MAX_BACKENDS || max_conns < 1) {
+        throw std::exception();
+    }
+    for (size_t b = 0; b < backends.size(); b++) {
+        backend & be = m_backends[b];
+        be.name = backends[b];
+        if (!parse_address(be.name, be.addr, be.addr_len)) {
+            throw std::exception();
+        }
+        // 虚拟节点的位置只由地址决定，所有事件循环（和重启前后）的哈希环都相同
+        for (int v = 0; v < VIRTUAL_NODES; v++) {
+            char buf[16];
+            int len = snprintf(buf, sizeof(buf), "#%d", v);
+            std::string key = be.name + std::string(buf, len);
+            m_ring.push_back(std::make_pair(hash_key(key.data(), key.size()), (int)b));
+        }
+    }
+    std::sort(m_ring.begin(), m_ring.end());
+    m_conns.resize(backends.size() * max_conns);
+}
+
+// 事件循环已经结束，连接对象不会再使用请求
+proxy_pool::~proxy_pool() {
+    for (size_t i = 0; i < m_conns.size(); i++) {
+        if (m_conns[i].fd != -1) close(m_conns[i].fd);
+        delete m_conns[i].req;
+    }
+    for (size_t i = 0; i < m_waiting.size(); i++) {
+        delete m_waiting[i];
+    }
+}
+
+// FNV-1a，再用MurmurHash3的收尾混合，让相近的键（如同一个后端的虚拟节点）在环上分散开
+uint32_t proxy_pool::hash_key(const char * data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+int proxy_pool::index_of(const void * ptr) const {
+    if (m_conns.empty() || ptr < (const void *) &m_conns[0] || ptr > (const void *) &m_conns.back()) {
+        return -1;
+    }
+    return (const conn *) ptr - &m_conns[0];
+}
+
+bool proxy_pool::current(int index, uint32_t gen) const {
+    return index >= 0 && (size_t)index < m_conns.size() && m_conns[index].fd != -1
+        && (m_conns[index].gen & 0xffffff) == gen;
+}
+
+void proxy_pool::submit(upstream_request * req) {
+    if (!try_start(req)) {
+        m_waiting.push_back(req);
+    }
+}
+
+// 没有失败过的后端中，不在失败期内的优先；都在失败期内时仍然从中选择，不让请求因为健康检查而直接失败
+int proxy_pool::choose(const upstream_request * req) {
+    uint64_t now = metrics::now_ns();
+    uint64_t untried = 0;
+    uint64_t live = 0;
+    for (size_t b = 0; b < m_backends.size(); b++) {
+        uint64_t bit = 1ULL << b;
+        if (req->tried & bit) continue;
+        untried |= bit;
+        if (m_backends[b].down_until <= now) live |= bit;
+    }
+    uint64_t candidates = live ? live : untried;
+    if (!candidates) {
+        return -1;
+    }
+    if (m_balance == CONSISTENT_HASH) {
+        // 从键的位置顺时针找第一个候选后端的虚拟节点
+        std::vector<std::pair<uint32_t, int> >::const_iterator it =
+            std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(req->hash, 0));
+        for (size_t i = 0; i < m_ring.size(); i++, it++) {
+            if (it == m_ring.end()) it = m_ring.begin();
+            if (candidates & (1ULL << it->second)) {
+                return it->second;
+            }
+        }
+        return -1;
+    }
+    int n = m_backends.size();
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+        int b = (m_next + i) % n;
+        if ((candidates & (1ULL << b)) && (best == -1 || m_backends[b].active < m_backends[best].active)) {
+            best = b;
+        }
+    }
+    m_next = (best + 1) % n;
+    return best;
+}
+
+// 最近用过的空闲连接优先，它最不可能已经被后端关闭
+int proxy_pool::acquire(int b, bool & error) {
+    error = false;
+    backend & be = m_backends[b];
+    if (!be.idle.empty()) {
+        int index = be.idle.back();
+        be.idle.pop_back();
+        return index;
+    }
+    for (int i = b * m_max_conns; i < (b + 1) * m_max_conns; i++) {
+        if (m_conns[i].fd == -1) {
+            if (!open_conn(i)) {
+                error = true;
+                return -1;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 马上就连接失败的后端记一次失败，换一个后端
+bool proxy_pool::try_start(upstream_request * req) {
+    while (true) {
+        int b = choose(req);
+        if (b == -1) {
+            req->failed = true;
+            return true;
+        }
+        bool error;
+        int index = acquire(b, error);
+        if (error) {
+            backend_failed(b);
+            req->tried |= 1ULL << b;
+            continue;
+        }
+        if (index == -1) {
+            return false;
+        }
+        start(index, req);
+        return true;
+    }
+}
+
+bool proxy_pool::open_conn(int index) {
+    conn & c = m_conns[index];
+    const backend & be = m_backends[index / m_max_conns];
+    int fd = socket(be.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        printf("proxy: socket failure: %s\n", strerror(errno));
+        return false;
+    }
+    if (be.addr.ss_family == AF_INET) {
+        // 请求头一次写完，不需要Nagle算法合并
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    bool connected = ::connect(fd, (struct sockaddr *) &be.addr, be.addr_len) == 0;
+    if (!connected && errno != EINPROGRESS) {
+        printf("proxy: connect to %s failed: %s\n", be.name.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    c.fd = fd;
+    c.gen++;
+    c.connected = connected;
+    c.want_out = false;
+    c.paused = false;
+    c.resume = false;
+    c.events = -1;
+    c.served = 0;
+    c.state = RESP_IDLE;
+    update_events(index);
+    return true;
+}
+
+void proxy_pool::close_conn(int index) {
+    conn & c = m_conns[index];
+    if (c.state == RESP_IDLE) {
+        std::vector<int> & idle = m_backends[index / m_max_conns].idle;
+        std::vector<int>::iterator it = std::find(idle.begin(), idle.end(), index);
+        if (it != idle.end()) {
+            idle.erase(it);
+        }
+    }
+    m_loop->watch_upstream(this, index, c.gen, c.fd, c.events, -1);
+    close(c.fd);
+    c.fd = -1;
+    c.events = -1;
+    c.state = RESP_IDLE;
+    std::string().swap(c.out);
+    c.out_pos = 0;
+    std::string().swap(c.in);
+}
+
+// 空闲的连接直接关闭；还没有响应头、也没有发送请求体的请求重试，其余的请求失败
+void proxy_pool::fail_conn(int index) {
+    conn & c = m_conns[index];
+    int b = index / m_max_conns;
+    bool reused = c.served > 0;
+    upstream_request * req = c.req;
+    c.req = NULL;
+    close_conn(index);
+    if (req) {
+        req->conn = -1;
+        m_backends[b].active--;
+        if (!req->header_done && req->body_sent == 0) {
+            if (reused && !req->retried) {
+                // 后端关闭了空闲的长连接，不算后端失败
+                req->retried = true;
+            } else {
+                backend_failed(b);
+                req->tried |= 1ULL << b;
+            }
+            m_waiting.push_front(req);
+        } else {
+            if (!req->header_done) {
+                backend_failed(b);
+            }
+            printf("proxy: connection to %s failed during request\n", m_backends[b].name.c_str());
+            req->failed = true;
+            notify(req);
+        }
+    }
+    start_waiting();
+}
+
+void proxy_pool::backend_failed(int b) {
+    backend & be = m_backends[b];
+    if (m_max_fails == 0) {
+        return;
+    }
+    be.fails++;
+    if (be.fails >= m_max_fails) {
+        uint64_t now = metrics::now_ns();
+        if (be.down_until <= now) {
+            printf("proxy: backend %s is down after %d failures\n", be.name.c_str(), be.fails);
+        }
+        be.down_until = now + m_fail_timeout_ns;
+    }
+}
+
+// 请求头放入发送缓冲；重试的chunked请求如果请求体已经结束（请求体为空），补上最后一块
+void proxy_pool::start(int index, upstream_request * req) {
+    conn & c = m_conns[index];
+    c.req = req;
+    c.state = RESP_HEADER;
+    c.keep_alive = true;
+    c.remaining = 0;
+    c.decoder.reset();
+    req->conn = index;
+    m_backends[index / m_max_conns].active++;
+    c.out += req->head;
+    if (req->body_done && req->body_length == -1) {
+        c.out.append(LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
+    }
+    m_pending = true;
+}
+
+// 有连接空闲或者关闭之后，能开始的排队请求都开始；后端都失败过的请求失败
+void proxy_pool::start_waiting() {
+    std::deque<upstream_request *> waiting;
+    waiting.swap(m_waiting);
+    for (size_t i = 0; i < waiting.size(); i++) {
+        upstream_request * req = waiting[i];
+        if (try_start(req)) {
+            notify(req);
+        } else {
+            m_waiting.push_back(req);
+        }
+    }
+}
+
+int proxy_pool::body_room(const upstream_request * req) const {
+    if (req->conn == -1) {
+        return 0;
+    }
+    const conn & c = m_conns[req->conn];
+    size_t pending = c.out.size() - c.out_pos;
+    return pending < (size_t)MAX_PENDING_OUTPUT ? MAX_PENDING_OUTPUT - pending : 0;
+}
+
+void proxy_pool::send_body(upstream_request * req, const char * data, int len) {
+    if (len == 0) {
+        req->body_done = true;
+    }
+    if (req->conn == -1) {
+        // 还在排队（开始时补上最后一块）或者响应已经结束
+        return;
+    }
+    std::string & out = m_conns[req->conn].out;
+    if (req->body_length == -1) {
+        if (len > 0) {
+            char header[CHUNK_HEADER_MAX];
+            out.append(header, chunk_header(header, len));
+            out.append(data, len);
+            out.append("\r\n", 2);
+        } else {
+            out.append(LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
+        }
+    } else {
+        out.append(data, len);
+    }
+    req->body_sent += len;
+    m_pending = true;
+}
+
+void proxy_pool::consumed(upstream_request * req) {
+    if (req->conn == -1) {
+        return;
+    }
+    const conn & c = m_conns[req->conn];
+    if (req->out.size() < (size_t)MAX_RESPONSE_BUFFER / 2
+        && (c.state != RESP_SPLICE || req->pipe_bytes < (size_t)c.pipe_size / 2)) {
+        pause(req->conn, false);
+    }
+}
+
+void proxy_pool::release(upstream_request * req) {
+    req->owner = NULL;
+    std::string().swap(req->out);
+    if (req->conn == -1) {
+        std::deque<upstream_request *>::iterator it = std::find(m_waiting.begin(), m_waiting.end(), req);
+        if (it != m_waiting.end()) {
+            m_waiting.erase(it);
+        }
+        discard(req);
+        return;
+    }
+    int index = req->conn;
+    m_conns[index].req = NULL;
+    m_backends[index / m_max_conns].active--;
+    req->conn = -1;
+    discard(req);
+    close_conn(index);
+    start_waiting();
+}
+
+void proxy_pool::update_events(int index) {
+    conn & c = m_conns[index];
+    // 没有暂停读取时可读，发送缓冲满或者正在连接时可写
+    watch_events(index, c.gen, c.fd, !c.paused, c.want_out || !c.connected, c.events);
+}
+
+void proxy_pool::pause(int index, bool paused) {
+    conn & c = m_conns[index];
+    if (c.fd == -1 || c.paused == paused) {
+        return;
+    }
+    c.paused = paused;
+    if (!paused) {
+        // io_uring的POLL_ADD不会为已经在缓冲中的数据再次通知，先读一次
+        c.resume = true;
+        m_pending = true;
+    }
+    update_events(index);
+}
+
+void proxy_pool::handle_event(int index, int events, bool out_disarmed) {
+    conn & c = m_conns[index];
+    if (c.fd == -1) {
+        return;
+    }
+    if (out_disarmed && c.events != -1) {
+        c.events &= ~EPOLLOUT;
+    }
+    if (!c.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+            printf("proxy: connect to %s failed: %s\n", m_backends[index / m_max_conns].name.c_str(),
+                   strerror(error ? error : errno));
+            fail_conn(index);
+            deliver();
+            return;
+        }
+        c.connected = true;
+        events |= EPOLLOUT;
+    }
+    if (events & EPOLLOUT) {
+        c.want_out = false;
+        write_conn(index);
+    }
+    // 出错或者对方关闭时水平触发的事件会一直报告，暂停时也要读完
+    if (c.fd != -1 && (events & (EPOLLERR | EPOLLHUP))) {
+        read_conn(index, true);
+    } else if (c.fd != -1 && !c.paused && (events & EPOLLIN)) {
+        read_conn(index, false);
+    }
+    if (c.fd != -1) {
+        update_events(index);
+    }
+    deliver();
+}
+
+void proxy_pool::flush() {
+    while (m_pending) {
+        m_pending = false;
+        for (size_t i = 0; i < m_conns.size(); i++) {
+            conn & c = m_conns[i];
+            if (c.fd != -1 && c.resume) {
+                c.resume = false;
+                read_conn(i, false);
+            }
+            // 等待可写的连接由可写事件继续发送
+            if (c.fd != -1 && c.connected && !c.want_out && c.out_pos < c.out.size()) {
+                write_conn(i);
+                if (c.fd != -1) update_events(i);
+            }
+        }
+        deliver();
+    }
+}
+
+// 发送缓冲从满变为有空间时，唤醒在等待的请求体
+void proxy_pool::write_conn(int index) {
+    conn & c = m_conns[index];
+    bool full = c.out.size() - c.out_pos >= (size_t)MAX_PENDING_OUTPUT;
+    while (c.out_pos < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                c.want_out = true;
+                break;
+            }
+            fail_conn(index);
+            return;
+        }
+        c.out_pos += n;
+    }
+    if (c.out_pos == c.out.size()) {
+        c.out.clear();
+        c.out_pos = 0;
+    } else if (c.out_pos >= (size_t)MAX_PENDING_OUTPUT) {
+        c.out.erase(0, c.out_pos);
+        c.out_pos = 0;
+    }
+    if (full && c.out.size() - c.out_pos < (size_t)MAX_PENDING_OUTPUT && c.req && !c.req->body_done) {
+        notify(c.req);
+    }
+}
+
+void proxy_pool::read_conn(int index, bool drain) {
+    conn & c = m_conns[index];
+    char buf[READ_SIZE];
+    while (c.fd != -1 && (drain || !c.paused)) {
+        if (c.state == RESP_SPLICE) {
+            splice_body(index, drain);
+            return;
+        }
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                fail_conn(index);
+            }
+            return;
+        }
+        if (n == 0) {
+            // 没有长度的响应体到连接关闭为止；空闲的连接直接关闭
+            if (c.state == RESP_UNTIL_CLOSE) {
+                end_response(index);
+            } else {
+                fail_conn(index);
+            }
+            return;
+        }
+        if (!response_data(index, buf, n)) {
+            return;
+        }
+    }
+}
+
+// 响应体从后端连接splice到管道，管道满时暂停，等客户端连接发送之后再继续。
+// splice的EAGAIN可能是socket没有数据，也可能是管道的缓冲区用完（socket的数据不满一页时也占一个缓冲区），
+// 用socket中是否有数据区分
+void proxy_pool::splice_body(int index, bool drain) {
+    conn & c = m_conns[index];
+    upstream_request * req = c.req;
+    while (drain || !c.paused) {
+        long long room = c.pipe_size - (long long)req->pipe_bytes;
+        bool full = room <= 0;
+        ssize_t n = 0;
+        if (!full) {
+            n = splice(c.fd, NULL, req->pipe[1], NULL, room < c.remaining ? room : c.remaining,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) {
+                int avail = 0;
+                if (ioctl(c.fd, FIONREAD, &avail) != 0 || avail == 0) {
+                    return;
+                }
+                full = true;
+            } else if (n <= 0) {
+                // 出错或者响应体没有收完后端就关闭了连接
+                fail_conn(index);
+                return;
+            }
+        }
+        if (full) {
+            if (drain) {
+                fail_conn(index);
+            } else {
+                pause(index, true);
+            }
+            return;
+        }
+        req->pipe_bytes += n;
+        c.remaining -= n;
+        notify(req);
+        if (c.remaining == 0) {
+            end_response(index);
+            return;
+        }
+    }
+}
+
+bool proxy_pool::response_data(int index, char * data, int len) {
+    conn & c = m_conns[index];
+    if (!c.req) {
+        // 空闲的连接上不应该有数据
+        close_conn(index);
+        return false;
+    }
+    if (c.state != RESP_HEADER) {
+        return body_data(index, data, len);
+    }
+    c.in.append(data, len);
+    int ret = parse_header(index);
+    if (ret == 0) {
+        return true;
+    }
+    if (ret < 0) {
+        printf("proxy: bad response header from %s\n", m_backends[index / m_max_conns].name.c_str());
+        fail_conn(index);
+        return false;
+    }
+    // 和响应头一起收到的响应体
+    std::string rest;
+    rest.swap(c.in);
+    return body_data(index, &rest[0], rest.size());
+}
+
+// Connection等逗号分隔的列表中是否有token（不区分大小写）
+static bool has_token(const char * list, const char * token) {
+    int token_len = strlen(token);
+    while (*list) {
+        list += strspn(list, " \t,");
+        int len = strcspn(list, " \t,;");
+        if (len == token_len && strncasecmp(list, token, len) == 0) return true;
+        list += strcspn(list, ",");
+    }
+    return false;
+}
+
+// 状态行和响应头，1xx的中间响应跳过。逐跳的头去掉，Date由连接重新生成，
+// 响应体的长度由Transfer-Encoding、Content-Length决定，都没有时到连接关闭为止
+int proxy_pool::parse_header(int index) {
+    conn & c = m_conns[index];
+    upstream_request * req = c.req;
+    size_t end;
+    while (true) {
+        end = c.in.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            return c.in.size() > (size_t)MAX_RESPONSE_HEADER ? -1 : 0;
+        }
+        const char * p = c.in.data();
+        if (end > (size_t)MAX_RESPONSE_HEADER || end < 12 || strncmp(p, "HTTP/1.", 7) != 0 || p[8] != ' '
+            || !isdigit((unsigned char)p[9]) || !isdigit((unsigned char)p[10]) || !isdigit((unsigned char)p[11])
+            || (p[12] != ' ' && p[12] != '\r')) {
+            return -1;
+        }
+        int status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+        if (status < 100 || status == 101) {
+            // 请求中没有转发Upgrade，不会有协议升级
+            return -1;
+        }
+        if (status >= 200) {
+            req->status = status;
+            break;
+        }
+        c.in.erase(0, end + 4);
+    }
+    const char * p = c.in.data();
+    const char * e = p + end;
+    const char * line_end = (const char *) memchr(p, '\r', end + 1);
+    req->reason = line_end > p + 13 ? trim_header_value(p + 13, line_end) : "";
+    bool close = p[7] == '0'; // HTTP/1.0
+    bool chunked = false;
+    bool other_coding = false;
+    long long length = -1;
+    p = line_end + 2;
+    while (p < e) {
+        const char * le = (const char *) memchr(p, '\r', e - p);
+        if (!le) le = e;
+        const char * colon = (const char *) memchr(p, ':', le - p);
+        if (!colon || colon == p) {
+            return -1;
+        }
+        std::string name(p, colon);
+        std::string value = trim_header_value(colon + 1, le);
+        p = le + 2;
+        const char * n = name.c_str();
+        if (strcasecmp(n, "Content-Length") == 0) {
+            char * rest;
+            long long v = strtoll(value.c_str(), &rest, 10);
+            if (value.empty() || *rest || v < 0 || (length != -1 && v != length)) {
+                return -1;
+            }
+            length = v;
+        } else if (strcasecmp(n, "Transfer-Encoding") == 0) {
+            // chunked必须是最后一个编码，否则响应体到连接关闭为止
+            chunked = value.size() >= 7 && strcasecmp(value.c_str() + value.size() - 7, "chunked") == 0;
+            other_coding = !chunked;
+        } else if (strcasecmp(n, "Connection") == 0) {
+            close = close || has_token(value.c_str(), "close");
+        } else if (strcasecmp(n, "Keep-Alive") != 0 && strcasecmp(n, "Proxy-Connection") != 0
+                   && strcasecmp(n, "TE") != 0 && strcasecmp(n, "Trailer") != 0 && strcasecmp(n, "Upgrade") != 0
+                   && strcasecmp(n, "Date") != 0) {
+            req->headers += name;
+            req->headers += ": ";
+            req->headers += value;
+            req->headers += "\r\n";
+        }
+    }
+    c.in.erase(0, end + 4);
+
+    backend & be = m_backends[index / m_max_conns];
+    if (m_max_fails && be.fails >= m_max_fails) {
+        printf("proxy: backend %s is up\n", be.name.c_str());
+    }
+    be.fails = 0;
+    be.down_until = 0;
+    req->header_done = true;
+    std::string().swap(req->head);
+    if (close) {
+        c.keep_alive = false;
+    }
+    if (req->status == 204 || req->status == 304) {
+        c.state = RESP_LENGTH;
+        c.remaining = 0;
+    } else if (chunked) {
+        // 同时有Content-Length时以chunked为准，之后不再用这个连接
+        c.state = RESP_CHUNKED;
+        if (length != -1) c.keep_alive = false;
+    } else if (other_coding || length == -1) {
+        c.state = RESP_UNTIL_CLOSE;
+        c.keep_alive = false;
+    } else {
+        req->content_length = length;
+        c.remaining = length;
+        c.state = RESP_LENGTH;
+        if (m_splice && length >= SPLICE_THRESHOLD && pipe2(req->pipe, O_CLOEXEC) == 0) {
+            c.pipe_size = fcntl(req->pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+            if (c.pipe_size <= 0) {
+                c.pipe_size = fcntl(req->pipe[1], F_GETPIPE_SZ);
+            }
+            c.state = RESP_SPLICE;
+        }
+    }
+    notify(req);
+    return 1;
+}
+
+// 响应体放入out；响应之后还有多余的数据时连接不再使用
+bool proxy_pool::body_data(int index, char * data, int len) {
+    conn & c = m_conns[index];
+    upstream_request * req = c.req;
+    int used = len;
+    bool done = false;
+    if (c.state == RESP_LENGTH || c.state == RESP_SPLICE) {
+        used = len < c.remaining ? len : (int)c.remaining;
+        req->out.append(data, used);
+        c.remaining -= used;
+        done = c.remaining == 0;
+    } else if (c.state == RESP_CHUNKED) {
+        int out;
+        chunked_decoder::RESULT r = c.decoder.decode(data, len, used, out);
+        if (r == chunked_decoder::CHUNK_BAD) {
+            printf("proxy: bad chunked response from %s\n", m_backends[index / m_max_conns].name.c_str());
+            fail_conn(index);
+            return false;
+        }
+        req->out.append(data, out);
+        done = r == chunked_decoder::CHUNK_DONE;
+    } else {
+        req->out.append(data, len);
+    }
+    if (used < len) {
+        c.keep_alive = false;
+    }
+    if (used > 0) {
+        notify(req);
+    }
+    if (done) {
+        end_response(index);
+        return false;
+    }
+    if (req->out.size() >= (size_t)MAX_RESPONSE_BUFFER) {
+        pause(index, true);
+    }
+    return true;
+}
+
+// 请求体还没有发送完（后端提前响应）时连接上还有属于这个请求的数据，不能再用
+void proxy_pool::end_response(int index) {
+    conn & c = m_conns[index];
+    upstream_request * req = c.req;
+    int b = index / m_max_conns;
+    c.req = NULL;
+    c.served++;
+    req->conn = -1;
+    req->ended = true;
+    notify(req);
+    m_backends[b].active--;
+    if (!req->body_done || c.out_pos < c.out.size()) {
+        c.keep_alive = false;
+    }
+    c.state = RESP_IDLE;
+    if (c.keep_alive) {
+        // 空闲时也监听可读，及时发现后端关闭了连接
+        pause(index, false);
+        c.resume = false;
+        m_backends[b].idle.push_back(index);
+    } else {
+        close_conn(index);
+    }
+    start_waiting();
+}
@@ -0,0 +1,130 @@
+#ifndef PROXYPOOL_H
+#define PROXYPOOL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <sys/socket.h>
+#include "upstream.h"
+#include "chunked.h"
+
+/*
+    反向代理到一组HTTP/1.1后端的连接池，每个事件循环一个，只在事件循环线程中使用。
+    每个后端有自己的空闲长连接，响应结束后连接留给同一个后端的下一个请求；一个连接上同时只有一个请求（不用流水线）。
+    选择后端：LEAST_CONN选进行中的请求最少的后端（并列时轮流），CONSISTENT_HASH按请求目标在哈希环上选，
+    后端不可用时顺着环找下一个，所以增减后端时只有少数请求换后端。
+    被动健康检查：连接失败、响应头之前断开或者响应头有错算一次失败，连续max_fails次之后fail_timeout_ms内不再选它，
+    期满后重新参加选择，一次成功的响应头清零失败次数；所有后端都不可用时仍然在它们中选择。
+    还没有收到响应头、也没有发送请求体的请求失败时换一个没有失败过的后端重试；
+    复用的长连接断开（后端关闭了空闲的连接）时换一个连接重试一次，不算后端失败。
+    有Content-Length、不小于SPLICE_THRESHOLD的响应体用splice从后端连接移到管道，再由客户端连接从管道发送，
+    不经过用户空间；其余的响应体（chunked的先解码）放在out中，由客户端连接按原来的长度或者重新用chunked编码发送。
+    请求体、响应体的缓存上限同fcgi_pool，管道中的响应体也不超过管道的大小。
+*/
+class proxy_pool : public upstream_pool {
+public:
+    static const int MAX_BACKENDS = 64; // 后端的最多个数，失败过的后端用64位的位图记录
+    static const int MAX_PENDING_OUTPUT = 64 * 1024; // 每个后端连接待发送数据的上限
+    static const int MAX_RESPONSE_BUFFER = 64 * 1024; // 每个请求缓存在out中的响应体的上限
+    static const int MAX_RESPONSE_HEADER = 8192; // 响应头的最大字节数，超过时回复502
+    static const int READ_SIZE = 16 * 1024; // 每次从后端连接读取的字节数
+    static const int SPLICE_THRESHOLD = 64 * 1024; // Content-Length不小于该值的响应体用splice转发
+    static const int PIPE_SIZE = 256 * 1024; // splice用的管道的大小
+    static const int VIRTUAL_NODES = 160; // 一致性哈希中每个后端的虚拟节点数
+
+    enum BALANCE { LEAST_CONN, CONSISTENT_HASH };
+
+    // backends为后端地址的列表（格式同fcgi_pool），max_conns为每个后端最多的连接数，max_fails为0时不做健康检查；
+    // use_splice为false时响应体都经过用户空间；地址不对时抛出异常
+    proxy_pool(eventloop * loop, const std::vector<std::string> & backends, BALANCE balance, int max_conns,
+               int max_fails, int fail_timeout_ms, bool use_splice);
+    ~proxy_pool();
+    static uint32_t hash_key(const char * data, size_t len); // 一致性哈希用的哈希函数
+
+    void submit(upstream_request * req);
+    int body_room(const upstream_request * req) const;
+    // req->body_length为-1时请求体用chunked编码转发
+    void send_body(upstream_request * req, const char * data, int len);
+    void consumed(upstream_request * req);
+    // 响应还没有收完时关闭后端连接
+    void release(upstream_request * req);
+
+    int index_of(const void * ptr) const;
+    void * key(int index) { return &m_conns[index]; }
+    bool current(int index, uint32_t gen) const;
+    int fd(int index) const { return m_conns[index].fd; }
+    void handle_event(int index, int events, bool out_disarmed = false);
+    void flush();
+
+private:
+    // 后端连接上的响应进行到哪里：空闲、响应头、按Content-Length读到out、按Content-Length splice到管道、
+    // chunked、读到连接关闭为止
+    enum RESPONSE_STATE { RESP_IDLE, RESP_HEADER, RESP_LENGTH, RESP_SPLICE, RESP_CHUNKED, RESP_UNTIL_CLOSE };
+
+    struct backend {
+        backend() : addr_len(0), active(0), fails(0), down_until(0) {}
+        std::string name; // 配置中的地址
+        sockaddr_storage addr;
+        socklen_t addr_len;
+        int active; // 进行中的请求数
+        int fails; // 连续失败的次数
+        uint64_t down_until; // 失败次数到上限之后，到这个时间（单调时钟）之前不再选择
+        std::vector<int> idle; // 空闲长连接的编号，最近用过的在最后
+    };
+
+    struct conn {
+        conn() : fd(-1), gen(0), connected(false), want_out(false), paused(false), resume(false), events(-1),
+                 served(0), keep_alive(false), out_pos(0), req(NULL), state(RESP_IDLE), remaining(0), pipe_size(0) {}
+        int fd; // -1表示没有使用
+        uint32_t gen; // 代数，每次建立连接加1，用来丢弃已经关闭的连接的事件
+        bool connected; // 非阻塞的connect已经完成
+        bool want_out; // 发送缓冲满，等待可写
+        bool paused; // 请求缓存的响应体太多，暂停读取
+        bool resume; // 恢复读取，在flush()中先读一次
+        int events; // 事件循环正在监听的事件，-1表示没有注册
+        int served; // 在这个连接上结束的请求数，大于0说明是复用的长连接
+        bool keep_alive; // 响应结束后连接可以留给下一个请求
+        std::string out; // 待发送的请求，从out_pos开始
+        size_t out_pos;
+        std::string in; // 收到的还不完整的响应头
+        upstream_request * req; // 进行中的请求，NULL表示空闲
+        RESPONSE_STATE state;
+        long long remaining; // 按Content-Length还没有收到的响应体字节数
+        chunked_decoder decoder;
+        int pipe_size; // 请求的管道的容量
+    };
+
+    BALANCE m_balance;
+    int m_max_conns;
+    int m_max_fails;
+    uint64_t m_fail_timeout_ns;
+    bool m_splice;
+    std::vector<backend> m_backends;
+    std::vector<std::pair<uint32_t, int> > m_ring; // 一致性哈希环：虚拟节点的哈希值和后端编号，按哈希值排序
+    int m_next; // LEAST_CONN时从这个后端开始比较，并列时轮流选择
+    std::vector<conn> m_conns; // 大小固定，第b个后端的连接为[b * max_conns, (b + 1) * max_conns)
+    std::deque<upstream_request *> m_waiting; // 等待空闲连接的请求
+
+    int choose(const upstream_request * req); // 选择后端，没有可以尝试的后端时返回-1
+    int acquire(int b, bool & error); // 后端b的空闲连接，必要时新建；都忙时返回-1，新建失败时error为true
+    bool try_start(upstream_request * req); // 选择后端并开始请求，要排队时返回false
+    bool open_conn(int index);
+    void close_conn(int index);
+    void fail_conn(int index); // 后端连接出错、被关闭或者响应有错
+    void backend_failed(int b);
+    void start(int index, upstream_request * req);
+    void start_waiting();
+    void update_events(int index);
+    void write_conn(int index);
+    void read_conn(int index, bool drain); // drain时不管是否暂停，读到EAGAIN或者出错
+    void splice_body(int index, bool drain);
+    bool response_data(int index, char * data, int len); // 处理收到的数据，连接关闭或者响应结束时返回false
+    int parse_header(int index); // 1为响应头完整，0为需要更多数据，-1为出错
+    bool body_data(int index, char * data, int len);
+    void end_response(int index);
+    void pause(int index, bool paused);
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef SLABPOOL_H
+#define SLABPOOL_H
+
+#include <new>
+#include <vector>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    对象池，模板类。对象存放在固定大小的slab中，每个slab一次分配SLAB_SIZE个对象的内存，
+    对象在第一次被借出时才构造（值初始化），归还后放进空闲链表，再次借出时不重新构造，由使用者自己重置状态。
+    对象的地址在池销毁之前不会改变，每个对象有一个固定的编号，可以用编号找回对象。
+    slab不归还给系统，池占用的内存取决于同时借出的对象数的峰值，而不是上限max_objects。
+    不加锁，只能在一个线程中使用。
+*/
+template <typename T>
+class slab_pool {
+public:
+    static const int SLAB_BITS = 8;
+    static const uint32_t SLAB_SIZE = 1 << SLAB_BITS; // 每个slab中的对象数
+    static const uint32_t NONE = 0xffffffff;
+
+    explicit slab_pool(uint32_t max_objects);
+    ~slab_pool();
+
+    // 借出一个对象，index返回它的编号；借出的对象数达到上限或者内存不足时返回NULL
+    T * alloc(uint32_t & index);
+    void free(uint32_t index); // 归还编号为index的对象
+    // 编号为index的对象，index不是构造过的对象时返回NULL
+    T * at(uint32_t index) {
+        return index < m_constructed ? &m_slabs[index >> SLAB_BITS][index & (SLAB_SIZE - 1)].obj : NULL;
+    }
+    uint32_t constructed() const { return m_constructed; } // 构造过的对象数，编号为[0, constructed())
+    uint32_t in_use() const { return m_in_use; } // 借出中的对象数
+
+private:
+    struct node {
+        T obj;
+        uint32_t next_free; // 空闲链表中下一个对象的编号
+    };
+
+    std::vector<node *> m_slabs;
+    uint32_t m_max;
+    uint32_t m_constructed;
+    uint32_t m_in_use;
+    uint32_t m_free; // 空闲链表头，NONE表示空
+
+    node & get(uint32_t index) { return m_slabs[index >> SLAB_BITS][index & (SLAB_SIZE - 1)]; }
+
+    slab_pool(const slab_pool &);
+    slab_pool & operator=(const slab_pool &);
+};
+
+template <typename T>
+slab_pool<T>::slab_pool(uint32_t max_objects)
+    : m_max(max_objects), m_constructed(0), m_in_use(0), m_free(NONE) {
+}
+
+template <typename T>
+slab_pool<T>::~slab_pool() {
+    for (uint32_t i = 0; i < m_constructed; i++) {
+        get(i).~node();
+    }
+    for (size_t i = 0; i < m_slabs.size(); i++) {
+        ::free(m_slabs[i]);
+    }
+}
+
+template <typename T>
+T * slab_pool<T>::alloc(uint32_t & index) {
+    if (m_free != NONE) {
+        index = m_free;
+        m_free = get(index).next_free;
+        m_in_use++;
+        return &get(index).obj;
+    }
+    if (m_constructed >= m_max) {
+        return NULL;
+    }
+
+    // 空闲链表为空，从最后一个slab中取一个没有用过的对象，最后一个slab满了就分配新的
+    index = m_constructed;
+    if ((index & (SLAB_SIZE - 1)) == 0) {
+        node * slab = (node *) malloc(sizeof(node) * SLAB_SIZE);
+        if (!slab) {
+            return NULL;
+        }
+        try {
+            m_slabs.push_back(slab);
+        } catch(...) {
+            ::free(slab);
+            return NULL;
+        }
+    }
+    node * n = &get(index);
+    try {
+        new (n) node();
+    } catch(...) {
+        return NULL;
+    }
+    n->next_free = NONE;
+    m_constructed++;
+    m_in_use++;
+    return &n->obj;
+}
+
+template <typename T>
+void slab_pool<T>::free(uint32_t index) {
+    get(index).next_free = m_free;
+    m_free = index;
+    m_in_use--;
+}
+
+#endif
@@ -2,99 +2,180 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <list>
+#include <sched.h>
+#include <unistd.h>
 #include "locker.h"
+#include "mpmc_queue.h"
+#include "metrics.h"
 #include <exception>
 #include <cstdio>
 
 // 线程池类，模板类，为了代码复用
+// 每个工作线程有自己的请求队列，append()轮流放入各个队列；工作线程先处理自己队列中的请求，
+// 自己的队列为空时从其他工作线程的队列中窃取，这样少数很慢的请求不会让排在它后面的请求一直等待
 template <typename T>
 class threadpool {
 public:
-    threadpool(int thread_num = 8, int max_requests = 10000);
+    static const int SPIN_COUNT = 200; // 工作线程没有任务时，休眠之前自旋尝试的次数
+
+    // pin_cpu为true时，第i个工作线程绑定到第i个（取模）CPU上
+    threadpool(int thread_num = 8, int max_requests = 10000, bool pin_cpu = false);
     ~threadpool();
     bool append(T *request);
-    void run();
+    size_t size() const; // 所有队列中等待处理的请求数量
 
 private:
+    struct worker_t {
+        threadpool * pool;
+        int index;
+        mpmc_queue<T*> * queue;  // 该线程的请求队列，无锁环形队列，其他线程可以从中窃取
+        pthread_t thread;
+    };
+
     int m_thread_num;  // 数量
-    pthread_t * m_threads;  // 线程池数组
+    worker_t * m_workers;  // 工作线程数组
     int m_max_requests;  // 请求队列中最多允许的请求数量
-    std::list<T*> m_workqueue;  // 请求队列
-    locker m_queuelocker;  // 互斥锁
-    sem m_queuestat;  // 信号量用于判断是否有任务需要处理
-    bool m_stop;  // 是否结束线程
+    std::atomic<unsigned> m_next;  // 下一个放入请求的队列
+    eventcount m_queuestat;  // 没有任务时工作线程在上面休眠
+    std::atomic<bool> m_stop;  // 是否结束线程
+
+    bool take(int index, T *&request); // 取出一个任务，没有任务时先自旋再休眠
+    bool try_take(int index, T *&request); // 先取自己的队列，再从其他队列窃取
+    void run(int index);
+    void destroy(int started);
 
     static void *worker(void *arg);
 };
 
 template <typename T>
-threadpool<T>::threadpool(int thread_num, int max_requests) : m_thread_num(thread_num), m_max_requests(max_requests), m_stop(false), m_threads(NULL) {
+threadpool<T>::threadpool(int thread_num, int max_requests, bool pin_cpu) : m_thread_num(thread_num), m_workers(NULL),
+    m_max_requests(max_requests), m_next(0), m_stop(false) {
     if (thread_num <= 0 || max_requests <= 0) {
         throw std::exception();
     }
 
-    m_threads = new pthread_t[m_thread_num];
-    if (!m_threads) {
-        throw std::exception();
+    m_workers = new worker_t[m_thread_num];
+    for (int i = 0; i < thread_num; i++) {
+        m_workers[i].pool = this;
+        m_workers[i].index = i;
+        m_workers[i].queue = NULL;
+    }
+    try {
+        for (int i = 0; i < thread_num; i++) {
+            m_workers[i].queue = new mpmc_queue<T*>((max_requests + thread_num - 1) / thread_num);
+        }
+    } catch(...) {
+        destroy(0);
+        throw;
     }
 
-    // 创建线程，设置为线程脱离（自己释放资源）
+    // 创建线程，析构时等待线程结束
+    int cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
     for (int i = 0; i < thread_num; i++) {
         printf("create the %dth thread\n", i);
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0) {  // worker:静态函数
-            delete [] m_threads;
+        if (pthread_create(&m_workers[i].thread, NULL, worker, m_workers + i) != 0) {  // worker:静态函数
+            destroy(i);
             throw std::exception();
         }
-        if (pthread_detach(m_threads[i]) != 0) {
-            delete [] m_threads;
-            throw std::exception();
-        } 
+        if (pin_cpu && cpu_num > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cpu_num, &cpus);
+            pthread_setaffinity_np(m_workers[i].thread, sizeof(cpus), &cpus);
+        }
     }
 
 }
 
 template <typename T>
 threadpool<T>::~threadpool() {
-    delete [] m_threads;
+    destroy(m_thread_num);
+}
+
+// 结束前started个线程，释放队列
+template <typename T>
+void threadpool<T>::destroy(int started) {
     m_stop = true;
+    m_queuestat.notify_all();
+    for (int i = 0; i < started; i++) {
+        pthread_join(m_workers[i].thread, NULL);
+    }
+    for (int i = 0; i < m_thread_num; i++) {
+        delete m_workers[i].queue;
+    }
+    delete [] m_workers;
+    m_workers = NULL;
 }
 
 template <typename T>
 bool threadpool<T>::append(T *request) {
-    m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests) {
-        m_queuelocker.unlock();
-        return false;
+    // 轮流放入各个队列，队列满时放入下一个
+    unsigned start = m_next.fetch_add(1, std::memory_order_relaxed);
+    for (int i = 0; i < m_thread_num; i++) {
+        if (m_workers[(start + i) % m_thread_num].queue->push(request)) {
+            metrics::count(COUNTER_QUEUE_PUSHES);
+            m_queuestat.notify_one();
+            return true;
+        }
     }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    return false;
+}
 
-    return true;
+template <typename T>
+size_t threadpool<T>::size() const {
+    size_t n = 0;
+    for (int i = 0; i < m_thread_num; i++) {
+        n += m_workers[i].queue->size();
+    }
+    return n;
 }
 
 template <typename T>
 void *threadpool<T>::worker(void *arg) {
-    threadpool *pool = (threadpool *) arg;
-    pool->run();
-    return pool;
+    worker_t *w = (worker_t *) arg;
+    w->pool->run(w->index);
+    return w->pool;
+}
+
+template <typename T>
+bool threadpool<T>::try_take(int index, T *&request) {
+    if (m_workers[index].queue->pop(request)) {
+        return true;
+    }
+    for (int i = 1; i < m_thread_num; i++) {
+        if (m_workers[(index + i) % m_thread_num].queue->pop(request)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 template <typename T>
-void threadpool<T>::run() {
+bool threadpool<T>::take(int index, T *&request) {
     while (!m_stop) {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty()) {
-            m_queuelocker.unlock();
-            continue;
+        for (int i = 0; i < SPIN_COUNT; i++) {
+            if (try_take(index, request)) {
+                return true;
+            }
+            cpu_relax();
         }
 
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+        // 登记为等待者之后再检查一次所有队列，避免错过append()的通知
+        int key = m_queuestat.prepare_wait();
+        if (m_stop || try_take(index, request)) {
+            m_queuestat.cancel_wait();
+            return !m_stop;
+        }
+        m_queuestat.wait(key);
+    }
+    return false;
+}
 
+template <typename T>
+void threadpool<T>::run(int index) {
+    T *request = NULL;
+    while (take(index, request)) {
+        metrics::count(COUNTER_QUEUE_POPS);
         if (!request) {
             continue;
         }
@@ -103,4 +184,4 @@ void threadpool<T>::run() {
     }
 }
 
-# endif
\ No newline at end of file
+# endif
@@ -0,0 +1,50 @@
+#include "tls.h"
+#include <stdio.h>
+#include <exception>
+#include <openssl/err.h>
+
+// TLS 1.3的套件和TLS 1.2的密码列表，AES-GCM在前：内核的tls模块都支持，CPU有AES指令时也最快
+static const char * tls13_suites = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+static const char * tls12_ciphers = "ECDHE+AESGCM:ECDHE+CHACHA20";
+
+tls_context::tls_context(const char * cert, const char * key, bool ktls) : m_ctx(NULL) {
+    m_ctx = SSL_CTX_new(TLS_server_method());
+    if (!m_ctx) {
+        throw std::exception();
+    }
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    // 不支持重新协商；对方不发close_notify就关闭连接时按正常关闭处理，响应是否完整由HTTP的长度决定
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF;
+    if (ktls) {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+    SSL_CTX_set_options(m_ctx, options);
+    // 连接空闲时归还记录缓冲区（每个连接约34K），大量空闲的长连接不占用内存
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_id_context(m_ctx, (const unsigned char *)"webserver", 9);
+    if (SSL_CTX_set_ciphersuites(m_ctx, tls13_suites) != 1 || SSL_CTX_set_cipher_list(m_ctx, tls12_ciphers) != 1
+        || SSL_CTX_use_certificate_chain_file(m_ctx, cert) != 1
+        || SSL_CTX_use_PrivateKey_file(m_ctx, key, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(m_ctx) != 1) {
+        printf("load TLS certificate failure: %s\n", ERR_error_string(ERR_get_error(), NULL));
+        SSL_CTX_free(m_ctx);
+        throw std::exception();
+    }
+}
+
+tls_context::~tls_context() {
+    SSL_CTX_free(m_ctx);
+}
+
+SSL * tls_context::create(int fd) {
+    SSL * ssl = SSL_new(m_ctx);
+    if (!ssl) {
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
@@ -0,0 +1,32 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+
+/*
+    TLS端口的OpenSSL上下文，整个进程一个，所有事件循环共享（SSL_CTX可以在多个线程中同时使用），每个连接一个SSL对象。
+    握手在连接的非阻塞状态机中进行。ktls为true时让OpenSSL在握手之后把记录的加密（TLS 1.2时还有解密）交给内核：
+    加密交给内核的连接照常用sendmsg、sendfile、splice发送明文，由内核加密，文件内容仍然不经过用户空间；
+    内核没有tls模块或者协商的加密套件不支持时，在用户空间用SSL_write加密。
+    只支持TLS 1.2和1.3，优先AES-GCM（内核支持的套件），空闲的连接释放记录缓冲区。
+*/
+class tls_context {
+public:
+    static const int RECORD_SIZE = 16 * 1024; // 一条TLS记录的最大明文长度，用户空间加密时每次SSL_write的上限
+
+    // cert为证书链文件，key为私钥文件，都是PEM格式；加载失败或者不匹配时抛出异常
+    tls_context(const char * cert, const char * key, bool ktls);
+    ~tls_context();
+
+    // 新连接的SSL对象，处于服务端握手状态；失败时返回NULL
+    SSL * create(int fd);
+
+    // 握手完成之后，记录的加密、解密是否已经交给内核
+    static bool ktls_send(SSL * ssl) { return BIO_get_ktls_send(SSL_get_wbio(ssl)); }
+    static bool ktls_recv(SSL * ssl) { return BIO_get_ktls_recv(SSL_get_rbio(ssl)); }
+
+private:
+    SSL_CTX * m_ctx;
+};
+
+#endif
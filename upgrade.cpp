@@ -0,0 +1,202 @@
+#include "upgrade.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <vector>
+
+extern char ** environ;
+
+const char * const upgrade::HANDOFF_ENV = "WEBSERVER_HANDOFF_FD";
+int upgrade::m_handoff_fd = -1;
+
+static const int BATCH_FDS = 64; // 每条消息携带的fd数，不能超过内核的SCM_MAX_FD（253）
+static const int CHILD_HANDOFF_FD = 3; // 新进程中Unix socket的fd
+
+// 每条消息的数据为后面携带的fd数，0表示结束
+int upgrade::inherit(int * fds, int max_fds) {
+    const char * env = getenv(HANDOFF_ENV);
+    if (!env) {
+        return 0;
+    }
+    m_handoff_fd = atoi(env);
+    // 不再传给以后升级启动的进程
+    unsetenv(HANDOFF_ENV);
+    fcntl(m_handoff_fd, F_SETFD, FD_CLOEXEC);
+
+    int n = 0;
+    for (;;) {
+        int count = 0;
+        struct iovec iov;
+        iov.iov_base = &count;
+        iov.iov_len = sizeof(count);
+        char control[CMSG_SPACE(sizeof(int) * BATCH_FDS)];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t ret = recvmsg(m_handoff_fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret != sizeof(count) || count < 0 || count > BATCH_FDS || (msg.msg_flags & MSG_CTRUNC)) {
+            break;
+        }
+        if (count == 0) {
+            return n;
+        }
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count)) {
+            break;
+        }
+        int * received = (int *) CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++) {
+            if (n < max_fds) {
+                fds[n++] = received[i];
+            } else {
+                close(received[i]);
+            }
+        }
+    }
+
+    printf("receive listening sockets failure\n");
+    for (int i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+    close(m_handoff_fd);
+    m_handoff_fd = -1;
+    return -1;
+}
+
+void upgrade::ready() {
+    if (m_handoff_fd == -1) {
+        return;
+    }
+    char c = 1;
+    send(m_handoff_fd, &c, 1, MSG_NOSIGNAL);
+    close(m_handoff_fd);
+    m_handoff_fd = -1;
+}
+
+bool upgrade::send_fds(int sock, const int * fds, int n) {
+    // 最后一条消息不带fd，表示结束
+    for (int start = 0; ; ) {
+        int count = n - start < BATCH_FDS ? n - start : BATCH_FDS;
+        struct iovec iov;
+        iov.iov_base = &count;
+        iov.iov_len = sizeof(count);
+        char control[CMSG_SPACE(sizeof(int) * BATCH_FDS)];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (count > 0) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+            struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            memcpy(CMSG_DATA(cmsg), fds + start, sizeof(int) * count);
+        }
+        ssize_t ret;
+        do {
+            ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != sizeof(count)) {
+            return false;
+        }
+        if (count == 0) {
+            return true;
+        }
+        start += count;
+    }
+}
+
+// 在fork之前准备好环境变量，子进程在exec之前只调用异步信号安全的函数
+pid_t upgrade::spawn(const char * exe, char * const argv[], int fd) {
+    std::vector<char *> envp;
+    for (char ** e = environ; *e; e++) {
+        envp.push_back(*e);
+    }
+    char handoff[64];
+    snprintf(handoff, sizeof(handoff), "%s=%d", HANDOFF_ENV, CHILD_HANDOFF_FD);
+    envp.push_back(handoff);
+    envp.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    // 子进程：Unix socket放到固定的fd上，关闭其余继承来的fd（连接、epoll、信号管道等），只保留标准输入输出
+    if (fd == CHILD_HANDOFF_FD) {
+        fcntl(fd, F_SETFD, 0);
+    } else if (dup2(fd, CHILD_HANDOFF_FD) == -1) {
+        _exit(127);
+    }
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, CHILD_HANDOFF_FD + 1, ~0U, 0) != 0)
+#endif
+    {
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        for (long i = CHILD_HANDOFF_FD + 1; i < max_fd; i++) {
+            close(i);
+        }
+    }
+    // 信号处理函数和屏蔽字会被继承，恢复默认
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    execve(exe, argv, &envp[0]);
+    _exit(127);
+}
+
+bool upgrade::hand_off(const char * exe, char * const argv[], const int * fds, int n) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        printf("upgrade: socketpair failure\n");
+        return false;
+    }
+    pid_t pid = spawn(exe, argv, sv[1]);
+    close(sv[1]);
+    if (pid < 0) {
+        printf("upgrade: fork failure\n");
+        close(sv[0]);
+        return false;
+    }
+
+    bool ok = send_fds(sv[0], fds, n);
+    if (ok) {
+        // 新进程创建完事件循环后回复一个字节；启动失败退出时读到EOF
+        struct pollfd pfd;
+        pfd.fd = sv[0];
+        pfd.events = POLLIN;
+        int ret;
+        do {
+            ret = poll(&pfd, 1, READY_TIMEOUT_MS);
+        } while (ret < 0 && errno == EINTR);
+        char c;
+        ok = ret > 0 && recv(sv[0], &c, 1, 0) == 1;
+    }
+    close(sv[0]);
+
+    if (!ok) {
+        printf("upgrade: new process %d is not ready, keep running\n", (int)pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    printf("upgrade: new process %d is ready, %d listening sockets handed off\n", (int)pid, n);
+    return true;
+}
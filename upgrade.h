@@ -0,0 +1,36 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+
+/*
+    平滑升级：不中断服务地换成新的可执行文件（或者新的只在启动时生效的配置）。
+    旧进程收到SIGUSR2后fork并exec新的进程，通过一对Unix socket用SCM_RIGHTS把所有监听socket交给它，
+    新进程用这些socket创建事件循环之后回复一个字节，旧进程这才停止accept、关闭自己的监听socket，
+    处理完已有的连接（最多drain_timeout_ms）后退出。监听socket在整个过程中一直打开，
+    已经在监听队列中的连接由新进程accept，所以不会有连接被拒绝。
+    新进程通过环境变量HANDOFF_ENV得到Unix socket的fd。
+*/
+class upgrade {
+public:
+    static const int MAX_LISTENERS = 1024; // 最多传递的监听socket数
+    static const int READY_TIMEOUT_MS = 10000; // 等待新进程就绪的时间，超时则放弃升级
+    static const char * const HANDOFF_ENV;
+
+    // 新进程启动时调用：接收旧进程交来的监听socket放到fds中，返回个数；不是由升级启动的返回0，出错返回-1
+    static int inherit(int * fds, int max_fds);
+    // 新进程创建完事件循环之后调用，通知旧进程停止accept
+    static void ready();
+
+    // 旧进程调用，会阻塞到新进程就绪：以exe和argv启动新的进程，把fds交给它；新进程就绪时返回true，
+    // 失败时结束新进程并返回false，旧进程照常运行
+    static bool hand_off(const char * exe, char * const argv[], const int * fds, int n);
+
+private:
+    static int m_handoff_fd; // 新进程中和旧进程之间的Unix socket，ready()之后关闭
+
+    static pid_t spawn(const char * exe, char * const argv[], int fd);
+    static bool send_fds(int sock, const int * fds, int n);
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "upstream.h"
+#include "eventloop.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+upstream_request::~upstream_request() {
+    if (pipe[0] != -1) {
+        close(pipe[0]);
+        close(pipe[1]);
+    }
+}
+
+upstream_pool::upstream_pool(eventloop * loop, UPSTREAM_KIND kind)
+    : m_loop(loop), m_kind(kind), m_pending(false) {
+}
+
+// 事件循环已经结束，连接对象不会再使用请求
+upstream_pool::~upstream_pool() {
+    for (size_t i = 0; i < m_garbage.size(); i++) {
+        delete m_garbage[i];
+    }
+}
+
+void upstream_pool::watch_events(int index, uint32_t gen, int fd, bool readable, bool writable, int & events) {
+    int want = (readable ? (int)EPOLLIN : 0) | (writable ? (int)EPOLLOUT : 0);
+    if (want != events) {
+        m_loop->watch_upstream(this, index, gen, fd, events, want);
+        events = want;
+    }
+}
+
+bool upstream_pool::parse_address(const std::string & address, sockaddr_storage & addr, socklen_t & len) {
+    memset(&addr, 0, sizeof(addr));
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un * un = (sockaddr_un *) &addr;
+        if (path.empty() || path.size() >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path.c_str(), path.size() + 1);
+        len = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+        return true;
+    }
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size()) {
+        return false;
+    }
+    std::string host = address.substr(0, colon);
+    if (host == "localhost") host = "127.0.0.1";
+    char * end;
+    long port = strtol(address.c_str() + colon + 1, &end, 10);
+    sockaddr_in * in = (sockaddr_in *) &addr;
+    if (*end || port < 1 || port > 65535 || inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1) {
+        return false;
+    }
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    len = sizeof(sockaddr_in);
+    return true;
+}
+
+void upstream_pool::notify(upstream_request * req) {
+    if (req->owner && !req->notified) {
+        req->notified = true;
+        m_wake.push_back(req);
+        m_pending = true;
+    }
+}
+
+void upstream_pool::discard(upstream_request * req) {
+    m_garbage.push_back(req);
+    m_pending = true;
+}
+
+// 被唤醒的连接可能释放请求、开始新的请求，所以请求在唤醒都完成之后才释放
+void upstream_pool::deliver() {
+    while (!m_wake.empty()) {
+        std::vector<upstream_request *> wake;
+        wake.swap(m_wake);
+        for (size_t i = 0; i < wake.size(); i++) {
+            upstream_request * req = wake[i];
+            req->notified = false;
+            if (req->owner) {
+                m_loop->wake_upstream(req->owner);
+            }
+        }
+    }
+    for (size_t i = 0; i < m_garbage.size(); i++) {
+        delete m_garbage[i];
+    }
+    m_garbage.clear();
+}
+
+std::string trim_header_value(const char * p, const char * end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+    return std::string(p, end);
+}
@@ -0,0 +1,103 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+class eventloop;
+class http_conn;
+
+// 后端连接池的种类，每个事件循环每种最多一个
+enum UPSTREAM_KIND { UPSTREAM_FASTCGI = 0, UPSTREAM_PROXY, UPSTREAM_KINDS };
+
+// 转发给后端的一个请求，由发起请求的连接和连接池共同使用，都在事件循环线程中
+struct upstream_request {
+    http_conn * owner; // 发起请求的连接，release()之后为NULL
+    // 编码好的请求头：FastCGI的PARAMS流，或者HTTP的请求行和请求头；保留到收到响应，换一个后端连接重试时再用
+    std::string head;
+    long long body_length; // 请求体的长度，-1表示chunked（事先不知道长度）
+    uint32_t hash; // 按一致性哈希选择后端时的键
+    int conn; // 所在的后端连接，-1表示还在排队或者已经结束
+    int id; // 在后端连接上的请求编号（FastCGI）
+    bool body_done; // 请求体已经全部交给连接池
+    long long body_sent; // 已经交给连接池的请求体字节数
+    bool retried; // 复用的长连接断开，已经换过一次连接
+    uint64_t tried; // 已经失败过的后端（反向代理），按编号的位图
+    bool notified; // 已经在等待唤醒的列表中
+
+    // 后端的响应
+    std::string header_buf; // 还没有结束的CGI响应头
+    bool header_done;
+    bool got_output; // 收到过STDOUT
+    int status;
+    std::string reason;
+    std::string headers; // 转发给客户端的响应头，每个以\r\n结尾
+    long long content_length; // 后端给出的Content-Length，-1表示没有
+    std::string out; // 还没有取走的响应体
+    int pipe[2]; // 用splice转发的响应体所在的管道，-1表示没有；在out之后
+    size_t pipe_bytes; // 管道中还没有发送给客户端的字节数
+    bool ended; // 后端的响应已经完整收到
+    bool failed; // 后端连接出错、拒绝请求或者响应头有错，响应不完整
+
+    explicit upstream_request(http_conn * o)
+        : owner(o), body_length(0), hash(0), conn(-1), id(0), body_done(false), body_sent(0), retried(false),
+          tried(0), notified(false), header_done(false), got_output(false), status(200), content_length(-1),
+          pipe_bytes(0), ended(false), failed(false) {
+        pipe[0] = pipe[1] = -1;
+    }
+    ~upstream_request(); // 关闭管道
+};
+
+/*
+    后端连接池的接口，FastCGI（fcgi_pool）和反向代理（proxy_pool）各自实现，每个事件循环一个，只在事件循环线程中使用。
+    后端连接是非阻塞的，和客户端连接一样由事件循环监听（eventloop::watch_upstream）。
+    后端连接上有事件、数据被取走之后，连接池唤醒受影响的请求的连接（eventloop::wake_upstream），
+    由它们调用下面的接口推进；这些接口本身不会同步地唤醒任何连接，唤醒都在handle_event()和flush()的最后进行。
+*/
+class upstream_pool {
+public:
+    virtual ~upstream_pool();
+
+    // 以下由发起请求的连接调用
+    virtual void submit(upstream_request * req) = 0; // 开始请求，连接不上后端时设置req->failed
+    virtual int body_room(const upstream_request * req) const = 0; // 现在可以交给连接池的请求体字节数
+    virtual void send_body(upstream_request * req, const char * data, int len) = 0; // len为0表示请求体结束
+    virtual void consumed(upstream_request * req) = 0; // 取走了一部分响应体
+    virtual void release(upstream_request * req) = 0; // 不再使用req，之后由连接池释放
+
+    // 以下由事件循环调用
+    virtual int index_of(const void * ptr) const = 0; // epoll中注册的指针对应的后端连接，不是时返回-1
+    virtual void * key(int index) = 0; // 后端连接在epoll中注册的指针
+    virtual bool current(int index, uint32_t gen) const = 0; // 编号和代数（低24位）是否是一个打开的后端连接
+    virtual int fd(int index) const = 0;
+    // 后端连接上有事件；out_disarmed表示一次性的可写监听已经结束（io_uring后端）
+    virtual void handle_event(int index, int events, bool out_disarmed = false) = 0;
+    virtual void flush() = 0; // 每轮事件处理完之后调用：发送积累的数据，唤醒等待的连接
+
+    UPSTREAM_KIND kind() const { return m_kind; }
+
+    // address为"unix:/path"或者"ip:port"，只支持IPv4地址，不解析域名
+    static bool parse_address(const std::string & address, sockaddr_storage & addr, socklen_t & len);
+
+protected:
+    upstream_pool(eventloop * loop, UPSTREAM_KIND kind);
+
+    eventloop * m_loop;
+    UPSTREAM_KIND m_kind;
+    std::vector<upstream_request *> m_wake; // 等待唤醒的请求
+    std::vector<upstream_request *> m_garbage; // 已经放弃的请求，唤醒完之后释放
+    bool m_pending; // 有待发送的数据或者待唤醒的请求
+
+    void notify(upstream_request * req);
+    void discard(upstream_request * req);
+    void deliver(); // 唤醒等待的请求的连接，释放放弃的请求
+    // 按后端连接的状态更新事件循环监听的事件，events为正在监听的事件，有变化时改为新的值
+    void watch_events(int index, uint32_t gen, int fd, bool readable, bool writable, int & events);
+};
+
+// 去掉响应头的值前后的空白
+std::string trim_header_value(const char * p, const char * end);
+
+#endif
@@ -0,0 +1,168 @@
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <exception>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring::uring(unsigned entries, unsigned buf_num, unsigned buf_size)
+    : m_fd(-1), m_sq_ptr(MAP_FAILED), m_sq_size(0), m_sqe_tail(0), m_sqes((io_uring_sqe *)MAP_FAILED), m_sqes_size(0),
+      m_cq_ptr(MAP_FAILED), m_cq_size(0), m_buf_ring((io_uring_buf *)MAP_FAILED), m_buf_ring_size(0),
+      m_bufs(NULL), m_buf_num(buf_num), m_buf_size(buf_size), m_buf_tail(0) {
+    // 多发recv和accept会产生很多完成项，完成队列设得比提交队列大
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+    m_fd = io_uring_setup(entries, &p);
+    if (m_fd < 0 && errno == EINVAL) {
+        // 较老的内核不支持COOP_TASKRUN
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        m_fd = io_uring_setup(entries, &p);
+    }
+    if (m_fd < 0) {
+        throw std::exception();
+    }
+
+    // 映射提交队列和完成队列
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cq_size > m_sq_size) m_sq_size = m_cq_size;
+        m_cq_size = 0;
+    }
+    m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED) {
+        destroy();
+        throw std::exception();
+    }
+    if (m_cq_size) {
+        m_cq_ptr = mmap(0, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED) {
+            destroy();
+            throw std::exception();
+        }
+    }
+    char * cq = (char *)(m_cq_size ? m_cq_ptr : m_sq_ptr);
+    m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe *)mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        destroy();
+        throw std::exception();
+    }
+
+    char * sq = (char *)m_sq_ptr;
+    m_sq_head = (unsigned *)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    m_sq_array = (unsigned *)(sq + p.sq_off.array);
+    m_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    m_sq_entries = p.sq_entries;
+    m_sqe_tail = *m_sq_tail;
+    m_cq_head = (unsigned *)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // 缓冲区环和缓冲区
+    m_buf_ring_size = buf_num * sizeof(io_uring_buf);
+    m_buf_ring = (io_uring_buf *)mmap(0, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    m_bufs = (char *)malloc((size_t)buf_num * buf_size);
+    if (m_buf_ring == MAP_FAILED || !m_bufs) {
+        destroy();
+        throw std::exception();
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)m_buf_ring;
+    reg.ring_entries = buf_num;
+    reg.bgid = BUF_GROUP;
+    if (io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        destroy();
+        throw std::exception();
+    }
+    for (unsigned i = 0; i < buf_num; i++) {
+        recycle_buf(i);
+    }
+}
+
+uring::~uring() {
+    destroy();
+}
+
+void uring::destroy() {
+    if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqes_size);
+    if (m_cq_ptr != MAP_FAILED) munmap(m_cq_ptr, m_cq_size);
+    if (m_sq_ptr != MAP_FAILED) munmap(m_sq_ptr, m_sq_size);
+    // 先关闭io_uring，内核不再使用缓冲区之后再释放它们
+    if (m_fd != -1) close(m_fd);
+    if (m_buf_ring != MAP_FAILED) munmap(m_buf_ring, m_buf_ring_size);
+    free(m_bufs);
+    m_sqes = (io_uring_sqe *)MAP_FAILED;
+    m_cq_ptr = MAP_FAILED;
+    m_sq_ptr = MAP_FAILED;
+    m_fd = -1;
+    m_buf_ring = (io_uring_buf *)MAP_FAILED;
+    m_bufs = NULL;
+}
+
+io_uring_sqe * uring::get_sqe() {
+    while (m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+        // 提交队列满，先交给内核
+        int ret = submit_and_wait(0);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            return NULL;
+        }
+    }
+    unsigned index = m_sqe_tail & m_sq_mask;
+    io_uring_sqe * sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    m_sqe_tail++;
+    return sqe;
+}
+
+int uring::submit_and_wait(unsigned wait_nr) {
+    // 内核还没有取走的提交项都需要提交，包括上次因为出错没有提交的
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret = io_uring_enter(m_fd, to_submit, wait_nr, flags);
+    return ret < 0 ? -errno : ret;
+}
+
+io_uring_cqe * uring::peek_cqe() {
+    unsigned head = *m_cq_head;
+    if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &m_cqes[head & m_cq_mask];
+}
+
+void uring::cqe_seen() {
+    __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring::recycle_buf(unsigned bid) {
+    io_uring_buf * buf = &m_buf_ring[m_buf_tail & (m_buf_num - 1)];
+    buf->addr = (unsigned long)get_buf(bid);
+    buf->len = m_buf_size;
+    buf->bid = bid;
+    m_buf_tail++;
+    __atomic_store_n(&m_buf_ring[0].resv, m_buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,71 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    io_uring的简单封装，直接使用系统调用，不依赖liburing。
+    提交队列、完成队列和内核共享内存，只能在一个线程（事件循环线程）中使用。
+    另外向内核注册一个缓冲区环（provided buffer ring），多发recv收到数据时由内核从中挑选缓冲区，
+    处理完数据后用recycle_buf()把缓冲区还给内核。
+*/
+class uring {
+public:
+    static const int BUF_GROUP = 0; // 缓冲区环的组号，recv的sqe->buf_group
+
+    // entries：提交队列大小；buf_num个大小为buf_size的缓冲区，buf_num必须是2的幂。内核不支持时抛出异常
+    uring(unsigned entries, unsigned buf_num, unsigned buf_size);
+    ~uring();
+
+    // 取得一个清零的提交项，提交队列满时先提交已有的提交项
+    io_uring_sqe * get_sqe();
+    // 提交所有提交项，并等待至少wait_nr个完成项，返回提交的数量或者-errno
+    int submit_and_wait(unsigned wait_nr);
+
+    // 取得下一个完成项，没有时返回NULL，处理完之后调用cqe_seen()
+    io_uring_cqe * peek_cqe();
+    void cqe_seen();
+
+    char * get_buf(unsigned bid) { return m_bufs + (size_t)bid * m_buf_size; }
+    void recycle_buf(unsigned bid); // 把缓冲区还给内核
+
+private:
+    int m_fd;
+
+    // 提交队列
+    void * m_sq_ptr;
+    size_t m_sq_size;
+    unsigned * m_sq_head;
+    unsigned * m_sq_tail;
+    unsigned * m_sq_array;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned m_sqe_tail; // 已经填写、还没有交给内核的提交项的尾部
+    io_uring_sqe * m_sqes;
+    size_t m_sqes_size;
+
+    // 完成队列，内核支持IORING_FEAT_SINGLE_MMAP时和提交队列共用一个映射
+    void * m_cq_ptr;
+    size_t m_cq_size;
+    unsigned * m_cq_head;
+    unsigned * m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe * m_cqes;
+
+    // 缓冲区环。C++中io_uring_buf_ring的柔性数组bufs不在偏移0处，直接按io_uring_buf数组访问，
+    // 尾部和第一项的resv字段重叠
+    io_uring_buf * m_buf_ring;
+    size_t m_buf_ring_size;
+    char * m_bufs;
+    unsigned m_buf_num;
+    unsigned m_buf_size;
+    unsigned short m_buf_tail;
+
+    void destroy();
+    uring(const uring &);
+    uring & operator=(const uring &);
+};
+
+#endif
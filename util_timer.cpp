@@ -1,115 +1,132 @@
 #include "util_timer.h"
 #include "http_conn.h"
+#include <sys/timerfd.h>
 
-sort_timer_list::sort_timer_list() : head(NULL), tail(NULL) {}
-sort_timer_list::~sort_timer_list() {
-    util_timer* tmp = head;
-    while (tmp) {
-        head = tmp->next;
-        delete tmp;
-        tmp = head;
+timer_wheel::timer_wheel() : m_timerfd(-1), m_current(0), m_start_ms(now_ms()) {
+    for (int i = 0; i < LEVELS; i++) {
+        for (int j = 0; j < SLOTS; j++) {
+            m_slots[i][j].prev = m_slots[i][j].next = &m_slots[i][j];
+        }
     }
-}
-
-void sort_timer_list::add_timer(util_timer* t) {
-    // printf("add\n");
 
-    if (!t) return;
-    if (!head) {
-        head = tail = t;
-        return;
+    // 每TICK_MS毫秒触发一次
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timerfd == -1) {
+        throw std::exception();
     }
-
-    if (t->expire < head->expire) {
-        t->next = head;
-        head->prev = t;
-        head = t;
-        return;
+    struct itimerspec its;
+    its.it_interval.tv_sec = TICK_MS / 1000;
+    its.it_interval.tv_nsec = (TICK_MS % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(m_timerfd, 0, &its, NULL) == -1) {
+        close(m_timerfd);
+        throw std::exception();
     }
+}
 
-    add_timer_from(t, head);
+timer_wheel::~timer_wheel() {
+    for (int i = 0; i < LEVELS; i++) {
+        for (int j = 0; j < SLOTS; j++) {
+            util_timer* head = &m_slots[i][j];
+            while (head->next != head) {
+                util_timer* tmp = head->next;
+                unlink_timer(tmp);
+                delete tmp;
+            }
+        }
+    }
+    close(m_timerfd);
+}
 
+uint64_t timer_wheel::now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void sort_timer_list::adjust_timer(util_timer* t) {
-    // printf("adjust %d %d %d\n", t, head, tail);
-    // printf("%d %d %d\n", t->next, head->prev, tail);
+void timer_wheel::add_timer(util_timer* t, int timeout_ms) {
     if (!t) return;
-    if (t == tail) return; // 尾部
-    util_timer* tmp = t->next;
-    if (t->expire <= tmp->expire) return;
+    // 向上取整，至少在下一个tick到期
+    uint64_t ticks = (timeout_ms + TICK_MS - 1) / TICK_MS;
+    if (ticks == 0) ticks = 1;
+    t->expire = m_current + ticks;
+    link_timer(t);
+}
 
-    if (t == head) {
-        head = t->next;
-        head->prev = NULL;
-        add_timer_from(t, head);
-    } else {
-        t->next->prev = t->prev;
-        t->prev->next = t->next;
-        add_timer_from(t, t->next);
-    }
+void timer_wheel::adjust_timer(util_timer* t, int timeout_ms) {
+    if (!t) return;
+    unlink_timer(t);
+    add_timer(t, timeout_ms);
 }
 
-void sort_timer_list::del_timer(util_timer* t) {
+void timer_wheel::del_timer(util_timer* t) {
     if (!t) return;
-    // printf("%d %d %d\n", t->next, head->prev, tail);
-    if (t == head && t == tail) {
-        delete t;
-        head = tail = NULL;
-        return;
-    }
+    unlink_timer(t);
+    delete t;
+}
 
-    if (t == head) {
-        head = t->next;
-        head->prev = NULL;
-        delete t;
-        return;
+// 根据到期时间与当前时间的差值选择层，根据到期时间选择槽
+void timer_wheel::link_timer(util_timer* t) {
+    uint64_t delta = t->expire > m_current ? t->expire - m_current : 0;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1)))) {
+        level++;
     }
-
-    if (t == tail) {
-        tail = t->prev;
-        tail->next = NULL;
-        delete t;
-        return;
+    if (delta >= ((uint64_t)1 << (SLOT_BITS * LEVELS))) {
+        // 超出时间轮的范围，放在最远的位置，下放时会被重新放置
+        t->expire = m_current + ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
     }
+    int slot = (t->expire >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+    util_timer* head = &m_slots[level][slot];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
 
+void timer_wheel::unlink_timer(util_timer* t) {
+    if (!t->prev) return;
     t->prev->next = t->next;
     t->next->prev = t->prev;
-    delete t;
+    t->prev = t->next = NULL;
 }
 
-/* SIGALARM 信号每次被触发就在其信号处理函数中执行一次 tick() 函数，以处理链表上到期任务。*/
-void sort_timer_list::tick() {
-    if (!head) return;
-    // printf("timer tick\n");
-    time_t cur = time(NULL); // 当前系统时间
-    util_timer* tmp = head;
-    while (tmp) {
-        if (cur < tmp->expire) break;
-        // 关闭连接，同时删除定时器
-        tmp->user_conn->close_conn();
-        tmp = head;
+// 将第level层当前槽中的定时器重新放置到低层
+void timer_wheel::cascade(int level) {
+    int slot = (m_current >> (SLOT_BITS * level)) & (SLOTS - 1);
+    util_timer* head = &m_slots[level][slot];
+    util_timer* tmp = head->next;
+    head->prev = head->next = head;
+    while (tmp != head) {
+        util_timer* next = tmp->next;
+        link_timer(tmp);
+        tmp = next;
     }
 }
 
-void sort_timer_list::add_timer_from(util_timer* t, util_timer* f) {
-    util_timer *p = f, *tmp = f->next;
-    while (tmp) {
-        if (t->expire < tmp->expire) {
-            p->next = t;
-            t->prev = p;
-            tmp->prev = t;
-            t->next = tmp;
-            return;
+/* timerfd可读时调用，推进时间轮到当前时间，处理到期任务。*/
+void timer_wheel::tick() {
+    uint64_t expirations;
+    while (read(m_timerfd, &expirations, sizeof(expirations)) > 0) {}
+
+    // 按单调时钟计算应该处理到的tick，事件循环繁忙时可能一次推进多个tick
+    uint64_t target = (now_ms() - m_start_ms) / TICK_MS;
+    while (m_current < target) {
+        m_current++;
+        // 低层转完一圈，将高层对应槽中的定时器下放
+        for (int level = 1; level < LEVELS; level++) {
+            if ((m_current & (((uint64_t)1 << (SLOT_BITS * level)) - 1)) != 0) break;
+            cascade(level);
         }
-        p = tmp;
-        tmp = tmp->next;
-    }
 
-    if (!tmp) {
-        tail->next = t;
-        t->prev = tail;
-        t->next = NULL;
-        tail = t;
+        util_timer* head = &m_slots[0][m_current & (SLOTS - 1)];
+        while (head->next != head) {
+            // 关闭连接，同时删除定时器；连接在工作线程中时推迟到交还之后关闭
+            util_timer* tmp = head->next;
+            unlink_timer(tmp);
+            metrics::count(COUNTER_TIMER_EXPIRATIONS);
+            tmp->user_conn->timeout();
+        }
     }
-}
\ No newline at end of file
+}
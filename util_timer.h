@@ -2,42 +2,61 @@
 #define UTILTIMER_H
 
 #include <time.h>
+#include <stdint.h>
 
 class http_conn;
 
 class util_timer {
 public:
-    util_timer() : prev(NULL), next(NULL) {}
+    util_timer() : expire(0), user_conn(NULL), prev(NULL), next(NULL) {}
 
-    time_t expire; // 任务超时时间，这里使用绝对时间
+    uint64_t expire; // 任务到期的tick，这里使用绝对时间
 
-    http_conn* user_conn; 
+    http_conn* user_conn;
 
-    util_timer* prev;    // 指向前一个定时器
-    util_timer* next;    // 指向后一个定时器
+    util_timer* prev;    // 指向同一个槽中的前一个定时器，NULL表示不在时间轮中
+    util_timer* next;    // 指向同一个槽中的后一个定时器
 };
 
-// 定时器链表，它是一个升序、双向链表，且带有头节点和尾节点。
-class sort_timer_list {
+/*
+    分层时间轮，由timerfd驱动，timerfd注册在所属事件循环的epoll中。
+    共LEVELS层，每层SLOTS个槽，第0层一个槽代表一个tick（TICK_MS毫秒），第i层一个槽代表SLOTS^i个tick。
+    每个槽是带头节点的双向循环链表，添加、调整、删除定时器都是O(1)的；
+    高层的槽在低层转完一圈时被下放（cascade）到低层。
+    时间轮只能在所属事件循环的线程中使用。
+*/
+class timer_wheel {
 public:
-    sort_timer_list();
-    ~sort_timer_list();
+    static const int TICK_MS = 100; // 时间轮的精度（毫秒）
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS; // 每层的槽数
+    static const int LEVELS = 4; // 层数，最长可以定时 SLOTS^LEVELS 个tick
 
-    void add_timer(util_timer* t);
+    timer_wheel();
+    ~timer_wheel();
 
-    void adjust_timer(util_timer* t);
+    int get_timerfd() const { return m_timerfd; }
+
+    void add_timer(util_timer* t, int timeout_ms);
+
+    void adjust_timer(util_timer* t, int timeout_ms);
 
     void del_timer(util_timer* t);
 
-    /* SIGALARM 信号每次被触发就在其信号处理函数中执行一次 tick() 函数，以处理链表上到期任务。*/
+    /* timerfd可读时调用，推进时间轮到当前时间，处理到期任务。*/
     void tick();
 
 private:
-    util_timer* head;
-    util_timer* tail;
-
-    void add_timer_from(util_timer* t, util_timer* f);
+    int m_timerfd;
+    uint64_t m_current; // 已经处理过的tick
+    uint64_t m_start_ms; // 时间轮创建时的单调时钟（毫秒）
+    util_timer m_slots[LEVELS][SLOTS]; // 每个槽的头节点
+
+    void link_timer(util_timer* t);
+    void unlink_timer(util_timer* t);
+    void cascade(int level);
+    static uint64_t now_ms();
 };
 
 
-#endif
\ No newline at end of file
+#endif